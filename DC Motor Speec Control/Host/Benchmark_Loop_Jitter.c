@@ -0,0 +1,406 @@
+// Control-loop wake-up latency, before and after the thread split
+// Runs on a POSIX host; a model, it links none of the firmware, so its
+// figures are estimates computed from the per-step costs below, not
+// measurements. The board measures the "after" latency itself (L and J
+// on the 'B' pages); the loop before the split is no longer in the tree,
+// so its side can only be estimated.
+//
+// Both kernels and both thread layouts are stepped a microsecond at a
+// time for SIM_SECONDS, with the same keypad presses, and the latency
+// Control_Thread measures with the DWT cycle counter (block finished to
+// the thread running past its OS_Wait) is taken the same way in each:
+// - before: the original os_v2.c (round robin over a 2ms SysTick, a
+//   signal never switches threads) running Keypad_Thread and
+//   Controller_LCD_Thread, which waited for a 100-sample average every
+//   10ms and redrew the LCD itself every 100 updates; Timer0A bit-banged
+//   each sample, about 30µs of every 100µs
+// - after: the priority scheduler in os_v2.c (a signal that wakes a
+//   higher-priority thread switches at once) running Control_Thread at
+//   1 kHz, Keypad_Thread, Display_Thread and Telemetry_Thread (not
+//   recording) over the idle thread, with one uDMA interrupt per block
+// With every thread blocked or asleep the old scheduler spun inside
+// SysTick with interrupts disabled, which never ends; it is modeled as
+// waiting for the next interrupt to ready a thread instead.
+//
+// LCD_GoTo() and LCD_OutChar() each spin in Delay1ms (cycle-counted, so
+// stretched by interrupts), and a key held down spins another 10ms in
+// the keypad debounce. The other costs are estimates at 16 MHz, except
+// that the three the "after" figures hinge on are taken from the board
+// when given on the command line, as read off the 'B' pages at 1 kHz:
+//   I  acquisition ISR per block (tenths of a percent of 1ms: µs)
+//   U  worst control update, µs
+//   M  best wake-up latency, µs: the ISR plus the switch into the thread
+// The switch cost is used for both kernels. Without the readings the run
+// prints "estimated costs" and uses the defaults. Either way the model
+// leaves out interrupts masked in kernel critical sections and flash
+// wait states, so its "after" jitter is a lower bound; the board's J is
+// the measured one.
+//
+// Prints min, mean, max and jitter (max - min) of the latency for both;
+// the run fails (exit status 1) if the worst latency after the split
+// exceeds AFTER_LIMIT_US, so a change that puts work or a wait back in
+// front of the control thread shows up here.
+//
+// Build:
+//   gcc -O2 -I.. -I. Benchmark_Loop_Jitter.c -o loop_jitter
+// Run:
+//   ./loop_jitter [I U M]
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define SIM_SECONDS             60
+#define TICK_US                 2000    // SysTick time slice
+#define SWITCH_US               2       // SysTick handler and context switch (default)
+#define KEY_PERIOD_US           250000  // A key pressed every 250ms
+#define LCD_OP_US               1000    // One LCD_GoTo or LCD_OutChar
+#define AFTER_LIMIT_US          50
+
+#define OLD_SAMPLE_US           100     // Timer0A, one sample per interrupt
+#define OLD_SAMPLE_ISR_US       30      // R/C pulse, BUSY wait, 12 bits by hand
+#define OLD_BLOCK_SAMPLES       100     // Average handed over every 10ms
+#define OLD_CONTROL_US          150     // Speed conversion and PID
+#define NEW_BLOCK_US            1000    // uDMA block of 10 samples
+#define NEW_BLOCK_ISR_US        6       // Re-arm, time-stamp and signal (default)
+#define NEW_CONTROL_US          60      // Filter the block, speed and Q16 PID (default)
+#define SCAN_US                 20      // Scan_Keypad with no key down
+#define TELEMETRY_US            20      // Telemetry_Thread poll
+
+#define MAX_THREADS             5
+#define NO_THREAD               0xFF
+#define IDLE_PRIORITY           255
+#define STAMP_SLOTS             64
+
+// Thread program steps
+enum { S_BUSY, S_WAIT, S_SIGNAL, S_SLEEP, S_LATENCY, S_IF_KEY, S_IF_NTH, S_LOOP };
+enum { SEM_ADC, SEM_LCD, SEMAPHORES };
+
+typedef struct {
+  uint8_t op;
+  uint32_t arg;                         // µs, semaphore, ticks
+  uint32_t skip;                        // S_IF_KEY, S_IF_NTH: steps skipped when false
+} Step_t;
+
+typedef struct {
+  const Step_t *prog;
+  uint8_t priority;
+  uint8_t pc;
+  uint32_t busy;                        // µs of work left in an S_BUSY
+  int8_t blocked;                       // Semaphore, or -1
+  uint32_t sleep;                       // Ticks
+  uint32_t count;                       // S_IF_NTH passes
+  uint32_t stamp;                       // Time of the block taken by the last S_WAIT on SEM_ADC
+} Sim_Thread_t;
+
+typedef struct {
+  const char *name;
+  uint8_t priorities;                   // 0: round robin, no switch on signal
+  uint32_t block_us;                    // Block handed to the control thread
+  uint32_t isr_period_us;
+  uint32_t isr_us;
+  const Step_t *progs[MAX_THREADS];
+  uint8_t prio[MAX_THREADS];
+  uint8_t threads;
+} Config_t;
+
+// Before: OS_AddThreads(&Keypad_Thread, &Controller_LCD_Thread)
+static const Step_t Old_Keypad[] = {
+  {S_BUSY, SCAN_US, 0},
+  {S_IF_KEY, 0, 5},
+  {S_BUSY, 10 * LCD_OP_US, 0},          // Debounce in Read_PortD
+  {S_WAIT, SEM_LCD, 0},
+  {S_BUSY, 2 * LCD_OP_US, 0},           // Echo the digit
+  {S_SIGNAL, SEM_LCD, 0},
+  {S_SLEEP, 100, 0},
+  {S_SLEEP, 5, 0},
+  {S_LOOP, 0, 0},
+};
+
+static const Step_t Old_Controller_LCD[] = {
+  {S_WAIT, SEM_ADC, 0},
+  {S_LATENCY, 0, 0},
+  {S_BUSY, OLD_CONTROL_US, 0},
+  {S_IF_NTH, 100, 3},                   // Every second
+  {S_WAIT, SEM_LCD, 0},
+  {S_BUSY, 10 * LCD_OP_US, 0},          // Two positions, eight digits
+  {S_SIGNAL, SEM_LCD, 0},
+  {S_LOOP, 0, 0},
+};
+
+// After: control, keypad, display and telemetry threads, then idle
+static Step_t New_Control[] = {
+  {S_WAIT, SEM_ADC, 0},
+  {S_LATENCY, 0, 0},
+  {S_BUSY, NEW_CONTROL_US, 0},
+  {S_LOOP, 0, 0},
+};
+
+static const Step_t New_Display[] = {
+  {S_SLEEP, 500, 0},
+  {S_WAIT, SEM_LCD, 0},
+  {S_BUSY, 16 * LCD_OP_US, 0},          // Three positions, thirteen characters
+  {S_SIGNAL, SEM_LCD, 0},
+  {S_LOOP, 0, 0},
+};
+
+static const Step_t New_Telemetry[] = {
+  {S_BUSY, TELEMETRY_US, 0},
+  {S_SLEEP, 10, 0},
+  {S_LOOP, 0, 0},
+};
+
+static const Step_t Idle[] = {
+  {S_BUSY, 0xFFFFFFFFU, 0},             // WFI
+  {S_LOOP, 0, 0},
+};
+
+static Config_t Configs[] = {
+  {"before", 0, OLD_SAMPLE_US * OLD_BLOCK_SAMPLES, OLD_SAMPLE_US, OLD_SAMPLE_ISR_US,
+   {Old_Keypad, Old_Controller_LCD}, {0, 0}, 2},
+  {"after", 1, NEW_BLOCK_US, NEW_BLOCK_US, NEW_BLOCK_ISR_US,
+   {New_Control, Old_Keypad, New_Display, New_Telemetry, Idle}, {0, 1, 2, 3, IDLE_PRIORITY}, 5},
+};
+
+// Costs of the "after" layout (command line or defaults)
+static uint32_t Switch_Us = SWITCH_US;
+
+// Model state for the configuration being run
+static const Config_t *Cfg;
+static Sim_Thread_t Threads[MAX_THREADS];
+static uint8_t RunPt;
+static int32_t Sems[SEMAPHORES];
+static uint32_t Stamps[STAMP_SLOTS];    // Block times not yet taken, oldest first
+static uint32_t Stamp_Put, Stamp_Get;
+static uint32_t Now;
+static uint32_t Next_Key;
+static uint8_t Switch_Pending;          // SysTick pended (OS_Suspend, or a preempting signal)
+
+static uint32_t Lat_Count, Lat_Min, Lat_Max;
+static uint64_t Lat_Sum;
+
+static uint8_t ready(uint8_t i){
+  return (Threads[i].blocked < 0) && (Threads[i].sleep == 0);
+}
+
+// Scheduler() as it was (round robin) or as it is (priority, round robin
+// among equals); a tick counts sleeps down for all but the leaving thread
+static void scheduler(uint8_t tick){
+  uint8_t n = Cfg->threads;
+  uint8_t from = (RunPt == NO_THREAD) ? (uint8_t)(n - 1U) : RunPt;
+  uint8_t best = NO_THREAD;
+  uint32_t bestPriority = IDLE_PRIORITY + 1U;
+  uint8_t i, k;
+
+  for(i = 0; tick && (i < n); i++){
+    if((i != RunPt) && Threads[i].sleep){
+      Threads[i].sleep--;
+    }
+  }
+  for(k = 1; k <= n; k++){
+    i = (uint8_t)((from + k) % n);
+    if(!ready(i)){
+      continue;
+    }
+    if(!Cfg->priorities){
+      best = i;                         // Next in the ring
+      break;
+    }
+    if(Threads[i].priority < bestPriority){
+      bestPriority = Threads[i].priority;
+      best = i;
+    }
+  }
+  RunPt = best;                         // NO_THREAD: the old spin, waiting for an interrupt
+}
+
+static void sem_signal(uint8_t s){
+  uint8_t i;
+
+  Sems[s]++;
+  if(Sems[s] > 0){
+    return;
+  }
+  for(i = 0; i < Cfg->threads; i++){
+    if(Threads[i].blocked == (int8_t)s){
+      Threads[i].blocked = -1;
+      if(s == SEM_ADC){
+        Threads[i].stamp = Stamps[Stamp_Get++ % STAMP_SLOTS];
+      }
+      if((RunPt == NO_THREAD) ||
+         (Cfg->priorities && (Threads[i].priority < Threads[RunPt].priority))){
+        Switch_Pending = 1;
+      }
+      return;
+    }
+  }
+}
+
+static void latency_record(uint32_t us){
+  if((Lat_Count == 0) || (us < Lat_Min)){
+    Lat_Min = us;
+  }
+  if(us > Lat_Max){
+    Lat_Max = us;
+  }
+  Lat_Sum += us;
+  Lat_Count++;
+}
+
+// Run the current thread's steps that take no time, up to its next
+// S_BUSY or until it blocks or sleeps
+static void thread_steps(void){
+  Sim_Thread_t *t = &Threads[RunPt];
+  const Step_t *step;
+
+  while(!Switch_Pending){
+    step = &t->prog[t->pc];
+    switch(step->op){
+      case S_BUSY:
+        if(t->busy == 0){
+          t->busy = step->arg;
+        }
+        return;
+      case S_WAIT:
+        t->pc++;
+        Sems[step->arg]--;
+        if(Sems[step->arg] < 0){
+          t->blocked = (int8_t)step->arg;
+          Switch_Pending = 1;           // OS_Suspend
+        } else if(step->arg == SEM_ADC){
+          t->stamp = Stamps[Stamp_Get++ % STAMP_SLOTS];
+        }
+        break;
+      case S_SIGNAL:
+        t->pc++;
+        sem_signal((uint8_t)step->arg);
+        break;
+      case S_SLEEP:
+        t->pc++;
+        t->sleep = step->arg;
+        Switch_Pending = 1;
+        break;
+      case S_LATENCY:
+        t->pc++;
+        latency_record(Now - t->stamp);
+        break;
+      case S_IF_KEY:
+        t->pc++;
+        if(Now >= Next_Key){
+          Next_Key += KEY_PERIOD_US;
+        } else{
+          t->pc += step->skip;
+        }
+        break;
+      case S_IF_NTH:
+        t->pc++;
+        if((++t->count % step->arg) != 0){
+          t->pc += step->skip;
+        }
+        break;
+      default:                          // S_LOOP
+        t->pc = 0;
+        break;
+    }
+  }
+}
+
+static void run(const Config_t *cfg){
+  uint32_t end = SIM_SECONDS * 1000000U;
+  uint32_t isr_left = 0;
+  uint32_t isr_stamp = 0;
+  uint32_t switch_left = 0;
+  uint32_t samples = 0;
+  uint8_t tick = 0;
+  uint8_t tick_switch = 0;
+  uint8_t block_done = 0;
+  uint8_t i;
+
+  Cfg = cfg;
+  for(i = 0; i < cfg->threads; i++){
+    Threads[i] = (Sim_Thread_t){cfg->progs[i], cfg->prio[i], 0, 0, -1, 0, 0, 0};
+  }
+  Sems[SEM_ADC] = 0;
+  Sems[SEM_LCD] = 1;
+  Stamp_Put = Stamp_Get = 0;
+  Next_Key = KEY_PERIOD_US;
+  Switch_Pending = 0;
+  Lat_Count = Lat_Min = Lat_Max = 0;
+  Lat_Sum = 0;
+  RunPt = 0;
+
+  for(Now = 0; Now < end; Now++){
+    if((Now % cfg->isr_period_us) == 0){
+      isr_left = cfg->isr_us;
+      isr_stamp = Now;                  // DWT_CYCCNT on entry
+      samples += cfg->isr_period_us;
+      block_done = (samples % cfg->block_us) == 0;
+    }
+    if((Now % TICK_US) == 0){
+      tick = 1;
+    }
+
+    // Interrupts first, then SysTick (lowest), then the running thread
+    if(isr_left){
+      if(--isr_left == 0 && block_done){
+        Stamps[Stamp_Put++ % STAMP_SLOTS] = isr_stamp;
+        sem_signal(SEM_ADC);
+      }
+    } else if(switch_left){
+      if(--switch_left == 0){
+        scheduler(tick_switch);
+      }
+    } else if(tick || Switch_Pending){
+      tick_switch = tick;
+      tick = 0;
+      Switch_Pending = 0;
+      switch_left = Switch_Us;
+    } else if(RunPt != NO_THREAD){
+      thread_steps();
+      if(!Switch_Pending && Threads[RunPt].busy && (--Threads[RunPt].busy == 0)){
+        Threads[RunPt].pc++;
+      }
+    }
+  }
+}
+
+int main(int argc, char **argv){
+  uint32_t c;
+  uint32_t isr_us, control_us, best_us;
+  int failed = 0;
+
+  // Board readings I, U, M: the ISR and the control update as measured,
+  // the switch as whatever the best latency has beyond the ISR
+  if(argc == 4){
+    isr_us = (uint32_t)strtoul(argv[1], NULL, 10);
+    control_us = (uint32_t)strtoul(argv[2], NULL, 10);
+    best_us = (uint32_t)strtoul(argv[3], NULL, 10);
+    if((isr_us == 0) || (control_us == 0) || (best_us <= isr_us)){
+      printf("usage: %s [I U M], with M > I > 0 and U > 0\n", argv[0]);
+      return 2;
+    }
+    Configs[1].isr_us = isr_us;
+    New_Control[2].arg = control_us;
+    Switch_Us = best_us - isr_us;
+    printf("measured costs: ISR %uus, control %uus, switch %uus\n",
+           (unsigned)isr_us, (unsigned)control_us, (unsigned)Switch_Us);
+  } else{
+    printf("estimated costs: ISR %uus, control %uus, switch %uus\n",
+           (unsigned)NEW_BLOCK_ISR_US, (unsigned)NEW_CONTROL_US, (unsigned)SWITCH_US);
+  }
+
+  printf("%-8s %8s %8s %8s %8s %8s %8s\n", "loop", "rate Hz", "updates", "min us", "mean us", "max us", "jitter");
+  for(c = 0; c < sizeof(Configs) / sizeof(Configs[0]); c++){
+    run(&Configs[c]);
+    printf("%-8s %8u %8u %8u %8u %8u %8u\n", Configs[c].name, (unsigned)(1000000U / Configs[c].block_us),
+           (unsigned)Lat_Count, (unsigned)Lat_Min, (unsigned)(Lat_Sum / (Lat_Count ? Lat_Count : 1U)),
+           (unsigned)Lat_Max, (unsigned)(Lat_Max - Lat_Min));
+  }
+
+  // The last one run is the current firmware
+  if((Lat_Count == 0) || (Lat_Max > AFTER_LIMIT_US)){
+    printf("FAIL worst latency after the split over %uus\n", (unsigned)AFTER_LIMIT_US);
+    failed = 1;
+  }
+  return failed;
+}
@@ -0,0 +1,227 @@
+// Closed-loop step-response benchmark
+// Runs on a POSIX host against Motor_Sim.c
+//
+// The real controller.c, filter.c and Voltage2RPM.c run against the
+// simulated motor: every 100µs the plant gives an ADC code, the codes go
+// through the sample filter as ADC_Get_Average_Voltage() feeds it, and
+// every control update (1ms at the default rate) the filtered voltage
+// goes through Current_speed() into Controller_Update(). A script of
+// target changes, some with a load or a sagging supply that the
+// feedforward map does not know about, is run and for each step the
+// controller's own metrics are printed:
+//   rise ms    - 10% to 90% of the step
+//   overshoot  - largest excursion past the target (RPM)
+//   settle ms  - until inside ±15 RPM for good
+//   ss error   - mean error once settled (RPM, as measured)
+//   true error - mean error of the simulated shaft over the last 0.5s
+// A step that does not settle within STEP_SECONDS, or settles with more
+// than ±15 RPM of error, measured or true, fails the run (exit status 1),
+// so the benchmark doubles as a regression test for controller changes.
+// Run with the argument "autotune" to tune the gains with autotune.c
+// (relay experiment at 1200 RPM) before the script instead of using the
+// defaults, and with "calibrate" to run the calibrate.c sweep first, the
+// simulated shaft speed standing in for the reference tachometer.
+//
+// Add -DCONTROLLER_UPDATE_RATE_HZ=100 to run the loop at 100 Hz, and
+// e.g. -DMOTOR_SIM_SENSOR_GAIN=1080 -DMOTOR_SIM_SENSOR_OFFSET_MV=-150 for
+// a motor unit whose sensor is off the nominal curve (fails without
+// "calibrate").
+//
+// Build:
+//   gcc -O2 -I.. -I. -DMOTOR_FLASH_STORAGE=0 Benchmark_Step_Response.c Motor_Sim.c ../controller.c
+//       ../autotune.c ../calibrate.c ../storage.c ../filter.c ../Voltage2RPM.c
+//       -o step_response
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "system.h"
+#include "Motor_Sim.h"
+
+#define STEP_SECONDS            3       // Run time after each target change
+#define TAIL_UPDATES            (CONTROLLER_UPDATE_RATE_HZ / 2) // Updates averaged for the true error
+#define AUTOTUNE_RPM            1200
+#define AUTOTUNE_SECONDS        40      // Longer than the autotune timeout
+#define CALIBRATE_SECONDS       30      // Longer than a sweep
+
+typedef struct {
+  int32_t target;                       // RPM
+  int32_t droop;                        // Load, RPM lost at any duty
+  int32_t supply;                       // mV at 100% duty
+  const char *note;
+} Step_Script_t;
+
+static const Step_Script_t Script[] = {
+  {1200,   0, MOTOR_SIM_SUPPLY_MV, "from rest"},
+  {2400,   0, MOTOR_SIM_SUPPLY_MV, "up to full speed"},
+  { 400,   0, MOTOR_SIM_SUPPLY_MV, "down to minimum"},
+  {1800,   0, MOTOR_SIM_SUPPLY_MV, ""},
+  {1000, 200, MOTOR_SIM_SUPPLY_MV, "load -200 RPM"},
+  {2000, 200, 8500,                "load, supply 8.5V"},
+  { 600,   0, 8500,                "supply 8.5V"},
+};
+
+#define SCRIPT_STEPS            (sizeof(Script) / sizeof(Script[0]))
+
+// Host stand-ins for the critical section calls in startup_TM4C123.s
+int32_t StartCritical(void){
+  return 0;
+}
+
+void EndCritical(int32_t primask){
+  (void)primask;
+}
+
+// One control period of ADC samples through the filter; returns the
+// filtered voltage (mV)
+static int32_t measure_voltage(void){
+  uint32_t i;
+
+  for(i = 0; i < ADC_SAMPLES_PER_BLOCK; i++){
+    Filter_Put((int32_t)((uint32_t)Motor_Sim_Sample() << 20) >> 20);
+  }
+  return (Filter_Output() * 625) / 32768;
+}
+
+// The same, converted to the measured speed
+static int32_t measure_period(void){
+  return Current_speed(measure_voltage());
+}
+
+// One control period: the ADC samples, then the controller
+static void control_period(int32_t target){
+  Controller_Update(target, measure_period());
+}
+
+// Relay experiment from rest; returns 1 if the gains were set
+static int run_autotune(void){
+  Autotune_Result_t result;
+  uint32_t t;
+  uint8_t status = AUTOTUNE_RUNNING;
+
+  Autotune_Start(AUTOTUNE_RPM);
+  for(t = 0; (t < AUTOTUNE_SECONDS * CONTROLLER_UPDATE_RATE_HZ) && (status == AUTOTUNE_RUNNING); t++){
+    status = Autotune_Update(measure_period());
+  }
+  if(status != AUTOTUNE_DONE){
+    printf("autotune failed after %u ms\n", (unsigned)(t * (1000 / CONTROLLER_UPDATE_RATE_HZ)));
+    return 0;
+  }
+
+  Autotune_GetResult(&result);
+  printf("autotune at %d RPM: %u ms, Ku %.3f, Tu %u ms, amplitude %d RPM\n",
+         AUTOTUNE_RPM, (unsigned)(t * (1000 / CONTROLLER_UPDATE_RATE_HZ)),
+         result.ku / 65536.0, (unsigned)result.tu_ms, (int)result.amplitude_rpm);
+  printf("model: lag %u ms, dead time %u ms\n", (unsigned)result.tau_ms, (unsigned)result.dead_ms);
+  printf("gains: Kp %.3f, Ki %.4f, Kd %.3f\n\n",
+         result.kp / 65536.0, result.ki / 65536.0, result.kd / 65536.0);
+
+  // Back to rest so the script starts as without tuning
+  for(t = 0; t < 2 * CONTROLLER_UPDATE_RATE_HZ; t++){
+    control_period(0);
+  }
+  return 1;
+}
+
+// Calibration sweep from rest; returns 1 if the new table is in use
+static int run_calibrate(void){
+  int16_t table[V2RPM_POINTS];
+  uint32_t t, i;
+  uint8_t status = CALIBRATE_RUNNING;
+
+  Calibrate_Start();
+  for(t = 0; (t < CALIBRATE_SECONDS * CONTROLLER_UPDATE_RATE_HZ) && (status != CALIBRATE_DONE) &&
+             (status != CALIBRATE_FAILED); t++){
+    status = Calibrate_Update(measure_voltage());
+    if(status == CALIBRATE_WAITING){
+      status = Calibrate_Reference(Motor_Sim_Speed());
+    }
+  }
+  if(status != CALIBRATE_DONE){
+    printf("calibration failed after %u ms\n", (unsigned)(t * (1000 / CONTROLLER_UPDATE_RATE_HZ)));
+    return 0;
+  }
+
+  Voltage2RPM_GetTable(table);
+  printf("calibration: %u ms, RPM at 0, %u, ... %u mV:\n",
+         (unsigned)(t * (1000 / CONTROLLER_UPDATE_RATE_HZ)), (unsigned)V2RPM_STEP_MV, (unsigned)V2RPM_MAX_MV);
+  for(i = 0; i < V2RPM_POINTS; i++){
+    printf("%5d%s", (int)table[i], ((i % 11) == 10) ? "\n" : "");
+  }
+  printf("\n\n");
+
+  for(t = 0; t < 2 * CONTROLLER_UPDATE_RATE_HZ; t++){
+    control_period(0);
+  }
+  return 1;
+}
+
+int main(int argc, char **argv){
+  Controller_Step_t step;
+  uint32_t s, t;
+  int32_t from;
+  int32_t trueError;
+  uint32_t failures = 0;
+  int a;
+  const uint32_t updates = STEP_SECONDS * CONTROLLER_UPDATE_RATE_HZ;
+
+  Motor_Sim_Init();
+  Filter_Init(ADC_FILTER_TYPE, ADC_FILTER_LENGTH);
+  Controller_Init();
+
+  printf("motor: tau %u ms, supply %u mV, noise %u mV rms\n\n",
+         (unsigned)MOTOR_SIM_TAU_MS, (unsigned)MOTOR_SIM_SUPPLY_MV, (unsigned)MOTOR_SIM_NOISE_MV);
+
+  for(a = 1; a < argc; a++){
+    if((strcmp(argv[a], "calibrate") == 0) && !run_calibrate()){
+      return 1;
+    }
+    if((strcmp(argv[a], "autotune") == 0) && !run_autotune()){
+      return 1;
+    }
+  }
+  printf("step           rise ms  overshoot  settle ms  ss error  true error\n");
+
+  from = 0;
+  for(s = 0; s < SCRIPT_STEPS; s++){
+    Motor_Sim_SetLoad(Script[s].droop);
+    Motor_Sim_SetSupply(Script[s].supply);
+
+    trueError = 0;
+    for(t = 0; t < updates; t++){
+      control_period(Script[s].target);
+      if(t >= updates - TAIL_UPDATES){
+        trueError += Script[s].target - Motor_Sim_Speed();
+      }
+    }
+    trueError /= TAIL_UPDATES;
+
+    Controller_GetStepMetrics(&step);
+    printf("%4d -> %4d   ", (int)from, (int)Script[s].target);
+    if(step.risen){
+      printf("%7u", (unsigned)step.rise_ms);
+    }
+    else{
+      printf("%7s", "-");
+    }
+    printf("  %9d", (int)step.overshoot_rpm);
+    if(step.settled){
+      printf("  %9u  %8d", (unsigned)step.settle_ms, (int)step.steady_error);
+    }
+    else{
+      printf("  %9s  %8s", "-", "-");
+    }
+    printf("  %10d  %s\n", (int)trueError, Script[s].note);
+
+    if(!step.settled || (abs(step.steady_error) > CONTROLLER_TARGET_ERROR) ||
+       (abs(trueError) > CONTROLLER_TARGET_ERROR)){
+      failures++;
+    }
+    from = Script[s].target;
+  }
+
+  printf("\n%u steps, %u failures\n", (unsigned)SCRIPT_STEPS, (unsigned)failures);
+
+  return (failures == 0) ? 0 : 1;
+}
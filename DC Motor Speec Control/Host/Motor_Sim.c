@@ -0,0 +1,113 @@
+// Motor_Sim.c
+// Host DC motor plant
+// Runs on a POSIX host (Linux)
+// First-order motor: the speed moves toward the speed the applied
+// voltage holds with time constant MOTOR_SIM_TAU_MS. The applied voltage
+// is duty * supply; the speed it holds is the unloaded curve that
+// Current_speed() inverts (RPM = 0.3267 * mV - 225, nothing below 1200mV)
+// minus the load droop. The sensed voltage is that curve run backwards
+// from the shaft speed, off by this unit's sensor gain and offset, plus
+// noise, quantized like the ADS7806 (±10V, 12 bits, two's complement).
+//
+// PWM_SetDutyCycle() and PWM_GetDutyCycle() replace pwm_control.c with
+// the same 18.0% - 99.5% limits. Like the PWM generator, which loads a
+// new compare value when its counter reaches zero, a new duty reaches
+// the motor at the start of the next 10ms PWM period.
+
+#include <stdint.h>
+#include "Motor_Sim.h"
+#include "system.h"
+
+#define PWM_DUTY_MIN            180     // 18.0%
+#define PWM_DUTY_MAX            995     // 99.5%
+#define STEP_US                 ADC_SAMPLE_PERIOD_US
+#define PWM_PERIOD_US           (PWM_PERIOD_MS * 1000)
+
+static double Speed;                    // RPM
+static int32_t Droop;                   // RPM
+static int32_t Supply;                  // mV
+static uint16_t Duty;                   // Tenths of percent, as set
+static uint16_t Applied_Duty;           // Duty of the current PWM period
+static uint32_t Period_Time;            // Time into the PWM period (µs)
+static uint32_t Seed;
+
+//------------sim_noise------------
+// Roughly normal noise with unit variance (sum of 12 uniforms)
+static double sim_noise(void){
+    double sum = 0;
+    int i;
+
+    for(i = 0; i < 12; i++){
+        Seed = Seed * 1103515245 + 12345;
+        sum += (double)(Seed >> 8) / (double)(1 << 24);
+    }
+    return sum - 6.0;
+}
+
+//------------sim_hold_rpm------------
+// Speed the applied voltage holds when nothing else changes
+static double sim_hold_rpm(void){
+    double mV = (double)Applied_Duty * Supply / 1000.0;
+    double rpm;
+
+    if(mV <= 1200.0){
+        return 0;
+    }
+    rpm = (21408.0 * mV) / 65536.0 - 225.0 - Droop;
+    return (rpm > 0) ? rpm : 0;
+}
+
+void Motor_Sim_Init(void){
+    Speed = 0;
+    Droop = 0;
+    Supply = MOTOR_SIM_SUPPLY_MV;
+    Duty = 0;
+    Applied_Duty = 0;
+    Period_Time = 0;
+    Seed = 1;
+}
+
+void Motor_Sim_SetLoad(int32_t droop_rpm){
+    Droop = droop_rpm;
+}
+
+void Motor_Sim_SetSupply(int32_t supply_mV){
+    Supply = supply_mV;
+}
+
+uint16_t Motor_Sim_Sample(void){
+    double mV;
+    int32_t code;
+
+    if(Period_Time == 0){
+        Applied_Duty = Duty;
+    }
+    Period_Time = (Period_Time + STEP_US) % PWM_PERIOD_US;
+
+    Speed += (sim_hold_rpm() - Speed) * STEP_US / (MOTOR_SIM_TAU_MS * 1000.0);
+
+    // Sensor voltage that Current_speed() maps back to this speed
+    mV = (Speed > 0) ? ((Speed + 225.0) * 65536.0) / 21408.0 : 0;
+    mV = (mV * MOTOR_SIM_SENSOR_GAIN) / 1000.0 + MOTOR_SIM_SENSOR_OFFSET_MV;
+    mV += MOTOR_SIM_NOISE_MV * sim_noise();
+
+    // ±10V over 4096 codes
+    code = (int32_t)(mV * 4096.0 / 20000.0);
+    code = CLAMP(code, -2048, 2047);
+    return (uint16_t)(code & 0x0FFF);
+}
+
+int32_t Motor_Sim_Speed(void){
+    return (int32_t)(Speed + 0.5);
+}
+
+//------------PWM_SetDutyCycle------------
+// Same limits as pwm_control.c
+void PWM_SetDutyCycle(uint16_t duty_percent_x10){
+    Duty = CLAMP(duty_percent_x10, PWM_DUTY_MIN, PWM_DUTY_MAX);
+}
+
+//------------PWM_GetDutyCycle------------
+uint16_t PWM_GetDutyCycle(void){
+    return Duty;
+}
@@ -0,0 +1,54 @@
+// Motor_Sim.h
+// Host DC motor plant
+// Runs on a POSIX host (Linux)
+// Stands in for the motor, the speed sensor voltage, the ADS7806 and
+// pwm_control.c so controller.c, filter.c and Voltage2RPM.c can be run
+// in closed loop on a PC.
+
+#ifndef MOTOR_SIM_H
+#define MOTOR_SIM_H
+
+#include <stdint.h>
+
+// Motor supply at 100% duty (mV)
+#ifndef MOTOR_SIM_SUPPLY_MV
+#define MOTOR_SIM_SUPPLY_MV     9500
+#endif
+
+// Mechanical time constant (ms)
+#ifndef MOTOR_SIM_TAU_MS
+#define MOTOR_SIM_TAU_MS        120
+#endif
+
+// RMS noise on the sensed voltage (mV), before quantization
+#ifndef MOTOR_SIM_NOISE_MV
+#define MOTOR_SIM_NOISE_MV      20
+#endif
+
+// This unit's speed sensor against the nominal curve: the sensed voltage
+// is scaled by MOTOR_SIM_SENSOR_GAIN (per mille) and offset by
+// MOTOR_SIM_SENSOR_OFFSET_MV
+#ifndef MOTOR_SIM_SENSOR_GAIN
+#define MOTOR_SIM_SENSOR_GAIN   1000
+#endif
+#ifndef MOTOR_SIM_SENSOR_OFFSET_MV
+#define MOTOR_SIM_SENSOR_OFFSET_MV 0
+#endif
+
+// Initialize the plant at rest, duty 0, no load
+void Motor_Sim_Init(void);
+
+// Load on the shaft: speed lost at any duty (RPM)
+void Motor_Sim_SetLoad(int32_t droop_rpm);
+
+// Supply voltage at 100% duty (mV), e.g. a sagging battery
+void Motor_Sim_SetSupply(int32_t supply_mV);
+
+// Advance one ADC period (100µs) and return the 12-bit code the SSI
+// would receive (two's complement, upper 4 bits zero)
+uint16_t Motor_Sim_Sample(void);
+
+// True shaft speed (RPM)
+int32_t Motor_Sim_Speed(void);
+
+#endif // MOTOR_SIM_H
@@ -0,0 +1,11 @@
+// TM4C123GH6PM.h
+// Host stand-in for the CMSIS device header
+// Lets controller.c, filter.c, dsp.c and Voltage2RPM.c compile on a PC;
+// no register is touched by the code built on the host.
+
+#ifndef TM4C123GH6PM_HOST_H
+#define TM4C123GH6PM_HOST_H
+
+#include <stdint.h>
+
+#endif // TM4C123GH6PM_HOST_H
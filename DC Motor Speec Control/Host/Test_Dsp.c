@@ -0,0 +1,167 @@
+// Equivalence test for the DSP kernels
+// Runs on a POSIX host against dsp.c
+//
+// Every kernel is run on random blocks of every length from 0 to 70, at
+// even and odd start addresses, with small (ADC-like) and full-scale
+// samples, and compared with a one-sample-at-a-time reference written
+// here; DSP_Extend12 is run in place at both start addresses too.
+// Build it twice: once with the packed (SMLAD/SSUB16/SEL) loops, with
+// the instructions emulated in C, and once with the plain fallback.
+//
+// Build:
+//   gcc -I.. -DDSP_SIMD_EMULATE Test_Dsp.c ../dsp.c -o test_dsp_simd
+//   gcc -I.. Test_Dsp.c ../dsp.c -o test_dsp_c
+
+#include <stdint.h>
+#include <stdio.h>
+#include "system.h"
+
+#define MAX_SAMPLES             72
+#define MAX_TAPS                9
+#define ROUNDS                  200
+
+static uint32_t Seed = 12345;
+static uint32_t Failures = 0;
+
+static uint32_t rand_next(void){
+  Seed = Seed * 1103515245 + 12345;
+  return Seed >> 8;
+}
+
+static void check(int ok, const char *kernel, uint32_t n){
+  if(!ok){
+    if(Failures < 10){
+      printf("FAIL: %s, %u samples\n", kernel, (unsigned)n);
+    }
+    Failures++;
+  }
+}
+
+// Reference kernels
+
+static int32_t ref_dot(const int16_t *x, const int16_t *h, uint32_t n){
+  uint32_t acc = 0;
+  uint32_t i;
+  for(i = 0; i < n; i++){
+    acc += (uint32_t)((int32_t)x[i] * h[i]);
+  }
+  return (int32_t)acc;
+}
+
+static uint32_t ref_rms(const int16_t *x, uint32_t n){
+  uint64_t sum = 0;
+  uint32_t mean;
+  uint32_t root = 0;
+  uint32_t i;
+  if(n == 0){
+    return 0;
+  }
+  for(i = 0; i < n; i++){
+    sum += (uint64_t)((int64_t)x[i] * x[i]);
+  }
+  mean = (uint32_t)(sum / n);
+  while((uint64_t)(root + 1) * (root + 1) <= mean){
+    root++;
+  }
+  return root;
+}
+
+static void test_block(const int16_t *x, uint32_t n, const int16_t *h){
+  int16_t y[MAX_SAMPLES];
+  int32_t sums[MAX_SAMPLES];
+  int16_t lo, hi;
+  int32_t acc, expect;
+  uint32_t taps = 1 + rand_next() % MAX_TAPS;
+  uint32_t factor = 1 + rand_next() % 12;
+  uint8_t shift = (uint8_t)(rand_next() % 16);
+  uint32_t count, i, j;
+  int ok;
+
+  // Sum: a dot product with ones
+  expect = 0;
+  for(i = 0; i < n; i++){
+    expect += x[i];
+  }
+  check(DSP_Sum(x, n) == expect, "DSP_Sum", n);
+
+  check(DSP_Dot(x, h, n) == ref_dot(x, h, n), "DSP_Dot", n);
+
+  count = DSP_FIR(x, n, h, taps, shift, y);
+  ok = (count == ((n >= taps) ? n - taps + 1 : 0));
+  for(i = 0; ok && (i < count); i++){
+    acc = ref_dot(&x[i], h, taps) >> shift;
+    ok = (y[i] == (int16_t)CLAMP(acc, -32768, 32767));
+  }
+  check(ok, "DSP_FIR", n);
+
+  count = DSP_Decimate(x, n, factor, sums);
+  ok = (count == n / factor);
+  for(j = 0; ok && (j < count); j++){
+    expect = 0;
+    for(i = 0; i < factor; i++){
+      expect += x[j * factor + i];
+    }
+    ok = (sums[j] == expect);
+  }
+  check(ok, "DSP_Decimate", n);
+
+  if(n > 0){
+    DSP_MinMax(x, n, &lo, &hi);
+    ok = 1;
+    for(i = 0; i < n; i++){
+      ok = ok && (lo <= x[i]) && (hi >= x[i]);
+    }
+    for(i = 0; (i < n) && (x[i] != lo); i++){}
+    ok = ok && (i < n);
+    for(i = 0; (i < n) && (x[i] != hi); i++){}
+    ok = ok && (i < n);
+    check(ok, "DSP_MinMax", n);
+  }
+
+  check(DSP_RMS(x, n) == ref_rms(x, n), "DSP_RMS", n);
+}
+
+int main(void){
+  int16_t buffer[MAX_SAMPLES + 1];
+  int16_t taps[MAX_SAMPLES + 1];
+  uint16_t codes[MAX_SAMPLES + 1];
+  uint32_t round, n, start, i;
+  int ok;
+
+  for(round = 0; round < ROUNDS; round++){
+    for(n = 0; n <= MAX_SAMPLES - 2; n++){
+      for(start = 0; start < 2; start++){
+        // Half the rounds ADC-sized samples, half full scale
+        for(i = 0; i < MAX_SAMPLES + 1; i++){
+          if(round & 1){
+            buffer[i] = (int16_t)rand_next();
+          }
+          else{
+            buffer[i] = (int16_t)((int32_t)(rand_next() % 4096) - 2048) * 16;
+          }
+          taps[i] = (int16_t)rand_next();
+        }
+        test_block(&buffer[start], n, &taps[start]);
+      }
+
+      // Random 12-bit codes, widened in place at both start addresses
+      for(start = 0; start < 2; start++){
+        for(i = 0; i < n; i++){
+          codes[start + i] = (uint16_t)(rand_next() & 0x0FFF);
+          buffer[i] = (int16_t)((int32_t)((uint32_t)codes[start + i] << 20) >> 20);
+        }
+        DSP_Extend12(&codes[start], n);
+        ok = 1;
+        for(i = 0; i < n; i++){
+          ok = ok && ((int16_t)codes[start + i] == buffer[i] * 16);
+        }
+        check(ok, "DSP_Extend12", n);
+      }
+    }
+  }
+
+  printf("%u blocks, %u failures\n", (unsigned)(ROUNDS * (MAX_SAMPLES - 1) * 2),
+         (unsigned)Failures);
+
+  return (Failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,315 @@
+// Settings and log storage test
+// Runs on a POSIX host against storage.c, the Simple_File_System sources
+// and their flash simulator (Flash_Sim.c)
+//
+// - a blank disk gets a settings file; nothing loads from it yet
+// - gains and calibration records are saved over and over, each load
+//   returning the latest; the file is compacted as it grows, so it stays
+//   short and there is only ever one settings file
+// - the same saves are rerun with power cut at each flash operation in
+//   turn: after a remount each tag must load the value of the last save
+//   that completed (or the one under way), one settings file must be
+//   left, and a further save must load back
+// - while erases are held (motor running) a save is refused with
+//   STORAGE_BUSY and background work does nothing; released, both work
+// - a telemetry-sized log is written through the delta mode and read back
+//
+// The kernel calls the file system's lock makes (FS_THREAD_SAFE=1) are
+// stood in for by counters: Flash_Sim.c finishes each request before
+// OS_Wait() is reached, so nothing here ever blocks.
+//
+// Build:
+//   gcc -O2 -I.. -I. -I../../Simple_File_System -I../../Simple_File_System/Host
+//       -DMOTOR_FLASH_STORAGE=1 -DFS_THREAD_SAFE=1 -DFS_PACK_CHANNELS=5U
+//       Test_Storage.c ../storage.c ../../Simple_File_System/Host/Flash_Sim.c
+//       ../../Simple_File_System/OS_File_System.c ../../Simple_File_System/OS_File_Log.c
+//       ../../Simple_File_System/OS_File_Wear.c ../../Simple_File_System/OS_File_Cache.c
+//       ../../Simple_File_System/OS_File_Handle.c ../../Simple_File_System/OS_File_Lock.c
+//       ../../Simple_File_System/OS_File_Crc.c ../../Simple_File_System/OS_File_Pack.c
+//       -o test_storage
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "system.h"
+#include "OS_File_System.h"
+#include "Flash_Sim.h"
+
+#define SAVES                   200     // Saves of each tag, several compactions
+#define CUT_SAVES               40      // Saves of each tag in a power-cut run
+#define CUT_WARMUP              10      // Saves before the cut run starts counting
+#define LOG_RECORDS             2000
+#define SETTINGS_LIMIT          1200U   // Longest the settings file may get
+
+static uint32_t Failures = 0;
+
+// Kernel stand-ins: a wait on a semaphore that is not given would hang
+void OS_InitSemaphore(int32_t *s, int32_t value){
+  *s = value;
+}
+
+void OS_Wait(int32_t *s){
+  if(*s <= 0){
+    printf("FAIL wait would block\n");
+    Failures++;
+  }
+  (*s)--;
+}
+
+void OS_Signal(int32_t *s){
+  (*s)++;
+}
+
+void OS_Suspend(void){
+}
+
+void OS_Sleep(uint32_t ticks){
+  (void)ticks;
+}
+
+static void check(int ok, const char *what, uint32_t n){
+  if(!ok){
+    Failures++;
+    printf("FAIL %s (%u)\n", what, (unsigned)n);
+  }
+}
+
+// Records of the two sizes the firmware saves, filled from a sequence number
+static void gains_fill(int32_t gains[4], uint32_t seq){
+  gains[0] = (int32_t)(seq * 3U);
+  gains[1] = (int32_t)(seq * 5U + 1U);
+  gains[2] = -(int32_t)seq;
+  gains[3] = CONTROLLER_UPDATE_RATE_HZ;
+}
+
+static void table_fill(int16_t table[V2RPM_POINTS], uint32_t seq){
+  uint32_t i;
+
+  for(i = 0; i < V2RPM_POINTS; i++){
+    table[i] = (int16_t)(i * 150U + seq);
+  }
+}
+
+// Sequence number of the saved gains (and table), or -1 if none loads or
+// the two halves of a record disagree
+static int32_t gains_seq(void){
+  int32_t gains[4];
+  int32_t expect[4];
+
+  if(Storage_Load(STORAGE_TAG_GAINS, gains, sizeof(gains)) != STORAGE_SUCCESS){
+    return -1;
+  }
+  gains_fill(expect, (uint32_t)gains[0] / 3U);
+  return (memcmp(gains, expect, sizeof(gains)) == 0) ? gains[0] / 3 : -1;
+}
+
+static int32_t table_seq(void){
+  int16_t table[V2RPM_POINTS];
+  int16_t expect[V2RPM_POINTS];
+
+  if(Storage_Load(STORAGE_TAG_CAL, table, sizeof(table)) != STORAGE_SUCCESS){
+    return -1;
+  }
+  table_fill(expect, (uint32_t)table[0]);
+  return (memcmp(table, expect, sizeof(table)) == 0) ? table[0] : -1;
+}
+
+// Save both records under one sequence number; 1 if both committed
+static uint8_t save_both(uint32_t seq){
+  int32_t gains[4];
+  int16_t table[V2RPM_POINTS];
+
+  gains_fill(gains, seq);
+  table_fill(table, seq);
+  return (Storage_Save(STORAGE_TAG_GAINS, gains, sizeof(gains)) == STORAGE_SUCCESS) &&
+         (Storage_Save(STORAGE_TAG_CAL, table, sizeof(table)) == STORAGE_SUCCESS) &&
+         !Flash_Sim_PowerLost();
+}
+
+// Raw files that start like a settings file, and the longest of them
+static uint32_t settings_files(uint32_t *longest){
+  uint8_t header[4];
+  uint32_t count = 0;
+  uint32_t i;
+  FS_Handle_t h;
+
+  *longest = 0;
+  for(i = 0; i <= MAX_FILE_NUMBER; i++){
+    if(!OS_File_Exists((FS_File_t)i) || (OS_File_Mode((FS_File_t)i) != FS_MODE_RAW)){
+      continue;
+    }
+    h = OS_File_Open((FS_File_t)i);
+    if((OS_File_ReadBytes(h, header, 4) == 4) && (memcmp(header, "DMOT", 4) == 0)){
+      count++;
+      if(OS_File_Length((FS_File_t)i) > *longest){
+        *longest = OS_File_Length((FS_File_t)i);
+      }
+    }
+    OS_File_Close(h);
+  }
+  return count;
+}
+
+static void test_saves(void){
+  uint32_t longest = 0;
+  uint32_t most = 0;
+  uint32_t seq;
+
+  Flash_Sim_Reset();
+  check(Storage_Init() == STORAGE_SUCCESS, "init on a blank disk", 0);
+  check(gains_seq() == -1, "nothing saved yet", 0);
+
+  for(seq = 1; seq <= SAVES; seq++){
+    check(save_both(seq), "save", seq);
+    check(gains_seq() == (int32_t)seq, "latest gains", seq);
+    check(table_seq() == (int32_t)seq, "latest table", seq);
+    check(settings_files(&longest) == 1U, "one settings file", seq);
+    most = (longest > most) ? longest : most;
+  }
+  check(most <= SETTINGS_LIMIT, "settings file compacted", most);
+
+  // Across a remount
+  check(Storage_Init() == STORAGE_SUCCESS, "init again", 0);
+  check((gains_seq() == SAVES) && (table_seq() == SAVES), "latest after a remount", 0);
+  printf("saves: %u of each record, settings file at most %u bytes\n", SAVES, (unsigned)most);
+}
+
+// One power-cut run; returns the flash operations of the saves
+static uint32_t cut_run(int32_t cut, uint32_t *done){
+  uint32_t start;
+  uint32_t seq;
+
+  Flash_Sim_Reset();
+  Storage_Init();
+  for(seq = 1; seq <= CUT_WARMUP; seq++){
+    save_both(seq);
+  }
+  *done = CUT_WARMUP;
+  start = Flash_Sim_Operations();
+  Flash_Sim_CutAfter(cut);
+  for(; seq <= CUT_WARMUP + CUT_SAVES; seq++){
+    if(!save_both(seq)){
+      break;
+    }
+    *done = seq;
+  }
+  return Flash_Sim_Operations() - start;
+}
+
+static void test_power_cuts(void){
+  uint32_t total;
+  uint32_t done;
+  uint32_t longest;
+  int32_t gains;
+  int32_t table;
+  uint32_t cut;
+  uint32_t cuts_failed = 0;
+  uint8_t ok;
+
+  total = cut_run(FLASH_SIM_NO_CUT, &done);
+  check(done == CUT_WARMUP + CUT_SAVES, "reference run", done);
+
+  for(cut = 0; cut < total; cut++){
+    cut_run((int32_t)cut, &done);
+
+    // Power back on: the last completed save, or the one under way
+    Flash_Sim_CutAfter(FLASH_SIM_NO_CUT);
+    ok = (Storage_Init() == STORAGE_SUCCESS);
+    gains = gains_seq();
+    table = table_seq();
+    ok = ok && (gains >= (int32_t)done) && (gains <= (int32_t)done + 1) &&
+         (table >= (int32_t)done) && (table <= gains);
+    ok = ok && (settings_files(&longest) == 1U);
+
+    // And it still takes saves
+    ok = ok && save_both(1000U) && (gains_seq() == 1000) && (table_seq() == 1000) &&
+         (Storage_Init() == STORAGE_SUCCESS) && (gains_seq() == 1000);
+
+    if(!ok){
+      printf("FAIL power cut at operation %u (after save %u: gains %d, table %d)\n",
+             (unsigned)cut, (unsigned)done, (int)gains, (int)table);
+      cuts_failed++;
+    }
+  }
+  Failures += cuts_failed;
+  printf("power cuts: %u, %u failed\n", (unsigned)total, (unsigned)cuts_failed);
+}
+
+static void test_hold(void){
+  int32_t gains[4];
+
+  Flash_Sim_Reset();
+  check(Storage_Init() == STORAGE_SUCCESS, "init for the hold", 0);
+  check(save_both(1), "save before the hold", 0);
+  Storage_Hold(1);
+  gains_fill(gains, 2);
+  check(Storage_Save(STORAGE_TAG_GAINS, gains, sizeof(gains)) == STORAGE_BUSY, "save refused while held", 0);
+  check(Storage_Background() == STORAGE_ERROR, "no background work while held", 0);
+  check(gains_seq() == 1, "loads while held", 0);
+  Storage_Hold(0);
+  check(Storage_Save(STORAGE_TAG_GAINS, gains, sizeof(gains)) == STORAGE_SUCCESS, "save once released", 0);
+  check(gains_seq() == 2, "saved once released", 0);
+}
+
+static void test_log(void){
+  int32_t record[TELEMETRY_CHANNELS];
+  int32_t back[TELEMETRY_CHANNELS];
+  uint32_t files = 0;
+  uint32_t bytes = 0;
+  uint32_t good = 0;
+  uint32_t i;
+  uint32_t k;
+  FS_File_t log = FILE_INVALID;
+  FS_Handle_t h;
+
+  Flash_Sim_Reset();
+  check(Storage_Init() == STORAGE_SUCCESS, "init for the log", 0);
+  check(Storage_Log_Start(TELEMETRY_CHANNELS) == STORAGE_SUCCESS, "log start", 0);
+  for(i = 0; i < LOG_RECORDS; i++){
+    record[0] = 1200;
+    record[1] = 1200 + (int32_t)(i % 7U) - 3;
+    record[2] = record[0] - record[1];
+    record[3] = 400 + (int32_t)(i / 100U);
+    record[4] = 520;
+    check(Storage_Log_Write(record, TELEMETRY_CHANNELS) == STORAGE_SUCCESS, "log write", i);
+    if((i % 500U) == 499U){
+      check(Storage_Log_Sync() == STORAGE_SUCCESS, "log sync", i);
+    }
+  }
+  check(Storage_Log_Stop() == STORAGE_SUCCESS, "log stop", 0);
+
+  for(i = 0; i <= MAX_FILE_NUMBER; i++){
+    if(OS_File_Exists((FS_File_t)i) && (OS_File_Mode((FS_File_t)i) != FS_MODE_RAW)){
+      log = (FS_File_t)i;
+      bytes = OS_File_Size(log) * SECTOR_SIZE;
+      files++;
+    }
+  }
+  check(files == 1U, "one log file", files);
+
+  h = OS_File_Open(log);
+  for(i = 0; i < LOG_RECORDS; i++){
+    if(OS_File_ReadBytes(h, (uint8_t *)back, sizeof(back)) != sizeof(back)){
+      break;
+    }
+    record[1] = 1200 + (int32_t)(i % 7U) - 3;
+    k = (back[0] == 1200) && (back[1] == record[1]) && (back[2] == 1200 - record[1]) &&
+        (back[3] == 400 + (int32_t)(i / 100U)) && (back[4] == 520);
+    good += k;
+  }
+  OS_File_Close(h);
+  check(good == LOG_RECORDS, "log reads back", good);
+  printf("log: %u records in %u bytes of sectors\n", (unsigned)good, (unsigned)bytes);
+}
+
+int main(void){
+  Flash_Sim_Init();
+
+  test_saves();
+  test_power_cuts();
+  test_hold();
+  test_log();
+
+  printf("%s\n", Failures ? "FAILED" : "ok");
+  return Failures ? 1 : 0;
+}
@@ -0,0 +1,236 @@
+// Telemetry recording test
+// Runs on a POSIX host against telemetry.c, storage.c, the
+// Simple_File_System sources and their flash simulator (Flash_Sim.c)
+//
+// Telemetry_Thread runs unchanged as the only thread; simulated time
+// passes in its OS_Sleep() and in any OS_Wait() that would block, where
+// the control loop's 1 kHz Telemetry_Put() calls and the keypad's
+// actions are played out. An earlier log fills most of the disk, so the
+// new one (which deletes it) soon needs an erase. The motor is started
+// (Storage_Hold(1)) as the recording starts, runs long enough to use up
+// the erased sectors, and is stopped (Storage_Hold(0)); then the
+// recording is stopped.
+//
+// Checked:
+// - no flash erase happens while the motor runs, and they do once stopped
+// - the log opens with its header, and every record read back follows
+//   the one before, or the gap record before it accounts for the jump
+// - the drops the gap records account for are the ones counted
+// - the hold did stop the drain (something was dropped), and records
+//   were logged again once it ended
+// The update count (in the I term) stays below 65536, so it reads back whole.
+//
+// Build:
+//   gcc -O2 -I.. -I. -I../../Simple_File_System -I../../Simple_File_System/Host
+//       -DMOTOR_FLASH_STORAGE=1 -DFS_THREAD_SAFE=1 -DFS_PACK_CHANNELS=5U
+//       Test_Telemetry.c ../telemetry.c ../storage.c ../../Simple_File_System/Host/Flash_Sim.c
+//       ../../Simple_File_System/OS_File_System.c ../../Simple_File_System/OS_File_Log.c
+//       ../../Simple_File_System/OS_File_Wear.c ../../Simple_File_System/OS_File_Cache.c
+//       ../../Simple_File_System/OS_File_Handle.c ../../Simple_File_System/OS_File_Lock.c
+//       ../../Simple_File_System/OS_File_Crc.c ../../Simple_File_System/OS_File_Pack.c
+//       -o test_telemetry
+
+#include <stdint.h>
+#include <stdio.h>
+#include <setjmp.h>
+#include "system.h"
+#include "OS_File_System.h"
+#include "Flash_Sim.h"
+
+#define TICK_MS                 2       // One RTOS tick (RTOS_TIMESLICE_US)
+#define RUN_MS                  20000   // Recording with the motor running
+#define AFTER_MS                2000    // Then stopped
+#define END_MS                  60000   // Give up
+#define RUN_TARGET              1200
+#define ERASED_LEFT             32U     // Free sectors the earlier log leaves
+
+static uint32_t Failures = 0;
+static uint32_t Now_ms = 0;             // Simulated time
+static uint32_t Updates = 0;            // Control updates since reset
+static uint8_t Running = 0;             // Motor started, erases held
+static uint32_t Held_Erases = 0;        // Erases done while held
+static uint32_t Released = 0;           // Update count when the hold ended
+static uint32_t Stopped_ms = 0;         // When the recording was stopped
+static jmp_buf Done;
+
+static void check(int ok, const char *what, uint32_t n){
+  if(!ok){
+    Failures++;
+    printf("FAIL %s (%u)\n", what, (unsigned)n);
+  }
+}
+
+static uint32_t erases(void){
+  Flash_SimStats_t stats;
+
+  Flash_Sim_GetStats(&stats);
+  return stats.erases;
+}
+
+// A control update: the speed wanders about the target, the I term
+// carries the update count
+static void put_update(void){
+  int32_t target = Running ? RUN_TARGET : 0;
+  int32_t rpm = Running ? RUN_TARGET - (int32_t)(Updates % 7U) : 0;
+
+  Telemetry_Put(target, rpm, target - rpm, (int16_t)Updates, Running ? 450U : 0U);
+  Updates++;
+}
+
+// One millisecond: the keypad's script, then a control update
+static void tick_ms(void){
+  static uint32_t run_erases;
+
+  Now_ms++;
+  if(Now_ms == 1){
+    Storage_Hold(1);            // Before the motor starts
+    run_erases = erases();
+    Running = 1;
+    Telemetry_Start();
+  }
+  else if(Now_ms == RUN_MS){
+    Running = 0;
+    Held_Erases = erases() - run_erases;
+    Released = Updates;
+    Storage_Hold(0);
+  }
+  else if(Now_ms == RUN_MS + AFTER_MS){
+    Telemetry_Stop();
+    Stopped_ms = Now_ms;
+  }
+  else if(Now_ms >= END_MS){
+    printf("FAIL still waiting at %ums\n", (unsigned)Now_ms);
+    Failures++;
+    longjmp(Done, 1);
+  }
+
+  put_update();
+}
+
+// Kernel stand-ins: a sleep or a wait that would block lets time pass
+void OS_InitSemaphore(int32_t *s, int32_t value){
+  *s = value;
+}
+
+void OS_Wait(int32_t *s){
+  while(*s <= 0){
+    tick_ms();
+  }
+  (*s)--;
+}
+
+void OS_Signal(int32_t *s){
+  (*s)++;
+}
+
+void OS_Suspend(void){
+}
+
+void OS_Sleep(uint32_t ticks){
+  uint32_t i;
+
+  for(i = 0; i < ticks * TICK_MS; i++){
+    tick_ms();
+  }
+  if(Stopped_ms && (Telemetry_Status() != TELEMETRY_RECORDING)){
+    longjmp(Done, 1);           // Log closed
+  }
+}
+
+// Read the log back: header, then each record against the one before
+static void check_log(void){
+  int32_t record[TELEMETRY_CHANNELS];
+  uint32_t records = 0;
+  uint32_t gaps = 0;
+  uint32_t lost = 0;
+  uint32_t expect = 0;
+  uint32_t start = 0;
+  uint32_t logged;
+  uint32_t dropped;
+  uint32_t i;
+  uint8_t first = 1;
+  FS_File_t log = FILE_INVALID;
+  FS_Handle_t h;
+
+  for(i = 0; i <= MAX_FILE_NUMBER; i++){
+    if(OS_File_Exists((FS_File_t)i) && (OS_File_Mode((FS_File_t)i) != FS_MODE_RAW)){
+      log = (FS_File_t)i;
+    }
+  }
+  check(log != FILE_INVALID, "log file", 0);
+  if(log == FILE_INVALID){
+    return;
+  }
+
+  h = OS_File_Open(log);
+  check((OS_File_ReadBytes(h, (uint8_t *)record, sizeof(record)) == sizeof(record)) &&
+        (record[0] == 0x4D4C4554) && (record[1] == CONTROLLER_UPDATE_RATE_HZ) &&
+        (record[2] == TELEMETRY_CHANNELS), "log header", 0);
+
+  while(OS_File_ReadBytes(h, (uint8_t *)record, sizeof(record)) == sizeof(record)){
+    if(record[0] == -1){
+      check(!first && (record[1] > 0), "gap record after a record", records);
+      expect += (uint32_t)record[1];
+      lost += (uint32_t)record[1];
+      gaps++;
+      continue;
+    }
+    check(first || ((uint16_t)record[3] == (uint16_t)expect), "record follows", records);
+    check((record[2] == record[0] - record[1]) && (record[4] == ((record[0] != 0) ? 450 : 0)),
+          "record fields", records);
+    if(first){
+      start = (uint16_t)record[3];
+    }
+    expect = (uint32_t)(uint16_t)record[3] + 1U;
+    first = 0;
+    records++;
+  }
+  OS_File_Close(h);
+
+  Telemetry_GetCounts(&logged, &dropped);
+  check(records == logged, "records read back", records);
+  check(lost == dropped, "gap records count the drops", lost);
+  check(records + lost == expect - start, "every update logged or dropped", records + lost);
+  check(dropped > 0, "drain held off while running", dropped);
+  check(expect > Released, "recording resumed after the hold", expect);
+  printf("log: %u records, %u dropped in %u gaps\n", (unsigned)records, (unsigned)dropped,
+         (unsigned)gaps);
+}
+
+int main(void){
+  int32_t record[TELEMETRY_CHANNELS];
+  uint32_t before;
+  uint32_t i;
+
+  Flash_Sim_Init();
+  Flash_Sim_Reset();
+  check(Storage_Init() == STORAGE_SUCCESS, "storage init", 0);
+
+  // The earlier recording
+  check(Storage_Log_Start(TELEMETRY_CHANNELS) == STORAGE_SUCCESS, "earlier log", 0);
+  for(i = 0; OS_FS_FreeSectors() > ERASED_LEFT; i++){
+    record[0] = RUN_TARGET;
+    record[1] = RUN_TARGET - (int32_t)(i % 7U);
+    record[2] = record[0] - record[1];
+    record[3] = (int32_t)i;
+    record[4] = 450;
+    if(Storage_Log_Write(record, TELEMETRY_CHANNELS) != STORAGE_SUCCESS){
+      break;
+    }
+  }
+  check(Storage_Log_Stop() == STORAGE_SUCCESS, "earlier log stop", 0);
+
+  before = erases();
+  if(setjmp(Done) == 0){
+    Telemetry_Thread();
+  }
+
+  check(Held_Erases == 0, "no erase while the motor runs", Held_Erases);
+  check(erases() > before, "erases done while stopped", erases() - before);
+  check(Telemetry_Status() == TELEMETRY_IDLE, "recording ended cleanly", Telemetry_Status());
+  printf("erases: %u while running, %u in all\n", (unsigned)Held_Erases, (unsigned)(erases() - before));
+  check_log();
+
+  printf("%s\n", Failures ? "FAILED" : "ok");
+  return Failures ? 1 : 0;
+}
@@ -0,0 +1,4 @@
+// tm4c123gh6pm.h
+// Host stand-in, same as TM4C123GH6PM.h (Voltage2RPM.c uses this spelling)
+
+#include "TM4C123GH6PM.h"
@@ -1,16 +1,115 @@
-// The function Current_speed converts an input voltage in mVolts (between 0 and 95000)
-// To the corresponding DC motor speed in RPM. This is the speed of unloaded
-// motor.
+// The function Current_speed converts an input voltage in mVolts (between 0 and
+// V2RPM_MAX_MV, 10240; higher voltages read as the top of the table)
+// To the corresponding DC motor speed in RPM.
+// The conversion is a piecewise-linear table of the speed at every
+// V2RPM_STEP_MV (512mV) from 0 to V2RPM_MAX_MV, so one lookup is a shift,
+// a mask and a multiply: constant time, no division. The table starts as
+// the unloaded nominal motor, RPM = (21408 * mV >> 16) - 225 and nothing
+// up to 1200mV, taken at the table points only: between 1024mV and
+// 1536mV it ramps from 0 instead of stepping at 1200mV (94 RPM there, not
+// 167), which is below any speed the controller runs at. It is replaced
+// by the one a calibration sweep measures on the motor in use
+// (calibrate.c), which is kept in flash (MOTOR_FLASH_STORAGE, system.h).
 
 // John Tadrous
 // October 2, 2020
 
 #include "tm4c123gh6pm.h"
 #include "tm4c123gh6pm_def.h"
+#include <stdint.h>
 
+#include "system.h"
 
-int32_t Current_speed(int32_t Avg_volt){ // This function returns the current
-                                           // DC motor RPM given the voltage in mV
-  if (Avg_volt<= 1200) {return 0;}
-  else {return ((21408*Avg_volt)>>16)-225;}
+// Nominal motor, as the formula gives it at each table point
+static const int16_t Nominal_Table[V2RPM_POINTS] = {
+       0,    0,    0,  276,  444,  611,  778,  945, 1113, 1280,   // 0 - 4608mV
+    1447, 1614, 1782, 1949, 2116, 2283, 2451, 2618, 2785, 2952,   // 5120 - 9728mV
+    3120                                                          // 10240mV
+};
+
+// Two copies: a new table is written to the one not in use, then made
+// current with a single pointer store, so the control thread never reads
+// a half-written table
+static int16_t Tables[2][V2RPM_POINTS];
+static const int16_t * volatile Table = Nominal_Table;
+
+//******** Current_speed ************
+// Input: Avg_volt - motor voltage in mV
+// Returns: speed in RPM, 0 below the table's dead zone
+int32_t Current_speed(int32_t Avg_volt){
+    const int16_t *table = Table;
+    uint32_t index;
+    int32_t frac;
+
+    if(Avg_volt <= 0){
+        return table[0];
+    }
+    if(Avg_volt >= V2RPM_MAX_MV){
+        return table[V2RPM_POINTS - 1];
+    }
+    index = (uint32_t)Avg_volt >> V2RPM_SHIFT;
+    frac = Avg_volt & (V2RPM_STEP_MV - 1);
+    return table[index] + (((table[index + 1] - table[index]) * frac) >> V2RPM_SHIFT);
+}
+
+//******** Voltage2RPM_SetTable ************
+// Use a new conversion table (from a thread)
+// Input: table - RPM at 0, V2RPM_STEP_MV, ... V2RPM_MAX_MV
+void Voltage2RPM_SetTable(const int16_t *table){
+    int16_t *next = (Table == Tables[0]) ? Tables[1] : Tables[0];
+    uint32_t i;
+
+    for(i = 0; i < V2RPM_POINTS; i++){
+        next[i] = table[i];
+    }
+    Table = next;
+}
+
+//******** Voltage2RPM_GetTable ************
+// Output: table - the conversion table in use (V2RPM_POINTS entries)
+void Voltage2RPM_GetTable(int16_t *table){
+    const int16_t *current = Table;
+    uint32_t i;
+
+    for(i = 0; i < V2RPM_POINTS; i++){
+        table[i] = current[i];
+    }
+}
+
+//******** Voltage2RPM_Save ************
+// Save the conversion table in use to flash (see storage.c)
+// Called from a thread, not the control path: a flash write blocks
+// Returns: STORAGE_SUCCESS, STORAGE_BUSY while the motor runs (save
+//          again once stopped), or STORAGE_ERROR
+uint8_t Voltage2RPM_Save(void){
+    int16_t table[V2RPM_POINTS];
+
+    Voltage2RPM_GetTable(table);
+    return Storage_Save(STORAGE_TAG_CAL, table, sizeof(table));
+}
+
+//******** Voltage2RPM_Load ************
+// Use the conversion table last saved to flash
+// Returns: STORAGE_SUCCESS, or STORAGE_ERROR (table kept) if none is
+//          saved or it is not a rising speed curve
+uint8_t Voltage2RPM_Load(void){
+    int16_t table[V2RPM_POINTS];
+    uint32_t i;
+
+    if(Storage_Load(STORAGE_TAG_CAL, table, sizeof(table)) != STORAGE_SUCCESS){
+        return STORAGE_ERROR;
+    }
+    if(table[0] < 0){
+        return STORAGE_ERROR;
+    }
+    for(i = 1; i < V2RPM_POINTS; i++){
+        if(table[i] < table[i - 1]){
+            return STORAGE_ERROR;
+        }
+    }
+    if(table[V2RPM_POINTS - 1] <= MOTOR_SPEED_MIN){
+        return STORAGE_ERROR;
+    }
+    Voltage2RPM_SetTable(table);
+    return STORAGE_SUCCESS;
 }
@@ -1,223 +1,321 @@
 // adc_interface.c
 // ADS7806 12-bit ADC Serial Interface
-// Uses periodic Timer interrupt at 100µs (10kHz sampling rate)
-// Accumulates 100 samples every 10ms and computes average
+// Timer0A runs in PWM mode and drives R/C, so a conversion starts every
+// 100µs (10kHz sampling rate) without software. The ADS7806 clocks each
+// result out on its own data clock, framed by BUSY, into SSI0 running as
+// a slave receiver. uDMA channel 10 moves the samples into two blocks of
+// ADC_SAMPLES_PER_BLOCK in ping-pong mode: while one fills, the control
+// thread runs the other through the streaming filter (filter.c). The only
+// interrupt is the uDMA completion on the SSI0 vector, once per block
+// (10 samples, 1ms, at the default 1 kHz control rate), which re-arms the
+// finished block.
+//
+// The interrupt can run late: behind a flash erase or program, which
+// stalls every fetch from flash, or with completions merged. It therefore
+// reads which halves the uDMA has actually finished from their control
+// words rather than counting interrupts, re-arms each one, and restarts the
+// channel if it ran out of armed halves and stopped. Blocks missed
+// meanwhile, found from the cycle counter, are added to the lost count.
 //
 // Pin connections:
-// PB6 - R/C (Read/Convert control)
-// PB7 - BUSY (conversion status input)
-// PB4 - SDATA (serial data input from ADC)
-// PB5 - DATACLK (data clock output to ADC, if using external clock mode)
+// PB6 - R/C (Read/Convert control), T0CCP0
+// PA2 - DATACLK (data clock output from ADC), SSI0Clk
+// PA3 - BUSY (conversion status, low while data is sent), SSI0Fss
+// PA4 - SDATA (serial data input from ADC), SSI0Rx
 //
 // ADS7806 Configuration:
 // - Using internal data clock mode (EXT/INT tied LOW)
 // - ±10V input range
-// - R/C pulse initiates conversion and serial data output
+// - R/C falling edge starts conversion n and sends the result of
+//   conversion n-1, MSB first, while BUSY is low (datasheet Figure 13:
+//   slave SPI with CPOL = 0, CPHA = 1)
 
 #include "TM4C123GH6PM.h"
 #include "tm4c123gh6pm_def.h"
 #include <stdint.h>
 
-#include "system.h" 
+#include "system.h"
 
 // External semaphore (correctly NOT static - used by main.c)
 extern int32_t ADC_Data_Ready;
 extern void OS_Signal(int32_t *s);
 
 // ADC Configuration
-#define ADC_SAMPLES_PER_AVERAGE 100    // 100 samples at 10kHz = 10ms averaging
+#define ADC_PERIOD_CYCLES       (ADC_SAMPLE_PERIOD_US * (SYSTEM_CLOCK_HZ / 1000000))
+#define ADC_DMA_CHANNEL         10     // SSI0 RX (encoding 0)
+#define RC_PULSE_CYCLES         16     // R/C low for 1µs (40ns minimum)
+#define ADC_BLOCK_CYCLES        (ADC_SAMPLES_PER_BLOCK * ADC_PERIOD_CYCLES)
+#define ADC_DMA_BIT             (1 << ADC_DMA_CHANNEL)
 
 // Pin definitions for ADS7806
 #define R_C_PIN         (1 << 6)       // PB6
-#define BUSY_PIN        (1 << 7)       // PB7
-#define SDATA_PIN       (1 << 4)       // PB4
+#define SSI0_PINS       0x1C           // PA2-PA4
+
+// Cortex-M4 cycle counter, used to measure the time spent in the ISR and
+// to time-stamp each block
+#define CORE_DEMCR_R            (*((volatile uint32_t *)0xE000EDFC))
+#define CORE_DEMCR_TRCENA       0x01000000
+#define DWT_CTRL_R              (*((volatile uint32_t *)0xE0001000))
+#define DWT_CTRL_CYCCNTENA      0x00000001
+#define DWT_CYCCNT_R            (*((volatile uint32_t *)0xE0001004))
+
+// DMA channel control words
+#define ADC_DMA_CONTROL (UDMA_CHCTL_DSTINC_16 | UDMA_CHCTL_DSTSIZE_16 |       \
+                         UDMA_CHCTL_SRCINC_NONE | UDMA_CHCTL_SRCSIZE_16 |     \
+                         UDMA_CHCTL_ARBSIZE_4 |                               \
+                         ((ADC_SAMPLES_PER_BLOCK - 1) << 4) |               \
+                         UDMA_CHCTL_XFERMODE_PINGPONG)
 
-static volatile int32_t ADC_Sample_Buffer[ADC_SAMPLES_PER_AVERAGE];
-static volatile uint32_t Sample_Index = 0;
+// uDMA control table: 32 primary then 32 alternate channel structures of
+// {source end, destination end, control, unused}, 1024-byte aligned
+static uint32_t DMA_Control_Table[256] __attribute__((aligned(1024)));
+
+// Ping-pong halves: 12-bit two's complement codes as received
+static uint16_t ADC_Sample_Buffer[2][ADC_SAMPLES_PER_BLOCK];
+static volatile uint8_t Next_Half = 0;         // Half the uDMA finishes next
+static volatile uint8_t Ready_Buffer = 0;      // Last half it finished
+static volatile uint32_t Ready_Seq = 0;        // Bumped with each finished half and restart
+// The control thread's copy of the ready half, widened to int16_t in place
+static uint16_t ADC_Work_Block[ADC_SAMPLES_PER_BLOCK];
 static volatile int32_t Average_Voltage_mV = 0;
 static volatile uint8_t Average_Ready_Flag = 0;
+static volatile uint32_t Lost_Blocks = 0;      // Blocks finished before the last was read
+static uint32_t Dropped_Blocks = 0;            // Copies the uDMA overtook (control thread)
+static volatile int32_t Ripple_mV = 0;         // Peak-to-peak of the last block
+static volatile uint32_t ISR_Load = 0;         // Last block, tenths of a percent
+static volatile uint32_t Block_Time = 0;       // Cycle count when the last block finished
 
 static void Timer0A_Init(void);
 static void PortB_ADC_Init(void);
-static uint16_t ADC_Read_Serial(void);
-static int32_t ADC_12bit_to_mV(uint16_t adc_value);
+static void SSI0_ADC_Init(void);
+static void DMA_ADC_Init(void);
+static void DMA_ADC_Arm(uint8_t half);
+static uint8_t DMA_ADC_Done(uint8_t half);
 
-void Timer0A_Handler(void);
-void PortB_ADC_Init(void);
-uint16_t ADC_Read_Serial(void);
-int32_t ADC_12bit_to_mV(uint16_t adc_value);
+void SSI0_Handler(void);
 
 //******** ADC_Init ************
 // Initialize ADS7806 interface
-// Configure GPIO pins and Timer0A for 100µs periodic interrupt
+// Configure R/C, SSI0 and Timer0A for a conversion every 100µs
 void ADC_Init(void){
-    // Initialize GPIO Port B for ADC interface
+    // Initialize GPIO Port B for the R/C output
     PortB_ADC_Init();
-    
-    // Initialize Timer0A for 100µs periodic interrupts
+
+    // Initialize SSI0 to receive the serial data
+    SSI0_ADC_Init();
+
+    // Initialize the uDMA to move it into the sample buffers
+    DMA_ADC_Init();
+
+    // Initialize Timer0A to pulse R/C every 100µs
     Timer0A_Init();
-    
-    // Clear sample buffer
-    Sample_Index = 0;
+
+    // Filter the sample stream
+    Filter_Init(ADC_FILTER_TYPE, ADC_FILTER_LENGTH);
+
+    // Start the cycle counter for ADC_Get_ISR_Load
+    CORE_DEMCR_R |= CORE_DEMCR_TRCENA;
+    DWT_CTRL_R |= DWT_CTRL_CYCCNTENA;
+
+    // Clear sample buffer state
     Average_Voltage_mV = 0;
     Average_Ready_Flag = 0;
+    Lost_Blocks = 0;
+    Dropped_Blocks = 0;
+    Ripple_mV = 0;
+    ISR_Load = 0;
 }
 
 //******** PortB_ADC_Init ************
-// Configure Port B pins for ADS7806 interface
+// Configure PB6 as T0CCP0 to drive R/C of the ADS7806
 void PortB_ADC_Init(void){
     // Enable Port B clock
     SYSCTL_RCGCGPIO_R |= 0x02;
     while((SYSCTL_PRGPIO_R & 0x02) == 0){};  // Wait for Port B ready
-    
-    // Unlock Port B (should not be needed for PB4-7, but safe)
+
+    // Unlock Port B (should not be needed for PB6, but safe)
     GPIO_PORTB_LOCK_R = 0x4C4F434B;
-    GPIO_PORTB_CR_R |= (R_C_PIN | BUSY_PIN | SDATA_PIN);
-    
-    // Configure pin directions
-    GPIO_PORTB_DIR_R |= R_C_PIN;           // PB6 R/C output
-    GPIO_PORTB_DIR_R &= ~(BUSY_PIN | SDATA_PIN); // PB7 BUSY, PB4 SDATA inputs
-    
-    // Enable digital function
-    GPIO_PORTB_DEN_R |= (R_C_PIN | BUSY_PIN | SDATA_PIN);
-    
-    // Disable analog function
-    GPIO_PORTB_AMSEL_R &= ~(R_C_PIN | BUSY_PIN | SDATA_PIN);
-    
-    // No pull-up/pull-down needed for R/C (output)
-    // Enable pull-down for BUSY and SDATA
-    GPIO_PORTB_PUR_R &= ~(BUSY_PIN | SDATA_PIN);
-    GPIO_PORTB_PDR_R |= (BUSY_PIN | SDATA_PIN);
-    
-    // Initialize R/C HIGH (idle state)
-    GPIO_PORTB_DATA_R |= R_C_PIN;
+    GPIO_PORTB_CR_R |= R_C_PIN;
+
+    // PB6 is driven by Timer0A
+    GPIO_PORTB_AFSEL_R |= R_C_PIN;
+    GPIO_PORTB_PCTL_R = (GPIO_PORTB_PCTL_R & 0xF0FFFFFF) | 0x07000000; // T0CCP0
+    GPIO_PORTB_DEN_R |= R_C_PIN;
+    GPIO_PORTB_AMSEL_R &= ~R_C_PIN;
+}
+
+//******** SSI0_ADC_Init ************
+// Configure SSI0 as a receive-only slave clocked by the ADS7806
+// DATACLK is ~900kHz, below the 1.33MHz slave limit (16MHz / 12)
+void SSI0_ADC_Init(void){
+    // Enable SSI0 and Port A clocks
+    SYSCTL_RCGCSSI_R |= 0x01;
+    SYSCTL_RCGCGPIO_R |= 0x01;
+    while((SYSCTL_PRSSI_R & 0x01) == 0){};
+    while((SYSCTL_PRGPIO_R & 0x01) == 0){};
+
+    // PA2 SSI0Clk, PA3 SSI0Fss, PA4 SSI0Rx
+    GPIO_PORTA_AFSEL_R |= SSI0_PINS;
+    GPIO_PORTA_PCTL_R = (GPIO_PORTA_PCTL_R & 0xFFF000FF) | 0x00022200;
+    GPIO_PORTA_DEN_R |= SSI0_PINS;
+    GPIO_PORTA_AMSEL_R &= ~SSI0_PINS;
+
+    // Disable SSI0 during setup
+    SSI0_CR1_R = 0;
+
+    // Slave, transmitter off (SDATA is the only data line)
+    SSI0_CR1_R = SSI_CR1_MS | SSI_CR1_SOD;
+    SSI0_CC_R = 0;                 // System clock
+    SSI0_CPSR_R = 2;               // Unused as a slave, must be at least 2
+
+    // Freescale SPI, clock idle low, data captured on the falling edge, 12 bits
+    SSI0_CR0_R = SSI_CR0_SPH | SSI_CR0_FRF_MOTO | SSI_CR0_DSS_12;
+
+    // The uDMA empties the receive FIFO; its completion is the only interrupt
+    SSI0_IM_R = 0;
+    SSI0_DMACTL_R = SSI_DMACTL_RXDMAE;
+
+    // Set interrupt priority (lower than SysTick priority 7)
+    NVIC_PRI1_R = (NVIC_PRI1_R & 0x00FFFFFF) | 0x40000000; // Priority 2
+
+    // Enable SSI0 interrupt in NVIC (interrupt 7)
+    NVIC_EN0_R |= (1 << 7);
+
+    // Enable SSI0
+    SSI0_CR1_R |= SSI_CR1_SSE;
+}
+
+//******** DMA_ADC_Arm ************
+// Set up one half of the ping-pong transfer (0 primary, 1 alternate)
+void DMA_ADC_Arm(uint8_t half){
+    uint32_t *entry = &DMA_Control_Table[(half * 128) + (ADC_DMA_CHANNEL * 4)];
+
+    entry[0] = (uint32_t)&SSI0_DR_R;                                       // Source end
+    entry[1] = (uint32_t)&ADC_Sample_Buffer[half][ADC_SAMPLES_PER_BLOCK - 1]; // Destination end
+    entry[2] = ADC_DMA_CONTROL;
+}
+
+//******** DMA_ADC_Done ************
+// Whether the uDMA has finished a half: it sets the mode of a control
+// structure to stop once the structure's transfer is complete
+uint8_t DMA_ADC_Done(uint8_t half){
+    uint32_t control = DMA_Control_Table[(half * 128) + (ADC_DMA_CHANNEL * 4) + 2];
+
+    return (control & UDMA_CHCTL_XFERMODE_M) == UDMA_CHCTL_XFERMODE_STOP;
+}
+
+//******** DMA_ADC_Init ************
+// Configure uDMA channel 10 to fill the two sample buffers in turn
+void DMA_ADC_Init(void){
+    // Enable uDMA clock
+    SYSCTL_RCGCDMA_R |= 0x01;
+    while((SYSCTL_PRDMA_R & 0x01) == 0){};
+
+    UDMA_CFG_R = UDMA_CFG_MASTEN;
+    UDMA_CTLBASE_R = (uint32_t)DMA_Control_Table;
+
+    // Channel 10 serves SSI0 RX, default priority, single and burst requests
+    UDMA_CHMAP1_R &= ~UDMA_CHMAP1_CH10SEL_M;
+    UDMA_PRIOCLR_R = ADC_DMA_BIT;
+    UDMA_USEBURSTCLR_R = ADC_DMA_BIT;
+    UDMA_REQMASKCLR_R = ADC_DMA_BIT;
+
+    // Start with the primary half; the alternate follows
+    DMA_ADC_Arm(0);
+    DMA_ADC_Arm(1);
+    Next_Half = 0;
+    UDMA_ALTCLR_R = ADC_DMA_BIT;
+    UDMA_ENASET_R = ADC_DMA_BIT;
 }
 
 //******** Timer0A_Init ************
-// Initialize Timer0A for 100µs periodic interrupts (10kHz)
+// Initialize Timer0A in PWM mode: R/C goes low for 1µs every 100µs
 // 16 MHz clock, 100µs = 1600 cycles
 void Timer0A_Init(void){
     // Enable Timer0 clock
     SYSCTL_RCGCTIMER_R |= 0x01;
     while((SYSCTL_PRTIMER_R & 0x01) == 0){}; // Wait for Timer0 ready
-    
+
     // Disable timer during setup
-    TIMER0_CTL_R &= ~0x01;
-    
-    // Configure for 32-bit periodic mode
-    TIMER0_CFG_R = 0x00;           // 32-bit mode
-    TIMER0_TAMR_R = 0x02;          // Periodic mode
-    
+    TIMER0_CTL_R &= ~TIMER_CTL_TAEN;
+
+    // Configure for 16-bit PWM mode
+    TIMER0_CFG_R = TIMER_CFG_16_BIT;
+    TIMER0_TAMR_R = TIMER_TAMR_TAAMS | TIMER_TAMR_TAMR_PERIOD;
+    TIMER0_CTL_R &= ~TIMER_CTL_TAPWML;     // High from reload down to the match
+
     // Set reload value for 100µs
     // 100µs * 16 MHz = 1600 cycles
-    TIMER0_TAILR_R = 1600 - 1;
-    
-    // Clear timeout flag
-    TIMER0_ICR_R = 0x01;
-    
-    // Enable timeout interrupt
-    TIMER0_IMR_R |= 0x01;
-    
-    // Set interrupt priority (lower than SysTick priority 7)
-    NVIC_PRI4_R = (NVIC_PRI4_R & 0x00FFFFFF) | 0x40000000; // Priority 2
-    
-    // Enable Timer0A interrupt in NVIC (interrupt 19)
-    NVIC_EN0_R |= (1 << 19);
+    TIMER0_TAPR_R = 0;
+    TIMER0_TAILR_R = ADC_PERIOD_CYCLES - 1;
+
+    // Low for the last RC_PULSE_CYCLES of each period; the falling edge
+    // starts a conversion
+    TIMER0_TAMATCHR_R = RC_PULSE_CYCLES;
 }
 
 //******** ADC_Start_Sampling ************
-// Enable Timer0A to start 100µs periodic sampling
+// Enable Timer0A to start 100µs periodic conversions
 void ADC_Start_Sampling(void){
-    TIMER0_CTL_R |= 0x01;  // Enable Timer0A
+    Block_Time = DWT_CYCCNT_R;       // The first block is due one block from now
+    TIMER0_CTL_R |= TIMER_CTL_TAEN;  // Enable Timer0A
 }
 
-//******** ADC_Read_Serial ************
-// Read 12-bit data from ADS7806 using internal data clock
-// Waits for BUSY to go HIGH indicating conversion complete
-// Returns: 12-bit ADC value (0x000 to 0xFFF)
-uint16_t ADC_Read_Serial(void){
-    uint16_t adc_value = 0;
-    uint8_t bit_count;
-    uint32_t timeout;
-    
-    // Trigger conversion: R/C LOW for at least 40ns
-    GPIO_PORTB_DATA_R &= ~R_C_PIN;
-    // Short delay (at 16MHz, a few NOPs = 62.5ns each)
-    __asm("NOP");
-    __asm("NOP");
-    GPIO_PORTB_DATA_R |= R_C_PIN;
-    
-    // Wait for BUSY to go HIGH (conversion complete)
-    // Typical conversion time ~15µs, timeout at 30µs
-    timeout = 500; // Conservative timeout
-    while(!(GPIO_PORTB_DATA_R & BUSY_PIN) && timeout > 0){
-        timeout--;
-    }
-    
-    if(timeout == 0){
-        return 0; // Timeout error
-    }
-    
-    // Read 12 bits serially
-    // Internal clock mode: data clocked out automatically after conversion
-    // Data valid on both rising and falling edges
-    // We'll sample on each bit period
-    
-    for(bit_count = 0; bit_count < 12; bit_count++){
-        adc_value <<= 1;
-        
-        // Small delay to allow data to settle
-        __asm("NOP");
-        __asm("NOP");
-        __asm("NOP");
-        __asm("NOP");
-        
-        // Read SDATA bit
-        if(GPIO_PORTB_DATA_R & SDATA_PIN){
-            adc_value |= 0x01;
+//******** ADC_Get_Average_Voltage ************
+// Return the most recent filtered voltage in millivolts
+// Should be called after ADC_Average_Ready() returns true
+// Filters the finished block in the caller's thread, from a copy: the
+// uDMA writes the half again once the other one is full (or at once if
+// the channel restarts), so a copy the uDMA may have overtaken is dropped
+// as a lost block and the last voltage returned
+int32_t ADC_Get_Average_Voltage(void){
+    uint16_t *block;
+    int16_t *samples;
+    uint32_t seq;
+    int16_t lo;
+    int16_t hi;
+    uint32_t i;
+
+    if(Average_Ready_Flag){
+        Average_Ready_Flag = 0;
+
+        // The half and its sequence number from the same completion
+        do{
+            seq = Ready_Seq;
+            block = ADC_Sample_Buffer[Ready_Buffer];
+        } while(seq != Ready_Seq);
+
+        for(i = 0; i < ADC_SAMPLES_PER_BLOCK; i++){
+            ADC_Work_Block[i] = block[i];
         }
-        
-        // Delay for next bit (internal clock ~900kHz, ~1.1µs period)
-        // At 16MHz: 1.1µs = ~18 cycles
-        for(int i = 0; i < 3; i++){
-            __asm("NOP");
+        if(seq != Ready_Seq){
+            Dropped_Blocks++;
+            return Average_Voltage_mV;
         }
-    }
-    
-    return adc_value;
-}
 
-//******** ADC_12bit_to_mV ************
-// Convert 12-bit ADC value to millivolts for ±10V range
-// ADS7806 in Binary Two's Complement format (±10V range)
-// Input: 12-bit value (0x000 to 0xFFF)
-// Output: Voltage in mV (-10000 to +9995 mV)
-int32_t ADC_12bit_to_mV(uint16_t adc_value){
-    int32_t voltage_mV;
-    
-    // Check if value is negative (MSB = 1 in two's complement)
-    if(adc_value & 0x800){
-        // Negative value: convert from 12-bit two's complement
-        // Sign extend to 32-bit
-        voltage_mV = adc_value | 0xFFFFF000;
-    }
-    else{
-        // Positive value
-        voltage_mV = adc_value;
+        // Codes * 16 as int16_t, two per instruction (dsp.c)
+        DSP_Extend12(ADC_Work_Block, ADC_SAMPLES_PER_BLOCK);
+        samples = (int16_t *)ADC_Work_Block;
+
+        // Peak-to-peak noise of the block
+        // 20000mV / (4096 codes * 16) = 625 / 2048
+        DSP_MinMax(samples, ADC_SAMPLES_PER_BLOCK, &lo, &hi);
+        Ripple_mV = ((hi - lo) * 625) / 2048;
+
+        // Sign-extended 12-bit codes, one at a time
+        for(i = 0; i < ADC_SAMPLES_PER_BLOCK; i++){
+            Filter_Put(samples[i] >> 4);
+        }
+
+        // Scale to millivolts
+        // Full scale = 20V = 20000mV for 4096 codes, output is Q8 codes
+        // 20000 / (4096 * 256) = 625 / 32768
+        // The product is 64-bit: a full-scale Q8 code times 625 already
+        // needs 29 bits, so a larger FILTER_FRAC_BITS or any filter
+        // overshoot must not wrap it
+        Average_Voltage_mV = (int32_t)(((int64_t)Filter_Output() * 625) / 32768);
     }
-    
-    // Scale to millivolts
-    // Full scale = 20V = 20000mV for 4096 codes
-    // 1 LSB = 20000mV / 4096 ≈ 4.88 mV
-    voltage_mV = (voltage_mV * 20000) / 4096;
-    
-    return voltage_mV;
-}
 
-//******** ADC_Get_Average_Voltage ************
-// Return the most recent averaged voltage in millivolts
-// Should be called after ADC_Average_Ready() returns true
-int32_t ADC_Get_Average_Voltage(void){
     return Average_Voltage_mV;
 }
 
@@ -227,42 +325,91 @@ uint8_t ADC_Average_Ready(void){
     return Average_Ready_Flag;
 }
 
-//******** Timer0A_Handler ************
-// ISR for Timer0A - executes every 100µs
-// Samples ADC, accumulates 100 samples, computes average every 10ms
-void Timer0A_Handler(void){
-    uint16_t adc_raw;
-    int32_t voltage_sample;
-    int64_t sum;
-    uint32_t i;
-    
-    // Clear interrupt flag
-    TIMER0_ICR_R = 0x01;
-    
-    // Read ADC value
-    adc_raw = ADC_Read_Serial();
-    
-    // Convert to millivolts
-    voltage_sample = ADC_12bit_to_mV(adc_raw);
-    
-    // Store in buffer
-    ADC_Sample_Buffer[Sample_Index] = voltage_sample;
-    Sample_Index++;
-    
-    // Check if 100 samples collected (10ms elapsed)
-    if(Sample_Index >= ADC_SAMPLES_PER_AVERAGE){
-        // Compute average
-        sum = 0;
-        for(i = 0; i < ADC_SAMPLES_PER_AVERAGE; i++){
-            sum += ADC_Sample_Buffer[i];
+//******** ADC_Get_Ripple ************
+// Peak-to-peak voltage within the last block (noise and PWM ripple)
+// Returns: millivolts
+int32_t ADC_Get_Ripple(void){
+    return Ripple_mV;
+}
+
+//******** ADC_Get_Lost_Blocks ************
+// Number of blocks replaced before ADC_Get_Average_Voltage read them,
+// overwritten while it copied them, or missed because the uDMA interrupt
+// ran more than a block late
+uint32_t ADC_Get_Lost_Blocks(void){
+    return Lost_Blocks + Dropped_Blocks;
+}
+
+//******** ADC_Get_ISR_Load ************
+// CPU time spent acquiring samples during the last block
+// Returns: load in tenths of a percent (1000 = all of the CPU)
+uint32_t ADC_Get_ISR_Load(void){
+    return ISR_Load;
+}
+
+//******** ADC_Get_Block_Time ************
+// When the latest block finished, for timing the thread it wakes
+// Returns: core cycle count (DWT_CYCCNT) on entry to the uDMA interrupt
+uint32_t ADC_Get_Block_Time(void){
+    return Block_Time;
+}
+
+//******** SSI0_Handler ************
+// ISR for SSI0 - executes when the uDMA has filled a half (every block)
+// Re-arms every finished half, restarts the channel if it stopped, and
+// hands the newest block to the control thread
+void SSI0_Handler(void){
+    uint32_t start = DWT_CYCCNT_R;
+    uint32_t blocks;
+    uint8_t done = 0;
+    uint8_t half = Next_Half;
+
+    if(UDMA_CHIS_R & ADC_DMA_BIT){
+        UDMA_CHIS_R = ADC_DMA_BIT;              // Acknowledge
+
+        // Halves finish in turn; normally one is done, both if this ran late
+        while((done < 2) && DMA_ADC_Done(half)){
+            DMA_ADC_Arm(half);
+            Ready_Buffer = half;
+            Ready_Seq++;
+            half ^= 1;
+            done++;
+        }
+        Next_Half = half;
+
+        // Both ran out and the channel stopped: drop what piled up in the
+        // receive FIFO meanwhile and start again from the primary half
+        if((UDMA_ENASET_R & ADC_DMA_BIT) == 0){
+            while(SSI0_SR_R & SSI_SR_RNE){
+                (void)SSI0_DR_R;
+            }
+            SSI0_ICR_R = SSI_ICR_RORIC;
+            Next_Half = 0;
+            Ready_Seq++;                        // The primary half is written again now
+            UDMA_ALTCLR_R = ADC_DMA_BIT;
+            UDMA_ENASET_R = ADC_DMA_BIT;
+        }
+
+        if(done != 0){
+            // Blocks due since the last one handed over, all but the newest lost
+            blocks = (start - Block_Time + (ADC_BLOCK_CYCLES / 2)) / ADC_BLOCK_CYCLES;
+            if(blocks > 1){
+                Lost_Blocks += blocks - 1;
+            }
+            Block_Time = start;
+
+            // A thread still owed the last block reads this one in its
+            // place: signalling again would wake it twice for one block
+            if(Average_Ready_Flag){
+                Lost_Blocks++;                  // The last one was never read
+            }
+            else{
+                Average_Ready_Flag = 1;
+                OS_Signal(&ADC_Data_Ready);
+            }
         }
-        Average_Voltage_mV = (int32_t)(sum / ADC_SAMPLES_PER_AVERAGE);
-        
-        // Reset sample index
-        Sample_Index = 0;
-        
-        // Set flag and signal semaphore
-        Average_Ready_Flag = 1;
-        OS_Signal(&ADC_Data_Ready);
     }
-}
\ No newline at end of file
+
+    // Load over the block: cycles / (cycles per block / 1000)
+    ISR_Load = (DWT_CYCCNT_R - start) / (ADC_BLOCK_CYCLES / 1000);
+}
@@ -0,0 +1,308 @@
+// autotune.c
+// Relay-feedback autotuning of the PID gains (Astrom-Hagglund)
+// Called every update in place of Controller_Update while a tune runs
+//
+// The PID is replaced by a relay around the tuning speed:
+//   duty = FF(target) + bias + d   while the speed is below target + h
+//   duty = FF(target) + bias - d   once it is above, until below target - h
+// The loop then oscillates at its ultimate period Tu with a speed
+// amplitude a, and the ultimate gain (the Kp that would just hold that
+// oscillation) follows from the describing function of the relay:
+//   Ku = 4d / (pi * sqrt(a^2 - h^2))
+// The hysteresis h keeps sensor noise from chattering the relay. The bias
+// is adjusted each cycle until the high and low halves are equally long,
+// so a load or supply the feedforward map does not know about does not
+// skew the measurement.
+//
+// The Ziegler-Nichols rules in the tuning notes of controller.c assume
+// the dead time is a good share of the lag. Here the motor lag is some
+// 100ms and the loop delay (sample filter, PWM period, one update) some
+// 10ms, so they give a Kp near the ultimate gain and the loop rings. Ku and
+// Tu are fitted with a first-order-plus-dead-time model, using the static
+// gain K (RPM per duty) read from the feedforward map:
+//   w = 2*pi / Tu
+//   tau = sqrt((Ku*K)^2 - 1) / w           (lag)
+//   L = (pi/2 + atan(1 / (w*tau))) / w      (dead time)
+// and tuned with the SIMC rules for a PI controller, closed-loop time
+// constant equal to L:
+//   Kp = tau / (2*K*L),  Ti = min(tau, 8*L),  Ki = Kp / Ti,  Kd = 0
+// with times in updates. A tune takes the settling time plus
+// AUTOTUNE_SKIP_CYCLES + AUTOTUNE_CYCLES oscillations, a few seconds on
+// the bench motor, and gives up after AUTOTUNE_TIMEOUT_MS.
+
+#include "TM4C123GH6PM.h"
+#include "tm4c123gh6pm_def.h"
+#include <stdint.h>
+
+#include "system.h"
+
+// Critical sections (startup_TM4C123.s)
+extern int32_t StartCritical(void);
+extern void EndCritical(int32_t primask);
+
+// PWM limits (in tenths of percent)
+#define PWM_DUTY_MIN            180     // 18.0%
+#define PWM_DUTY_MAX            995     // 99.5%
+
+// Relay
+#define RELAY_AMPLITUDE         100     // d: ±10.0% duty
+#define RELAY_HYSTERESIS        10      // h: RPM either side of the target
+
+// Tuning speed range: the relay must stay clear of the duty limits
+#define AUTOTUNE_MIN_RPM        800
+#define AUTOTUNE_MAX_RPM        2000
+#define AUTOTUNE_DEFAULT_RPM    1200    // Used when the motor is stopped
+
+// Experiment length
+#define UPDATE_MS               (1000 / CONTROLLER_UPDATE_RATE_HZ)
+#define AUTOTUNE_SETTLE_MS      1000    // Feedforward duty alone first
+#define AUTOTUNE_SKIP_CYCLES    2       // Oscillations left to grow steady
+#define AUTOTUNE_CYCLES         6       // Oscillations measured
+#define AUTOTUNE_TIMEOUT_MS     30000
+#define AUTOTUNE_SPEED_LIMIT    (MOTOR_SPEED_MAX + 200)
+
+// Speed span the static gain is read from the feedforward map over
+#define SLOPE_SPAN_RPM          400
+
+// Constants in Q16
+#define FOUR_OVER_PI_Q16        83443   // 4/pi
+#define QUARTER_PI_Q16          51472   // pi/4
+#define HALF_PI_Q16             102944  // pi/2
+#define TWO_PI_Q16              411775  // 2*pi
+#define ATAN_K_Q16              17891   // 0.273: atan(y) ~ y*pi/4 + 0.273*y*(1-y)
+
+// Experiment phases
+#define PHASE_SETTLE            0
+#define PHASE_RELAY             1
+
+static uint8_t Status = AUTOTUNE_IDLE;
+static uint8_t Phase;
+static int32_t Target;                  // Tuning speed (RPM)
+static int32_t Feedforward;             // FF(target), duty
+static int32_t Bias;                    // Relay centre correction, duty
+static uint8_t Relay_High;              // Relay output is FF + bias + d
+static uint32_t Time;                   // Updates since the start
+static uint32_t Last_Fall;              // Update of the last high-to-low switch
+static uint32_t Last_Rise;              // Update of the last low-to-high switch
+static int32_t Cycle_Max;               // Speed extremes in this cycle
+static int32_t Cycle_Min;
+static uint32_t Cycles;                 // Complete cycles seen
+static uint32_t Period_Sum;             // Measured cycles: updates
+static uint32_t Swing_Sum;              // Measured cycles: peak-to-peak RPM
+static Autotune_Result_t Result;
+
+//******** Autotune_Sqrt ************
+// Integer square root, rounded down
+static uint32_t Autotune_Sqrt(uint32_t x){
+    uint32_t root = 0;
+    uint32_t bit = 1UL << 30;
+
+    while(bit > x){
+        bit >>= 2;
+    }
+    while(bit != 0){
+        if(x >= root + bit){
+            x -= root + bit;
+            root = (root >> 1) + bit;
+        }
+        else{
+            root >>= 1;
+        }
+        bit >>= 2;
+    }
+    return root;
+}
+
+//******** Autotune_Finish ************
+// Leave the experiment: controller state is cleared either way
+static uint8_t Autotune_Finish(uint8_t status){
+    Status = status;
+    Controller_Init();
+    return status;
+}
+
+//******** Autotune_Compute ************
+// Ultimate gain and period from the measured cycles, the model fitted to
+// them, then the gains
+static uint8_t Autotune_Compute(void){
+    uint32_t swing16;           // Mean amplitude a, RPM x16
+    uint32_t hyst16 = RELAY_HYSTERESIS * 16;
+    uint32_t amplitude16;       // sqrt(a^2 - h^2), RPM x16
+    uint32_t period16;          // Tu, updates x16
+    int64_t ku;                 // Q16 duty per RPM
+    int64_t slope;              // 1/K, Q16 duty per RPM
+    uint32_t ratio8;            // Ku*K, Q8
+    uint32_t lag8;              // w*tau = sqrt((Ku*K)^2 - 1), Q8
+    int64_t y;                  // 1/(w*tau), Q16
+    int64_t phase;              // pi/2 + atan(1/(w*tau)), Q16 radians
+    int64_t tau;                // Updates, Q16
+    int64_t dead;               // Updates, Q16
+    int64_t ti;                 // Integral time, updates Q16
+
+    swing16 = (Swing_Sum * 8) / AUTOTUNE_CYCLES;
+    period16 = (Period_Sum * 16) / AUTOTUNE_CYCLES;
+    if(swing16 <= hyst16){
+        return AUTOTUNE_FAILED; // Noise, not an oscillation
+    }
+    amplitude16 = Autotune_Sqrt(swing16 * swing16 - hyst16 * hyst16);
+    if(amplitude16 == 0){
+        return AUTOTUNE_FAILED;
+    }
+    ku = ((int64_t)RELAY_AMPLITUDE * FOUR_OVER_PI_Q16 * 16) / amplitude16;
+
+    // Static gain from the feedforward map around the tuning speed
+    slope = ((int64_t)(Controller_Feedforward(Target + SLOPE_SPAN_RPM / 2) -
+                       Controller_Feedforward(Target - SLOPE_SPAN_RPM / 2)) * 65536) / SLOPE_SPAN_RPM;
+    if(slope <= 0){
+        return AUTOTUNE_FAILED;
+    }
+
+    // Model: the lag gives the gain drop at the ultimate frequency, the
+    // dead time the rest of the -180 degrees
+    ratio8 = (uint32_t)MIN((ku << 8) / slope, 0xFFFF);
+    if(ratio8 * ratio8 <= 2 * 65536){
+        return AUTOTUNE_FAILED; // w*tau < 1: not lag dominated
+    }
+    lag8 = Autotune_Sqrt(ratio8 * ratio8 - 65536);
+    y = ((int64_t)65536 * 256) / lag8;
+    phase = HALF_PI_Q16 + ((y * QUARTER_PI_Q16) + ((ATAN_K_Q16 * y * (65536 - y)) >> 16)) / 65536;
+    dead = (phase * period16 * 65536) / (16 * (int64_t)TWO_PI_Q16);
+    tau = ((int64_t)lag8 * period16 * 65536 * 16) / TWO_PI_Q16;
+
+    Result.ku = (int32_t)ku;
+    Result.tu_ms = (period16 * UPDATE_MS) / 16;
+    Result.amplitude_rpm = (int32_t)(swing16 / 16);
+    Result.tau_ms = (uint32_t)((tau * UPDATE_MS) >> 16);
+    Result.dead_ms = (uint32_t)((dead * UPDATE_MS) >> 16);
+
+    // SIMC PI with the closed-loop time constant equal to the dead time
+    ti = MIN(tau, 8 * dead);
+    Result.kp = (int32_t)((tau * slope) / (2 * dead));
+    Result.ki = (int32_t)(((int64_t)Result.kp << 16) / ti);
+    Result.kd = 0;
+
+    return AUTOTUNE_DONE;
+}
+
+//******** Autotune_Start ************
+// Begin a relay experiment
+// Input: target_rpm - speed to tune at (0 picks the default); limited to
+//        the range where the relay stays clear of the duty limits
+void Autotune_Start(int32_t target_rpm){
+    int32_t status = StartCritical();
+
+    if(target_rpm == 0){
+        target_rpm = AUTOTUNE_DEFAULT_RPM;
+    }
+    Target = CLAMP(target_rpm, AUTOTUNE_MIN_RPM, AUTOTUNE_MAX_RPM);
+    Feedforward = Controller_Feedforward(Target);
+    Bias = 0;
+    Phase = PHASE_SETTLE;
+    Time = 0;
+    Cycles = 0;
+    Period_Sum = 0;
+    Swing_Sum = 0;
+    Status = AUTOTUNE_RUNNING;
+
+    EndCritical(status);
+}
+
+//******** Autotune_Stop ************
+// Abandon a running experiment (the gains are not changed)
+void Autotune_Stop(void){
+    int32_t status = StartCritical();
+
+    if(Status == AUTOTUNE_RUNNING){
+        Autotune_Finish(AUTOTUNE_FAILED);
+    }
+    EndCritical(status);
+}
+
+//******** Autotune_Update ************
+// Advance the experiment by one control period and drive the PWM
+// Called every update by the control thread instead of Controller_Update
+// Input: current_rpm - measured speed from ADC
+// Returns: AUTOTUNE_RUNNING, or AUTOTUNE_DONE / AUTOTUNE_FAILED on the
+//          update that ends the experiment (then the gains are in use)
+uint8_t Autotune_Update(int32_t current_rpm){
+    int32_t duty;
+    uint32_t period;
+    uint32_t high;
+
+    if(Status != AUTOTUNE_RUNNING){
+        return Status;
+    }
+    Time++;
+
+    if((current_rpm > AUTOTUNE_SPEED_LIMIT) || (Time * UPDATE_MS > AUTOTUNE_TIMEOUT_MS)){
+        PWM_SetDutyCycle((uint16_t)Feedforward);
+        return Autotune_Finish(AUTOTUNE_FAILED);
+    }
+
+    if(Phase == PHASE_SETTLE){
+        PWM_SetDutyCycle((uint16_t)Feedforward);
+        if(Time * UPDATE_MS >= AUTOTUNE_SETTLE_MS){
+            Phase = PHASE_RELAY;
+            Relay_High = (current_rpm < Target) ? 1 : 0;
+            Last_Fall = 0;
+            Last_Rise = 0;
+            Cycle_Max = current_rpm;
+            Cycle_Min = current_rpm;
+        }
+        return AUTOTUNE_RUNNING;
+    }
+
+    Cycle_Max = MAX(Cycle_Max, current_rpm);
+    Cycle_Min = MIN(Cycle_Min, current_rpm);
+
+    if(Relay_High && (current_rpm > Target + RELAY_HYSTERESIS)){
+        // High-to-low switch ends a cycle that began at the last one
+        Relay_High = 0;
+        if((Last_Fall != 0) && (Last_Rise > Last_Fall)){
+            period = Time - Last_Fall;
+            high = Time - Last_Rise;
+            Cycles++;
+            if(Cycles > AUTOTUNE_SKIP_CYCLES){
+                Period_Sum += period;
+                Swing_Sum += (uint32_t)(Cycle_Max - Cycle_Min);
+            }
+
+            // Move the relay centre toward equal high and low times
+            Bias += (RELAY_AMPLITUDE * ((int32_t)(2 * high) - (int32_t)period)) / (int32_t)(2 * period);
+            Bias = CLAMP(Bias, -RELAY_AMPLITUDE, RELAY_AMPLITUDE);
+
+            if(Cycles >= AUTOTUNE_SKIP_CYCLES + AUTOTUNE_CYCLES){
+                if(Autotune_Compute() == AUTOTUNE_DONE){
+                    Controller_SetGains(Result.kp, Result.ki, Result.kd);
+                    return Autotune_Finish(AUTOTUNE_DONE);
+                }
+                return Autotune_Finish(AUTOTUNE_FAILED);
+            }
+        }
+        Last_Fall = Time;
+        Cycle_Max = current_rpm;
+        Cycle_Min = current_rpm;
+    }
+    else if(!Relay_High && (current_rpm < Target - RELAY_HYSTERESIS)){
+        Relay_High = 1;
+        Last_Rise = Time;
+    }
+
+    duty = Feedforward + Bias + (Relay_High ? RELAY_AMPLITUDE : -RELAY_AMPLITUDE);
+    PWM_SetDutyCycle((uint16_t)CLAMP(duty, PWM_DUTY_MIN, PWM_DUTY_MAX));
+
+    return AUTOTUNE_RUNNING;
+}
+
+//******** Autotune_Status ************
+// Returns: AUTOTUNE_IDLE, AUTOTUNE_RUNNING, AUTOTUNE_DONE or AUTOTUNE_FAILED
+uint8_t Autotune_Status(void){
+    return Status;
+}
+
+//******** Autotune_GetResult ************
+// Measurements and gains of the last successful tune
+// Output: *result - Ku, Tu, amplitude and the gains set
+void Autotune_GetResult(Autotune_Result_t *result){
+    *result = Result;
+}
@@ -0,0 +1,192 @@
+// calibrate.c
+// Calibration sweep of the voltage to RPM conversion (Voltage2RPM.c)
+// Called every update in place of Controller_Update while a sweep runs
+//
+// The motor is held open loop at CALIBRATE_POINTS duties across the PWM
+// range. At each one the filtered voltage is averaged once the speed has
+// settled, and the sweep waits for the true speed read off a reference
+// tachometer (Calibrate_Reference(), keyed in on the keypad). From those
+// pairs the conversion table is rebuilt at its fixed 512mV points:
+// straight lines between measured points, the end segments extended
+// outward (down to 0 RPM below the first point), so the table holds the
+// dead zone, slope and bend of this motor and sensor rather than the
+// nominal ones. Sweep with the working load on the shaft: the motor
+// voltage for a given speed rises with load, and the table then reads
+// true speed at that load.
+//
+// Each point takes CALIBRATE_SETTLE_MS + CALIBRATE_MEASURE_MS plus the
+// time to key in the reference.
+
+#include "TM4C123GH6PM.h"
+#include "tm4c123gh6pm_def.h"
+#include <stdint.h>
+
+#include "system.h"
+
+// Critical sections (startup_TM4C123.s)
+extern int32_t StartCritical(void);
+extern void EndCritical(int32_t primask);
+
+// Sweep
+#define CALIBRATE_DUTY_MIN      180     // 18.0%, the PWM minimum
+#define CALIBRATE_DUTY_MAX      900     // 90.0%, past MOTOR_SPEED_MAX
+#define CALIBRATE_SETTLE_MS     1500    // Several motor time constants
+#define CALIBRATE_MEASURE_MS    500     // Voltage averaged over this
+
+#define UPDATE_MS               (1000 / CONTROLLER_UPDATE_RATE_HZ)
+#define SETTLE_UPDATES          (CALIBRATE_SETTLE_MS / UPDATE_MS)
+#define MEASURE_UPDATES         (CALIBRATE_MEASURE_MS / UPDATE_MS)
+
+static uint8_t Status = CALIBRATE_IDLE;
+static uint8_t Point;                   // Point being measured
+static uint32_t Time;                   // Updates at this point
+static int32_t Volt_Sum;                // mV summed while measuring
+static int32_t Point_mV[CALIBRATE_POINTS];
+static int32_t Point_RPM[CALIBRATE_POINTS];
+
+//******** Calibrate_Duty ************
+// Duty of a sweep point (tenths of percent)
+static uint16_t Calibrate_Duty(uint8_t point){
+    return (uint16_t)(CALIBRATE_DUTY_MIN +
+                      ((CALIBRATE_DUTY_MAX - CALIBRATE_DUTY_MIN) * point) / (CALIBRATE_POINTS - 1));
+}
+
+//******** Calibrate_Finish ************
+// Leave the sweep: controller state is cleared either way
+static uint8_t Calibrate_Finish(uint8_t status){
+    Status = status;
+    Controller_Init();
+    return status;
+}
+
+//******** Calibrate_Build ************
+// Conversion table from the measured points
+// Returns: CALIBRATE_DONE, or CALIBRATE_FAILED if the voltage or the
+//          speed did not rise along the sweep
+static uint8_t Calibrate_Build(int16_t *table){
+    int32_t mV;
+    int32_t rpm;
+    uint32_t i;
+    uint32_t k = 0;             // Segment: points k and k + 1
+
+    for(i = 1; i < CALIBRATE_POINTS; i++){
+        if((Point_mV[i] <= Point_mV[i - 1]) || (Point_RPM[i] <= Point_RPM[i - 1])){
+            return CALIBRATE_FAILED;
+        }
+    }
+
+    for(i = 0; i < V2RPM_POINTS; i++){
+        mV = (int32_t)(i << V2RPM_SHIFT);
+        while((k < CALIBRATE_POINTS - 2) && (mV > Point_mV[k + 1])){
+            k++;
+        }
+        rpm = Point_RPM[k] + ((Point_RPM[k + 1] - Point_RPM[k]) * (mV - Point_mV[k])) /
+                             (Point_mV[k + 1] - Point_mV[k]);
+        table[i] = (int16_t)CLAMP(rpm, 0, INT16_MAX);
+    }
+    return CALIBRATE_DONE;
+}
+
+//******** Calibrate_Start ************
+// Begin a sweep from the lowest duty
+void Calibrate_Start(void){
+    int32_t status = StartCritical();
+
+    Point = 0;
+    Time = 0;
+    Volt_Sum = 0;
+    Status = CALIBRATE_RUNNING;
+
+    EndCritical(status);
+}
+
+//******** Calibrate_Stop ************
+// Abandon a running sweep (the table is not changed)
+void Calibrate_Stop(void){
+    int32_t status = StartCritical();
+
+    if((Status == CALIBRATE_RUNNING) || (Status == CALIBRATE_WAITING)){
+        Calibrate_Finish(CALIBRATE_FAILED);
+    }
+    EndCritical(status);
+}
+
+//******** Calibrate_Update ************
+// Advance the sweep by one control period and drive the PWM
+// Called every update by the control thread instead of Controller_Update
+// Input: voltage_mV - filtered motor voltage from ADC
+// Returns: CALIBRATE_RUNNING while settling or measuring a point,
+//          CALIBRATE_WAITING while it waits for the reference speed
+uint8_t Calibrate_Update(int32_t voltage_mV){
+    if((Status != CALIBRATE_RUNNING) && (Status != CALIBRATE_WAITING)){
+        return Status;
+    }
+    PWM_SetDutyCycle(Calibrate_Duty(Point));
+
+    if(Status == CALIBRATE_RUNNING){
+        Time++;
+        if(Time > SETTLE_UPDATES){
+            Volt_Sum += voltage_mV;
+        }
+        if(Time == SETTLE_UPDATES + MEASURE_UPDATES){
+            Point_mV[Point] = Volt_Sum / MEASURE_UPDATES;
+            Status = CALIBRATE_WAITING;
+        }
+    }
+    return Status;
+}
+
+//******** Calibrate_Reference ************
+// Give the true speed at the point the sweep waits at, and move on
+// Builds and uses the new table after the last point (call from a thread)
+// Input: rpm - speed read off the reference tachometer; 0 keeps what the
+//        conversion in use reads there
+// Returns: CALIBRATE_RUNNING for the next point, CALIBRATE_DONE or
+//          CALIBRATE_FAILED after the last, or the status unchanged if
+//          the sweep was not waiting
+uint8_t Calibrate_Reference(int32_t rpm){
+    int16_t table[V2RPM_POINTS];
+    uint8_t result;
+    int32_t status;
+
+    if(Status != CALIBRATE_WAITING){
+        return Status;
+    }
+    if(rpm == 0){
+        rpm = Current_speed(Point_mV[Point]);
+    }
+    Point_RPM[Point] = rpm;
+
+    if(Point < CALIBRATE_POINTS - 1){
+        status = StartCritical();
+        Point++;
+        Time = 0;
+        Volt_Sum = 0;
+        Status = CALIBRATE_RUNNING;
+        EndCritical(status);
+        return CALIBRATE_RUNNING;
+    }
+
+    // Sweep done: the motor holds the last duty until the controller resumes
+    result = Calibrate_Build(table);
+    if(result == CALIBRATE_DONE){
+        Voltage2RPM_SetTable(table);
+    }
+    status = StartCritical();
+    Calibrate_Finish(result);
+    EndCritical(status);
+    return result;
+}
+
+//******** Calibrate_Status ************
+// Returns: CALIBRATE_IDLE, CALIBRATE_RUNNING, CALIBRATE_WAITING,
+//          CALIBRATE_DONE or CALIBRATE_FAILED
+uint8_t Calibrate_Status(void){
+    return Status;
+}
+
+//******** Calibrate_Point ************
+// Returns: the sweep point being measured (0 to CALIBRATE_POINTS - 1)
+uint8_t Calibrate_Point(void){
+    return Point;
+}
@@ -1,39 +1,78 @@
 // controller.c
 // DC Motor Speed Controller
-// Implements PID control with anti-windup
-// Updates every 10ms (100 Hz control rate)
+// Implements PID control in Q16 fixed point with feedforward and
+// back-calculation anti-windup
+// Updates once per uDMA block, CONTROLLER_UPDATE_RATE_HZ (1 kHz default)
 // Target steady-state error: ±15 RPM
 //
-// Control equation:
-// u(t) = Kp*e(t) + Ki*∫e(t)dt + Kd*de(t)/dt
-// where e(t) = target_rpm - measured_rpm
+// Control equation (duty cycle in tenths of percent):
+// u = FF(target) + Kp*e + I - Kd*(measured - previous measured)
+// I = I + Ki*e + Kt*(u_limited - u)
+// where e = target_rpm - measured_rpm
+//
+// The feedforward map gives the duty that holds the target speed, so a
+// step starts from about the right duty instead of integrating up to it.
+// The derivative acts on the measurement, so a target step does not kick
+// the output. While the output is limited, the back-calculation term pulls
+// the integral back toward the value that just reaches the limit, so it
+// does not wind up.
 
 #include "TM4C123GH6PM.h"
 #include "tm4c123gh6pm_def.h"
 #include <stdint.h>
 
-#include "system.h" 
+#include "system.h"
+
+// Critical sections (startup_TM4C123.s)
+extern int32_t StartCritical(void);
+extern void EndCritical(int32_t primask);
 
 // PWM limits (in tenths of percent)
 #define PWM_DUTY_MIN   180     // 18.0%
 #define PWM_DUTY_MAX   995     // 99.5%
 #define PWM_DUTY_ZERO  0       // 0% for target = 0 RPM
 
-// PID Controller gains (tunable parameters)
-// These values are starting points and should be tuned experimentally
-#define KP  50      // Proportional gain (scaled by 100)
-#define KI  10      // Integral gain (scaled by 100)
-#define KD  20      // Derivative gain (scaled by 100)
+// Q16 fixed point: 65536 = 1.0
+#define Q16_SHIFT      16
+#define Q16_ONE        (1 << Q16_SHIFT)
+
+// Default PID gains (Q16, tunable at run time with Controller_SetGains)
+// Ki and Kd act per update, so they follow the update rate
+#define KP_DEFAULT     (Q16_ONE / 4)                                // 0.25 duty/RPM
+#define KI_DEFAULT     ((Q16_ONE * 2) / CONTROLLER_UPDATE_RATE_HZ)   // 2 duty/RPM per second
+#define KD_DEFAULT     ((Q16_ONE * CONTROLLER_UPDATE_RATE_HZ) / 1000) // 1 duty/(RPM per ms)
+
+// Back-calculation gain: share of (limited - requested) output returned
+// to the integral each update
+#define KT             (Q16_ONE / 2)
+
+// Limit for the integral term itself (Q16 duty)
+#define INTEGRAL_MAX   (PWM_DUTY_MAX << Q16_SHIFT)
+#define INTEGRAL_MIN   (-INTEGRAL_MAX)
 
-// Anti-windup limits for integral term
-#define INTEGRAL_MAX   5000    // Maximum integral accumulation
-#define INTEGRAL_MIN   -5000   // Minimum integral accumulation
+// Feedforward map: duty (tenths of percent) that holds each speed
+// Nominal motor: Current_speed() inverted, 9.5V at full duty
+#define FF_STEP_RPM    400
+#define FF_POINTS      7
+static const int16_t FF_Duty[FF_POINTS] = {
+    72, 201, 330, 459, 588, 717, 846       // 0, 400, ... 2400 RPM
+};
+
+// Step response measurement
+#define UPDATE_MS      (1000 / CONTROLLER_UPDATE_RATE_HZ)
+#define SETTLE_HOLD    (500 / UPDATE_MS) // Updates inside ±15 RPM (0.5s) to count as settled
+
+// Runtime gains
+static volatile int32_t Kp = KP_DEFAULT;
+static volatile int32_t Ki = KI_DEFAULT;
+static volatile int32_t Kd = KD_DEFAULT;
 
 // Control state variables
 static volatile int32_t Error_Current = 0;
-static volatile int32_t Error_Previous = 0;
-static volatile int32_t Error_Integral = 0;
-static volatile int32_t Error_Derivative = 0;
+static volatile int32_t Error_Integral = 0;        // Integral term, Q16 duty
+static volatile int32_t Error_Derivative = 0;      // Measurement change, RPM per update
+static volatile int32_t Measured_Previous = 0;
+static volatile int32_t Target_Previous = 0;
 
 // Control output
 static volatile int32_t Control_Output = 0;
@@ -41,88 +80,176 @@ static volatile int32_t Control_Output = 0;
 // Statistics
 static volatile uint32_t Control_Updates = 0;
 
+// Response to the latest target change
+static Controller_Step_t Step;
+static uint32_t Step_Time = 0;         // Updates since the change
+static uint32_t Rise_Start = 0;        // Update that passed 10% of the step
+static uint32_t Band_Entry = 0;        // Update that entered ±15 RPM, 0 if outside
+static int32_t Band_Error_Sum = 0;     // Error summed inside the band
+
+//******** Q16_Mul ************
+// Multiply by a Q16 value, rounded to nearest
+static int32_t Q16_Mul(int32_t q16, int32_t value){
+    return (int32_t)((((int64_t)q16 * value) + (Q16_ONE / 2)) >> Q16_SHIFT);
+}
+
+//******** Step_Start ************
+// Begin measuring the response to a new target
+static void Step_Start(int32_t target_rpm, int32_t current_rpm){
+    Step.target = target_rpm;
+    Step.start_rpm = current_rpm;
+    Step.rise_ms = 0;
+    Step.settle_ms = 0;
+    Step.overshoot_rpm = 0;
+    Step.steady_error = 0;
+    Step.risen = 0;
+    Step.settled = 0;
+    Step_Time = 0;
+    Rise_Start = 0;
+    Band_Entry = 0;
+    Band_Error_Sum = 0;
+}
+
+//******** Step_Update ************
+// Track rise, overshoot and settling of the latest step
+static void Step_Update(int32_t current_rpm){
+    int32_t span = Step.target - Step.start_rpm;
+    int32_t progress = current_rpm - Step.start_rpm;
+    int32_t error = Step.target - current_rpm;
+
+    Step_Time++;
+
+    // Measure along the direction of the step
+    if(span < 0){
+        span = -span;
+        progress = -progress;
+    }
+
+    // Rise time: 10% to 90% of the step
+    if(!Step.risen){
+        if((Rise_Start == 0) && (progress * 10 >= span)){
+            Rise_Start = Step_Time;
+        }
+        if((Rise_Start != 0) && (progress * 10 >= span * 9)){
+            Step.rise_ms = (Step_Time - Rise_Start) * UPDATE_MS;
+            Step.risen = 1;
+        }
+    }
+
+    if(progress - span > Step.overshoot_rpm){
+        Step.overshoot_rpm = progress - span;
+    }
+
+    // Settling: the last entry into ±15 RPM that lasted SETTLE_HOLD updates
+    if((error > CONTROLLER_TARGET_ERROR) || (error < -CONTROLLER_TARGET_ERROR)){
+        Band_Entry = 0;
+        Band_Error_Sum = 0;
+        Step.settled = 0;
+        return;
+    }
+
+    if(Band_Entry == 0){
+        Band_Entry = Step_Time;
+    }
+    Band_Error_Sum += error;
+
+    if(Step_Time - Band_Entry + 1 >= SETTLE_HOLD){
+        Step.settled = 1;
+        Step.settle_ms = Band_Entry * UPDATE_MS;
+        Step.steady_error = Band_Error_Sum / (int32_t)(Step_Time - Band_Entry + 1);
+    }
+}
+
 //******** Controller_Init ************
-// Initialize controller state variables
+// Initialize controller state variables (gains are kept)
 void Controller_Init(void){
     Error_Current = 0;
-    Error_Previous = 0;
     Error_Integral = 0;
     Error_Derivative = 0;
+    Measured_Previous = 0;
+    Target_Previous = 0;
     Control_Output = 0;
     Control_Updates = 0;
+    Step_Start(0, 0);
+}
+
+//******** Controller_Feedforward ************
+// Duty cycle that holds a speed, interpolated from the feedforward map
+// Input: target_rpm - 0 to 2400
+// Returns: duty cycle in tenths of percent
+int32_t Controller_Feedforward(int32_t target_rpm){
+    int32_t index;
+    int32_t frac;
+
+    target_rpm = CLAMP(target_rpm, 0, FF_STEP_RPM * (FF_POINTS - 1));
+    index = target_rpm / FF_STEP_RPM;
+    if(index >= FF_POINTS - 1){
+        return FF_Duty[FF_POINTS - 1];
+    }
+    frac = target_rpm - (index * FF_STEP_RPM);
+
+    return FF_Duty[index] + ((FF_Duty[index + 1] - FF_Duty[index]) * frac) / FF_STEP_RPM;
 }
 
 //******** Controller_Update ************
 // Update PID controller and adjust PWM duty cycle
-// Called every 10ms by Controller_LCD_Thread
+// Called every update by Control_Thread
 // Input: target_rpm - desired speed (0 or 400-2400)
 //        current_rpm - measured speed from ADC
 void Controller_Update(int32_t target_rpm, int32_t current_rpm){
     int32_t control_signal;
-    uint16_t duty_cycle;
-    
+    int32_t duty_request;
+    int32_t duty_cycle;
+
     Control_Updates++;
-    
+
     // Handle special case: target = 0 RPM
     if(target_rpm == 0){
         PWM_SetDutyCycle(PWM_DUTY_ZERO);
         Controller_Init(); // Reset controller state
         return;
     }
-    
+
+    // A new target: measure its response; from a stop the previous
+    // measurement is this one (no derivative kick)
+    if(target_rpm != Target_Previous){
+        if(Target_Previous == 0){
+            Measured_Previous = current_rpm;
+        }
+        Target_Previous = target_rpm;
+        Step_Start(target_rpm, current_rpm);
+    }
+
     // Compute error
     Error_Current = target_rpm - current_rpm;
-    
-    // Compute integral term (with anti-windup)
-    Error_Integral += Error_Current;
-    if(Error_Integral > INTEGRAL_MAX){
-        Error_Integral = INTEGRAL_MAX;
-    }
-    else if(Error_Integral < INTEGRAL_MIN){
-        Error_Integral = INTEGRAL_MIN;
-    }
-    
-    // Compute derivative term
-    Error_Derivative = Error_Current - Error_Previous;
-    
-    // Compute PID control signal (scaled by 100)
-    // control_signal = (Kp * error + Ki * integral + Kd * derivative) / 100
-    control_signal = ((KP * Error_Current) + 
-                     (KI * Error_Integral) + 
-                     (KD * Error_Derivative)) / 100;
-    
-    // Get current duty cycle
-    duty_cycle = PWM_GetDutyCycle();
-    
-    // Apply control signal to duty cycle
-    // Assume ~10 RPM change per 1% duty cycle change (approximate)
-    // Scale control signal to duty cycle adjustment
-    duty_cycle += (control_signal / 10);
-    
+
+    // Derivative on measurement
+    Error_Derivative = current_rpm - Measured_Previous;
+    Measured_Previous = current_rpm;
+
+    // Integral term (Q16)
+    Error_Integral += Ki * Error_Current;
+    Error_Integral = CLAMP(Error_Integral, INTEGRAL_MIN, INTEGRAL_MAX);
+
+    // PID correction around the feedforward duty
+    control_signal = Q16_Mul(Kp, Error_Current)
+                   + ((Error_Integral + (Q16_ONE / 2)) >> Q16_SHIFT)
+                   - Q16_Mul(Kd, Error_Derivative);
+    duty_request = Controller_Feedforward(target_rpm) + control_signal;
+
     // Apply safety limits
-    if(duty_cycle < PWM_DUTY_MIN){
-        duty_cycle = PWM_DUTY_MIN;
-        // Anti-windup: don't let integral term grow if at saturation
-        if(Error_Current > 0){
-            Error_Integral -= Error_Current;
-        }
-    }
-    else if(duty_cycle > PWM_DUTY_MAX){
-        duty_cycle = PWM_DUTY_MAX;
-        // Anti-windup: don't let integral term grow if at saturation
-        if(Error_Current < 0){
-            Error_Integral -= Error_Current;
-        }
-    }
-    
+    duty_cycle = CLAMP(duty_request, PWM_DUTY_MIN, PWM_DUTY_MAX);
+
+    // Anti-windup: return part of what the limit cut off to the integral
+    Error_Integral += KT * (duty_cycle - duty_request);
+
     // Update PWM
-    PWM_SetDutyCycle(duty_cycle);
-    
-    // Save current error for next iteration
-    Error_Previous = Error_Current;
-    
+    PWM_SetDutyCycle((uint16_t)duty_cycle);
+
     // Store control output for debugging/monitoring
     Control_Output = control_signal;
+
+    Step_Update(current_rpm);
 }
 
 //******** Controller_GetError ************
@@ -134,14 +261,14 @@ int32_t Controller_GetError(void){
 
 //******** Controller_GetIntegral ************
 // Get current integral term (for debugging/monitoring)
-// Returns: Accumulated integral error
+// Returns: Integral term in tenths of percent duty
 int32_t Controller_GetIntegral(void){
-    return Error_Integral;
+    return Error_Integral >> Q16_SHIFT;
 }
 
 //******** Controller_GetDerivative ************
 // Get current derivative term (for debugging/monitoring)
-// Returns: Error rate of change
+// Returns: Measured speed change over the last update (RPM)
 int32_t Controller_GetDerivative(void){
     return Error_Derivative;
 }
@@ -152,14 +279,66 @@ void Controller_ResetIntegral(void){
     Error_Integral = 0;
 }
 
-//******** Controller_TuneGains ************
+//******** Controller_SetGains ************
 // Adjust PID gains during runtime (for tuning)
-// Note: This function would need to modify the const values
-// For production, gains should be determined experimentally and hardcoded
+// Input: kp, ki, kd - Q16 gains (65536 = 1.0), see tuning notes for units
+// The integral term is kept, so the output does not jump
 void Controller_SetGains(int32_t kp, int32_t ki, int32_t kd){
-    // This would require making KP, KI, KD non-const
-    // Left as exercise for tuning phase
-    // For now, modify the #define values in code
+    int32_t status = StartCritical();
+    Kp = kp;
+    Ki = ki;
+    Kd = kd;
+    EndCritical(status);
+}
+
+//******** Controller_GetGains ************
+// Read the PID gains in use
+// Output: *kp, *ki, *kd - Q16 gains
+void Controller_GetGains(int32_t *kp, int32_t *ki, int32_t *kd){
+    *kp = Kp;
+    *ki = Ki;
+    *kd = Kd;
+}
+
+//******** Controller_SaveGains ************
+// Save the PID gains in use to flash (see storage.c), with the update
+// rate they were tuned for
+// Called from a thread, not the control path: a flash write blocks
+// Returns: STORAGE_SUCCESS, STORAGE_BUSY while the motor runs (save
+//          again once stopped), or STORAGE_ERROR
+uint8_t Controller_SaveGains(void){
+    int32_t gains[4];
+
+    Controller_GetGains(&gains[0], &gains[1], &gains[2]);
+    gains[3] = CONTROLLER_UPDATE_RATE_HZ;
+    return Storage_Save(STORAGE_TAG_GAINS, gains, sizeof(gains));
+}
+
+//******** Controller_LoadGains ************
+// Use the PID gains last saved to flash
+// Returns: STORAGE_SUCCESS, or STORAGE_ERROR (defaults kept) if none are
+//          saved, they are not usable or Ki and Kd were tuned at another
+//          update rate
+uint8_t Controller_LoadGains(void){
+    int32_t gains[4];
+
+    if(Storage_Load(STORAGE_TAG_GAINS, gains, sizeof(gains)) != STORAGE_SUCCESS){
+        return STORAGE_ERROR;
+    }
+    if((gains[0] <= 0) || (gains[1] < 0) || (gains[2] < 0) ||
+       (gains[3] != CONTROLLER_UPDATE_RATE_HZ)){
+        return STORAGE_ERROR;
+    }
+    Controller_SetGains(gains[0], gains[1], gains[2]);
+    return STORAGE_SUCCESS;
+}
+
+//******** Controller_GetStepMetrics ************
+// Response to the latest target change
+// Output: *metrics - rise time (10%-90%), overshoot, settling time into
+//         ±15 RPM (held 0.5s) and steady-state error once settled
+void Controller_GetStepMetrics(Controller_Step_t *metrics){
+    *metrics = Step;
 }
 
 //******** Controller_GetStatistics ************
@@ -172,44 +351,61 @@ uint32_t Controller_GetStatistics(void){
 
 /******************************************************************************
  * CONTROLLER TUNING NOTES:
- * 
- * The PID gains (KP, KI, KD) provided above are starting values and MUST be
- * tuned experimentally for your specific motor and system.
- * 
+ *
+ * The gains are Q16 fixed point (65536 = 1.0) and can be changed at run
+ * time with Controller_SetGains(). The defaults above are starting values
+ * and should be tuned for your specific motor and system.
+ *   Kp - tenths of percent duty per RPM of error
+ *   Ki - tenths of percent duty per RPM of error, added every update
+ *   Kd - tenths of percent duty per RPM the measurement moved in an update
+ * The feedforward map supplies most of the duty for a new target, so the
+ * PID only corrects what the map gets wrong (load, supply, motor).
+ *
+ * AUTOMATIC TUNING (autotune.c):
+ *
+ * Press 'A' on the keypad. The motor runs a relay experiment around the
+ * entered speed (1200 RPM when stopped) for a few seconds, Ku and Tu are
+ * measured from the speed, fitted with a lag plus dead time model and PI
+ * gains put in use (see autotune.c for why not the rules below). With
+ * MOTOR_FLASH_STORAGE they are saved and loaded at the next start. 'C'
+ * abandons a tune in progress.
+ *
  * TUNING PROCEDURE (Ziegler-Nichols method):
- * 
- * 1. Set KI = 0, KD = 0
- * 2. Increase KP until system oscillates consistently
+ *
+ * 1. Set Ki = 0, Kd = 0
+ * 2. Increase Kp until system oscillates consistently
  *    - Record this value as Ku (ultimate gain)
- *    - Record oscillation period as Tu
- * 
+ *    - Record oscillation period as Tu (in updates)
+ *
  * 3. Calculate PID gains:
- *    - KP = 0.6 * Ku
- *    - KI = 1.2 * Ku / Tu
- *    - KD = 0.075 * Ku * Tu
- * 
+ *    - Kp = 0.6 * Ku
+ *    - Ki = 1.2 * Ku / Tu
+ *    - Kd = 0.075 * Ku * Tu
+ *
  * ALTERNATIVE: Manual tuning
- * 
- * 1. Start with KP only:
- *    - Increase KP until fast response with slight overshoot
- * 
- * 2. Add KI:
- *    - Increase KI to eliminate steady-state error
- *    - If system becomes unstable, reduce KI
- * 
- * 3. Add KD:
- *    - Increase KD to reduce overshoot
- *    - Too much KD causes instability from noise
- * 
+ *
+ * 1. Start with Kp only:
+ *    - Increase Kp until fast response with slight overshoot
+ *
+ * 2. Add Ki:
+ *    - Increase Ki to eliminate steady-state error
+ *    - If system becomes unstable, reduce Ki
+ *
+ * 3. Add Kd:
+ *    - Increase Kd to reduce overshoot
+ *    - Too much Kd causes instability from noise
+ *
  * MONITORING:
+ * - Controller_GetStepMetrics() reports rise time, overshoot, settling
+ *   time and steady-state error for the latest target change
  * - Use LCD to display error values during tuning
- * - Observe system response to step changes in target speed
  * - Acceptable performance: ±15 RPM steady-state error
- * 
+ *
  * TROUBLESHOOTING:
- * - System oscillates: Reduce KP and/or KD
- * - Slow response: Increase KP
- * - Steady-state error: Increase KI
- * - Overshoot: Increase KD or reduce KP
- * 
- *****************************************************************************/
\ No newline at end of file
+ * - System oscillates: Reduce Kp and/or Kd
+ * - Slow response: Increase Kp
+ * - Steady-state error: Increase Ki
+ * - Overshoot: Increase Kd or reduce Kp
+ * - Overshoot after the duty was held at a limit: increase KT
+ *
+ *****************************************************************************/
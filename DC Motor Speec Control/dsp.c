@@ -0,0 +1,266 @@
+// dsp.c
+// Block kernels for 16-bit sample processing
+// On the Cortex-M4F each 32-bit load carries two samples, and the DSP
+// extension works on both halves in one instruction:
+//   SMLAD   acc += x.lo*y.lo + x.hi*y.hi      (sums, dot products, FIR)
+//   SMLALD  the same into a 64-bit accumulator (sum of squares)
+//   SSUB16 + SEL   per-halfword compare and select (min/max)
+// so a loop handles two samples per iteration with no extra instructions
+// for the second one.
+//
+// Without the DSP extension (or on a host) the same kernels are plain C.
+// Defining DSP_SIMD_EMULATE runs the packed code with the instructions
+// written out in C, which is how Host/Test_Dsp.c checks the packed loops
+// against the plain ones.
+//
+// Samples are int16_t; 12-bit ADS7806 codes are widened by DSP_Extend12.
+// Arrays need only be 2-byte aligned: sample pairs are moved with
+// memcpy, which the compiler turns into a single LDR/STR (unaligned
+// access is allowed for those on the Cortex-M4) but never into an
+// LDRD/LDM that would fault on an odd halfword address.
+
+#include <stdint.h>
+#include <string.h>
+
+#include "system.h"
+
+#if defined(DSP_SIMD_EMULATE)
+#define DSP_SIMD    1
+#elif (defined(__ARM_FEATURE_DSP) && __ARM_FEATURE_DSP) || defined(__TARGET_FEATURE_DSPMUL)
+#define DSP_SIMD    1
+#include "TM4C123GH6PM.h"               // CMSIS SIMD intrinsics
+#else
+#define DSP_SIMD    0
+#endif
+
+#if DSP_SIMD
+
+#if defined(DSP_SIMD_EMULATE)
+
+// The DSP instructions in C (same results as the CMSIS intrinsics)
+#define DSP_LO(x)   ((int32_t)(int16_t)(x))
+#define DSP_HI(x)   ((int32_t)(int16_t)((x) >> 16))
+
+static uint32_t DSP_GE;                 // GE flags of the last SSUB16, one bit per half
+
+static uint32_t __SMLAD(uint32_t x, uint32_t y, uint32_t acc){
+    return acc + (uint32_t)(DSP_LO(x) * DSP_LO(y)) + (uint32_t)(DSP_HI(x) * DSP_HI(y));
+}
+
+static uint64_t __SMLALD(uint32_t x, uint32_t y, uint64_t acc){
+    return acc + (uint64_t)((int64_t)DSP_LO(x) * DSP_LO(y) + (int64_t)DSP_HI(x) * DSP_HI(y));
+}
+
+static uint32_t __SSUB16(uint32_t x, uint32_t y){
+    int32_t lo = DSP_LO(x) - DSP_LO(y);
+    int32_t hi = DSP_HI(x) - DSP_HI(y);
+
+    DSP_GE = (lo >= 0 ? 1 : 0) | (hi >= 0 ? 2 : 0);
+    return ((uint32_t)lo & 0xFFFF) | ((uint32_t)hi << 16);
+}
+
+static uint32_t __SEL(uint32_t x, uint32_t y){
+    return ((DSP_GE & 1 ? x : y) & 0x0000FFFF) | ((DSP_GE & 2 ? x : y) & 0xFFFF0000);
+}
+
+#endif
+
+// Two samples as one word, x[0] in the low half (little endian)
+static uint32_t DSP_Pair(const void *x){
+    uint32_t pair;
+
+    memcpy(&pair, x, sizeof(pair));
+    return pair;
+}
+
+static void DSP_Put_Pair(void *x, uint32_t pair){
+    memcpy(x, &pair, sizeof(pair));
+}
+
+#define DSP_ONES    0x00010001          // {1, 1}: SMLAD with it adds both halves
+
+#endif // DSP_SIMD
+
+//******** DSP_Sum ************
+// Sum of a block of samples
+// Input: x - samples, n - number of samples (up to 65536)
+// Returns: sum
+int32_t DSP_Sum(const int16_t *x, uint32_t n){
+    uint32_t sum = 0;
+    uint32_t i = 0;
+
+#if DSP_SIMD
+    for(; i + 1 < n; i += 2){
+        sum = __SMLAD(DSP_Pair(&x[i]), DSP_ONES, sum);
+    }
+#endif
+    for(; i < n; i++){
+        sum += (uint32_t)x[i];
+    }
+
+    return (int32_t)sum;
+}
+
+//******** DSP_Dot ************
+// Dot product of two blocks
+// Input: x, h - samples, n - number of samples
+// Returns: sum of x[i]*h[i] (wraps past 32 bits)
+int32_t DSP_Dot(const int16_t *x, const int16_t *h, uint32_t n){
+    uint32_t acc = 0;
+    uint32_t i = 0;
+
+#if DSP_SIMD
+    for(; i + 1 < n; i += 2){
+        acc = __SMLAD(DSP_Pair(&x[i]), DSP_Pair(&h[i]), acc);
+    }
+#endif
+    for(; i < n; i++){
+        acc += (uint32_t)((int32_t)x[i] * h[i]);
+    }
+
+    return (int32_t)acc;
+}
+
+//******** DSP_FIR ************
+// FIR filter over a block, no state kept between blocks
+// Input: x - n samples, h - taps coefficients (Q'shift')
+//        y - n - taps + 1 outputs, y[i] = (sum of x[i+k]*h[k]) >> shift,
+//            saturated to 16 bits
+// Returns: number of outputs
+uint32_t DSP_FIR(const int16_t *x, uint32_t n, const int16_t *h, uint32_t taps,
+                 uint8_t shift, int16_t *y){
+    int32_t acc;
+    uint32_t i;
+
+    if((taps == 0) || (n < taps)){
+        return 0;
+    }
+
+    for(i = 0; i + taps <= n; i++){
+        acc = DSP_Dot(&x[i], h, taps) >> shift;
+        y[i] = (int16_t)CLAMP(acc, -32768, 32767);
+    }
+
+    return n - taps + 1;
+}
+
+//******** DSP_Decimate ************
+// Sum each group of 'factor' samples (boxcar decimation; scale by the caller)
+// Input: x - n samples, factor - samples per output
+//        y - n / factor outputs
+// Returns: number of outputs
+uint32_t DSP_Decimate(const int16_t *x, uint32_t n, uint32_t factor, int32_t *y){
+    uint32_t j;
+
+    if(factor == 0){
+        return 0;
+    }
+
+    for(j = 0; (j + 1) * factor <= n; j++){
+        y[j] = DSP_Sum(&x[j * factor], factor);
+    }
+
+    return j;
+}
+
+//******** DSP_MinMax ************
+// Smallest and largest sample of a block
+// Input: x - samples, n - number of samples (at least 1)
+// Output: *min, *max
+void DSP_MinMax(const int16_t *x, uint32_t n, int16_t *min, int16_t *max){
+    int16_t lo = x[0];
+    int16_t hi = x[0];
+    uint32_t i = 0;
+#if DSP_SIMD
+    uint32_t pair;
+    uint32_t lows;
+    uint32_t highs;
+#endif
+
+#if DSP_SIMD
+    if(n >= 2){
+        lows = highs = DSP_Pair(&x[0]);
+        for(i = 2; i + 1 < n; i += 2){
+            pair = DSP_Pair(&x[i]);
+            __SSUB16(pair, lows);
+            lows = __SEL(lows, pair);       // Keep the old half where pair >= it
+            __SSUB16(pair, highs);
+            highs = __SEL(pair, highs);     // Take the new half where pair >= it
+        }
+
+        // Combine the two halves
+        lo = (int16_t)MIN((int16_t)lows, (int16_t)(lows >> 16));
+        hi = (int16_t)MAX((int16_t)highs, (int16_t)(highs >> 16));
+    }
+#endif
+    for(; i < n; i++){
+        lo = MIN(lo, x[i]);
+        hi = MAX(hi, x[i]);
+    }
+
+    *min = lo;
+    *max = hi;
+}
+
+//******** DSP_RMS ************
+// Root mean square of a block
+// Input: x - samples, n - number of samples
+// Returns: sqrt(sum of x[i]^2 / n), rounded down
+uint32_t DSP_RMS(const int16_t *x, uint32_t n){
+    uint64_t sum = 0;
+    uint32_t mean;
+    uint32_t root = 0;
+    uint32_t bit;
+    uint32_t i = 0;
+#if DSP_SIMD
+    uint32_t pair;
+#endif
+
+    if(n == 0){
+        return 0;
+    }
+
+#if DSP_SIMD
+    for(; i + 1 < n; i += 2){
+        pair = DSP_Pair(&x[i]);
+        sum = __SMLALD(pair, pair, sum);
+    }
+#endif
+    for(; i < n; i++){
+        sum += (uint64_t)((int32_t)x[i] * x[i]);
+    }
+
+    // Mean square fits in 31 bits (32768^2)
+    mean = (uint32_t)(sum / n);
+
+    // Integer square root, one result bit per step
+    for(bit = 1UL << 30; bit != 0; bit >>= 2){
+        if(mean >= root + bit){
+            mean -= root + bit;
+            root = (root >> 1) + bit;
+        }
+        else{
+            root >>= 1;
+        }
+    }
+
+    return root;
+}
+
+//******** DSP_Extend12 ************
+// Turn 12-bit two's complement codes into int16_t samples in place
+// The code goes to the top of the halfword, so samples are codes * 16
+// Input: x - n codes as read from the ADS7806 (upper 4 bits zero)
+void DSP_Extend12(uint16_t *x, uint32_t n){
+    uint32_t i = 0;
+
+#if DSP_SIMD
+    // Both halves at once: the upper 4 bits of each are zero
+    for(; i + 1 < n; i += 2){
+        DSP_Put_Pair(&x[i], DSP_Pair(&x[i]) << 4);
+    }
+#endif
+    for(; i < n; i++){
+        x[i] = (uint16_t)(x[i] << 4);
+    }
+}
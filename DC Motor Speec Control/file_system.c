@@ -0,0 +1,26 @@
+// file_system.c
+// The Simple_File_System sources, built into this project for storage.c
+// Add this one file to the project instead of the OS_File_*.c files: it
+// compiles them, and the flash driver, with the configuration system.h
+// gives storage.c (FS_THREAD_SAFE 1, FS_PACK_CHANNELS TELEMETRY_CHANNELS),
+// so the two can never be built with different settings. Their headers
+// are found next to each source, so no include path is needed.
+// With MOTOR_FLASH_STORAGE 0 it compiles to nothing.
+
+#include <stdint.h>
+
+#include "system.h"
+
+#if MOTOR_FLASH_STORAGE
+
+#include "../Simple_File_System/FlashProgram.c"
+#include "../Simple_File_System/OS_File_Lock.c"
+#include "../Simple_File_System/OS_File_Crc.c"
+#include "../Simple_File_System/OS_File_Log.c"
+#include "../Simple_File_System/OS_File_Wear.c"
+#include "../Simple_File_System/OS_File_Cache.c"
+#include "../Simple_File_System/OS_File_Pack.c"
+#include "../Simple_File_System/OS_File_Handle.c"
+#include "../Simple_File_System/OS_File_System.c"
+
+#endif // MOTOR_FLASH_STORAGE
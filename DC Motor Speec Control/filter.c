@@ -0,0 +1,132 @@
+// filter.c
+// Streaming filter for the ADS7806 sample stream
+// Each sample costs the same few operations whatever the window, so the
+// thread feeding it sees flat timing and can read an estimate after any
+// sample instead of once per 10ms block.
+//
+// Filter types:
+// FILTER_BOXCAR - moving average of the last N samples, kept as a running
+//                 sum (add the new sample, subtract the one leaving)
+// FILTER_CIC    - CIC decimator: FILTER_CIC_ORDER integrators at the sample
+//                 rate, as many combs once every N samples; output every N
+// FILTER_IIR    - first-order low-pass y += (x - y) / 2^N
+//
+// Input: sign-extended 12-bit ADC codes
+// Output: filtered codes scaled by 2^FILTER_FRAC_BITS (Q8)
+// Codes are negative below 0V, so they are scaled up by multiplying:
+// a left shift of a negative value is undefined in C.
+
+#include <stdint.h>
+
+#include "system.h"
+
+#define FILTER_CIC_ORDER    2           // CIC stages (gain N^2)
+#define FILTER_MAX_LENGTH   128         // Longest boxcar window / CIC decimation
+#define FILTER_MAX_SHIFT    12          // Slowest IIR: alpha = 1/4096
+
+static uint8_t Filter_Type = FILTER_BOXCAR;
+static uint32_t Filter_Length = 1;      // N: window, decimation or IIR shift
+
+// FILTER_BOXCAR
+static int16_t History[FILTER_MAX_LENGTH];
+static uint32_t History_Index = 0;
+static int32_t Running_Sum = 0;
+
+// FILTER_CIC (two's complement wrap-around is harmless in the integrators)
+static uint32_t Integrator[FILTER_CIC_ORDER];
+static uint32_t Comb_Delay[FILTER_CIC_ORDER];
+static uint32_t Decimate_Count = 0;
+
+// Latest output (FILTER_IIR state), Q8
+static int32_t Filter_Value = 0;
+
+//******** Filter_Init ************
+// Select the filter and clear its state
+// Input: type - FILTER_BOXCAR, FILTER_CIC or FILTER_IIR
+//        length - boxcar window or CIC decimation (1-128 samples),
+//                 or IIR shift (alpha = 1/2^length, 0-12)
+void Filter_Init(uint8_t type, uint32_t length){
+    uint32_t i;
+
+    if(type == FILTER_IIR){
+        length = MIN(length, FILTER_MAX_SHIFT);
+    }
+    else{
+        length = CLAMP(length, 1, FILTER_MAX_LENGTH);
+    }
+
+    Filter_Type = type;
+    Filter_Length = length;
+
+    for(i = 0; i < FILTER_MAX_LENGTH; i++){
+        History[i] = 0;
+    }
+    History_Index = 0;
+    Running_Sum = 0;
+
+    for(i = 0; i < FILTER_CIC_ORDER; i++){
+        Integrator[i] = 0;
+        Comb_Delay[i] = 0;
+    }
+    Decimate_Count = 0;
+
+    Filter_Value = 0;
+}
+
+//******** Filter_Put ************
+// Feed one sample through the filter
+// Input: sample - sign-extended 12-bit ADC code
+// Returns: 1 if Filter_Output() has a new value (every sample, or every
+//          N samples for FILTER_CIC)
+uint8_t Filter_Put(int32_t sample){
+    uint32_t value;
+    uint32_t delayed;
+    uint32_t i;
+
+    switch(Filter_Type){
+    case FILTER_CIC:
+        value = (uint32_t)sample;
+        for(i = 0; i < FILTER_CIC_ORDER; i++){
+            Integrator[i] += value;
+            value = Integrator[i];
+        }
+
+        Decimate_Count++;
+        if(Decimate_Count < Filter_Length){
+            return 0;
+        }
+        Decimate_Count = 0;
+
+        for(i = 0; i < FILTER_CIC_ORDER; i++){
+            delayed = Comb_Delay[i];
+            Comb_Delay[i] = value;
+            value -= delayed;
+        }
+
+        // Gain is N^FILTER_CIC_ORDER; once per N samples
+        Filter_Value = (int32_t)(((int64_t)(int32_t)value * (1 << FILTER_FRAC_BITS)) /
+                                 (int32_t)(Filter_Length * Filter_Length));
+        return 1;
+
+    case FILTER_IIR:
+        Filter_Value += ((sample * (1 << FILTER_FRAC_BITS)) - Filter_Value) >> Filter_Length;
+        return 1;
+
+    default:    // FILTER_BOXCAR
+        Running_Sum += sample - History[History_Index];
+        History[History_Index] = (int16_t)sample;
+        History_Index++;
+        if(History_Index >= Filter_Length){
+            History_Index = 0;
+        }
+        Filter_Value = (Running_Sum * (1 << FILTER_FRAC_BITS)) / (int32_t)Filter_Length;
+        return 1;
+    }
+}
+
+//******** Filter_Output ************
+// Latest filtered value; may be read after any sample
+// Returns: filtered ADC code scaled by 2^FILTER_FRAC_BITS
+int32_t Filter_Output(void){
+    return Filter_Value;
+}
@@ -9,9 +9,39 @@
 volatile uint16_t Target_RPM = 0;           // Target speed in RPM
 volatile int32_t Current_RPM = 0;           // Current measured speed in RPM
 
-// Local
-static uint32_t Current_RPM_Accumulator = 0; // For 1-second averaging
-static uint16_t Current_RPM_Count = 0;    // Count for averaging (100 samples per second)
+// Cortex-M4 cycle counter (started by ADC_Init)
+#define DWT_CYCCNT_R            (*((volatile uint32_t *)0xE0001004))
+#define CYCLES_PER_US           (SYSTEM_CLOCK_HZ / 1000000)
+
+// Controller state as of the latest update, for the display thread
+typedef struct {
+    uint16_t target;            // Target speed (RPM)
+    int32_t rpm;                // Measured speed (RPM)
+    int32_t error;              // Target - measured (RPM)
+    int32_t integral;           // Integral term (tenths of percent duty)
+    uint16_t duty;              // PWM duty (tenths of percent)
+    uint32_t updates;           // Control updates since reset
+    uint32_t rpm_sum;           // Running sum of rpm (wraps)
+    uint32_t latency_us;        // Block finished to control thread running
+    uint32_t latency_min_us;    // Best and worst since reset ('B' on keypad)
+    uint32_t latency_max_us;
+    uint32_t update_max_us;     // Worst control update, wake-up to published
+    int32_t voltage_mv;         // Filtered ADC input (mV)
+    int32_t ripple_mv;          // Peak-to-peak within the last block (mV)
+    uint32_t isr_load;          // Acquisition ISR, tenths of a percent of the CPU
+    uint32_t lost_blocks;       // Sample blocks lost since reset
+} Control_Snapshot_t;
+
+// Written only by Control_Thread: Snapshot_Seq is odd while it writes,
+// so a reader that sees it odd or changed reads again (no lock, the
+// control thread never waits)
+static volatile Control_Snapshot_t Snapshot;
+static volatile uint32_t Snapshot_Seq = 0;
+
+// Line 2 of the LCD: 0 target and speed, 1 loop timing, 2 acquisition
+// load, 3 input voltage, 4 loop costs
+#define DISPLAY_PAGES           5
+static volatile uint8_t Display_Page = 0;
 
 // Semaphores
 int32_t LCD_Mutex;                          // Protects LCD access
@@ -22,20 +52,170 @@ int32_t New_Target_Speed;                   // Signals when new target speed ent
 uint8_t Keypad_Buffer[5];                   // 4 digits + null terminator
 uint8_t Keypad_Index = 0;
 
+// Autotune started from the keypad and not yet reported
+static uint8_t Tune_Pending = 0;
+
+// Calibration sweep started from the keypad and not yet reported, and the
+// sweep state shown on the LCD (point, or CALIBRATE_POINTS while waiting)
+static uint8_t Cal_Pending = 0;
+static uint8_t Cal_Shown = 0xFF;
+
+// Tuned gains and calibration table still to be saved: flash is written
+// only once the motor has stopped (see storage.c)
+static uint8_t Save_Gains = 0;
+static uint8_t Save_Table = 0;
+
 // Function prototypes for threads
 void Keypad_Thread(void);
-void Controller_LCD_Thread(void);
+void Control_Thread(void);
+void Display_Thread(void);
+
+//******** Snapshot_Publish ************
+// Record the state after a control update (Control_Thread only)
+static void Snapshot_Publish(int32_t rpm, int32_t voltage, uint32_t latency_cycles,
+                             uint32_t update_cycles){
+    uint32_t latency_us = latency_cycles / CYCLES_PER_US;
+    uint32_t update_us = update_cycles / CYCLES_PER_US;
+    
+    Snapshot_Seq++;                 // Odd: being written
+    Snapshot.target = Target_RPM;
+    Snapshot.rpm = rpm;
+    Snapshot.error = Controller_GetError();
+    Snapshot.integral = Controller_GetIntegral();
+    Snapshot.duty = PWM_GetDutyCycle();
+    Snapshot.rpm_sum += (uint32_t)rpm;
+    Snapshot.latency_us = latency_us;
+    if((Snapshot.updates == 0) || (latency_us < Snapshot.latency_min_us)){
+        Snapshot.latency_min_us = latency_us;
+    }
+    if(latency_us > Snapshot.latency_max_us){
+        Snapshot.latency_max_us = latency_us;
+    }
+    if(update_us > Snapshot.update_max_us){
+        Snapshot.update_max_us = update_us;
+    }
+    Snapshot.voltage_mv = voltage;
+    Snapshot.ripple_mv = ADC_Get_Ripple();
+    Snapshot.isr_load = ADC_Get_ISR_Load();
+    Snapshot.lost_blocks = ADC_Get_Lost_Blocks();
+    Snapshot.updates++;
+    Snapshot_Seq++;                 // Even: consistent
+}
+
+//******** Snapshot_Read ************
+// Copy a consistent snapshot (any thread below Control_Thread)
+static void Snapshot_Read(Control_Snapshot_t *copy){
+    uint32_t seq;
+    
+    do{
+        seq = Snapshot_Seq;
+        *copy = Snapshot;
+    } while((seq & 1) || (seq != Snapshot_Seq));
+}
+
+//******** Keypad_Show ************
+// Show a 4-character message in the entry field for 1s (Keypad_Thread)
+static void Keypad_Show(char *text){
+    OS_Wait(&LCD_Mutex);
+    LCD_GoTo(0, 10);
+    LCD_OutString(text);
+    OS_Signal(&LCD_Mutex);
+    
+    OS_Sleep(500); // Show it for 1s
+    
+    OS_Wait(&LCD_Mutex);
+    LCD_GoTo(0, 10);
+    LCD_OutString("    ");
+    OS_Signal(&LCD_Mutex);
+}
+
+//******** Motor_Driven ************
+// Returns: nonzero while the loop drives the motor (a target speed, a
+//          tune or a sweep), when flash erases must wait
+static uint8_t Motor_Driven(void){
+    uint8_t cal_status = Calibrate_Status();
+    
+    return (Target_RPM != 0) || (Autotune_Status() == AUTOTUNE_RUNNING) ||
+           (cal_status == CALIBRATE_RUNNING) || (cal_status == CALIBRATE_WAITING);
+}
+
+//******** Keypad_Sweep ************
+// Show the calibration sweep's progress in the entry field: CALn while
+// point n settles, RPM? when the reference speed is to be keyed in
+static void Keypad_Sweep(uint8_t cal_status){
+    uint8_t shown = (cal_status == CALIBRATE_WAITING) ? CALIBRATE_POINTS : Calibrate_Point();
+    
+    if((shown == Cal_Shown) || (Keypad_Index != 0)){
+        return;     // Unchanged, or digits being keyed in
+    }
+    Cal_Shown = shown;
+    OS_Wait(&LCD_Mutex);
+    LCD_GoTo(0, 10);
+    if(shown == CALIBRATE_POINTS){
+        LCD_OutString("RPM?");
+    }
+    else{
+        LCD_OutString("CAL");
+        LCD_OutChar((char)('1' + shown));
+    }
+    OS_Signal(&LCD_Mutex);
+}
 
 //******** Keypad_Thread ************
 // Handles keypad input for target speed
 // Accepts 4-digit decimal numbers
 // '#' applies the speed, 'C' clears entry
+// 'A' autotunes the PID gains at the target speed, 'C' abandons the tune
+// 'B' steps the display through speeds, loop timing, acquisition load
+// and input voltage
+// 'D' starts or stops a telemetry recording
+// '*' sweeps the PWM range to calibrate the speed measurement: at each
+// RPM? prompt key in the speed read off a tachometer and '#' ('#' alone
+// keeps the current reading), 'C' abandons the sweep
 // Valid range: 0 or 400-2400 RPM
+// Flash erases are held off before anything here starts the motor, and
+// let go once it is stopped; finished tunes and sweeps are saved then
 void Keypad_Thread(void){
     uint8_t key;
     uint16_t raw_value;
+    uint8_t tune_status;
+    uint8_t cal_status;
     
     while(1){
+        // Stopped: flash may be erased again, and what is waiting is saved
+        if(!Motor_Driven()){
+            Storage_Hold(0);
+            if(Save_Gains && (Controller_SaveGains() != STORAGE_BUSY)){
+                Save_Gains = 0;
+            }
+            if(Save_Table && (Voltage2RPM_Save() != STORAGE_BUSY)){
+                Save_Table = 0;
+            }
+        }
+        
+        // Report a finished tune; good gains are kept in flash
+        tune_status = Autotune_Status();
+        if(Tune_Pending && (tune_status != AUTOTUNE_RUNNING)){
+            Tune_Pending = 0;
+            if(tune_status == AUTOTUNE_DONE){
+                Save_Gains = 1;
+            }
+            Keypad_Show((tune_status == AUTOTUNE_DONE) ? "DONE" : "FAIL");
+        }
+        
+        // Same for a calibration sweep; the table is kept in flash
+        cal_status = Calibrate_Status();
+        if(Cal_Pending && ((cal_status == CALIBRATE_RUNNING) || (cal_status == CALIBRATE_WAITING))){
+            Keypad_Sweep(cal_status);
+        }
+        else if(Cal_Pending){
+            Cal_Pending = 0;
+            if(cal_status == CALIBRATE_DONE){
+                Save_Table = 1;
+            }
+            Keypad_Show((cal_status == CALIBRATE_DONE) ? "DONE" : "FAIL");
+        }
+        
         // Scan for keypress
         Scan_Keypad();
         key = Key_ASCII;
@@ -60,17 +240,6 @@ void Keypad_Thread(void){
                     Keypad_Buffer[4] = '\0';
                     raw_value = ASCII2Hex(Keypad_Buffer);
                     
-                    // Apply range constraints
-                    if(raw_value > 2400){
-                        Target_RPM = 2400;
-                    }
-                    else if(raw_value > 0 && raw_value < 400){
-                        Target_RPM = 400;
-                    }
-                    else{
-                        Target_RPM = raw_value;
-                    }
-                    
                     // Clear input display
                     Keypad_Index = 0;
                     OS_Wait(&LCD_Mutex);
@@ -78,15 +247,42 @@ void Keypad_Thread(void){
                     LCD_OutString("    "); // Clear 4 digits
                     OS_Signal(&LCD_Mutex);
                     
-                    // Signal new target speed
-                    OS_Signal(&New_Target_Speed);
+                    if(Calibrate_Status() == CALIBRATE_WAITING){
+                        // Reference speed for the calibration sweep
+                        Calibrate_Reference(raw_value);
+                    }
+                    else{
+                        Storage_Hold(1);    // Before the motor can start
+                        
+                        // Apply range constraints
+                        if(raw_value > 2400){
+                            Target_RPM = 2400;
+                        }
+                        else if(raw_value > 0 && raw_value < 400){
+                            Target_RPM = 400;
+                        }
+                        else{
+                            Target_RPM = raw_value;
+                        }
+                        
+                        // Signal new target speed
+                        OS_Signal(&New_Target_Speed);
+                    }
                 }
             }
             else if(key == '#'){
+                if(Calibrate_Status() == CALIBRATE_WAITING){
+                    // Reference speed for the calibration sweep, 0 if none keyed in
+                    Keypad_Buffer[Keypad_Index] = '\0';
+                    raw_value = (Keypad_Index > 0) ? ASCII2Hex(Keypad_Buffer) : 0;
+                    Keypad_Index = 0;
+                    Calibrate_Reference(raw_value);
+                }
                 // Apply current entry (if less than 4 digits)
-                if(Keypad_Index > 0){
+                else if(Keypad_Index > 0){
                     Keypad_Buffer[Keypad_Index] = '\0';
                     raw_value = ASCII2Hex(Keypad_Buffer);
+                    Storage_Hold(1);        // Before the motor can start
                     
                     // Apply range constraints
                     if(raw_value > 2400){
@@ -111,14 +307,47 @@ void Keypad_Thread(void){
                 }
             }
             else if(key == 'C'){
-                // Clear current entry
+                // Clear current entry, abandon a tune or a sweep
+                Autotune_Stop();
+                Calibrate_Stop();
                 Keypad_Index = 0;
                 OS_Wait(&LCD_Mutex);
                 LCD_GoTo(0, 10);
                 LCD_OutString("    ");
                 OS_Signal(&LCD_Mutex);
             }
-            // Ignore 'A', 'B', 'D', '*'
+            else if((key == 'A') && !Cal_Pending){
+                // Autotune at the target speed (1200 RPM if stopped)
+                Storage_Hold(1);
+                Autotune_Start(Target_RPM);
+                Tune_Pending = 1;
+                Keypad_Index = 0;
+                OS_Wait(&LCD_Mutex);
+                LCD_GoTo(0, 10);
+                LCD_OutString("TUNE");
+                OS_Signal(&LCD_Mutex);
+            }
+            else if(key == 'B'){
+                // Line 2: next page
+                Display_Page = (Display_Page + 1) % DISPLAY_PAGES;
+            }
+            else if(key == 'D'){
+                // Record every update to flash, or stop recording
+                if(Telemetry_Status() == TELEMETRY_RECORDING){
+                    Telemetry_Stop();
+                }
+                else{
+                    Telemetry_Start();
+                }
+            }
+            else if((key == '*') && !Tune_Pending && !Cal_Pending){
+                // Calibration sweep, progress shown by Keypad_Sweep
+                Storage_Hold(1);
+                Calibrate_Start();
+                Cal_Pending = 1;
+                Cal_Shown = 0xFF;
+                Keypad_Index = 0;
+            }
             
             // Debounce delay
             OS_Sleep(100); // 200ms delay (100 * 2ms timeslice)
@@ -128,14 +357,76 @@ void Keypad_Thread(void){
     }
 }
 
-//******** Controller_LCD_Thread ************
-// Runs controller every 10ms when new ADC data available
-// Updates LCD display every 1 second with averaged current speed
-void Controller_LCD_Thread(void){
+//******** Control_Thread ************
+// Highest priority: runs once per ADC block (CONTROLLER_UPDATE_RATE_HZ)
+// Runs the controller (the autotune experiment or the calibration sweep
+// in its place while one runs), publishes a snapshot for the display and queues the update for
+// the telemetry log; never touches the LCD or flash
+void Control_Thread(void){
     int32_t avg_voltage;
     int32_t current_rpm_instant;
-    uint32_t display_counter = 0;
+    uint32_t latency;
+    uint32_t woke;
+    uint8_t cal_status;
+    
+    while(1){
+        // Wait for the next block of samples; a wake-up with no new block
+        // would feed the controller the last voltage a second time
+        OS_Wait(&ADC_Data_Ready);
+        if(!ADC_Average_Ready()){
+            continue;
+        }
+        
+        // Wake-up latency: block finished to thread running
+        woke = DWT_CYCCNT_R;
+        latency = woke - ADC_Get_Block_Time();
+        
+        // Get averaged voltage in millivolts
+        avg_voltage = ADC_Get_Average_Voltage();
+        
+        // Convert to RPM
+        current_rpm_instant = Current_speed(avg_voltage);
+        Current_RPM = current_rpm_instant;
+        
+        // Update controller
+        cal_status = Calibrate_Status();
+        if(Autotune_Status() == AUTOTUNE_RUNNING){
+            Autotune_Update(current_rpm_instant);
+        }
+        else if((cal_status == CALIBRATE_RUNNING) || (cal_status == CALIBRATE_WAITING)){
+            Calibrate_Update(avg_voltage);
+        }
+        else{
+            Controller_Update(Target_RPM, current_rpm_instant);
+        }
+        
+        Snapshot_Publish(current_rpm_instant, avg_voltage, latency, DWT_CYCCNT_R - woke);
+        Telemetry_Put(Target_RPM, current_rpm_instant, Controller_GetError(),
+                      Controller_GetIntegral(), PWM_GetDutyCycle());
+    }
+}
+
+//******** Display_Thread ************
+// Above only the telemetry drain: updates the LCD every second from the
+// control thread's snapshot, with the speed averaged over that second
+// 'B' on the keypad steps line 2 through the pages after T (target) and
+// C (speed):
+// L: worst wake-up latency, J: jitter (worst - best latency), in µs
+// I: acquisition ISR load (tenths of a percent), D: blocks lost
+// P: ripple within a block, V: filtered input voltage, in mV
+// U: worst control update, M: best wake-up latency, in µs (with I, the
+//    costs Host/Benchmark_Loop_Jitter.c takes)
+// The last column of line 1 shows R while telemetry records, E if the
+// last recording failed
+void Display_Thread(void){
+    Control_Snapshot_t now;
+    Control_Snapshot_t last;
+    int32_t avg_display_rpm;
+    uint32_t first;
+    uint32_t second;
     uint8_t ascii_buffer[6];
+    uint8_t page;
+    char record;
     
     // Initialize LCD
     OS_Wait(&LCD_Mutex);
@@ -147,56 +438,83 @@ void Controller_LCD_Thread(void){
     LCD_OutString("T:0000 C:0000");
     OS_Signal(&LCD_Mutex);
     
+    // Tuned gains and speed calibration from flash, if any were saved
+    if(Storage_Init() == STORAGE_SUCCESS){
+        Controller_LoadGains();
+        Voltage2RPM_Load();
+    }
+    
+    Snapshot_Read(&last);
+    
     while(1){
-        // Wait for new averaged voltage data (signals every 10ms)
-        OS_Wait(&ADC_Data_Ready);
+        OS_Sleep(500); // 1s (500 * 2ms timeslice)
         
-        // Get averaged voltage in millivolts
-        avg_voltage = ADC_Get_Average_Voltage();
+        Snapshot_Read(&now);
         
-        // Convert to RPM
-        current_rpm_instant = Current_speed(avg_voltage);
-        Current_RPM = current_rpm_instant;
+        // Average over the second: the sums wrap, their difference does not
+        if(now.updates != last.updates){
+            avg_display_rpm = (int32_t)(now.rpm_sum - last.rpm_sum) / (int32_t)(now.updates - last.updates);
+        }
+        else{
+            avg_display_rpm = now.rpm;
+        }
+        last = now;
         
-        // Accumulate for 1-second average display
-        Current_RPM_Accumulator += current_rpm_instant;
-        Current_RPM_Count++;
+        page = Display_Page;
+        switch(page){
+            case 1:
+                first = MIN(now.latency_max_us, 9999);
+                second = MIN(now.latency_max_us - now.latency_min_us, 9999);
+                break;
+            case 2:
+                first = MIN(now.isr_load, 9999);
+                second = MIN(now.lost_blocks, 9999);
+                break;
+            case 3:
+                first = (uint32_t)CLAMP(now.ripple_mv, 0, 9999);
+                second = (uint32_t)CLAMP(now.voltage_mv, 0, 9999);
+                break;
+            case 4:
+                first = MIN(now.update_max_us, 9999);
+                second = MIN(now.latency_min_us, 9999);
+                break;
+            default:
+                first = now.target;
+                second = (uint32_t)CLAMP(avg_display_rpm, 0, 9999);
+                break;
+        }
+        switch(Telemetry_Status()){
+            case TELEMETRY_RECORDING: record = 'R'; break;
+            case TELEMETRY_FAILED:    record = 'E'; break;
+            default:                  record = ' '; break;
+        }
         
-        // Update controller
-        Controller_Update(Target_RPM, current_rpm_instant);
+        // Update LCD Line 2, and the recording mark on line 1
+        OS_Wait(&LCD_Mutex);
         
-        // Update LCD every 1 second (100 controller cycles)
-        display_counter++;
-        if(display_counter >= 100){
-            display_counter = 0;
-            
-            // Compute 1-second average
-            int32_t avg_display_rpm = Current_RPM_Accumulator / Current_RPM_Count;
-            Current_RPM_Accumulator = 0;
-            Current_RPM_Count = 0;
-            
-            // Update LCD Line 2 with target and current speeds
-            OS_Wait(&LCD_Mutex);
-            
-            // Display Target Speed
-            Hex2ASCII(ascii_buffer, Target_RPM);
-            LCD_GoTo(1, 2);
-            // Display 4 digits
-            LCD_OutChar(ascii_buffer[0]);
-            LCD_OutChar(ascii_buffer[1]);
-            LCD_OutChar(ascii_buffer[2]);
-            LCD_OutChar(ascii_buffer[3]);
-            
-            // Display Current Speed
-            Hex2ASCII(ascii_buffer, (uint16_t)avg_display_rpm);
-            LCD_GoTo(1, 9);
-            LCD_OutChar(ascii_buffer[0]);
-            LCD_OutChar(ascii_buffer[1]);
-            LCD_OutChar(ascii_buffer[2]);
-            LCD_OutChar(ascii_buffer[3]);
-            
-            OS_Signal(&LCD_Mutex);
-        }
+        LCD_GoTo(0, LCD_COLS - 1);
+        LCD_OutChar(record);
+        
+        LCD_GoTo(1, 0);
+        LCD_OutChar("TLIPU"[page]);
+        Hex2ASCII(ascii_buffer, (uint16_t)first);
+        // Display 4 digits
+        LCD_OutChar(':');
+        LCD_OutChar(ascii_buffer[0]);
+        LCD_OutChar(ascii_buffer[1]);
+        LCD_OutChar(ascii_buffer[2]);
+        LCD_OutChar(ascii_buffer[3]);
+        
+        LCD_GoTo(1, 7);
+        LCD_OutChar("CJDVM"[page]);
+        Hex2ASCII(ascii_buffer, (uint16_t)second);
+        LCD_OutChar(':');
+        LCD_OutChar(ascii_buffer[0]);
+        LCD_OutChar(ascii_buffer[1]);
+        LCD_OutChar(ascii_buffer[2]);
+        LCD_OutChar(ascii_buffer[3]);
+        
+        OS_Signal(&LCD_Mutex);
     }
 }
 
@@ -218,10 +536,13 @@ int main(void){
     // Set initial motor direction (forward)
     PWM_SetDirection(1);
     
-    // Add threads to RTOS
-    OS_AddThreads(&Keypad_Thread, &Controller_LCD_Thread);
+    // Add threads to RTOS, control first so it runs first
+    OS_AddThread(&Control_Thread, CONTROL_PRIORITY);
+    OS_AddThread(&Keypad_Thread, KEYPAD_PRIORITY);
+    OS_AddThread(&Display_Thread, DISPLAY_PRIORITY);
+    OS_AddThread(&Telemetry_Thread, TELEMETRY_PRIORITY);
     
-    // Start ADC sampling (100µs periodic interrupt)
+    // Start ADC sampling (100µs conversions, one interrupt per block)
     ADC_Start_Sampling();
     
     // Launch RTOS with 2ms timeslice
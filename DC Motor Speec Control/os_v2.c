@@ -3,6 +3,11 @@
 // A very simple real time operating system with additional features: OS_Suspend, OS_Sleep, Blocking Semaphores, FIFO, Priority
 // John Tadrous
 // July 10, 2020
+// The scheduler runs the highest-priority thread that is neither blocked
+// nor sleeping, round robin among equals. A semaphore signal that wakes a
+// thread of higher priority than the one running switches to it at once
+// (from an ISR, as soon as the ISR returns), so a periodic thread woken by
+// an interrupt does not wait out another thread's time slice.
 
 
 /* Assume a 16 MHz clock frequency
@@ -10,6 +15,7 @@
 
 #include "TM4C123GH6PM.h"
 #include "tm4c123gh6pm_def.h"
+#include "system.h"     // STACKSIZE, when flash storage needs more
 
 
 
@@ -26,8 +32,11 @@ void Scheduler(void);
 void OS_InitSemaphore(int32_t *Sem, int32_t val);
 
 
-#define NUMTHREADS  4        // maximum number of threads
+#define NUMTHREADS  6        // maximum number of threads, idle thread included
+#ifndef STACKSIZE
 #define STACKSIZE   100      // number of 32-bit words in stack
+#endif
+#define IDLE_PRIORITY 255    // below every application thread
 
 uint32_t Mail;		// mailbox support
 int32_t Send;    // mailbox semaphore
@@ -49,6 +58,7 @@ typedef struct tcb tcbType;
 tcbType tcbs[NUMTHREADS];
 tcbType *RunPt;
 int32_t Stacks[NUMTHREADS][STACKSIZE];
+uint32_t NumThreads = 0;  // threads added so far
 
 
 // ******** OS_Suspend ************
@@ -80,7 +90,8 @@ void OS_Wait(int32_t *s){
 // output: none
 void OS_Signal(int32_t *s){
 	tcbType *pt;
-	DisableInterrupts();
+	int32_t status;
+	status = StartCritical(); // also called from ISRs
 	(*s) = (*s) + 1;
 	if((*s) <= 0){
 		pt = RunPt->next; // search for one blocked on this
@@ -88,8 +99,11 @@ void OS_Signal(int32_t *s){
 			pt = pt->next;
 		}
 		pt->blocked = 0;   // wakeup this one
+		if(pt->WorkingPriority < RunPt->WorkingPriority){
+			OS_Suspend();      // it preempts the running thread
+		}
 	}
-	EnableInterrupts();
+	EndCritical(status);
 }
 
 // ******** OS_Sleep ************
@@ -102,11 +116,17 @@ void OS_Sleep(uint32_t SleepCtr){
 }
 
 /*Secheduler*/
-// Selects the next thread to run (unblocked, non-sleeping, modifies the sleep counter
+// Selects the next thread to run: the highest priority (lowest number)
+// one not blocked or sleeping, the next in the ring among equals;
+// modifies the sleep counters of every thread but the one leaving, whose
+// Sleep, if any, OS_Sleep has only just set (so a sleep lasts its full
+// count of ticks). The idle thread is always ready.
 // input: none
 // output: none
 void Scheduler(void){
 	tcbType *pt;
+	tcbType *bestPt;
+	uint32_t best = IDLE_PRIORITY + 1;
 	pt=RunPt;
 	if (NVIC_ST_CTRL_R & 0x10000){  // full thread time has passed
 		while (pt->next != RunPt){
@@ -116,10 +136,16 @@ void Scheduler(void){
 			}
 		}
 	}
-	RunPt = RunPt->next;     // skip at least one
-	while((RunPt->Sleep)||(RunPt-> blocked)){
-		RunPt = RunPt->next;   // find one not sleeping and not blocked
-	}
+	pt = RunPt;
+	bestPt = RunPt;
+	do{
+		pt = pt->next;     // skip at least one
+		if((pt->WorkingPriority < best)&&(pt->Sleep == 0)&&(pt->blocked == 0)){
+			best = pt->WorkingPriority;
+			bestPt = pt;
+		}
+	} while (pt != RunPt);
+	RunPt = bestPt;
 }
 
 
@@ -217,25 +243,42 @@ void SetInitialStack(int i){
 
 
 
+// ******** OS_Idle ***************
+// runs when every other thread is blocked or sleeping
+// sleeps the core until the next interrupt
+static void OS_Idle(void){
+  while(1){
+    __WFI();
+  }
+}
+
 //******** OS_AddThread ***************
-// add three foregound threads to the scheduler
-// Inputs: three pointers to a void/void foreground tasks
+// add one foreground thread to the scheduler
+// Inputs: pointer to a void/void foreground task
+//         priority, 0 is highest
 // Outputs: 1 if successful, 0 if this thread can not be added
-int OS_AddThreads(void(*task0)(void),
-                 void(*task1)(void))/*,
-                 void(*task2)(void),
-								 void (*task3) (void) )*/
-                                { int32_t status;
+int OS_AddThread(void(*task)(void), uint8_t priority){
+  int32_t status;
+  uint32_t i;
   status = StartCritical();
-  tcbs[0].next = &tcbs[1]; // 0 points to 1
-  tcbs[1].next = &tcbs[0]; // 1 points to 0
- // tcbs[2].next = &tcbs[3]; // 2 points to 3
-//	tcbs[3].next = &tcbs[0]; // 3 points to 0
-  SetInitialStack(0); Stacks[0][STACKSIZE-2] = (int32_t)(task0); // PC
-  SetInitialStack(1); Stacks[1][STACKSIZE-2] = (int32_t)(task1); // PC
-//  SetInitialStack(2); Stacks[2][STACKSIZE-2] = (int32_t)(task2); // PC
-//	SetInitialStack(3); Stacks[3][STACKSIZE-2] = (int32_t)(task3); // PC
-  RunPt = &tcbs[0];       // thread 0 will run first
+  if((NumThreads >= NUMTHREADS) ||
+     ((priority != IDLE_PRIORITY) && (NumThreads >= NUMTHREADS - 1))){
+    EndCritical(status);
+    return 0;             // no room (the last slot is the idle thread's)
+  }
+  i = NumThreads;
+  SetInitialStack(i); Stacks[i][STACKSIZE-2] = (int32_t)(task); // PC
+  tcbs[i].blocked = 0;
+  tcbs[i].Sleep = 0;
+  tcbs[i].FixedPriority = priority;
+  tcbs[i].WorkingPriority = priority;
+  tcbs[i].Age = 0;
+  tcbs[i].next = &tcbs[0];          // new thread closes the ring
+  if(i > 0){
+    tcbs[i-1].next = &tcbs[i];
+  }
+  NumThreads++;
+  RunPt = &tcbs[0];       // first thread added will run first
   EndCritical(status);
   return 1;               // successful
 }
@@ -246,6 +289,7 @@ int OS_AddThreads(void(*task0)(void),
 //         (maximum of 24 bits)
 // Outputs: none (does not return)
 void OS_Launch(uint32_t theTimeSlice){
+  OS_AddThread(&OS_Idle, IDLE_PRIORITY);
   NVIC_ST_RELOAD_R = theTimeSlice - 1; // reload value
   NVIC_ST_CTRL_R = 0x00000007; // enable, core clock and interrupt arm
   StartOS();                   // start on the first task
@@ -108,7 +108,7 @@ __Vectors       DCD     __initial_sp              ; Top of Stack
                 DCD     COMP1_Handler             ;  26: Analog Comparator 1
                 DCD     COMP2_Handler             ;  27: Analog Comparator 2
                 DCD     SYSCTL_Handler            ;  28: System Control (PLL, OSC, BO)
-                DCD     FLASH_Handler             ;  29: FLASH Control
+                DCD     FlashCtl_Handler          ;  29: FLASH Control
                 DCD     GPIOF_Handler             ;  30: GPIO Port F
                 DCD     GPIOG_Handler             ;  31: GPIO Port G
                 DCD     GPIOH_Handler             ;  32: GPIO Port H
@@ -399,12 +399,11 @@ WDT0_Handler\
                 B       .
                 ENDP
 
-    IMPORT      TIMER0A_Handler
-;TIMER0A_Handler\
+TIMER0A_Handler\
                 PROC
-;                EXPORT  TIMER0A_Handler [WEAK]
-;                B       .
-;                ENDP
+                EXPORT  TIMER0A_Handler [WEAK]
+                B       .
+                ENDP
 
 TIMER0B_Handler\
                 PROC
@@ -460,9 +459,9 @@ SYSCTL_Handler\
                 B       .
                 ENDP
 
-FLASH_Handler\
+FlashCtl_Handler\
                 PROC
-                EXPORT  FLASH_Handler [WEAK]
+                EXPORT  FlashCtl_Handler [WEAK]
                 B       .
                 ENDP
 
@@ -0,0 +1,590 @@
+// storage.c
+// Settings kept in flash through the Simple_File_System file system
+// Small records (tuned gains, calibration) are appended to one settings
+// file; loading a record returns the latest one saved under its tag, so a
+// save never rewrites flash in place.
+//
+// Settings file: a header record (STORAGE_MAGIC) followed by records of
+//   tag (4 bytes) | length (2 bytes) | check (2 bytes) | data, padded to 4
+// where check is the 16-bit sum of the data bytes. A record a power loss
+// tore is skipped to the next sector, where appends go on after a mount.
+//
+// Appending never frees anything, so once the file passes
+// STORAGE_COMPACT_BYTES the latest record of each tag (and length) is
+// copied to a new settings file and the old one deleted. The copy's header
+// carries a generation one higher than the old file's, and the copy ends
+// with a seal record (STORAGE_SEAL, same generation) before it is
+// committed. A power loss part way leaves an unsealed copy, or two files;
+// Storage_Init() keeps the sealed one with the highest generation and
+// deletes the rest, so a save is never lost to a compaction.
+//
+// One log file (telemetry.c) is kept alongside: each Storage_Log_Start()
+// deletes the last one, so a log must be read out before the next
+// recording, and creates a new file in the file system's delta mode,
+// records of int32 channels stored as varint differences, so slowly moving
+// signals cost a byte or two per sample. Storage_Log_Write() only fills
+// the write-back cache, which programs a sector when one fills; the
+// Storage_Log_Sync() calls commit what has been written so far.
+//
+// Enabled by MOTOR_FLASH_STORAGE in system.h (1, the default). The build needs:
+// - file_system.c in the project: it compiles the Simple_File_System
+//   sources and FlashProgram.c with FS_THREAD_SAFE 1 and FS_PACK_CHANNELS
+//   TELEMETRY_CHANNELS (5), set in system.h for both it and this file;
+//   the checks below catch a project define that overrides them
+// - FlashCtl_Handler in the vector table (startup_TM4C123.s)
+// - STACKSIZE in os_v2.c large enough for the file system calls (system.h)
+// All functions block on flash operations and must be called from a
+// thread, never from an interrupt or the control path.
+//
+// A 1 KB erase stalls every fetch from flash for some 10ms, the SSI0
+// interrupt and Control_Thread included: at 1 kHz that is ten control
+// updates and lost ADC blocks. So the thread that starts the motor calls
+// Storage_Hold(1) first and Storage_Hold(0) once it has stopped. While
+// held, Storage_Save() refuses (STORAGE_BUSY: save again once stopped),
+// Storage_Background() erases nothing, and an erase the log still needs
+// (no erased sector left) waits, its thread asleep, until the hold ends.
+// Programming a sector stalls fetches too, but only for a write-buffer
+// load at a time, within the one block of slack the ADC's ping-pong
+// buffers leave.
+// With MOTOR_FLASH_STORAGE 0 every call fails and nothing is linked.
+
+#include <stdint.h>
+
+#include "system.h"
+
+#if MOTOR_FLASH_STORAGE
+
+#include "../Simple_File_System/OS_File_System.h"
+#include "../Simple_File_System/OS_File_Lock.h"
+#include "../Simple_File_System/OS_File_Pack.h"
+
+#if !FS_THREAD_SAFE
+#error "storage.c needs the file system built with FS_THREAD_SAFE=1 (threads share it)"
+#endif
+#if FS_PACK_CHANNELS < TELEMETRY_CHANNELS
+#error "storage.c needs FS_PACK_CHANNELS of at least TELEMETRY_CHANNELS for the telemetry log"
+#endif
+
+#define STORAGE_MAGIC       0x544F4D44  // "DMOT"
+#define STORAGE_SEAL        0x444E4544  // "DEND": end of a compacted copy
+#define STORAGE_HEADER      8           // Bytes ahead of each record's data
+#define STORAGE_COMPACT_BYTES   1024    // Settings file length that starts a compaction
+#define STORAGE_KEYS        8           // Tag and length pairs a compaction can copy
+
+// What Storage_Header() finds in a file
+#define STORAGE_OTHER       0           // Not a settings file
+#define STORAGE_UNSEALED    1           // Compacted copy without its seal
+#define STORAGE_WHOLE       2           // Settings file to use
+
+static FS_File_t Settings_File = FILE_INVALID;
+static uint32_t Generation = 0;         // Compactions of the settings file
+static FS_File_t Log_File = FILE_INVALID;
+static FS_Handle_t Log_Handle = HANDLE_INVALID;
+static volatile uint8_t Held = 0;       // Erases held off (Storage_Hold)
+
+//******** Storage_Check ************
+// 16-bit sum of a record's data bytes
+static uint16_t Storage_Check(const uint8_t *data, uint16_t length){
+    uint16_t sum = 0;
+    uint16_t i;
+
+    for(i = 0; i < length; i++){
+        sum += data[i];
+    }
+    return sum;
+}
+
+//******** Storage_Put ************
+// Write one record through an open handle; the caller commits it
+static uint8_t Storage_Put(FS_Handle_t h, uint32_t tag, const uint8_t *data, uint16_t length){
+    uint8_t header[STORAGE_HEADER];
+    uint8_t pad[3] = {0, 0, 0};
+    uint16_t check = Storage_Check(data, length);
+    uint16_t padding = (uint16_t)((4 - (length & 3)) & 3);
+
+    header[0] = (uint8_t)tag;
+    header[1] = (uint8_t)(tag >> 8);
+    header[2] = (uint8_t)(tag >> 16);
+    header[3] = (uint8_t)(tag >> 24);
+    header[4] = (uint8_t)length;
+    header[5] = (uint8_t)(length >> 8);
+    header[6] = (uint8_t)check;
+    header[7] = (uint8_t)(check >> 8);
+
+    if((OS_File_Write(h, header, STORAGE_HEADER) != STORAGE_HEADER) ||
+       (OS_File_Write(h, data, length) != length) ||
+       (OS_File_Write(h, pad, padding) != padding)){
+        return STORAGE_ERROR;
+    }
+    return STORAGE_SUCCESS;
+}
+
+//******** Storage_Append ************
+// Append one record to the settings file and commit it
+static uint8_t Storage_Append(FS_File_t file, uint32_t tag, const uint8_t *data, uint16_t length){
+    FS_Handle_t h;
+    uint8_t result;
+
+    h = OS_File_Open(file);
+    if(h == HANDLE_INVALID){
+        return STORAGE_ERROR;
+    }
+    result = Storage_Put(h, tag, data, length);
+    if(OS_File_Close(h) != FS_SUCCESS){
+        result = STORAGE_ERROR;
+    }
+    if(OS_File_Flush() != FS_SUCCESS){
+        result = STORAGE_ERROR;
+    }
+    return result;
+}
+
+//******** Storage_Word ************
+// Little-endian 32-bit value at data
+static uint32_t Storage_Word(const uint8_t *data){
+    return (uint32_t)data[0] | ((uint32_t)data[1] << 8) |
+           ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+//******** Storage_Next ************
+// Read the record at *position and step past it. A record a power loss
+// tore is followed by a fresh sector (the file system pads a torn tail
+// sector out when it mounts, and appends go on in the next one), so a
+// damaged record is stepped past to the next sector boundary
+// Output: *tag, *length, record - the record as read
+//         *intact - 1 if its length and check are good
+// Returns: 1 if a record was read, 0 at the end of the file
+static uint8_t Storage_Next(FS_Handle_t h, uint32_t *position, uint32_t *tag,
+                            uint16_t *length, uint8_t *record, uint8_t *intact){
+    uint8_t header[STORAGE_HEADER];
+    uint32_t start = *position;
+
+    if((OS_File_Seek(h, start) != FS_SUCCESS) ||
+       (OS_File_ReadBytes(h, header, STORAGE_HEADER) != STORAGE_HEADER)){
+        return 0;
+    }
+    *tag = Storage_Word(header);
+    *length = (uint16_t)(header[4] | (header[5] << 8));
+    *intact = (*length <= STORAGE_MAX_RECORD) &&
+              (OS_File_ReadBytes(h, record, *length) == *length) &&
+              (Storage_Check(record, *length) == (uint16_t)(header[6] | (header[7] << 8)));
+
+    if(*intact){
+        *position = start + STORAGE_HEADER + ((*length + 3U) & ~3U);
+    }
+    else{
+        *position = (start + SECTOR_SIZE) & ~(SECTOR_SIZE - 1U);
+    }
+    return 1;
+}
+
+//******** Storage_Find ************
+// Find the latest intact record with a tag and length in a settings file
+// Output: data - its contents (length bytes), unchanged if there is none
+// Returns: STORAGE_SUCCESS, or STORAGE_ERROR if there is none
+static uint8_t Storage_Find(FS_File_t file, uint32_t tag, uint16_t length, uint8_t *data){
+    uint8_t record[STORAGE_MAX_RECORD];
+    uint32_t position = 0;
+    uint32_t record_tag;
+    uint16_t record_length;
+    uint16_t i;
+    uint8_t intact;
+    uint8_t result = STORAGE_ERROR;
+    FS_Handle_t h;
+
+    h = OS_File_Open(file);
+    if(h == HANDLE_INVALID){
+        return STORAGE_ERROR;
+    }
+
+    // Walk the records, keeping the last intact one with this tag
+    while(Storage_Next(h, &position, &record_tag, &record_length, record, &intact)){
+        if(intact && (record_tag == tag) && (record_length == length)){
+            for(i = 0; i < length; i++){
+                data[i] = record[i];
+            }
+            result = STORAGE_SUCCESS;
+        }
+    }
+    OS_File_Close(h);
+
+    return result;
+}
+
+//******** Storage_Header ************
+// Check whether a file is a whole settings file
+// Output: *generation - compactions it has been through
+// Returns: STORAGE_WHOLE if its header is intact and, for a compacted
+//          copy, so is its seal; STORAGE_UNSEALED for a copy without
+//          one; else STORAGE_OTHER
+static uint8_t Storage_Header(FS_File_t file, uint32_t *generation){
+    uint8_t header[STORAGE_HEADER + 4];
+    uint8_t seal[4];
+    uint16_t length;
+    FS_Handle_t h;
+    uint16_t got;
+
+    if(!OS_File_Exists(file) || (OS_File_Mode(file) != FS_MODE_RAW)){
+        return STORAGE_OTHER;
+    }
+    h = OS_File_Open(file);
+    if(h == HANDLE_INVALID){
+        return STORAGE_OTHER;
+    }
+    got = OS_File_ReadBytes(h, header, sizeof(header));
+    OS_File_Close(h);
+
+    if((got < STORAGE_HEADER) || (Storage_Word(header) != STORAGE_MAGIC)){
+        return STORAGE_OTHER;
+    }
+    length = (uint16_t)(header[4] | (header[5] << 8));
+    if(length == 0){
+        *generation = 0;        // Never compacted
+        return STORAGE_WHOLE;
+    }
+    if((length != 4) || (got < sizeof(header))){
+        return STORAGE_UNSEALED;
+    }
+    *generation = Storage_Word(&header[STORAGE_HEADER]);
+    if((Storage_Find(file, STORAGE_SEAL, 4, seal) != STORAGE_SUCCESS) ||
+       (Storage_Word(seal) != *generation)){
+        return STORAGE_UNSEALED;
+    }
+    return STORAGE_WHOLE;
+}
+
+//******** Storage_Compact ************
+// Copy the latest record of each tag and length to a new settings file,
+// commit it sealed, then delete the old file
+// Returns: STORAGE_SUCCESS, or STORAGE_ERROR with the old file kept
+static uint8_t Storage_Compact(void){
+    uint8_t record[STORAGE_MAX_RECORD];
+    uint8_t word[4];
+    uint32_t tags[STORAGE_KEYS];
+    uint16_t lengths[STORAGE_KEYS];
+    uint32_t keys = 0;
+    uint32_t position = 0;
+    uint32_t tag;
+    uint32_t i;
+    uint16_t length;
+    uint8_t intact;
+    uint32_t next = Generation + 1;
+    FS_File_t file;
+    FS_Handle_t h;
+    uint8_t result = STORAGE_SUCCESS;
+
+    // Every tag and length saved so far
+    h = OS_File_Open(Settings_File);
+    if(h == HANDLE_INVALID){
+        return STORAGE_ERROR;
+    }
+    while((result == STORAGE_SUCCESS) && Storage_Next(h, &position, &tag, &length, record, &intact)){
+        if(intact && (tag != STORAGE_MAGIC) && (tag != STORAGE_SEAL)){
+            for(i = 0; (i < keys) && ((tags[i] != tag) || (lengths[i] != length)); i++){
+            }
+            if(i == STORAGE_KEYS){
+                result = STORAGE_ERROR;     // Would drop a record: keep appending instead
+            }
+            else if(i == keys){
+                tags[keys] = tag;
+                lengths[keys] = length;
+                keys++;
+            }
+        }
+    }
+    OS_File_Close(h);
+    if(result != STORAGE_SUCCESS){
+        return STORAGE_ERROR;
+    }
+
+    // The copy: header, latest records, seal, committed together
+    file = OS_File_New();
+    if(file == FILE_INVALID){
+        return STORAGE_ERROR;
+    }
+    h = OS_File_Open(file);
+    if(h == HANDLE_INVALID){
+        OS_File_Delete(file);
+        return STORAGE_ERROR;
+    }
+    word[0] = (uint8_t)next;
+    word[1] = (uint8_t)(next >> 8);
+    word[2] = (uint8_t)(next >> 16);
+    word[3] = (uint8_t)(next >> 24);
+    result = Storage_Put(h, STORAGE_MAGIC, word, 4);
+    for(i = 0; (i < keys) && (result == STORAGE_SUCCESS); i++){
+        if(Storage_Find(Settings_File, tags[i], lengths[i], record) == STORAGE_SUCCESS){
+            result = Storage_Put(h, tags[i], record, lengths[i]);
+        }
+    }
+    if(result == STORAGE_SUCCESS){
+        result = Storage_Put(h, STORAGE_SEAL, word, 4);
+    }
+    if(OS_File_Close(h) != FS_SUCCESS){
+        result = STORAGE_ERROR;
+    }
+    if((result != STORAGE_SUCCESS) || (OS_File_Flush() != FS_SUCCESS)){
+        OS_File_Delete(file);
+        OS_File_Flush();
+        return STORAGE_ERROR;
+    }
+
+    // Sealed copy committed: the old file can go
+    OS_File_Delete(Settings_File);
+    OS_File_Flush();
+    Settings_File = file;
+    Generation = next;
+    return STORAGE_SUCCESS;
+}
+
+//******** Storage_Init ************
+// Mount the file system and find (or create) the settings file; copies
+// left by a compaction that power cut short are deleted
+// Returns: STORAGE_SUCCESS, or STORAGE_ERROR if no settings file is usable
+uint8_t Storage_Init(void){
+    uint8_t header[STORAGE_HEADER];
+    uint32_t generation;
+    uint32_t i;
+
+    OS_FS_Init();
+    OS_File_Mount();    // A repaired disk is still mounted
+    Settings_File = FILE_INVALID;
+    Generation = 0;
+
+    // The whole settings file that has been compacted most
+    for(i = 0; i <= MAX_FILE_NUMBER; i++){
+        if((Storage_Header((FS_File_t)i, &generation) == STORAGE_WHOLE) &&
+           ((Settings_File == FILE_INVALID) || (generation > Generation))){
+            Settings_File = (FS_File_t)i;
+            Generation = generation;
+        }
+    }
+
+    // Any other file with a settings header is an old or unsealed copy
+    for(i = 0; i <= MAX_FILE_NUMBER; i++){
+        if((i != Settings_File) && (Storage_Header((FS_File_t)i, &generation) != STORAGE_OTHER)){
+            OS_File_Delete((FS_File_t)i);
+            OS_File_Flush();
+        }
+    }
+
+    // First run on this disk
+    if(Settings_File == FILE_INVALID){
+        Settings_File = OS_File_New();
+        if((Settings_File == FILE_INVALID) ||
+           (Storage_Append(Settings_File, STORAGE_MAGIC, header, 0) != STORAGE_SUCCESS)){
+            Settings_File = FILE_INVALID;
+            return STORAGE_ERROR;
+        }
+    }
+    return STORAGE_SUCCESS;
+}
+
+//******** Storage_Save ************
+// Save a record under a tag; it replaces any earlier record with that tag
+// Compacts the settings file once it has grown past STORAGE_COMPACT_BYTES
+// Input: tag - STORAGE_TAG_x
+//        data, length - record contents (up to STORAGE_MAX_RECORD bytes)
+// Returns: STORAGE_SUCCESS, STORAGE_BUSY while erases are held, or
+//          STORAGE_ERROR
+uint8_t Storage_Save(uint32_t tag, const void *data, uint16_t length){
+    uint8_t result;
+
+    if(Held){
+        return STORAGE_BUSY;    // A compaction or the allocator could erase
+    }
+    if((Settings_File == FILE_INVALID) || (length > STORAGE_MAX_RECORD)){
+        return STORAGE_ERROR;
+    }
+    result = Storage_Append(Settings_File, tag, (const uint8_t *)data, length);
+
+    // The record is committed either way; a failed compaction is retried
+    // at the next save
+    if((result == STORAGE_SUCCESS) && (OS_File_Length(Settings_File) > STORAGE_COMPACT_BYTES)){
+        Storage_Compact();
+    }
+    return result;
+}
+
+//******** Storage_Load ************
+// Load the latest record saved under a tag
+// Input: tag - STORAGE_TAG_x
+//        length - record size expected; records of another size are skipped
+// Output: *data - record contents, unchanged on failure
+// Returns: STORAGE_SUCCESS, or STORAGE_ERROR if there is no intact record
+uint8_t Storage_Load(uint32_t tag, void *data, uint16_t length){
+    uint8_t record[STORAGE_MAX_RECORD];
+    uint16_t i;
+
+    if((Settings_File == FILE_INVALID) || (length > STORAGE_MAX_RECORD) ||
+       (Storage_Find(Settings_File, tag, length, record) != STORAGE_SUCCESS)){
+        return STORAGE_ERROR;
+    }
+    for(i = 0; i < length; i++){
+        ((uint8_t *)data)[i] = record[i];
+    }
+    return STORAGE_SUCCESS;
+}
+
+//******** Storage_Log_Start ************
+// Replace the last log file with a new one, open for Storage_Log_Write()
+// Input: channels - int32 values per record (up to FS_PACK_CHANNELS)
+// Returns: STORAGE_SUCCESS, or STORAGE_ERROR if storage is not ready, a
+//          log is already open or the disk has no free file
+uint8_t Storage_Log_Start(uint8_t channels){
+    uint32_t i;
+
+    if((Settings_File == FILE_INVALID) || (Log_File != FILE_INVALID)){
+        return STORAGE_ERROR;
+    }
+
+    // Logs are the only compressed files
+    for(i = 0; i <= MAX_FILE_NUMBER; i++){
+        if(OS_File_Exists((FS_File_t)i) && (OS_File_Mode((FS_File_t)i) != FS_MODE_RAW)){
+            OS_File_Delete((FS_File_t)i);
+        }
+    }
+
+    Log_File = OS_File_New();
+    if(Log_File == FILE_INVALID){
+        return STORAGE_ERROR;
+    }
+    if(OS_File_SetMode(Log_File, FS_MODE_DELTA(channels)) == FS_SUCCESS){
+        Log_Handle = OS_File_Open(Log_File);
+    }
+    if(Log_Handle == HANDLE_INVALID){
+        OS_File_Delete(Log_File);
+        Log_File = FILE_INVALID;
+        return STORAGE_ERROR;
+    }
+    return STORAGE_SUCCESS;
+}
+
+//******** Storage_Log_Write ************
+// Append records to the open log
+// Input: values, count - int32 values, whole records
+// Returns: STORAGE_SUCCESS, or STORAGE_ERROR if no log is open or the
+//          disk is full (the values that fitted are kept)
+uint8_t Storage_Log_Write(const int32_t *values, uint16_t count){
+    uint16_t length = (uint16_t)(count * sizeof(int32_t));
+
+    if(Log_Handle == HANDLE_INVALID){
+        return STORAGE_ERROR;
+    }
+    if(OS_File_Write(Log_Handle, (const uint8_t *)values, length) != length){
+        return STORAGE_ERROR;
+    }
+    return STORAGE_SUCCESS;
+}
+
+//******** Storage_Log_Sync ************
+// Commit the log as written so far; a power loss after this keeps it
+// Returns: STORAGE_SUCCESS or STORAGE_ERROR
+uint8_t Storage_Log_Sync(void){
+    if(Log_File == FILE_INVALID){
+        return STORAGE_ERROR;
+    }
+    if((OS_File_Sync(Log_File) != FS_SUCCESS) || (OS_File_Flush() != FS_SUCCESS)){
+        return STORAGE_ERROR;
+    }
+    return STORAGE_SUCCESS;
+}
+
+//******** Storage_Log_Stop ************
+// Close the open log and commit it
+// Returns: STORAGE_SUCCESS or STORAGE_ERROR
+uint8_t Storage_Log_Stop(void){
+    uint8_t result = STORAGE_SUCCESS;
+
+    if(Log_File == FILE_INVALID){
+        return STORAGE_ERROR;
+    }
+    if((OS_File_Close(Log_Handle) != FS_SUCCESS) || (OS_File_Flush() != FS_SUCCESS)){
+        result = STORAGE_ERROR;
+    }
+    Log_Handle = HANDLE_INVALID;
+    Log_File = FILE_INVALID;
+    return result;
+}
+
+//******** Storage_Background ************
+// One step of flash housekeeping: erase a reclaimable block ahead of the
+// log so its appends find erased sectors, else write back a cache line
+// Call from a low-priority thread while it has nothing else to do
+// Returns: STORAGE_SUCCESS if there was work, STORAGE_ERROR if none (or
+//          while erases are held)
+uint8_t Storage_Background(void){
+    if((Settings_File == FILE_INVALID) || Held){
+        return STORAGE_ERROR;
+    }
+    if((OS_File_Reclaim() == FS_SUCCESS) || (OS_File_Background() == FS_SUCCESS)){
+        return STORAGE_SUCCESS;
+    }
+    return STORAGE_ERROR;
+}
+
+//******** Storage_Hold ************
+// Hold flash erases off while the motor runs, or let them go on
+// Holding waits for an erase under way (up to ~10ms); call it before the
+// motor starts, from the one thread that starts and stops it, and make no
+// other storage call from that thread while held
+// Input: hold - 1 while the motor runs, 0 once it has stopped
+void Storage_Hold(uint8_t hold){
+    if(hold){
+        FS_Flash_Hold(1);
+        Held = 1;
+    }
+    else{
+        Held = 0;
+        FS_Flash_Hold(0);
+    }
+}
+
+#else
+
+uint8_t Storage_Init(void){
+    return STORAGE_ERROR;
+}
+
+uint8_t Storage_Save(uint32_t tag, const void *data, uint16_t length){
+    (void)tag;
+    (void)data;
+    (void)length;
+    return STORAGE_ERROR;
+}
+
+uint8_t Storage_Load(uint32_t tag, void *data, uint16_t length){
+    (void)tag;
+    (void)data;
+    (void)length;
+    return STORAGE_ERROR;
+}
+
+uint8_t Storage_Log_Start(uint8_t channels){
+    (void)channels;
+    return STORAGE_ERROR;
+}
+
+uint8_t Storage_Log_Write(const int32_t *values, uint16_t count){
+    (void)values;
+    (void)count;
+    return STORAGE_ERROR;
+}
+
+uint8_t Storage_Log_Sync(void){
+    return STORAGE_ERROR;
+}
+
+uint8_t Storage_Log_Stop(void){
+    return STORAGE_ERROR;
+}
+
+uint8_t Storage_Background(void){
+    return STORAGE_ERROR;
+}
+
+void Storage_Hold(uint8_t hold){
+    (void)hold;
+}
+
+#endif // MOTOR_FLASH_STORAGE
@@ -11,11 +11,28 @@
 // RTOS Configuration
 #define RTOS_TIMESLICE_US   2000        // 2ms timeslice
 #define RTOS_TIMESLICE_CYCLES (RTOS_TIMESLICE_US * (SYSTEM_CLOCK_HZ / 1000000))
+#define CONTROL_PRIORITY    0           // Control thread, woken by each ADC block
+#define KEYPAD_PRIORITY     1           // Keypad thread
+#define DISPLAY_PRIORITY    2           // Display thread
+#define TELEMETRY_PRIORITY  3           // Telemetry log drain
 
 // ADC Sampling Configuration
 #define ADC_SAMPLE_PERIOD_US    100     // 100µs sampling period
 #define ADC_SAMPLE_RATE_HZ      10000   // 10 kHz sampling rate
 #define ADC_SAMPLES_PER_AVG     100     // Average over 100 samples (10ms)
+#define ADC_SAMPLES_PER_BLOCK   (ADC_SAMPLE_RATE_HZ / CONTROLLER_UPDATE_RATE_HZ) // One estimate per control update
+
+// Sample Filter Configuration (see filter.c)
+#define FILTER_BOXCAR           0       // Running-sum moving average
+#define FILTER_CIC              1       // CIC decimator
+#define FILTER_IIR              2       // First-order low-pass
+#define FILTER_FRAC_BITS        8       // Output is ADC codes in Q8
+#ifndef ADC_FILTER_TYPE
+#define ADC_FILTER_TYPE         FILTER_BOXCAR
+#endif
+#ifndef ADC_FILTER_LENGTH
+#define ADC_FILTER_LENGTH       ADC_SAMPLES_PER_AVG // Window, decimation or IIR shift
+#endif
 
 // PWM Configuration
 #define PWM_FREQUENCY_HZ    100         // 100 Hz PWM frequency
@@ -27,9 +44,65 @@
 #define MOTOR_SPEED_OFF     0           // Motor off
 
 // Controller Configuration
-#define CONTROLLER_UPDATE_RATE_HZ   100     // 100 Hz (10ms updates)
+// The control thread runs once per uDMA block, so the rate sets the block
+// size; it must divide ADC_SAMPLE_RATE_HZ (100 Hz - 1 kHz)
+#ifndef CONTROLLER_UPDATE_RATE_HZ
+#define CONTROLLER_UPDATE_RATE_HZ   1000    // 1 kHz (1ms updates)
+#endif
 #define CONTROLLER_TARGET_ERROR     15      // ±15 RPM target error
 
+// Autotune Status (see autotune.c)
+#define AUTOTUNE_IDLE           0       // No experiment since reset
+#define AUTOTUNE_RUNNING        1       // Relay experiment in progress
+#define AUTOTUNE_DONE           2       // Gains measured and in use
+#define AUTOTUNE_FAILED         3       // Timed out, overspeed or stopped
+
+// Voltage to RPM Table (see Voltage2RPM.c)
+#define V2RPM_SHIFT             9       // Table points every 2^9 = 512mV
+#define V2RPM_STEP_MV           (1 << V2RPM_SHIFT)
+#define V2RPM_POINTS            21      // 0 - 10240mV, the ADC's ±10V range
+#define V2RPM_MAX_MV            ((V2RPM_POINTS - 1) * V2RPM_STEP_MV)
+
+// Calibration Sweep (see calibrate.c)
+#define CALIBRATE_POINTS        7       // Duties measured, 18% - 90%
+#define CALIBRATE_IDLE          0       // No sweep since reset
+#define CALIBRATE_RUNNING       1       // Settling or measuring a point
+#define CALIBRATE_WAITING       2       // Waiting for the reference speed
+#define CALIBRATE_DONE          3       // New table in use
+#define CALIBRATE_FAILED        4       // Stopped, or the points did not rise
+
+// Flash Storage Configuration (see storage.c)
+// 1: tuned gains, the calibration table and telemetry logs are kept in
+//    flash through the Simple_File_System file system, which file_system.c
+//    builds into the project with the settings below; 0: nothing is stored
+//    (the host benchmarks, built without the file system)
+#ifndef MOTOR_FLASH_STORAGE
+#define MOTOR_FLASH_STORAGE     1
+#endif
+#if MOTOR_FLASH_STORAGE
+#ifndef FS_THREAD_SAFE
+#define FS_THREAD_SAFE          1       // Several threads share the file system
+#endif
+#ifndef FS_PACK_CHANNELS
+#define FS_PACK_CHANNELS        TELEMETRY_CHANNELS  // Telemetry log records
+#endif
+#ifndef STACKSIZE
+#define STACKSIZE               256     // Words per thread (os_v2.c): file system calls nest deep
+#endif
+#endif
+#define STORAGE_SUCCESS         0x00    // Operation successful
+#define STORAGE_ERROR           0xFF    // Operation failed
+#define STORAGE_BUSY            0x01    // Refused while erases are held (Storage_Hold)
+#define STORAGE_MAX_RECORD      64      // Largest record (bytes)
+#define STORAGE_TAG_GAINS       0x4E494147  // "GAIN": Kp, Ki, Kd, update rate
+#define STORAGE_TAG_CAL         0x204C4143  // "CAL ": voltage to RPM table
+
+// Telemetry Log (see telemetry.c)
+#define TELEMETRY_CHANNELS      5       // Target, speed, error, I term, duty
+#define TELEMETRY_IDLE          0       // Not recording
+#define TELEMETRY_RECORDING     1       // Logging every update
+#define TELEMETRY_FAILED        2       // Could not start, or the disk filled
+
 // Display Configuration
 #define LCD_UPDATE_RATE_HZ      1           // 1 Hz (1 second updates)
 #define LCD_ROWS                2           // 2-line LCD
@@ -43,18 +116,67 @@
 
 //******** ADC Interface (adc_interface.c) ************
 
-// Initialize ADS7806 interface and Timer0A
+// Initialize ADS7806 interface, SSI0, uDMA and Timer0A
 void ADC_Init(void);
 
 // Start periodic ADC sampling
 void ADC_Start_Sampling(void);
 
-// Get averaged voltage in millivolts
+// Get filtered voltage in millivolts
 int32_t ADC_Get_Average_Voltage(void);
 
 // Check if new average is ready
 uint8_t ADC_Average_Ready(void);
 
+// Get CPU time spent acquiring samples (tenths of a percent)
+uint32_t ADC_Get_ISR_Load(void);
+
+// Get number of averages replaced before they were read
+uint32_t ADC_Get_Lost_Blocks(void);
+
+// Get peak-to-peak voltage within the last block in millivolts
+int32_t ADC_Get_Ripple(void);
+
+// Get core cycle count when the latest block finished
+uint32_t ADC_Get_Block_Time(void);
+
+
+//******** Sample Filter (filter.c) ************
+
+// Select filter type and window/decimation/shift, clear its state
+void Filter_Init(uint8_t type, uint32_t length);
+
+// Feed one ADC code; returns 1 when a new output is available
+uint8_t Filter_Put(int32_t sample);
+
+// Get latest filtered ADC code (Q8)
+int32_t Filter_Output(void);
+
+
+//******** DSP Kernels (dsp.c) ************
+
+// Sum of n samples
+int32_t DSP_Sum(const int16_t *x, uint32_t n);
+
+// Sum of x[i]*h[i] over n samples
+int32_t DSP_Dot(const int16_t *x, const int16_t *h, uint32_t n);
+
+// FIR filter: y[i] = (sum of x[i+k]*h[k]) >> shift, saturated; returns outputs
+uint32_t DSP_FIR(const int16_t *x, uint32_t n, const int16_t *h, uint32_t taps,
+                 uint8_t shift, int16_t *y);
+
+// Sum each group of factor samples; returns outputs
+uint32_t DSP_Decimate(const int16_t *x, uint32_t n, uint32_t factor, int32_t *y);
+
+// Smallest and largest of n samples (n >= 1)
+void DSP_MinMax(const int16_t *x, uint32_t n, int16_t *min, int16_t *max);
+
+// Root mean square of n samples
+uint32_t DSP_RMS(const int16_t *x, uint32_t n);
+
+// Widen 12-bit two's complement codes to int16_t (codes * 16) in place
+void DSP_Extend12(uint16_t *x, uint32_t n);
+
 
 //******** PWM Control (pwm_control.c) ************
 
@@ -79,19 +201,31 @@ void PWM_Stop(void);
 
 //******** Controller (controller.c) ************
 
+// Response to the latest target change (Controller_GetStepMetrics)
+typedef struct {
+    int32_t target;             // Target of the step (RPM)
+    int32_t start_rpm;          // Speed when it was set
+    uint32_t rise_ms;           // 10% to 90% of the step (valid once risen)
+    uint32_t settle_ms;         // Until inside ±15 RPM for good (valid once settled)
+    int32_t overshoot_rpm;      // Largest excursion past the target
+    int32_t steady_error;       // Mean error since settling (RPM)
+    uint8_t risen;              // 90% of the step reached
+    uint8_t settled;            // Inside ±15 RPM for 0.5s
+} Controller_Step_t;
+
 // Initialize controller state
 void Controller_Init(void);
 
-// Update controller (called every 10ms)
+// Update controller (called every update)
 void Controller_Update(int32_t target_rpm, int32_t current_rpm);
 
 // Get current error value (for debugging)
 int32_t Controller_GetError(void);
 
-// Get integral term (for debugging)
+// Get integral term in tenths of percent duty (for debugging)
 int32_t Controller_GetIntegral(void);
 
-// Get derivative term (for debugging)
+// Get measured speed change per update (for debugging)
 int32_t Controller_GetDerivative(void);
 
 // Reset integral term
@@ -100,14 +234,132 @@ void Controller_ResetIntegral(void);
 // Get controller statistics
 uint32_t Controller_GetStatistics(void);
 
+// Set PID gains (Q16, 65536 = 1.0)
+void Controller_SetGains(int32_t kp, int32_t ki, int32_t kd);
+
+// Get PID gains (Q16)
+void Controller_GetGains(int32_t *kp, int32_t *ki, int32_t *kd);
+
+// Get feedforward duty (tenths of percent) for a target speed
+int32_t Controller_Feedforward(int32_t target_rpm);
+
+// Get response metrics of the latest target change
+void Controller_GetStepMetrics(Controller_Step_t *metrics);
+
+// Save the PID gains in use to flash (from a thread)
+uint8_t Controller_SaveGains(void);
+
+// Load saved PID gains from flash and use them (from a thread)
+uint8_t Controller_LoadGains(void);
+
+
+//******** Autotune (autotune.c) ************
+
+// Result of a relay experiment (Autotune_GetResult)
+typedef struct {
+    int32_t ku;                 // Ultimate gain (Q16 duty per RPM)
+    uint32_t tu_ms;             // Ultimate period
+    int32_t amplitude_rpm;      // Speed oscillation amplitude
+    uint32_t tau_ms;            // Fitted motor lag
+    uint32_t dead_ms;           // Fitted loop dead time
+    int32_t kp, ki, kd;         // Gains set (Q16)
+} Autotune_Result_t;
+
+// Start a relay experiment at a speed (0 = default speed)
+void Autotune_Start(int32_t target_rpm);
+
+// Abandon a running experiment
+void Autotune_Stop(void);
+
+// Run one experiment step in place of Controller_Update (every update)
+uint8_t Autotune_Update(int32_t current_rpm);
+
+// Get experiment status (AUTOTUNE_x)
+uint8_t Autotune_Status(void);
+
+// Get measurements and gains of the last tune
+void Autotune_GetResult(Autotune_Result_t *result);
+
+
+//******** Calibration (calibrate.c) ************
+
+// Start a voltage to RPM calibration sweep
+void Calibrate_Start(void);
+
+// Abandon a running sweep
+void Calibrate_Stop(void);
+
+// Run one sweep step in place of Controller_Update (every update)
+uint8_t Calibrate_Update(int32_t voltage_mV);
+
+// Give the reference speed at the waiting point (0 = keep the estimate)
+uint8_t Calibrate_Reference(int32_t rpm);
+
+// Get sweep status (CALIBRATE_x)
+uint8_t Calibrate_Status(void);
+
+// Get the point being measured
+uint8_t Calibrate_Point(void);
+
+
+//******** Flash Storage (storage.c) ************
+
+// Mount the file system and open the settings file (from a thread)
+uint8_t Storage_Init(void);
+
+// Save a record under a tag, replacing earlier ones
+uint8_t Storage_Save(uint32_t tag, const void *data, uint16_t length);
+
+// Load the latest record saved under a tag
+uint8_t Storage_Load(uint32_t tag, void *data, uint16_t length);
+
+// Create a new compressed log file of records of int32 channels
+uint8_t Storage_Log_Start(uint8_t channels);
+
+// Append whole records to the log
+uint8_t Storage_Log_Write(const int32_t *values, uint16_t count);
+
+// Commit the log as written so far
+uint8_t Storage_Log_Sync(void);
+
+// Close and commit the log
+uint8_t Storage_Log_Stop(void);
+
+// One step of background erase or write-back (low-priority thread)
+uint8_t Storage_Background(void);
+
+// Hold flash erases off while the motor runs (1), or let them go on (0)
+void Storage_Hold(uint8_t hold);
+
+
+//******** Telemetry (telemetry.c) ************
+
+// Queue one update's record (control thread, never waits)
+void Telemetry_Put(int32_t target, int32_t rpm, int32_t error, int32_t integral, uint16_t duty);
+
+// Start recording to a new log
+void Telemetry_Start(void);
+
+// Stop recording and close the log
+void Telemetry_Stop(void);
+
+// Get recording status (TELEMETRY_x)
+uint8_t Telemetry_Status(void);
+
+// Get records logged in this log and dropped since reset
+void Telemetry_GetCounts(uint32_t *logged, uint32_t *dropped);
+
+// Drain thread: writes queued records to flash
+void Telemetry_Thread(void);
+
 
 //******** RTOS Functions (os_v2.c) ************
 
 // Initialize operating system
 void OS_Init(void);
 
-// Add threads to scheduler
-int OS_AddThreads(void(*task0)(void), void(*task1)(void));
+// Add a thread to the scheduler (priority 0 is highest)
+int OS_AddThread(void(*task)(void), uint8_t priority);
 
 // Launch RTOS with specified timeslice
 void OS_Launch(uint32_t theTimeSlice);
@@ -169,20 +421,32 @@ void Hex2ASCII(uint8_t *ascii_array, uint16_t hex_value);
 // Convert motor voltage (mV) to RPM
 int32_t Current_speed(int32_t Avg_volt);
 
+// Use a new conversion table (V2RPM_POINTS speeds, from a thread)
+void Voltage2RPM_SetTable(const int16_t *table);
+
+// Get the conversion table in use
+void Voltage2RPM_GetTable(int16_t *table);
+
+// Save the conversion table in use to flash (from a thread)
+uint8_t Voltage2RPM_Save(void);
+
+// Load the saved conversion table and use it (from a thread)
+uint8_t Voltage2RPM_Load(void);
+
 
 //******** Pin Assignments ************
 
 /*
  * PORT A:
- *   PA2-PA5: Reserved for potential SSI0 use
+ *   PA2: SSI0Clk <- DATACLK (data clock from ADS7806)
+ *   PA3: SSI0Fss <- BUSY (conversion status from ADS7806)
+ *   PA4: SSI0Rx  <- SDATA (serial data from ADS7806)
+ *   PA5: SSI0Tx (unused)
  * 
  * PORT B:
  *   PB0: Motor Direction 0
  *   PB1: Motor Direction 1
- *   PB4: SDATA (serial data input from ADS7806)
- *   PB5: DATACLK (optional, if using external clock mode)
- *   PB6: R/C (Read/Convert control to ADS7806)
- *   PB7: BUSY (conversion status from ADS7806)
+ *   PB6: T0CCP0 -> R/C (Read/Convert control to ADS7806)
  * 
  * PORT C:
  *   PC4-PC7: Keypad columns (assumed from Keypad.s)
@@ -0,0 +1,234 @@
+// telemetry.c
+// Per-update controller log, recorded to flash for offline replay
+// Control_Thread hands every update's target, speed, error, I term and
+// duty to Telemetry_Put(); Telemetry_Thread, at the lowest priority,
+// drains them to a log file (storage.c) a batch at a time.
+//
+// The two meet in a ring with one writer per index: only Telemetry_Put()
+// advances Put_Index and only the drain advances Get_Index, both free
+// running, so neither ever waits or masks interrupts. A full ring (the
+// drain asleep longer than the ring lasts) drops the record and counts
+// it; the next record that fits carries the count and goes into the log
+// after a gap record, so replay knows where time jumps.
+//
+// Flash is never erased while the motor runs (Storage_Hold): an erase
+// stalls every fetch from flash for some 10ms, Control_Thread and the
+// SSI0 interrupt as much as this thread. A recording made meanwhile goes
+// into sectors erased beforehand, which Storage_Background() prepares
+// whenever this thread is idle and the motor is stopped; once the log
+// needs an erase the drain sleeps until the motor stops, and the records
+// of that stretch are dropped and show up as one gap. Programming a
+// sector only stalls fetches for a write-buffer load, which the control
+// loop and the ADC ride through.
+//
+// Log file (delta mode, TELEMETRY_CHANNELS int32 values per record):
+//   TELEMETRY_MAGIC, update rate (Hz), TELEMETRY_CHANNELS, 0, 0
+//   target, speed, error, I term, duty       one per update
+//   TELEMETRY_GAP, records dropped, 0, 0, 0  where records were lost
+// Speeds in RPM, I term and duty in tenths of percent. Steady running
+// codes to about 3 bytes per update, so at 1 kHz the disk (some 128KB)
+// holds well under a minute: a recording is for a tuning session or an
+// incident, started and stopped from the keypad ('D'), and replaces the
+// last one. A full disk ends it with what fitted kept.
+
+#include <stdint.h>
+
+#include "system.h"
+
+#define TELEMETRY_RING_SIZE     256     // Records, a power of two: 256ms at 1 kHz
+#define TELEMETRY_BATCH         64      // Records written to the log at once
+#define TELEMETRY_POLL_TICKS    10      // Drain thread period: 20ms (2ms ticks)
+#define TELEMETRY_SYNC_BATCHES  16      // Log committed every ~1s of records
+
+#define TELEMETRY_MAGIC         0x4D4C4554  // "TELM"
+#define TELEMETRY_GAP           (-1)        // Target of a gap record
+
+// One control update; gap is the number of records dropped just before it
+typedef struct {
+    int16_t target;
+    int16_t rpm;
+    int16_t error;
+    int16_t integral;
+    uint16_t duty;
+    uint16_t gap;
+} Telemetry_Record_t;
+
+static volatile Telemetry_Record_t Ring[TELEMETRY_RING_SIZE];
+static volatile uint32_t Put_Index = 0;     // Telemetry_Put only
+static volatile uint32_t Get_Index = 0;     // Telemetry_Thread only
+static uint16_t Gap = 0;                    // Telemetry_Put only: drops not yet logged
+
+static volatile uint8_t Requested = 0;      // Keypad: recording wanted
+static volatile uint8_t Recording = 0;      // Drain: log open, records taken
+static volatile uint8_t Failed = 0;         // Last recording could not start, filled the disk or was not committed
+static volatile uint32_t Logged = 0;        // Records handed to the current log
+static volatile uint32_t Dropped = 0;       // Records lost since reset
+
+// One batch as written to the log (Telemetry_Thread only; too big for its stack)
+static int32_t Batch[(TELEMETRY_BATCH + 1) * TELEMETRY_CHANNELS];
+
+//******** Telemetry_Put ************
+// Queue one update's record (Control_Thread only, never waits)
+// Ignored while no recording is running
+void Telemetry_Put(int32_t target, int32_t rpm, int32_t error, int32_t integral, uint16_t duty){
+    volatile Telemetry_Record_t *record;
+    uint32_t put = Put_Index;
+
+    if(!Recording){
+        Gap = 0;
+        return;
+    }
+    if(put - Get_Index >= TELEMETRY_RING_SIZE){
+        Dropped++;
+        if(Gap < 0xFFFF){
+            Gap++;
+        }
+        return;
+    }
+
+    record = &Ring[put & (TELEMETRY_RING_SIZE - 1)];
+    record->target = (int16_t)target;
+    record->rpm = (int16_t)rpm;
+    record->error = (int16_t)error;
+    record->integral = (int16_t)integral;
+    record->duty = duty;
+    record->gap = Gap;
+    Gap = 0;
+
+    Put_Index = put + 1;            // Published only once written
+}
+
+//******** Telemetry_Start ************
+// Ask the drain thread to open a new log and start recording
+void Telemetry_Start(void){
+    Failed = 0;
+    Requested = 1;
+}
+
+//******** Telemetry_Stop ************
+// Ask the drain thread to log what is queued and close the log
+void Telemetry_Stop(void){
+    Requested = 0;
+}
+
+//******** Telemetry_Status ************
+// Returns: TELEMETRY_RECORDING while records are being logged (or a
+//          start is pending), TELEMETRY_FAILED if the last recording
+//          could not start or ended on a full disk, else TELEMETRY_IDLE
+uint8_t Telemetry_Status(void){
+    if(Requested || Recording){
+        return TELEMETRY_RECORDING;
+    }
+    return Failed ? TELEMETRY_FAILED : TELEMETRY_IDLE;
+}
+
+//******** Telemetry_GetCounts ************
+// Output: *logged - records in the current (or last) log
+//         *dropped - records lost to a full ring since reset
+void Telemetry_GetCounts(uint32_t *logged, uint32_t *dropped){
+    *logged = Logged;
+    *dropped = Dropped;
+}
+
+//******** Telemetry_Write ************
+// Log the records queued now, up to one batch
+// Returns: STORAGE_SUCCESS, or STORAGE_ERROR on a full disk
+static uint8_t Telemetry_Write(void){
+    volatile Telemetry_Record_t *record;
+    uint32_t get = Get_Index;
+    uint32_t count = Put_Index - get;
+    uint32_t n = 0;
+    uint32_t i;
+
+    count = MIN(count, TELEMETRY_BATCH);
+    for(i = 0; i < count; i++){
+        record = &Ring[(get + i) & (TELEMETRY_RING_SIZE - 1)];
+
+        // A gap ahead of the first record only; later ones wait a batch
+        if(record->gap != 0){
+            if(i != 0){
+                break;
+            }
+            Batch[n++] = TELEMETRY_GAP;
+            Batch[n++] = record->gap;
+            Batch[n++] = 0;
+            Batch[n++] = 0;
+            Batch[n++] = 0;
+        }
+        Batch[n++] = record->target;
+        Batch[n++] = record->rpm;
+        Batch[n++] = record->error;
+        Batch[n++] = record->integral;
+        Batch[n++] = record->duty;
+    }
+    Get_Index = get + i;            // Slots free for Telemetry_Put again
+
+    if(n == 0){
+        return STORAGE_SUCCESS;
+    }
+    Logged += i;
+    return Storage_Log_Write(Batch, (uint16_t)n);
+}
+
+//******** Telemetry_Thread ************
+// Lowest priority: opens and closes logs as asked, drains the ring a
+// batch at a time, and erases flash ahead of the log while it waits and
+// the motor is stopped
+// Needs Storage_Init() done (by the display thread) before a start
+void Telemetry_Thread(void){
+    int32_t header[TELEMETRY_CHANNELS] = {TELEMETRY_MAGIC, CONTROLLER_UPDATE_RATE_HZ, TELEMETRY_CHANNELS, 0, 0};
+    uint32_t batches = 0;
+    uint8_t result;
+
+    while(1){
+        if(Requested && !Recording){
+            Logged = 0;
+            batches = 0;
+            if((Storage_Log_Start(TELEMETRY_CHANNELS) == STORAGE_SUCCESS) &&
+               (Storage_Log_Write(header, TELEMETRY_CHANNELS) == STORAGE_SUCCESS)){
+                Get_Index = Put_Index;  // Ring is empty: Telemetry_Put is idle
+                Recording = 1;
+            }
+            else{
+                Storage_Log_Stop();
+                Requested = 0;
+                Failed = 1;
+            }
+        }
+
+        if(Recording){
+            result = STORAGE_SUCCESS;
+
+            // Whole batches while recording; everything once stopping
+            while((result == STORAGE_SUCCESS) &&
+                  ((Put_Index - Get_Index >= TELEMETRY_BATCH) || (!Requested && (Put_Index != Get_Index)))){
+                result = Telemetry_Write();
+                batches++;
+                if((result == STORAGE_SUCCESS) && ((batches % TELEMETRY_SYNC_BATCHES) == 0)){
+                    result = Storage_Log_Sync();
+                }
+            }
+
+            if(result != STORAGE_SUCCESS){
+                Requested = 0;
+                Failed = 1;
+            }
+            if(!Requested){
+                Recording = 0;          // Telemetry_Put stops taking records
+                while((result == STORAGE_SUCCESS) && (Put_Index != Get_Index)){
+                    result = Telemetry_Write();
+                }
+                Get_Index = Put_Index;
+                if(Storage_Log_Stop() != STORAGE_SUCCESS){
+                    Failed = 1;         // The log did not all reach flash
+                }
+            }
+        }
+
+        // Nothing to log: get flash erased before the next batch needs it
+        if((Put_Index - Get_Index < TELEMETRY_BATCH) && (Storage_Background() == STORAGE_SUCCESS)){
+            continue;
+        }
+        OS_Sleep(TELEMETRY_POLL_TICKS);
+    }
+}
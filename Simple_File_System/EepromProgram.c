@@ -0,0 +1,91 @@
+// EepromProgram.c
+// Runs on LM4F120/TM4C123
+// Provide functions that initialize the on-chip EEPROM and read
+// and write it one 32-bit word at a time.
+// The EEPROM is 32 blocks of 16 words. A word is addressed by
+// its block (EEBLOCK) and offset in the block (EEOFFSET) and
+// then read or written through EERDWR; a write keeps the module
+// busy (EEDONE) until the word is stored.
+
+#include <stdint.h>
+#include "EepromProgram.h"
+
+#define EEPROM_EESIZE_R         (*((volatile uint32_t *)0x400AF000))
+#define EEPROM_EESIZE_WORDCNT_M 0x0000FFFF  // Number of 32-Bit Words
+#define EEPROM_EEBLOCK_R        (*((volatile uint32_t *)0x400AF004))
+#define EEPROM_EEOFFSET_R       (*((volatile uint32_t *)0x400AF008))
+#define EEPROM_EERDWR_R         (*((volatile uint32_t *)0x400AF010))
+#define EEPROM_EEDONE_R         (*((volatile uint32_t *)0x400AF018))
+#define EEPROM_EEDONE_INVPL     0x00000100  // Invalid Program Voltage Level
+#define EEPROM_EEDONE_NOPERM    0x00000010  // Write Without Permission
+#define EEPROM_EEDONE_WORKING   0x00000001  // EEPROM Working
+#define EEPROM_EESUPP_R         (*((volatile uint32_t *)0x400AF01C))
+#define EEPROM_EESUPP_PRETRY    0x00000008  // Programming Must Be Retried
+#define EEPROM_EESUPP_ERETRY    0x00000004  // Erase Must Be Retried
+#define SYSCTL_SREEPROM_R       (*((volatile uint32_t *)0x400FE558))
+#define SYSCTL_RCGCEEPROM_R     (*((volatile uint32_t *)0x400FE658))
+#define SYSCTL_PREEPROM_R       (*((volatile uint32_t *)0x400FEA58))
+
+#define EEPROM_BLOCK_WORDS      16U
+
+// wait for the module to finish; nonzero if the last
+// operation needs to be retried
+static int WaitDone(void){
+  while(EEPROM_EEDONE_R&EEPROM_EEDONE_WORKING){};
+  return EEPROM_EESUPP_R&(EEPROM_EESUPP_PRETRY|EEPROM_EESUPP_ERETRY);
+}
+
+//------------Eeprom_Init------------
+// Turn on the EEPROM module and run its recovery sequence.
+// Input: none
+// Output: 'NOERROR' if the module is usable, 'ERROR' if not
+int Eeprom_Init(void){
+  SYSCTL_RCGCEEPROM_R = 0x01;           // activate clock for EEPROM
+  while((SYSCTL_PREEPROM_R&0x01) == 0){};
+  // an operation interrupted by a reset is finished first
+  if(WaitDone()){
+    return ERROR;
+  }
+  SYSCTL_SREEPROM_R = 0x01;             // reset the module
+  SYSCTL_SREEPROM_R = 0x00;
+  while((SYSCTL_PREEPROM_R&0x01) == 0){};
+  if(WaitDone()){
+    return ERROR;
+  }
+  return NOERROR;
+}
+
+//------------Eeprom_Words------------
+// Size of the EEPROM.
+// Input: none
+// Output: number of 32-bit words (512 on the TM4C123)
+uint32_t Eeprom_Words(void){
+  return EEPROM_EESIZE_R&EEPROM_EESIZE_WORDCNT_M;
+}
+
+//------------Eeprom_Read------------
+// Read one word.
+// Input: word index of the word, 0 to Eeprom_Words()-1
+// Output: its value
+uint32_t Eeprom_Read(uint32_t word){
+  EEPROM_EEBLOCK_R = word/EEPROM_BLOCK_WORDS;
+  EEPROM_EEOFFSET_R = word%EEPROM_BLOCK_WORDS;
+  return EEPROM_EERDWR_R;
+}
+
+//------------Eeprom_Write------------
+// Write one word and wait until it is stored.
+// Input: word index of the word, 0 to Eeprom_Words()-1
+//        data 32-bit value
+// Output: 'NOERROR' if successful, 'ERROR' if fail
+// Note: a write takes on the order of 100 usec, longer when
+//       the module has to copy a block; interrupts stay enabled
+int Eeprom_Write(uint32_t word, uint32_t data){
+  EEPROM_EEBLOCK_R = word/EEPROM_BLOCK_WORDS;
+  EEPROM_EEOFFSET_R = word%EEPROM_BLOCK_WORDS;
+  EEPROM_EERDWR_R = data;
+  if(WaitDone() || (EEPROM_EEDONE_R&(EEPROM_EEDONE_INVPL|EEPROM_EEDONE_NOPERM))){
+    return ERROR;
+  }
+  return NOERROR;
+}
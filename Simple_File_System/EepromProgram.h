@@ -0,0 +1,45 @@
+// EepromProgram.h
+// Runs on LM4F120/TM4C123
+// Provide functions that initialize the on-chip EEPROM and read
+// and write it one 32-bit word at a time. Unlike flash, a word
+// can be rewritten with any value without an erase; the module
+// spreads its own wear over the 2 KB.
+
+#ifndef __EEPROMPROGRAM_H__
+#define __EEPROMPROGRAM_H__
+
+#include <stdint.h>
+
+#ifndef ERROR
+#define ERROR                   1           // Value returned if failure
+#define NOERROR                 0           // Value returned if success
+#endif
+
+//------------Eeprom_Init------------
+// Turn on the EEPROM module and run its recovery sequence.
+// Input: none
+// Output: 'NOERROR' if the module is usable, 'ERROR' if not
+int Eeprom_Init(void);
+
+//------------Eeprom_Words------------
+// Size of the EEPROM.
+// Input: none
+// Output: number of 32-bit words (512 on the TM4C123)
+uint32_t Eeprom_Words(void);
+
+//------------Eeprom_Read------------
+// Read one word.
+// Input: word index of the word, 0 to Eeprom_Words()-1
+// Output: its value
+uint32_t Eeprom_Read(uint32_t word);
+
+//------------Eeprom_Write------------
+// Write one word and wait until it is stored.
+// Input: word index of the word, 0 to Eeprom_Words()-1
+//        data 32-bit value
+// Output: 'NOERROR' if successful, 'ERROR' if fail
+// Note: a write takes on the order of 100 usec, longer when
+//       the module has to copy a block; interrupts stay enabled
+int Eeprom_Write(uint32_t word, uint32_t data);
+
+#endif // __EEPROMPROGRAM_H__
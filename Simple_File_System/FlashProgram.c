@@ -5,6 +5,11 @@
 // and erase a 1 KB block.
 // Daniel Valvano
 // May 3, 2015
+// Writes and erases can also be queued and carried out from the
+// flash controller interrupt (Flash_WriteStart, Flash_EraseStart).
+// None of the functions leaves interrupts disabled while the
+// controller works; they only keep them off for the few register
+// writes that start an operation.
 
 /* This example accompanies the book
    "Embedded Systems: Real Time Interfacing to Arm Cortex M Microcontrollers",
@@ -36,11 +41,19 @@
 #define FLASH_FMC_MERASE        0x00000004  // Mass Erase Flash Memory
 #define FLASH_FMC_ERASE         0x00000002  // Erase a Page of Flash Memory
 #define FLASH_FMC_WRITE         0x00000001  // Write a Word into Flash Memory
+#define FLASH_FCIM_R            (*((volatile uint32_t *)0x400FD010))
+#define FLASH_FCIM_PMASK        0x00000002  // Programming Interrupt Mask
+#define FLASH_FCMISC_R          (*((volatile uint32_t *)0x400FD014))
+#define FLASH_FCMISC_PMISC      0x00000002  // Programming Masked Interrupt
+                                            // Status and Clear
 #define FLASH_FMC2_R            (*((volatile uint32_t *)0x400FD020))
 #define FLASH_FMC2_WRBUF        0x00000001  // Buffered Flash Memory Write
 #define FLASH_FWBN_R            (*((volatile uint32_t *)0x400FD100))
 #define FLASH_BOOTCFG_R         (*((volatile uint32_t *)0x400FE1D0))
 #define FLASH_BOOTCFG_KEY       0x00000010  // KEY Select
+#define NVIC_EN0_R              (*((volatile uint32_t *)0xE000E100))
+#define NVIC_PRI7_R             (*((volatile uint32_t *)0xE000E41C))
+#define NVIC_EN0_FLASH          0x20000000  // Flash controller is IRQ 29
 
 void DisableInterrupts(void); // Disable interrupts
 void EnableInterrupts(void);  // Enable interrupts
@@ -48,6 +61,22 @@ long StartCritical (void);    // previous I bit, disable interrupts
 void EndCritical(long sr);    // restore I bit to previous value
 void WaitForInterrupt(void);  // low power mode
 
+// Queued operation, carried out from FlashCtl_Handler
+struct FlashRequest{
+  const uint32_t *source;     // words to write, 0 for an erase
+  uint32_t addr;              // next address to write or erase
+  uint16_t count;             // words still to write
+  void *tag;                  // passed to FlashDoneTask when finished
+};
+typedef struct FlashRequest FlashRequestType;
+
+static FlashRequestType Queue[FLASH_QUEUE_SIZE];
+static uint32_t QueueHead;    // oldest request, the one in progress
+static uint32_t QueueCount;
+static uint16_t InFlight;     // words (or 1 erase) the controller is doing for
+                              // Queue[QueueHead], 0 if none
+static void (*FlashDoneTask)(void *tag);  // called as each request finishes
+
 // Check if address offset is valid for write operation
 // Writing addresses must be 4-byte aligned and within range
 static int WriteAddrValid(uint32_t addr){
@@ -69,6 +98,83 @@ static int EraseAddrValid(uint32_t addr){
   // must be 1 KB aligned
   return (((addr % 1024) == 0) && (addr <= FLASH_FMA_OFFSET_MAX));
 }
+// Write key for FLASH_FMC_R and FLASH_FMC2_R
+static uint32_t FlashKey(void){
+  if(FLASH_BOOTCFG_R&FLASH_BOOTCFG_KEY){            // by default, the key is 0xA442
+    return FLASH_FMC_WRKEY;
+  }                                                 // otherwise, the key is 0x71D5
+  return FLASH_FMC_WRKEY2;
+}
+// Check if the controller itself is programming or erasing
+static int HardwareBusy(void){
+  return ((FLASH_FMC_R&(FLASH_FMC_WRITE|FLASH_FMC_ERASE|FLASH_FMC_MERASE)) ||
+          (FLASH_FMC2_R&FLASH_FMC2_WRBUF));
+}
+// Wait until the controller is idle and nothing is queued, then
+// return with interrupts disabled so the caller can start its operation
+static long Claim(void){
+  long sr;
+  while(1){
+    sr = StartCritical();
+    if((QueueCount == 0) && !HardwareBusy()){
+      return sr;
+    }
+    EndCritical(sr);          // let FlashCtl_Handler drain the queue
+  }
+}
+// Start the next piece of the oldest request: an erase, a buffered
+// write of the words that fall in the current 32-word (128-byte)
+// window, or a single word.  The controller only programs the
+// buffer registers written since the last buffered write, so the
+// window need not be filled from its start.
+// Called with interrupts disabled and the controller idle.
+static void StartNext(void){
+  FlashRequestType *req = &Queue[QueueHead];
+  uint32_t volatile *FLASH_FWBn_R = (uint32_t volatile*)0x400FD100;
+  uint16_t first;
+  if(QueueCount == 0){
+    return;
+  }
+  if(req->source == 0){
+    InFlight = 1;
+    FLASH_FMA_R = req->addr;
+    FLASH_FMC_R = (FlashKey()|FLASH_FMC_ERASE);     // start erasing 1 KB block
+  } else if(req->count > 1){
+    first = (req->addr/4)%32;
+    InFlight = 0;
+    while((first + InFlight < 32) && (InFlight < req->count)){
+      FLASH_FWBn_R[first + InFlight] = req->source[InFlight];
+      InFlight = InFlight + 1;
+    }
+    FLASH_FMA_R = req->addr&~0x7F;                  // window start
+    FLASH_FMC2_R = (FlashKey()|FLASH_FMC2_WRBUF);   // start buffered write
+  } else{
+    InFlight = 1;
+    FLASH_FMD_R = req->source[0];
+    FLASH_FMA_R = req->addr;
+    FLASH_FMC_R = (FlashKey()|FLASH_FMC_WRITE);     // start writing one word
+  }
+}
+// Add a request; starts it at once if the controller is free
+static int Enqueue(const uint32_t *source, uint32_t addr, uint16_t count, void *tag){
+  FlashRequestType *req;
+  long sr = StartCritical();
+  if(QueueCount == FLASH_QUEUE_SIZE){
+    EndCritical(sr);
+    return ERROR;
+  }
+  req = &Queue[(QueueHead + QueueCount) % FLASH_QUEUE_SIZE];
+  req->source = source;
+  req->addr = addr;
+  req->count = count;
+  req->tag = tag;
+  QueueCount = QueueCount + 1;
+  if((QueueCount == 1) && !HardwareBusy()){
+    StartNext();              // otherwise the next completion starts it
+  }
+  EndCritical(sr);
+  return NOERROR;
+}
 
 //------------Flash_Init------------
 // This function was critical to the write and erase
@@ -92,29 +198,19 @@ void Flash_Init(uint8_t systemClockFreqMHz){
 // Input: addr 4-byte aligned flash memory address to write
 //        data 32-bit data
 // Output: 'NOERROR' if successful, 'ERROR' if fail (defined in FlashProgram.h)
-// Note: disables interrupts while writing
+// Note: waits for queued operations first; interrupts stay
+//       enabled while the word is programmed
 int Flash_Write(uint32_t addr, uint32_t data){
-  uint32_t flashkey;
+  long sr;
   if(WriteAddrValid(addr)){
-    DisableInterrupts();                            // may be optional step
-                                                    // wait for hardware idle
-    while(FLASH_FMC_R&(FLASH_FMC_WRITE|FLASH_FMC_ERASE|FLASH_FMC_MERASE)){
-                 // to do later: return ERROR if this takes too long
-                 // remember to re-enable interrupts
-    };
+    sr = Claim();                                   // wait for hardware idle
     FLASH_FMD_R = data;
     FLASH_FMA_R = addr;
-    if(FLASH_BOOTCFG_R&FLASH_BOOTCFG_KEY){          // by default, the key is 0xA442
-      flashkey = FLASH_FMC_WRKEY;
-    } else{                                         // otherwise, the key is 0x71D5
-      flashkey = FLASH_FMC_WRKEY2;
-    }
-    FLASH_FMC_R = (flashkey|FLASH_FMC_WRITE);       // start writing
+    FLASH_FMC_R = (FlashKey()|FLASH_FMC_WRITE);     // start writing
+    EndCritical(sr);
     while(FLASH_FMC_R&FLASH_FMC_WRITE){
                  // to do later: return ERROR if this takes too long
-                 // remember to re-enable interrupts
     };           // wait for completion (~3 to 4 usec)
-    EnableInterrupts();
     return NOERROR;
   }
   return ERROR;
@@ -127,7 +223,7 @@ int Flash_Write(uint32_t addr, uint32_t data){
 //        count  number of 32-bit writes
 // Output: number of successful writes; return value == count if completely successful
 // Note: at 80 MHz, it takes 678 usec to write 10 words
-// Note: disables interrupts while writing
+// Note: interrupts stay enabled while writing
 int Flash_WriteArray(uint32_t *source, uint32_t addr, uint16_t count){
   uint16_t successfulWrites = 0;
   while((successfulWrites < count) && (Flash_Write(addr + 4*successfulWrites, source[successfulWrites]) == NOERROR)){
@@ -145,33 +241,23 @@ int Flash_WriteArray(uint32_t *source, uint32_t addr, uint16_t count){
 //        count  number of 32-bit writes (<=32)
 // Output: number of successful writes; return value == count if completely successful
 // Note: at 80 MHz, it takes 335 usec to write 10 words
-// Note: disables interrupts while writing
+// Note: interrupts stay enabled while writing
 int Flash_FastWrite(uint32_t *source, uint32_t addr, uint16_t count){
-  uint32_t flashkey;
   uint32_t volatile *FLASH_FWBn_R = (uint32_t volatile*)0x400FD100;
   int writes = 0;
+  long sr;
   if(MassWriteAddrValid(addr)){
-    DisableInterrupts();                            // may be optional step
-    while(FLASH_FMC2_R&FLASH_FMC2_WRBUF){           // wait for hardware idle
-                 // to do later: return ERROR if this takes too long
-                 // remember to re-enable interrupts
-    };
+    sr = Claim();                                   // wait for hardware idle
     while((writes < 32) && (writes < count)){
       FLASH_FWBn_R[writes] = source[writes];
       writes = writes + 1;
     }
     FLASH_FMA_R = addr;
-    if(FLASH_BOOTCFG_R&FLASH_BOOTCFG_KEY){          // by default, the key is 0xA442
-      flashkey = FLASH_FMC_WRKEY;
-    } else{                                         // otherwise, the key is 0x71D5
-      flashkey = FLASH_FMC_WRKEY2;
-    }
-    FLASH_FMC2_R = (flashkey|FLASH_FMC2_WRBUF);     // start writing
+    FLASH_FMC2_R = (FlashKey()|FLASH_FMC2_WRBUF);   // start writing
+    EndCritical(sr);
     while(FLASH_FMC2_R&FLASH_FMC2_WRBUF){
                  // to do later: return ERROR if this takes too long
-                 // remember to re-enable interrupts
     };           // wait for completion (~3 to 4 usec)
-    EnableInterrupts();
   }
   return writes;
 }
@@ -180,29 +266,125 @@ int Flash_FastWrite(uint32_t *source, uint32_t addr, uint16_t count){
 // Erase 1 KB block of flash.
 // Input: addr 1-KB aligned flash memory address to erase
 // Output: 'NOERROR' if successful, 'ERROR' if fail (defined in FlashProgram.h)
-// Note: disables interrupts while erasing
+// Note: waits for queued operations first; interrupts stay
+//       enabled while erasing
 int Flash_Erase(uint32_t addr){
-  uint32_t flashkey;
+  long sr;
   if(EraseAddrValid(addr)){
-    DisableInterrupts();                            // may be optional step
-                                                    // wait for hardware idle
-    while(FLASH_FMC_R&(FLASH_FMC_WRITE|FLASH_FMC_ERASE|FLASH_FMC_MERASE)){
-                 // to do later: return ERROR if this takes too long
-                 // remember to re-enable interrupts
-    };
+    sr = Claim();                                   // wait for hardware idle
     FLASH_FMA_R = addr;
-    if(FLASH_BOOTCFG_R&FLASH_BOOTCFG_KEY){          // by default, the key is 0xA442
-      flashkey = FLASH_FMC_WRKEY;
-    } else{                                         // otherwise, the key is 0x71D5
-      flashkey = FLASH_FMC_WRKEY2;
-    }
-    FLASH_FMC_R = (flashkey|FLASH_FMC_ERASE);       // start erasing 1 KB block
+    FLASH_FMC_R = (FlashKey()|FLASH_FMC_ERASE);     // start erasing 1 KB block
+    EndCritical(sr);
     while(FLASH_FMC_R&FLASH_FMC_ERASE){
                  // to do later: return ERROR if this takes too long
-                 // remember to re-enable interrupts
     };           // wait for completion (~3 to 4 usec)
-    EnableInterrupts();
     return NOERROR;
   }
   return ERROR;
 }
+
+//------------Flash_EnableInterrupt------------
+// Arm the flash controller interrupt, which is requested
+// each time a program or erase operation finishes.  Queued
+// operations only advance once this has been called.
+// Input: task      function called from FlashCtl_Handler as each
+//                  queued request finishes, with that request's
+//                  tag (0 for none)
+//        priority  NVIC priority 0 (highest) to 7
+// Output: none
+void Flash_EnableInterrupt(void(*task)(void *tag), uint32_t priority){
+  long sr = StartCritical();
+  FlashDoneTask = task;
+  FLASH_FCMISC_R = FLASH_FCMISC_PMISC;              // clear a stale completion
+  FLASH_FCIM_R |= FLASH_FCIM_PMASK;                 // arm programming/erase done
+  NVIC_PRI7_R = (NVIC_PRI7_R&0xFFFF1FFF)|((priority&0x07)<<13); // bits 15-13
+  NVIC_EN0_R = NVIC_EN0_FLASH;                      // enable IRQ 29 in NVIC
+  EndCritical(sr);
+}
+
+//------------Flash_WriteStart------------
+// Queue an array of 32-bit data to be written to flash starting
+// at given address, and return without waiting.  The words are
+// programmed from the flash controller interrupt, up to 32 at a
+// time (one 128-byte window of the write buffer).
+// Input: source pointer to array of 32-bit data; must stay
+//               unchanged until the request finishes
+//        addr   4-byte aligned flash memory address to start writing
+//        count  number of 32-bit writes (>0)
+//        tag    passed to the task when the last word is written
+// Output: 'NOERROR' if queued, 'ERROR' if the address is bad or
+//         FLASH_QUEUE_SIZE requests are already waiting
+// Note: the processor stalls on any fetch from flash while a word
+//       or buffer is being programmed, so code that must keep
+//       running meanwhile has to execute from SRAM
+int Flash_WriteStart(const uint32_t *source, uint32_t addr, uint16_t count, void *tag){
+  if(WriteAddrValid(addr) && (source != 0) && (count > 0) &&
+     (addr + 4*(uint32_t)count - 1 <= FLASH_FMA_OFFSET_MAX)){
+    return Enqueue(source, addr, count, tag);
+  }
+  return ERROR;
+}
+
+//------------Flash_EraseStart------------
+// Queue an erase of a 1 KB block of flash and return without
+// waiting.
+// Input: addr 1-KB aligned flash memory address to erase
+//        tag  passed to the task when the erase finishes
+// Output: 'NOERROR' if queued, 'ERROR' if the address is bad or
+//         FLASH_QUEUE_SIZE requests are already waiting
+// Note: the processor stalls on any fetch from flash until the
+//       erase finishes (~10 ms), so code that must keep running
+//       meanwhile has to execute from SRAM
+int Flash_EraseStart(uint32_t addr, void *tag){
+  if(EraseAddrValid(addr)){
+    return Enqueue(0, addr, 1, tag);
+  }
+  return ERROR;
+}
+
+//------------Flash_Busy------------
+// Check whether a program or erase operation is in progress
+// or queued.
+// Input: none
+// Output: 1 if busy, 0 if idle
+int Flash_Busy(void){
+  if((QueueCount != 0) || HardwareBusy()){
+    return 1;
+  }
+  return 0;
+}
+
+//------------FlashCtl_Handler------------
+// Flash controller interrupt: a program or erase finished.
+// Advances the oldest queued request and starts the next piece.
+// Input: none
+// Output: none
+void FlashCtl_Handler(void){
+  FlashRequestType *req = &Queue[QueueHead];
+  void *tag = 0;
+  int finished = 0;
+  long sr;
+  FLASH_FCMISC_R = FLASH_FCMISC_PMISC;              // acknowledge
+  sr = StartCritical();                             // Enqueue() may preempt otherwise
+  if(InFlight){                                     // else a blocking call finished
+    if(req->source){
+      req->source = req->source + InFlight;
+      req->addr = req->addr + 4*InFlight;
+    }
+    req->count = req->count - InFlight;
+    InFlight = 0;
+    if(req->count == 0){
+      tag = req->tag;                               // the slot may be reused at once
+      finished = 1;
+      QueueHead = (QueueHead + 1) % FLASH_QUEUE_SIZE;
+      QueueCount = QueueCount - 1;
+    }
+  }
+  if(!HardwareBusy()){
+    StartNext();
+  }
+  EndCritical(sr);
+  if(finished && FlashDoneTask){
+    (*FlashDoneTask)(tag);
+  }
+}
@@ -5,6 +5,8 @@
 // and erase a 1 KB block.
 // Daniel Valvano
 // October 21, 2014
+// Writes and erases can also be queued and carried out from the
+// flash controller interrupt (Flash_WriteStart, Flash_EraseStart).
 
 /* This example accompanies the book
    "Embedded Systems: Real Time Interfacing to Arm Cortex M Microcontrollers",
@@ -45,7 +47,8 @@ void Flash_Init(uint8_t systemClockFreqMHz);
 // Input: addr 4-byte aligned flash memory address to write
 //        data 32-bit data
 // Output: 'NOERROR' if successful, 'ERROR' if fail (defined in FlashProgram.h)
-// Note: disables interrupts while writing
+// Note: waits for queued operations first; interrupts stay
+//       enabled while the word is programmed
 int Flash_Write(uint32_t addr, uint32_t data);
 
 //------------Flash_WriteArray------------
@@ -55,7 +58,7 @@ int Flash_Write(uint32_t addr, uint32_t data);
 //        count  number of 32-bit writes
 // Output: number of successful writes; return value == count if completely successful
 // Note: at 80 MHz, it takes 678 usec to write 10 words
-// Note: disables interrupts while writing
+// Note: interrupts stay enabled while writing
 int Flash_WriteArray(uint32_t *source, uint32_t addr, uint16_t count);
 
 //------------Flash_FastWrite------------
@@ -67,12 +70,65 @@ int Flash_WriteArray(uint32_t *source, uint32_t addr, uint16_t count);
 //        count  number of 32-bit writes (<=32)
 // Output: number of successful writes; return value == count if completely successful
 // Note: at 80 MHz, it takes 335 usec to write 10 words
-// Note: disables interrupts while writing
+// Note: interrupts stay enabled while writing
 int Flash_FastWrite(uint32_t *source, uint32_t addr, uint16_t count);
 
 //------------Flash_Erase------------
 // Erase 1 KB block of flash.
 // Input: addr 1-KB aligned flash memory address to erase
 // Output: 'NOERROR' if successful, 'ERROR' if fail (defined in FlashProgram.h)
-// Note: disables interrupts while erasing
+// Note: waits for queued operations first; interrupts stay
+//       enabled while erasing
 int Flash_Erase(uint32_t addr);
+
+// Requests Flash_WriteStart() and Flash_EraseStart() can queue
+#ifndef FLASH_QUEUE_SIZE
+#define FLASH_QUEUE_SIZE        4
+#endif
+
+//------------Flash_EnableInterrupt------------
+// Arm the flash controller interrupt, which is requested
+// each time a program or erase operation finishes.  Queued
+// operations only advance once this has been called.
+// Input: task      function called from FlashCtl_Handler as each
+//                  queued request finishes, with that request's
+//                  tag (0 for none)
+//        priority  NVIC priority 0 (highest) to 7
+// Output: none
+void Flash_EnableInterrupt(void(*task)(void *tag), uint32_t priority);
+
+//------------Flash_WriteStart------------
+// Queue an array of 32-bit data to be written to flash starting
+// at given address, and return without waiting.  The words are
+// programmed from the flash controller interrupt, up to 32 at a
+// time (one 128-byte window of the write buffer).
+// Input: source pointer to array of 32-bit data; must stay
+//               unchanged until the request finishes
+//        addr   4-byte aligned flash memory address to start writing
+//        count  number of 32-bit writes (>0)
+//        tag    passed to the task when the last word is written
+// Output: 'NOERROR' if queued, 'ERROR' if the address is bad or
+//         FLASH_QUEUE_SIZE requests are already waiting
+// Note: the processor stalls on any fetch from flash while a word
+//       or buffer is being programmed, so code that must keep
+//       running meanwhile has to execute from SRAM
+int Flash_WriteStart(const uint32_t *source, uint32_t addr, uint16_t count, void *tag);
+
+//------------Flash_EraseStart------------
+// Queue an erase of a 1 KB block of flash and return without
+// waiting.
+// Input: addr 1-KB aligned flash memory address to erase
+//        tag  passed to the task when the erase finishes
+// Output: 'NOERROR' if queued, 'ERROR' if the address is bad or
+//         FLASH_QUEUE_SIZE requests are already waiting
+// Note: the processor stalls on any fetch from flash until the
+//       erase finishes (~10 ms), so code that must keep running
+//       meanwhile has to execute from SRAM
+int Flash_EraseStart(uint32_t addr, void *tag);
+
+//------------Flash_Busy------------
+// Check whether a program or erase operation is in progress
+// or queued.
+// Input: none
+// Output: 1 if busy, 0 if idle
+int Flash_Busy(void);
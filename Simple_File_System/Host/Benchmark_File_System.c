@@ -0,0 +1,374 @@
+// File system benchmark
+// Runs on a POSIX host against Flash_Sim.c
+//
+// Each workload starts from the state the previous one left. For each it
+// reports:
+//   flash ms  - simulated device time of the writes and erases issued
+//   KB/s      - payload bytes per simulated second (blank for reads and
+//               mounts, which issue no flash operations)
+//   host us   - CPU time spent in the file system code on this machine
+//   erases    - data-block and log-area erases
+// Rows marked "reclaim (idle)" are OS_File_Reclaim() calls, the work a
+// low-priority thread does off the foreground's path. The telemetry rows
+// log the same controller-like {RPM, error} records to a raw file and to
+// a delta-coded one (OS_File_SetMode) and report what each stores. At the
+// end comes the erase count spread over the data blocks.
+//
+// Every file system call is checked; a failed one ends the run with an
+// error instead of being counted as throughput. Files are deleted and
+// their blocks reclaimed (off the clock) once their rows are done, so
+// each workload has the disk room it needs.
+//
+// Build (default 128 KB disk, 512-byte sectors):
+//   gcc -O2 -I.. -I. Benchmark_File_System.c Flash_Sim.c ../OS_File_System.c
+//       ../OS_File_Log.c ../OS_File_Wear.c ../OS_File_Cache.c ../OS_File_Handle.c
+//       ../OS_File_Lock.c ../OS_File_Crc.c ../OS_File_Pack.c -o benchmark
+// Add -DFS_LOG_EEPROM=1 Eeprom_Sim.c to stage commits in the EEPROM
+// journal; its writes are then listed after the table.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "OS_File_System.h"
+#include "OS_File_Log.h"
+#include "Flash_Sim.h"
+#if FS_LOG_EEPROM
+#include "Eeprom_Sim.h"
+#endif
+
+#define APPEND_SECTORS          96U     // Sectors in the append/read workloads
+#define FLUSH_EVERY             8U      // Appends between flushes
+#define RECORD_BYTES            16U     // Buffered-write record size
+#define RECORDS                 4096U
+#define CHURN_ROUNDS            400U    // Create/fill/delete cycles
+#define TELEMETRY_RECORDS       6000U   // {RPM, error} pairs, a minute at 100 Hz
+#define SMALL_COMMITS           1000U   // Records flushed one at a time
+
+typedef struct {
+  Flash_SimStats_t before;
+  uint32_t dataErases;
+  uint32_t logErases;
+  struct timespec start;
+  uint64_t busyMicros;                  // Totals over the measured stretches
+  uint32_t dataTotal;
+  uint32_t logTotal;
+  double hostMicros;
+} Measure_t;
+
+static uint8_t Data[SECTOR_SIZE];
+static volatile uint32_t Sink;          // Keeps the read loop from being optimized out
+
+static uint32_t data_block_erases(uint32_t first, uint32_t last){
+  uint32_t block;
+  uint32_t total = 0;
+
+  for(block = first; block < last; block++){
+    total += Flash_Sim_BlockErases(block);
+  }
+  return total;
+}
+
+// A file system call failed: the numbers would mean nothing
+static void require(int ok, const char *what){
+  if(!ok){
+    printf("FAILED: %s\n", what);
+    exit(1);
+  }
+}
+
+static FS_File_t new_file(void){
+  FS_File_t file = OS_File_New();
+
+  require(file != FILE_INVALID, "OS_File_New");
+  return file;
+}
+
+// Start (or continue) counting
+static void measure_resume(Measure_t *m){
+  Flash_Sim_GetStats(&m->before);
+  m->dataErases = data_block_erases(0, NUM_DATA_BLOCKS);
+  m->logErases = data_block_erases(NUM_DATA_BLOCKS, NUM_SECTORS/SECTORS_PER_BLOCK);
+  clock_gettime(CLOCK_MONOTONIC, &m->start);
+}
+
+// Stop counting; what happens until the next resume is left out
+static void measure_pause(Measure_t *m){
+  struct timespec end;
+  Flash_SimStats_t after;
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  Flash_Sim_GetStats(&after);
+  m->hostMicros += (end.tv_sec - m->start.tv_sec)*1e6 + (end.tv_nsec - m->start.tv_nsec)/1e3;
+  m->busyMicros += after.busyMicros - m->before.busyMicros;
+  m->dataTotal += data_block_erases(0, NUM_DATA_BLOCKS) - m->dataErases;
+  m->logTotal += data_block_erases(NUM_DATA_BLOCKS, NUM_SECTORS/SECTORS_PER_BLOCK) - m->logErases;
+}
+
+static void measure_start(Measure_t *m){
+  m->busyMicros = 0;
+  m->dataTotal = 0;
+  m->logTotal = 0;
+  m->hostMicros = 0;
+  measure_resume(m);
+}
+
+// Report the stretches since measure_start(); call it while counting
+static void measure_report(Measure_t *m, const char *name, uint32_t bytes){
+  double flashMillis;
+
+  measure_pause(m);
+  flashMillis = m->busyMicros/1e3;
+
+  printf("%-22s %8u %10.1f ", name, (unsigned)bytes, flashMillis);
+  if((bytes != 0) && (flashMillis > 0)){
+    printf("%9.1f ", bytes/flashMillis);        // bytes per ms = KB/s (1000 B)
+  } else {
+    printf("%9s ", "-");
+  }
+  printf("%10.0f %7u %5u\n", m->hostMicros, (unsigned)m->dataTotal, (unsigned)m->logTotal);
+}
+
+// What an idle background thread does: reclaim until nothing is left
+static void reclaim_idle(void){
+  while(OS_File_Reclaim() == FS_SUCCESS){
+  }
+}
+
+// Delete a file whose rows are done and erase its blocks, off the clock
+static void discard(FS_File_t file){
+  require(OS_File_Delete(file) == FS_SUCCESS, "OS_File_Delete");
+  require(OS_File_Flush() == FS_SUCCESS, "OS_File_Flush");
+  reclaim_idle();
+}
+
+// Log TELEMETRY_RECORDS records of a motor stepping between set points:
+// the speed settles with a little sensor noise, the error follows it
+static void telemetry_write(FS_File_t file){
+  FS_Handle_t h = OS_File_Open(file);
+  uint32_t seed = 7U;
+  int32_t record[2];
+  int32_t target = 0;
+  int32_t rpm = 0;
+  uint32_t i;
+
+  require(h != HANDLE_INVALID, "OS_File_Open");
+  for(i = 0; i < TELEMETRY_RECORDS; i++){
+    if((i % 1000U) == 0U){
+      target = 1000 + (int32_t)(i / 1000U)*400;
+    }
+    rpm += (target - rpm)/8;
+    seed = seed*1103515245U + 12345U;
+    record[0] = rpm + (int32_t)((seed >> 16) % 3U) - 1;
+    record[1] = target - record[0];
+    require(OS_File_Write(h, (uint8_t *)record, sizeof(record)) == sizeof(record), "OS_File_Write");
+    OS_File_Background();
+  }
+  require(OS_File_Close(h) == FS_SUCCESS, "OS_File_Close");
+  require(OS_File_Flush() == FS_SUCCESS, "OS_File_Flush");
+}
+
+int main(void){
+  Measure_t m;
+  Measure_t idle;
+  FS_File_t file;
+  FS_File_t churn;
+  FS_Handle_t h;
+  FS_Status_t status;
+  Flash_SimStats_t stats;
+#if FS_LOG_EEPROM
+  Eeprom_SimStats_t eeprom;
+#endif
+  uint32_t i;
+  uint32_t j;
+  uint32_t raw;
+  uint32_t least = 0xFFFFFFFFU;
+  uint32_t most = 0;
+  uint8_t record[RECORD_BYTES];
+
+  Flash_Sim_Init();
+#if FS_LOG_EEPROM
+  Eeprom_Sim_Reset();
+#endif
+  OS_FS_Init();
+
+  printf("%u-byte sectors, %u data sectors, %u data blocks; program %u us, erase %u us\n\n",
+         (unsigned)SECTOR_SIZE, (unsigned)METADATA_SECTOR, (unsigned)NUM_DATA_BLOCKS,
+         (unsigned)FLASH_SIM_PROGRAM_US, (unsigned)FLASH_SIM_ERASE_US);
+  printf("%-22s %8s %10s %9s %10s %7s %5s\n",
+         "workload", "bytes", "flash ms", "KB/s", "host us", "erases", "log");
+
+  // Format a blank disk
+  measure_start(&m);
+  require(OS_File_Format() == FS_SUCCESS, "OS_File_Format");
+  measure_report(&m, "format", 0);
+
+  // Whole-sector appends with a flush every few sectors
+  file = new_file();
+  measure_start(&m);
+  for(i = 0; i < APPEND_SECTORS; i++){
+    memset(Data, (int)i, SECTOR_SIZE);
+    require(OS_File_Append(file, Data) == FS_SUCCESS, "OS_File_Append");
+    if((i % FLUSH_EVERY) == FLUSH_EVERY - 1U){
+      require(OS_File_Flush() == FS_SUCCESS, "OS_File_Flush");
+    }
+  }
+  measure_report(&m, "append+flush", APPEND_SECTORS*SECTOR_SIZE);
+
+  // Flush cost alone: the commit of a single appended sector
+  require(OS_File_Append(file, Data) == FS_SUCCESS, "OS_File_Append");
+  measure_start(&m);
+  require(OS_File_Flush() == FS_SUCCESS, "OS_File_Flush");
+  measure_report(&m, "flush (1 sector)", 0);
+
+  // Sequential sector reads
+  measure_start(&m);
+  for(i = 0; i < APPEND_SECTORS; i++){
+    require(OS_File_Read(file, (FS_Sector_t)i, Data) == FS_SUCCESS, "OS_File_Read");
+    Sink += Data[i % SECTOR_SIZE];
+  }
+  measure_report(&m, "read", APPEND_SECTORS*SECTOR_SIZE);
+
+  // Mount: replay of the metadata log
+  measure_start(&m);
+  require(OS_File_Mount() == FS_SUCCESS, "OS_File_Mount");
+  measure_report(&m, "mount", 0);
+
+  // First reads after a mount also compare each sector with its CRC
+  measure_start(&m);
+  for(i = 0; i < APPEND_SECTORS; i++){
+    require(OS_File_Read(file, (FS_Sector_t)i, Data) == FS_SUCCESS, "OS_File_Read");
+    Sink += Data[i % SECTOR_SIZE];
+  }
+  measure_report(&m, "read (after mount)", APPEND_SECTORS*SECTOR_SIZE);
+  discard(file);
+
+  // Small records through a handle and the write-back cache
+  file = new_file();
+  h = OS_File_Open(file);
+  require(h != HANDLE_INVALID, "OS_File_Open");
+  for(i = 0; i < RECORD_BYTES; i++){
+    record[i] = (uint8_t)i;
+  }
+  measure_start(&m);
+  for(i = 0; i < RECORDS; i++){
+    require(OS_File_Write(h, record, RECORD_BYTES) == RECORD_BYTES, "OS_File_Write");
+    OS_File_Background();
+  }
+  require(OS_File_Flush() == FS_SUCCESS, "OS_File_Flush");
+  measure_report(&m, "16-byte writes", RECORDS*RECORD_BYTES);
+
+  // A record made durable at a time: each flush commits a TAIL record
+  measure_start(&m);
+  for(i = 0; i < SMALL_COMMITS; i++){
+    require(OS_File_Write(h, record, RECORD_BYTES) == RECORD_BYTES, "OS_File_Write");
+    require(OS_File_Flush() == FS_SUCCESS, "OS_File_Flush");
+  }
+  measure_report(&m, "16-byte writes+flush", SMALL_COMMITS*RECORD_BYTES);
+
+  // The same records read back through the handle
+  require(OS_File_Seek(h, 0) == FS_SUCCESS, "OS_File_Seek");
+  measure_start(&m);
+  for(i = 0; i < RECORDS; i++){
+    require(OS_File_ReadBytes(h, record, RECORD_BYTES) == RECORD_BYTES, "OS_File_ReadBytes");
+    Sink += record[i % RECORD_BYTES];
+  }
+  measure_report(&m, "16-byte reads", RECORDS*RECORD_BYTES);
+  require(OS_File_Close(h) == FS_SUCCESS, "OS_File_Close");
+  discard(file);
+
+  // Churn: fill a scratch file, delete it, repeat (garbage collection)
+  measure_start(&m);
+  for(i = 0; i < CHURN_ROUNDS; i++){
+    churn = new_file();
+    for(j = 0; j < 8U; j++){
+      require(OS_File_Append(churn, Data) == FS_SUCCESS, "OS_File_Append");
+    }
+    require(OS_File_Delete(churn) == FS_SUCCESS, "OS_File_Delete");
+    require(OS_File_Flush() == FS_SUCCESS, "OS_File_Flush");
+  }
+  measure_report(&m, "churn (8 sectors)", CHURN_ROUNDS*8U*SECTOR_SIZE);
+
+  // The same churn with a background thread erasing between rounds: the
+  // foreground line counts only the appends, deletes and flushes
+  measure_start(&m);
+  measure_pause(&m);
+  measure_start(&idle);
+  measure_pause(&idle);
+  for(i = 0; i < CHURN_ROUNDS; i++){
+    measure_resume(&m);
+    churn = new_file();
+    for(j = 0; j < 8U; j++){
+      require(OS_File_Append(churn, Data) == FS_SUCCESS, "OS_File_Append");
+    }
+    require(OS_File_Delete(churn) == FS_SUCCESS, "OS_File_Delete");
+    require(OS_File_Flush() == FS_SUCCESS, "OS_File_Flush");
+    measure_pause(&m);
+
+    measure_resume(&idle);
+    reclaim_idle();
+    measure_pause(&idle);
+  }
+  measure_resume(&m);
+  measure_report(&m, "churn, idle reclaim", CHURN_ROUNDS*8U*SECTOR_SIZE);
+  measure_resume(&idle);
+  measure_report(&idle, "  reclaim (idle)", 0);
+
+  // Format again, now over a used disk
+  measure_start(&m);
+  require(OS_File_Format() == FS_SUCCESS, "OS_File_Format");
+  measure_report(&m, "format (used disk)", 0);
+
+  // The old data is erased afterwards, in the background
+  measure_start(&m);
+  reclaim_idle();
+  measure_report(&m, "  reclaim (idle)", 0);
+
+  // Controller telemetry, stored as written and delta coded
+  file = new_file();
+  measure_start(&m);
+  telemetry_write(file);
+  measure_report(&m, "telemetry, raw", TELEMETRY_RECORDS*8U);
+  raw = OS_File_Length(file);
+  require(raw == TELEMETRY_RECORDS*8U, "raw telemetry length");
+  discard(file);
+
+  file = new_file();
+  require(OS_File_SetMode(file, FS_MODE_DELTA(2)) == FS_SUCCESS, "OS_File_SetMode");
+  measure_start(&m);
+  telemetry_write(file);
+  measure_report(&m, "telemetry, delta", TELEMETRY_RECORDS*8U);
+
+  h = OS_File_Open(file);
+  require(h != HANDLE_INVALID, "OS_File_Open");
+  i = 0;
+  measure_start(&m);
+  while((j = OS_File_ReadBytes(h, Data, 64)) != 0){
+    i += j;
+    Sink += Data[0];
+  }
+  measure_report(&m, "telemetry reads, delta", TELEMETRY_RECORDS*8U);
+  require(i == TELEMETRY_RECORDS*8U, "delta telemetry read back");
+  require(OS_File_Close(h) == FS_SUCCESS, "OS_File_Close");
+  printf("  stored: raw %u bytes, delta %u bytes (%.1fx)\n",
+         (unsigned)raw, (unsigned)OS_File_Length(file), (double)raw/OS_File_Length(file));
+  discard(file);
+
+  for(i = 0; i < NUM_DATA_BLOCKS; i++){
+    j = Flash_Sim_BlockErases(i);
+    least = (j < least) ? j : least;
+    most = (j > most) ? j : most;
+  }
+  Flash_Sim_GetStats(&stats);
+  OS_FS_GetStatus(&status);
+  printf("\ndata block erases: min %u max %u; 0->1 rewrites: %u; free sectors: %u\n",
+         (unsigned)least, (unsigned)most, (unsigned)stats.rewrites, (unsigned)status.freeSectors);
+#if FS_LOG_EEPROM
+  Eeprom_Sim_GetStats(&eeprom);
+  printf("EEPROM journal: %u word writes, %.1f ms\n",
+         (unsigned)eeprom.writes, eeprom.busyMicros/1e3);
+#endif
+
+  return 0;
+}
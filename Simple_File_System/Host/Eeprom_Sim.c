@@ -0,0 +1,74 @@
+// *****************************************************************************
+// Eeprom_Sim.c - Host EEPROM Simulator Implementation
+// Runs on a POSIX host (Linux)
+// Any word can be written with any value. A power cut landing on a write
+// leaves that word holding a mix of its old and new bits; every later
+// write fails without effect until Flash_Sim_CutAfter() restores power.
+//
+// *****************************************************************************
+
+#include "Eeprom_Sim.h"
+#include "Flash_Sim.h"
+#include "EepromProgram.h"
+#include <stdint.h>
+#include <string.h>
+
+// =============================================================================
+// SIMULATOR STATE
+// =============================================================================
+static uint32_t Words[EEPROM_SIM_WORDS];
+static Eeprom_SimStats_t Stats;
+
+// =============================================================================
+// SIMULATOR FUNCTIONS
+// =============================================================================
+
+void Eeprom_Sim_Reset(void) {
+    memset(Words, 0xFF, sizeof(Words));
+    Eeprom_Sim_ClearStats();
+}
+
+void Eeprom_Sim_GetStats(Eeprom_SimStats_t *stats) {
+    *stats = Stats;
+}
+
+void Eeprom_Sim_ClearStats(void) {
+    memset(&Stats, 0, sizeof(Stats));
+}
+
+// =============================================================================
+// EEPROM FUNCTIONS (EepromProgram.h)
+// =============================================================================
+
+int Eeprom_Init(void) {
+    return NOERROR;
+}
+
+uint32_t Eeprom_Words(void) {
+    return EEPROM_SIM_WORDS;
+}
+
+uint32_t Eeprom_Read(uint32_t word) {
+    return (word < EEPROM_SIM_WORDS) ? Words[word] : 0xFFFFFFFFU;
+}
+
+int Eeprom_Write(uint32_t word, uint32_t data) {
+    uint8_t torn;
+
+    if ((word >= EEPROM_SIM_WORDS) || !Flash_Sim_Step(&torn)) {
+        return ERROR;
+    }
+
+    Stats.writes++;
+    Stats.busyMicros += EEPROM_SIM_WRITE_US;
+
+    if (torn) {
+        // Half the bits take their new value, the rest keep the old one
+        Words[word] = (Words[word] & 0xA5A5A5A5U) | (data & 0x5A5A5A5AU);
+        return ERROR;
+    }
+
+    Words[word] = data;
+
+    return NOERROR;
+}
@@ -0,0 +1,38 @@
+// *****************************************************************************
+// Eeprom_Sim.h - Host EEPROM Simulator Header
+// Runs on a POSIX host (Linux)
+// Stands in for EepromProgram.c: 2 KB of word-rewritable storage that
+// keeps its contents across simulated mounts and shares Flash_Sim.c's
+// power cut, so a cut can land on an EEPROM write as well
+//
+// *****************************************************************************
+
+#ifndef __EEPROM_SIM_H__
+#define __EEPROM_SIM_H__
+
+#include <stdint.h>
+
+#ifndef EEPROM_SIM_WORDS
+#define EEPROM_SIM_WORDS        512U            // TM4C123: 2 KB
+#endif
+
+// Device time per word write, in microseconds (the TM4C123 data sheet
+// gives about 110 us when no block copy is needed)
+#ifndef EEPROM_SIM_WRITE_US
+#define EEPROM_SIM_WRITE_US     110U
+#endif
+
+typedef struct {
+    uint32_t writes;            // Word writes
+    uint64_t busyMicros;        // Simulated device time of the above
+} Eeprom_SimStats_t;
+
+// Every word back to 0xFFFFFFFF, as a new part reads
+void Eeprom_Sim_Reset(void);
+
+// Write counts and device time since the last clear (or reset)
+void Eeprom_Sim_GetStats(Eeprom_SimStats_t *stats);
+
+void Eeprom_Sim_ClearStats(void);
+
+#endif // __EEPROM_SIM_H__
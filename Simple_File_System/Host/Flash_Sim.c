@@ -0,0 +1,238 @@
+// *****************************************************************************
+// Flash_Sim.c - Host Flash Simulator Implementation
+// Runs on a POSIX host (Linux)
+// Same rules as the TM4C123 flash: a word write can only clear bits (the
+// result is old AND new), and an erase sets a whole 1 KB block to 0xFF.
+// A simulated power cut tears the operation it lands on: a write clears
+// only some of its bits, an erase only reaches part of the block.
+// Programming a 1 over a 0 is counted as a rewrite; like the hardware,
+// the bit stays 0. Flash_WriteStart() and Flash_EraseStart() finish
+// the operation before they return and then call the completion task,
+// as the interrupt would.
+//
+// *****************************************************************************
+
+#include "Flash_Sim.h"
+#include "OS_File_System.h"
+#include "FlashProgram.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define DISK_BYTES              (DISK_END_ADDRESS - DISK_START_ADDRESS)
+#define DISK_BLOCKS             (DISK_BYTES / ERASE_BLOCK_SIZE)
+
+// =============================================================================
+// SIMULATOR STATE
+// =============================================================================
+static uint8_t *Disk;
+static int32_t CutCountdown = FLASH_SIM_NO_CUT;
+static uint8_t PowerLost;
+static uint32_t Operations;
+static Flash_SimStats_t Stats;
+static uint32_t BlockErases[DISK_BLOCKS];
+static void (*DoneTask)(void *tag);
+
+// =============================================================================
+// HELPER FUNCTIONS
+// =============================================================================
+
+// Returns 1 if this operation may proceed, 0 if power is already gone;
+// *torn is set when the cut lands on this operation
+static uint8_t sim_power(uint8_t *torn) {
+    *torn = 0;
+
+    if (PowerLost) {
+        return 0;
+    }
+
+    Operations++;
+
+    if (CutCountdown == 0) {
+        PowerLost = 1;
+        *torn = 1;
+    } else if (CutCountdown > 0) {
+        CutCountdown--;
+    }
+
+    return 1;
+}
+
+// =============================================================================
+// SIMULATOR FUNCTIONS
+// =============================================================================
+
+void Flash_Sim_Init(void) {
+    void *map = mmap((void *)(uintptr_t)DISK_START_ADDRESS, DISK_BYTES,
+                     PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+
+    if (map != (void *)(uintptr_t)DISK_START_ADDRESS) {
+        perror("Flash_Sim_Init: mmap");
+        exit(1);
+    }
+
+    Disk = (uint8_t *)map;
+    Flash_Sim_Reset();
+}
+
+void Flash_Sim_Reset(void) {
+    memset(Disk, 0xFF, DISK_BYTES);
+    CutCountdown = FLASH_SIM_NO_CUT;
+    PowerLost = 0;
+    Operations = 0;
+    memset(BlockErases, 0, sizeof(BlockErases));
+    Flash_Sim_ClearStats();
+}
+
+void Flash_Sim_CutAfter(int32_t operations) {
+    CutCountdown = operations;
+    PowerLost = 0;
+}
+
+uint32_t Flash_Sim_Operations(void) {
+    return Operations;
+}
+
+uint8_t Flash_Sim_PowerLost(void) {
+    return PowerLost;
+}
+
+void Flash_Sim_GetStats(Flash_SimStats_t *stats) {
+    *stats = Stats;
+}
+
+void Flash_Sim_ClearStats(void) {
+    memset(&Stats, 0, sizeof(Stats));
+}
+
+uint32_t Flash_Sim_BlockErases(uint32_t block) {
+    return (block < DISK_BLOCKS) ? BlockErases[block] : 0;
+}
+
+uint8_t Flash_Sim_Step(uint8_t *torn) {
+    return sim_power(torn);
+}
+
+// =============================================================================
+// FLASH PROGRAMMING FUNCTIONS (FlashProgram.h)
+// =============================================================================
+
+void Flash_Init(uint8_t systemClockFreqMHz) {
+    (void)systemClockFreqMHz;
+}
+
+int Flash_Write(uint32_t addr, uint32_t data) {
+    uint32_t *word;
+    uint8_t torn;
+
+    if ((addr & 3U) || (addr < DISK_START_ADDRESS) || (addr >= DISK_END_ADDRESS)) {
+        return ERROR;
+    }
+
+    if (!sim_power(&torn)) {
+        return ERROR;
+    }
+
+    word = (uint32_t *)(uintptr_t)addr;
+    Stats.writes++;
+    Stats.busyMicros += FLASH_SIM_PROGRAM_US;
+
+    if (data & ~*word) {
+        Stats.rewrites++;
+    }
+
+    if (torn) {
+        // Only the bits in one pseudo-random half of the word get cleared
+        *word &= data | (0x5A5A5A5AU ^ (addr * 2654435761U));
+        return ERROR;
+    }
+
+    *word &= data;
+
+    return NOERROR;
+}
+
+int Flash_WriteArray(uint32_t *source, uint32_t addr, uint16_t count) {
+    uint16_t i;
+
+    for (i = 0; i < count; i++) {
+        if (Flash_Write(addr + 4U * i, source[i]) != NOERROR) {
+            return i;
+        }
+    }
+
+    return count;
+}
+
+int Flash_FastWrite(uint32_t *source, uint32_t addr, uint16_t count) {
+    // Same 32-word, 128-byte-aligned limits as the hardware write buffer
+    if ((count > 32U) || (addr & 0x7FU)) {
+        return 0;
+    }
+
+    return Flash_WriteArray(source, addr, count);
+}
+
+int Flash_Erase(uint32_t addr) {
+    uint8_t torn;
+
+    if ((addr & (ERASE_BLOCK_SIZE - 1U)) || (addr < DISK_START_ADDRESS) ||
+        (addr >= DISK_END_ADDRESS)) {
+        return ERROR;
+    }
+
+    if (!sim_power(&torn)) {
+        return ERROR;
+    }
+
+    Stats.erases++;
+    Stats.busyMicros += FLASH_SIM_ERASE_US;
+    BlockErases[(addr - DISK_START_ADDRESS) / ERASE_BLOCK_SIZE]++;
+
+    if (torn) {
+        // Erase stopped part way through the block
+        memset((void *)(uintptr_t)addr, 0xFF, ERASE_BLOCK_SIZE / 2U);
+        return ERROR;
+    }
+
+    memset((void *)(uintptr_t)addr, 0xFF, ERASE_BLOCK_SIZE);
+
+    return NOERROR;
+}
+
+void Flash_EnableInterrupt(void (*task)(void *tag), uint32_t priority) {
+    (void)priority;
+    DoneTask = task;
+}
+
+int Flash_WriteStart(const uint32_t *source, uint32_t addr, uint16_t count, void *tag) {
+    // A write cut short never completes
+    if ((count == 0) || (Flash_WriteArray((uint32_t *)source, addr, count) != count)) {
+        return ERROR;
+    }
+
+    if (DoneTask != 0) {
+        (*DoneTask)(tag);
+    }
+
+    return NOERROR;
+}
+
+int Flash_EraseStart(uint32_t addr, void *tag) {
+    // A torn erase never completes
+    if (Flash_Erase(addr) != NOERROR) {
+        return ERROR;
+    }
+
+    if (DoneTask != 0) {
+        (*DoneTask)(tag);
+    }
+
+    return NOERROR;
+}
+
+int Flash_Busy(void) {
+    return 0;
+}
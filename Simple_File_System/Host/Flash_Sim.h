@@ -0,0 +1,63 @@
+// *****************************************************************************
+// Flash_Sim.h - Host Flash Simulator Header
+// Runs on a POSIX host (Linux)
+// Stands in for FlashProgram.c so the file system can be compiled and
+// exercised on a PC. The disk is mapped at its real address range, so the
+// file system's direct flash reads work unchanged. Each write and erase
+// adds its device time to a simulated clock; reads are not timed.
+//
+// *****************************************************************************
+
+#ifndef __FLASH_SIM_H__
+#define __FLASH_SIM_H__
+
+#include <stdint.h>
+
+#define FLASH_SIM_NO_CUT        (-1)            // Power never fails
+
+// Device time per operation, in microseconds. The defaults are in the
+// range of the TM4C123's word-program and 1 KB page-erase times; define
+// them on the command line to match measured values.
+#ifndef FLASH_SIM_PROGRAM_US
+#define FLASH_SIM_PROGRAM_US    30U
+#endif
+#ifndef FLASH_SIM_ERASE_US
+#define FLASH_SIM_ERASE_US      10000U
+#endif
+
+typedef struct {
+    uint32_t writes;            // Word programs
+    uint32_t erases;            // Block erases
+    uint32_t rewrites;          // Programs that asked for a 0 -> 1 change
+    uint64_t busyMicros;        // Simulated device time of the above
+} Flash_SimStats_t;
+
+// Map the disk range and fill it with 0xFF
+void Flash_Sim_Init(void);
+
+// Back to a blank (erased) disk, power restored
+void Flash_Sim_Reset(void);
+
+// Power fails during the given flash operation (0 = the next one): that
+// write or erase is left torn and every later one fails without effect
+void Flash_Sim_CutAfter(int32_t operations);
+
+// Writes and erases issued since the last reset
+uint32_t Flash_Sim_Operations(void);
+
+// Nonzero once the power cut has happened
+uint8_t Flash_Sim_PowerLost(void);
+
+// Operation counts and device time since the last clear (or reset)
+void Flash_Sim_GetStats(Flash_SimStats_t *stats);
+
+void Flash_Sim_ClearStats(void);
+
+// Erases of one 1 KB block of the disk since the last reset
+uint32_t Flash_Sim_BlockErases(uint32_t block);
+
+// Count one operation of another simulated device (Eeprom_Sim.c) against
+// the same power cut; returns 0 once power is gone, sets *torn on the cut
+uint8_t Flash_Sim_Step(uint8_t *torn);
+
+#endif // __FLASH_SIM_H__
@@ -0,0 +1,211 @@
+// Register-model test of the interrupt-driven flash queue in FlashProgram.c
+// Runs on a POSIX host (Linux)
+//
+// The flash controller, BOOTCFG and NVIC register pages are mapped at
+// their TM4C123 addresses, so FlashProgram.c runs unchanged. A small
+// model of the controller stands behind them: each time the driver has
+// started an operation the model carries it out on a model flash array
+// (an erase fills its 1 KB block with 0xFF; a word or buffered write ANDs
+// the data in, as programming can only clear bits), checks the write key
+// and that only one operation was started, clears the busy bit and calls
+// FlashCtl_Handler as the interrupt would.
+//
+// Checked: requests finish in order with their own tags, a write split
+// across 128-byte windows lands whole, a full queue refuses a request,
+// bad addresses are refused, Flash_Busy follows the queue, a request
+// queued from the completion task runs last, and the interrupt is armed
+// at the priority asked for.
+//
+// Build:
+//   gcc -I.. -I. Test_Flash_Queue.c ../FlashProgram.c -o flash_queue
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "FlashProgram.h"
+
+#define FLASH_BASE              0x400FD000U
+#define SYSCTL_BASE             0x400FE000U
+#define NVIC_BASE               0xE000E000U
+
+#define REG(a)                  (*((volatile uint32_t *)(uintptr_t)(a)))
+#define FMA                     REG(0x400FD000U)
+#define FMD                     REG(0x400FD004U)
+#define FMC                     REG(0x400FD008U)
+#define FCIM                    REG(0x400FD010U)
+#define FMC2                    REG(0x400FD020U)
+#define FWB(n)                  REG(0x400FD100U + 4U*(n))
+#define BOOTCFG                 REG(0x400FE1D0U)
+#define NVIC_EN0                REG(0xE000E100U)
+#define NVIC_PRI7               REG(0xE000E41CU)
+
+#define FMC_WRITE               0x00000001U
+#define FMC_ERASE               0x00000002U
+#define FMC2_WRBUF              0x00000001U
+#define WRKEY                   0xA4420000U     // BOOTCFG KEY bit set
+
+#define MODEL_SIZE              0x40000U        // 256 KB of flash
+#define MAX_DONE                16U
+
+void FlashCtl_Handler(void);
+
+static uint32_t Model[MODEL_SIZE/4U];
+static void *Done[MAX_DONE];                    // Tags in completion order
+static uint32_t DoneCount;
+static uint32_t Erases, Words, Buffers;
+static uint32_t Failures;
+
+static uint32_t Extra[2] = {0x11111111U, 0x22222222U};
+static const char *Tag_A = "A";
+static const char *Tag_B = "B";
+static const char *Tag_C = "C";
+static const char *Tag_D = "D";
+static const char *Tag_E = "E";
+
+// Interrupts are never taken on the host: critical sections are empty
+long StartCritical(void){
+  return 0;
+}
+
+void EndCritical(long sr){
+  (void)sr;
+}
+
+static void check(int ok, const char *what){
+  if(!ok){
+    Failures++;
+    printf("FAIL %s\n", what);
+  }
+}
+
+// Completion task: record the tag; tag A queues one more request
+static void done_task(void *tag){
+  if(DoneCount < MAX_DONE){
+    Done[DoneCount] = tag;
+  }
+  DoneCount++;
+  if(tag == (void *)Tag_A){
+    check(Flash_WriteStart(Extra, 0x21000U, 2, (void *)Tag_E) == NOERROR, "queue from completion task");
+  }
+}
+
+// Carry out the operation the driver started, then take the interrupt
+static int model_step(void){
+  uint32_t started = ((FMC & FMC_WRITE) != 0) + ((FMC & FMC_ERASE) != 0) + ((FMC2 & FMC2_WRBUF) != 0);
+  uint32_t addr = FMA;
+  uint32_t i;
+
+  if(started == 0){
+    return 0;
+  }
+  check(started == 1, "one operation at a time");
+  check(((FMC & FMC_ERASE) == 0) || ((FMC & 0xFFFF0000U) == WRKEY), "erase key");
+  check(((FMC & FMC_WRITE) == 0) || ((FMC & 0xFFFF0000U) == WRKEY), "write key");
+  check(((FMC2 & FMC2_WRBUF) == 0) || ((FMC2 & 0xFFFF0000U) == WRKEY), "buffered write key");
+  check(addr < MODEL_SIZE, "address in range");
+  addr %= MODEL_SIZE;
+
+  if(FMC & FMC_ERASE){
+    check((addr & 0x3FFU) == 0, "erase aligned");
+    memset(&Model[(addr & ~0x3FFU)/4U], 0xFF, 1024);
+    Erases++;
+  } else if(FMC & FMC_WRITE){
+    check((addr & 3U) == 0, "word aligned");
+    Model[addr/4U] &= FMD;
+    Words++;
+  } else{
+    check((addr & 0x7FU) == 0, "buffer window aligned");
+    for(i = 0; i < 32U; i++){
+      Model[(addr & ~0x7FU)/4U + i] &= FWB(i);
+      FWB(i) = 0xFFFFFFFFU;     // Buffer registers only count once written
+    }
+    Buffers++;
+  }
+  FMC = 0;
+  FMC2 = 0;
+  if((FCIM & 0x2U) && (NVIC_EN0 & 0x20000000U)){
+    FlashCtl_Handler();
+  }
+  return 1;
+}
+
+static void run_until_idle(void){
+  uint32_t steps = 0;
+
+  while(model_step() && (steps < 1000U)){
+    steps++;
+  }
+}
+
+static void *map_page(uint32_t addr){
+  return mmap((void *)(uintptr_t)addr, 0x1000, PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+}
+
+int main(void){
+  uint32_t words[40];
+  uint32_t small[3] = {0x0000ABCDU, 0x12345678U, 0x0F0F0F0FU};
+  uint32_t one = 0xCAFEF00DU;
+  uint32_t i;
+
+  if((map_page(FLASH_BASE) == MAP_FAILED) || (map_page(SYSCTL_BASE) == MAP_FAILED) ||
+     (map_page(NVIC_BASE) == MAP_FAILED)){
+    printf("cannot map the register pages\n");
+    return 1;
+  }
+  BOOTCFG = 0x00000010U;
+  for(i = 0; i < 32U; i++){
+    FWB(i) = 0xFFFFFFFFU;
+  }
+  memset(Model, 0xFF, sizeof(Model));
+  memset(&Model[0x20400U/4U], 0x00, 1024);      // To be erased
+  for(i = 0; i < 40U; i++){
+    words[i] = 0xA5000000U + i;
+  }
+
+  Flash_EnableInterrupt(&done_task, 5);
+  check((NVIC_EN0 & 0x20000000U) != 0, "IRQ 29 enabled");
+  check(((NVIC_PRI7 >> 13) & 7U) == 5U, "priority 5 in PRI7 bits 15-13");
+  check((FCIM & 0x2U) != 0, "completion interrupt armed");
+
+  // Bad requests
+  check(Flash_WriteStart(words, 0x20002U, 1, 0) == ERROR, "unaligned write refused");
+  check(Flash_WriteStart(words, 0x20000U, 0, 0) == ERROR, "empty write refused");
+  check(Flash_WriteStart(words, 0x3FFFCU, 2, 0) == ERROR, "write past the end refused");
+  check(Flash_EraseStart(0x20200U, 0) == ERROR, "unaligned erase refused");
+  check(!Flash_Busy(), "idle before any request");
+
+  // Four requests fill the queue; the first starts at once
+  check(Flash_WriteStart(words, 0x20010U, 40, (void *)Tag_A) == NOERROR, "queue A");
+  check(Flash_EraseStart(0x20400U, (void *)Tag_B) == NOERROR, "queue B");
+  check(Flash_WriteStart(&one, 0x20800U, 1, (void *)Tag_C) == NOERROR, "queue C");
+  check(Flash_WriteStart(small, 0x2087CU, 3, (void *)Tag_D) == NOERROR, "queue D");
+  check(Flash_EraseStart(0x20C00U, 0) == ERROR, "full queue refuses");
+  check(Flash_Busy(), "busy while queued");
+  check(DoneCount == 0, "nothing done before the interrupt");
+
+  run_until_idle();
+
+  check(!Flash_Busy(), "idle once drained");
+  check(DoneCount == 5U, "five requests done");
+  check((Done[0] == (void *)Tag_A) && (Done[1] == (void *)Tag_B) && (Done[2] == (void *)Tag_C) &&
+        (Done[3] == (void *)Tag_D) && (Done[4] == (void *)Tag_E), "done in queue order");
+  for(i = 0; i < 40U; i++){
+    check(Model[0x20010U/4U + i] == words[i], "A written across two windows");
+  }
+  check(Model[0x2000CU/4U] == 0xFFFFFFFFU, "word before A untouched");
+  check(Model[0x200B0U/4U] == 0xFFFFFFFFU, "word after A untouched");
+  for(i = 0; i < 256U; i++){
+    check(Model[0x20400U/4U + i] == 0xFFFFFFFFU, "B erased");
+  }
+  check(Model[0x20800U/4U] == one, "C written");
+  check((Model[0x2087CU/4U] == small[0]) && (Model[0x20880U/4U] == small[1]) &&
+        (Model[0x20884U/4U] == small[2]), "D written across a window edge");
+  check((Model[0x21000U/4U] == Extra[0]) && (Model[0x21004U/4U] == Extra[1]), "E written");
+  check((Erases == 1U) && (Words == 1U) && (Buffers == 5U), "operations as expected");
+
+  printf("%u erases, %u word writes, %u buffered writes: %s\n", (unsigned)Erases,
+         (unsigned)Words, (unsigned)Buffers, Failures ? "FAILED" : "ok");
+  return Failures ? 1 : 0;
+}
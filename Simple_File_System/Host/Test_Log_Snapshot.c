@@ -0,0 +1,255 @@
+// Metadata log snapshot test for the file system
+// Runs on a POSIX host against Flash_Sim.c
+//
+// A log compaction writes the whole state as one snapshot of packed
+// tables: wear counts, chains, sector CRCs, last sector lengths and
+// storage modes. This fills every one of them at the default geometry: the
+// disk is filled and emptied twice so every block has been erased, then
+// small files (10 raw bytes, or three delta-coded samples on every third
+// file) are created one per flush until the disk or directory is full, so
+// each ends in a part-filled sector. Every flush must succeed, a
+// checkpoint of the full disk must fit, and a mount must give each file
+// back.
+//
+// The file phase is then rerun from the aged disk with power cut at every
+// CUT_STRIDE-th flash operation (and at each one of the final
+// checkpoint): after a mount every file flushed before the cut must read
+// back, and the disk must still take a file.
+//
+// Build (default geometry):
+//   gcc -I.. -I. Test_Log_Snapshot.c Flash_Sim.c ../OS_File_System.c
+//       ../OS_File_Log.c ../OS_File_Wear.c ../OS_File_Cache.c ../OS_File_Handle.c
+//       ../OS_File_Lock.c ../OS_File_Crc.c ../OS_File_Pack.c -o log_snapshot
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "OS_File_System.h"
+#include "OS_File_Log.h"
+#include "OS_File_Wear.h"
+#include "Flash_Sim.h"
+
+// The cut runs restart from a saved flash image; a journal in the EEPROM
+// would not be saved with it
+#if FS_LOG_EEPROM
+#error "Test_Log_Snapshot: build without FS_LOG_EEPROM"
+#endif
+
+#define AGING_PASSES            2U
+#define SMALL_BYTES             10U
+#define DELTA_EVERY             3U      // Every third file is delta coded
+#define CUT_STRIDE              97U
+
+#define DISK_BYTES              (DISK_END_ADDRESS - DISK_START_ADDRESS)
+
+static uint8_t *Disk;                   // The simulated disk
+static uint8_t Aged[DISK_BYTES];        // Disk image once aged
+static FS_File_t Files[DIRECTORY_SIZE]; // In creation order
+static uint32_t FileCount;
+static uint32_t Flushed;                // Files whose flush completed
+static uint8_t Flush_Failed;            // A flush failed with power on
+static uint32_t Failures;
+
+static void check(int ok, const char *what, uint32_t n){
+  if(!ok){
+    Failures++;
+    printf("FAIL %s (%u)\n", what, (unsigned)n);
+  }
+}
+
+static uint8_t is_delta(uint32_t k){
+  return (k % DELTA_EVERY) == (DELTA_EVERY - 1U);
+}
+
+// Fill the disk with one file, delete it and erase everything it used
+static void age(void){
+  uint8_t buf[SECTOR_SIZE];
+  uint32_t pass;
+  FS_File_t f;
+
+  OS_FS_Init();
+  OS_File_Format();
+  for(pass = 0; pass < AGING_PASSES; pass++){
+    memset(buf, (int)pass, sizeof(buf));
+    f = OS_File_New();
+    while(OS_File_Append(f, buf) == FS_SUCCESS){
+    }
+    OS_File_Flush();
+    OS_File_Delete(f);
+    OS_File_Flush();
+    while(OS_File_Reclaim() == FS_SUCCESS){
+    }
+  }
+}
+
+// The k-th small file, then a flush; 0 once the disk or directory is full
+static uint8_t small_file(uint32_t k){
+  uint8_t bytes[SMALL_BYTES];
+  int32_t samples[3];
+  uint16_t wrote;
+  uint32_t i;
+  FS_File_t f;
+  FS_Handle_t h;
+
+  f = OS_File_New();
+  if(f == FILE_INVALID){
+    return 0;
+  }
+  Files[k] = f;
+  FileCount = k + 1U;
+
+  if(is_delta(k)){
+    OS_File_SetMode(f, FS_MODE_DELTA(1));
+  }
+  h = OS_File_Open(f);
+  if(is_delta(k)){
+    for(i = 0; i < 3U; i++){
+      samples[i] = (int32_t)(k * 1000U + i);
+    }
+    wrote = OS_File_Write(h, (const uint8_t *)samples, sizeof(samples));
+    wrote = (wrote == sizeof(samples)) ? SMALL_BYTES : 0U;
+  } else{
+    for(i = 0; i < SMALL_BYTES; i++){
+      bytes[i] = (uint8_t)(k + i);
+    }
+    wrote = OS_File_Write(h, bytes, SMALL_BYTES);
+  }
+  OS_File_Close(h);
+  if(wrote != SMALL_BYTES){
+    return 0;
+  }
+  if(OS_File_Flush() != FS_SUCCESS){
+    Flush_Failed = !Flash_Sim_PowerLost();
+    return 0;
+  }
+  if(Flash_Sim_PowerLost()){
+    return 0;
+  }
+  Flushed = k + 1U;
+  return 1;
+}
+
+// The file phase from the aged disk; returns the flash operations it took
+static uint32_t file_phase(int32_t cut){
+  uint32_t start;
+  uint32_t k;
+
+  Flash_Sim_Reset();
+  memcpy(Disk, Aged, DISK_BYTES);
+  OS_FS_Init();
+  OS_File_Mount();
+  start = Flash_Sim_Operations();
+  Flash_Sim_CutAfter(cut);
+
+  FileCount = 0;
+  Flushed = 0;
+  Flush_Failed = 0;
+  for(k = 0; (k < DIRECTORY_SIZE) && small_file(k); k++){
+  }
+  return Flash_Sim_Operations() - start;
+}
+
+// Does the k-th file read back?
+static uint8_t small_file_ok(uint32_t k){
+  uint8_t bytes[SMALL_BYTES];
+  int32_t samples[3];
+  uint8_t ok;
+  uint32_t i;
+  FS_Handle_t h;
+
+  h = OS_File_Open(Files[k]);
+  if(h == HANDLE_INVALID){
+    return 0;
+  }
+  if(is_delta(k)){
+    ok = (OS_File_ReadBytes(h, (uint8_t *)samples, sizeof(samples)) == sizeof(samples));
+    for(i = 0; ok && (i < 3U); i++){
+      ok = (samples[i] == (int32_t)(k * 1000U + i));
+    }
+  } else{
+    ok = (OS_File_ReadBytes(h, bytes, SMALL_BYTES) == SMALL_BYTES);
+    for(i = 0; ok && (i < SMALL_BYTES); i++){
+      ok = (bytes[i] == (uint8_t)(k + i));
+    }
+  }
+  OS_File_Close(h);
+  return ok;
+}
+
+static uint8_t files_ok(uint32_t count){
+  uint32_t k;
+
+  for(k = 0; k < count; k++){
+    if(!small_file_ok(k)){
+      return 0;
+    }
+  }
+  return 1;
+}
+
+int main(void){
+  FS_Status_t status;
+  uint32_t total;
+  uint32_t check_start;
+  uint32_t check_ops;
+  uint32_t runs = 0;
+  uint32_t cuts_failed = 0;
+  uint32_t cut;
+  uint32_t flushed;
+  uint32_t block;
+  uint32_t unworn = 0;
+  uint8_t ok;
+
+  Flash_Sim_Init();
+  Disk = (uint8_t *)(uintptr_t)DISK_START_ADDRESS;
+  age();
+  for(block = 0; block < NUM_DATA_BLOCKS; block++){
+    unworn += (FS_Wear_EraseCount((FS_Sector_t)block) == 0);
+  }
+  check(unworn == 0, "every block erased while aging", unworn);
+  memcpy(Aged, Disk, DISK_BYTES);
+
+  // Reference run: every flush succeeds until the disk or directory is full
+  total = file_phase(FLASH_SIM_NO_CUT);
+  OS_FS_GetStatus(&status);
+  check(!Flush_Failed, "every flush succeeded", Flushed);
+  check((Flushed == MAX_FILE_NUMBER + 1U) || (status.freeSectors == 0),
+        "filled the disk or directory", status.freeSectors);
+  check_start = Flash_Sim_Operations();
+  check(FS_Log_Checkpoint() == FS_SUCCESS, "checkpoint of the full disk", Flushed);
+  check_ops = Flash_Sim_Operations() - check_start;
+  check((OS_File_Mount() == FS_SUCCESS) && files_ok(Flushed), "files after a mount", Flushed);
+  printf("%u small files, %u free sectors left, checkpoint of %u flash operations\n",
+         (unsigned)Flushed, (unsigned)status.freeSectors, (unsigned)check_ops);
+
+  // Power cuts through the file phase, then through the checkpoint
+  for(cut = 0; cut < total + check_ops; cut = (cut < total) ? cut + CUT_STRIDE : cut + 1U){
+    if(cut < total){
+      file_phase((int32_t)cut);
+    } else{
+      file_phase(FLASH_SIM_NO_CUT);
+      Flash_Sim_CutAfter((int32_t)(cut - total));
+      FS_Log_Checkpoint();
+    }
+    flushed = Flushed;
+
+    Flash_Sim_CutAfter(FLASH_SIM_NO_CUT);
+    ok = (OS_File_Mount() == FS_SUCCESS) && files_ok(flushed);
+
+    // Still takes a file (the directory may be full)
+    OS_File_Delete(Files[0]);
+    ok = ok && (OS_File_Flush() == FS_SUCCESS) && small_file(0) && small_file_ok(0) &&
+         (OS_File_Mount() == FS_SUCCESS) && small_file_ok(0);
+
+    if(!ok){
+      printf("FAIL power cut at operation %u (after %u files)\n", (unsigned)cut, (unsigned)flushed);
+      cuts_failed++;
+    }
+    runs++;
+  }
+  Failures += cuts_failed;
+  printf("%u power cuts, %u failures\n", (unsigned)runs, (unsigned)cuts_failed);
+
+  printf("%s\n", Failures ? "FAILED" : "ok");
+  return Failures ? 1 : 0;
+}
@@ -0,0 +1,234 @@
+// Power-fail test for the file system
+// Runs on a POSIX host against Flash_Sim.c
+//
+// A fixed workload (appends, buffered writes, deletes, one flush per step,
+// background reclaims)
+// is first run to completion, saving each file's contents after every
+// flush. It is then rerun once for every flash operation it issues, with
+// power cut on that operation (the write or erase is left torn). After
+// each cut the disk is mounted again and every file must hold either its
+// contents at the last completed flush or a state on the way to the next
+// one; the disk must then still accept new data. Files are read back both
+// a sector at a time and through a handle in odd-sized pieces.
+//
+// Build (small disk so that log compaction and garbage collection run):
+//   gcc -I.. -I. -DDISK_END_ADDRESS=0x00024000U -DSECTOR_SIZE=256U
+//       -DDIRECTORY_SIZE=8U Test_Power_Fail.c Flash_Sim.c ../OS_File_System.c
+//       ../OS_File_Log.c ../OS_File_Wear.c ../OS_File_Cache.c ../OS_File_Handle.c
+//       ../OS_File_Lock.c ../OS_File_Crc.c ../OS_File_Pack.c -o power_fail
+// With the EEPROM journal (cuts then land on EEPROM writes too), add
+//   -DFS_LOG_EEPROM=1 Eeprom_Sim.c
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "OS_File_System.h"
+#include "OS_File_Wear.h"
+#include "OS_File_Log.h"
+#include "Flash_Sim.h"
+#if FS_LOG_EEPROM
+#include "Eeprom_Sim.h"
+#endif
+
+#define FILES                   3U
+#define STEPS                   150U
+#define FILE_LIMIT              (12U * SECTOR_SIZE)     // Delete a file past this size
+#define STREAM_BYTES            (FILE_LIMIT + 2U * SECTOR_SIZE)
+
+typedef struct {
+  uint32_t length;
+  uint8_t data[STREAM_BYTES];
+} Stream_t;
+
+static Stream_t Model[FILES];                 // What each file should hold
+static Stream_t Snapshot[STEPS + 1U][FILES];  // Model after each completed flush
+static Stream_t Mounted;
+static FS_Handle_t Handles[FILES];            // One per file for buffered writes
+static uint32_t Seed;
+static uint32_t Flushes;                      // Flushes completed before the power cut
+
+static uint32_t next_random(void){
+  Seed = Seed*1103515245U + 12345U;
+  return Seed >> 16;
+}
+
+// Read a file back as a byte stream, by sector and again by handle
+static void read_stream(FS_File_t num, Stream_t *s){
+  uint8_t buf[SECTOR_SIZE];
+  uint32_t n;
+  uint16_t got;
+  FS_Sector_t sector = 0;
+  FS_Handle_t h;
+
+  s->length = OS_File_Length(num);
+  for(n = 0; n < s->length; n += SECTOR_SIZE){
+    if((s->length > STREAM_BYTES) || (OS_File_Read(num, sector++, buf) != FS_SUCCESS)){
+      s->length = 0xFFFFFFFFU;            // Unreadable: never matches
+      return;
+    }
+    memcpy(&s->data[n], buf, (s->length - n < SECTOR_SIZE) ? s->length - n : SECTOR_SIZE);
+  }
+
+  h = OS_File_Open(num);
+  n = 0;
+  while((got = OS_File_ReadBytes(h, buf, 37)) != 0){
+    if((n + got > s->length) || (memcmp(&s->data[n], buf, got) != 0)){
+      break;
+    }
+    n += got;
+  }
+  if((OS_File_Close(h) != FS_SUCCESS) || (n != s->length)){
+    s->length = 0xFFFFFFFFU;
+  }
+}
+
+static uint8_t is_prefix(const Stream_t *a, const Stream_t *b){
+  return (a->length <= b->length) && (memcmp(a->data, b->data, a->length) == 0);
+}
+
+// One workload step: a single change to one file, then a flush
+static void step(uint32_t k){
+  uint8_t buf[SECTOR_SIZE];
+  uint32_t r = next_random()%100U;
+  FS_File_t f = (FS_File_t)(next_random()%FILES);
+  uint16_t n;
+  uint16_t i;
+
+  if(Model[f].length > FILE_LIMIT){
+    OS_File_Delete(f);
+    Model[f].length = 0;
+  } else if(r < 40U){
+    // Whole sector: a partly written tail sector is padded out first
+    for(i = 0; i < SECTOR_SIZE; i++){
+      buf[i] = (uint8_t)(k*7U + i);
+    }
+    OS_File_Append(f, buf);
+    while(Model[f].length%SECTOR_SIZE){
+      Model[f].data[Model[f].length++] = 0xFF;
+    }
+    memcpy(&Model[f].data[Model[f].length], buf, SECTOR_SIZE);
+    Model[f].length += SECTOR_SIZE;
+  } else {
+    // Buffered bytes, some written back early
+    n = (uint16_t)(1U + next_random()%(SECTOR_SIZE + SECTOR_SIZE/2U));
+    for(i = 0; i < n; i++){
+      buf[i%SECTOR_SIZE] = (uint8_t)(k*13U + i);
+      OS_File_Write(Handles[f], &buf[i%SECTOR_SIZE], 1);
+      Model[f].data[Model[f].length++] = buf[i%SECTOR_SIZE];
+    }
+    if(r < 60U){
+      OS_File_Background();
+    } else if(r < 70U){
+      OS_File_Sync(f);
+    }
+  }
+
+  // A flush only counts if every write before it had power (after a cut,
+  // a flush with nothing left to write still reports success)
+  if((OS_File_Flush() == FS_SUCCESS) && !Flash_Sim_PowerLost()){
+    Flushes++;
+  }
+
+  // Every other step the idle thread gets a turn; files do not change
+  if((k%2U) == 0U){
+    OS_File_Reclaim();
+  }
+}
+
+static void workload_start(void){
+  FS_File_t f;
+
+  Flash_Sim_Reset();
+#if FS_LOG_EEPROM
+  Eeprom_Sim_Reset();
+#endif
+  OS_FS_Init();
+  OS_File_Format();
+  for(f = 0; f < FILES; f++){
+    Handles[f] = OS_File_Open(f);
+  }
+  memset(Model, 0, sizeof(Model));
+  Seed = 442U;
+  Flushes = 0;
+}
+
+int main(void){
+  uint32_t setupOps;
+  uint32_t totalOps;
+  uint32_t cut;
+  uint32_t k;
+  uint32_t failures = 0;
+  FS_File_t f;
+  FS_Status_t status;
+  uint8_t extra[100];
+  uint8_t ok;
+
+  Flash_Sim_Init();
+
+  // Reference run, no power loss
+  workload_start();
+  setupOps = Flash_Sim_Operations();
+  memcpy(Snapshot[0], Model, sizeof(Model));
+  for(k = 0; k < STEPS; k++){
+    step(k);
+    memcpy(Snapshot[Flushes], Model, sizeof(Model));
+  }
+  totalOps = Flash_Sim_Operations() - setupOps;
+  if(Flushes != STEPS){
+    printf("reference run failed: %u of %u flushes\n", (unsigned)Flushes, (unsigned)STEPS);
+    return 1;
+  }
+
+  // Same run with power cut at each flash operation in turn
+  for(cut = 0; cut < totalOps; cut++){
+    workload_start();
+    Flash_Sim_CutAfter((int32_t)cut);
+    for(k = 0; k < STEPS; k++){
+      step(k);
+    }
+
+    // Power back on
+    Flash_Sim_CutAfter(FLASH_SIM_NO_CUT);
+    ok = (OS_File_Mount() == FS_SUCCESS);
+
+    for(f = 0; ok && (f < FILES); f++){
+      read_stream(f, &Mounted);
+      ok = (Mounted.length == Snapshot[Flushes][f].length &&
+            memcmp(Mounted.data, Snapshot[Flushes][f].data, Mounted.length) == 0) ||
+           ((Flushes < STEPS) && is_prefix(&Mounted, &Snapshot[Flushes + 1U][f]) &&
+            (is_prefix(&Snapshot[Flushes][f], &Mounted) ||
+             (Mounted.length == Snapshot[Flushes + 1U][f].length)));
+    }
+
+    // Counters rebuilt by the mount
+    OS_FS_GetStatus(&status);
+    for(f = 0, k = 0; f < FILES; f++){
+      k += OS_File_Size(f);
+    }
+    ok = ok && (status.usedSectors == k) &&
+         (status.freeSectors == METADATA_SECTOR - WEAR_RESERVE_SECTORS - k);
+
+    // The recovered disk takes new data and keeps it across a mount
+    memset(extra, 0x3C, sizeof(extra));
+    if(ok){
+      read_stream(0, &Model[0]);
+      ok = (OS_File_Write(OS_File_Open(0), extra, sizeof(extra)) == sizeof(extra)) &&
+           (OS_File_Flush() == FS_SUCCESS) && (OS_File_Mount() == FS_SUCCESS);
+      read_stream(0, &Mounted);
+      ok = ok && (Mounted.length <= STREAM_BYTES) &&
+           (Mounted.length >= Model[0].length + sizeof(extra)) &&
+           (memcmp(Mounted.data, Model[0].data, Model[0].length) == 0) &&
+           (memcmp(&Mounted.data[Mounted.length - sizeof(extra)], extra, sizeof(extra)) == 0);
+    }
+
+    if(!ok){
+      printf("FAIL: power cut at operation %u (after %u flushes)\n",
+             (unsigned)cut, (unsigned)Flushes);
+      failures++;
+    }
+  }
+
+  printf("%u power cuts, %u failures\n", (unsigned)totalOps, (unsigned)failures);
+
+  return (failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,545 @@
+// Thread-safety stress test for the file system
+// Runs on a POSIX host against Flash_Sim.c, with FS_THREAD_SAFE 1
+//
+// The kernel calls the lock needs (OS_InitSemaphore, OS_Wait, OS_Signal,
+// OS_Suspend, OS_Sleep) are stood in for by pthreads, and these run at once:
+// - churn threads that take a number with OS_File_New, append a sector,
+//   read it back and delete the file; no two may ever hold one number
+// - appenders that each grow a long file a sector at a time
+// - readers that read back random published sectors of those files
+// - a streaming writer putting odd-sized pieces through a handle, with
+//   syncs, flushes and cache write-backs
+// - a reclaim thread standing in for the idle thread
+// Churn turns over several times the disk, so garbage collection runs
+// under the readers. Afterwards the disk is mounted again and every file
+// must read back whole.
+//
+// Then the disk is formatted, and mounted, while appenders keep going:
+// each call must wait for the appends in flight, so every file left must
+// hold only whole sectors of its own, in order, before and after a remount.
+//
+// Last, a file is deleted while a sector is being appended to it: the
+// appending thread is held inside its program (outside the lock) until
+// the deleting thread has deleted the file, taken a new one and appended
+// to it, or for a few milliseconds if the delete waits. The new file must
+// hold only its own sector, and the deleted one must stay deleted. Every
+// other round the sector is written through a handle instead, so it is a
+// cache write-back that is held, and a read of the file must not wait
+// for it.
+//
+// Flash_Sim.c completes each queued request at once and signals it from
+// the calling thread; only its operation counters are shared unguarded,
+// and this test does not read them.
+//
+// Build:
+//   gcc -O2 -pthread -I.. -I. -DFS_THREAD_SAFE=1 Test_Threads.c Flash_Sim.c
+//       ../OS_File_System.c ../OS_File_Log.c ../OS_File_Wear.c ../OS_File_Cache.c
+//       ../OS_File_Handle.c ../OS_File_Lock.c ../OS_File_Crc.c ../OS_File_Pack.c
+//       -o threads
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "OS_File_System.h"
+#include "Flash_Sim.h"
+
+#if !FS_THREAD_SAFE
+#error "Test_Threads.c needs -DFS_THREAD_SAFE=1"
+#endif
+
+#define CHURN_THREADS           3U
+#define CHURN_ROUNDS            300U
+#define APPEND_THREADS          2U
+#define APPEND_SECTORS          40U
+#define READ_THREADS            2U
+#define STREAM_BYTES            (12U * SECTOR_SIZE + 100U)
+#define STREAM_PIECE            37U
+#define RESET_ROUNDS            20U
+#define DELETE_ROUNDS           50U
+#define DELETE_WAIT_US          5000U   // Appender held at most this long
+
+// Kernel stand-ins: every semaphore shares one mutex and condition
+static pthread_mutex_t Sema_Mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t Sema_Cond = PTHREAD_COND_INITIALIZER;
+static uint32_t Wait_Count;
+
+// Delete-during-append phase
+static FS_File_t Victim_File;
+static __thread uint8_t Victim_Thread;        // This thread's append is to be held
+static uint32_t Victim_Programming;           // It has reached its program (atomic)
+static uint32_t Victim_Held;                  // It is inside victim_hold() (atomic)
+static uint32_t Deleter_Done;                 // Delete and new file done (atomic)
+static pthread_barrier_t Round_Barrier;
+
+// The lock's semaphores are statics; a program's completion semaphore
+// is a local of the waiting thread
+static uint8_t on_stack(const void *p){
+  char here;
+  intptr_t d = (const char *)p - &here;
+
+  return (d > -65536) && (d < 65536);
+}
+
+// The victim waits on its program with the lock released: hold it there
+static void victim_hold(void){
+  uint32_t waited;
+
+  Victim_Thread = 0;
+  __atomic_store_n(&Victim_Held, 1U, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&Victim_Programming, 1U, __ATOMIC_SEQ_CST);
+  for(waited = 0; (waited < DELETE_WAIT_US) && !__atomic_load_n(&Deleter_Done, __ATOMIC_SEQ_CST);
+      waited += 50U){
+    usleep(50);
+  }
+  __atomic_store_n(&Victim_Held, 0U, __ATOMIC_SEQ_CST);
+}
+
+void OS_InitSemaphore(int32_t *s, int32_t value){
+  pthread_mutex_lock(&Sema_Mutex);
+  *s = value;
+  pthread_mutex_unlock(&Sema_Mutex);
+}
+
+void OS_Wait(int32_t *s){
+  if(Victim_Thread && on_stack(s)){
+    victim_hold();
+  }
+  pthread_mutex_lock(&Sema_Mutex);
+  while(*s <= 0){
+    pthread_cond_wait(&Sema_Cond, &Sema_Mutex);
+  }
+  (*s)--;
+  pthread_mutex_unlock(&Sema_Mutex);
+
+  // Real flash takes a while: let others run after an erase or program
+  // (or any wait) so that the windows around them are hit
+  if(__atomic_fetch_add(&Wait_Count, 1U, __ATOMIC_RELAXED)%4U == 0U){
+    usleep(20);
+  }
+}
+
+void OS_Signal(int32_t *s){
+  pthread_mutex_lock(&Sema_Mutex);
+  (*s)++;
+  pthread_cond_broadcast(&Sema_Cond);
+  pthread_mutex_unlock(&Sema_Mutex);
+}
+
+void OS_Suspend(void){
+  sched_yield();
+}
+
+void OS_Sleep(uint32_t ticks){
+  usleep(ticks*1000U);
+}
+
+static FS_File_t Append_File[APPEND_THREADS];
+static uint32_t Published[APPEND_THREADS];    // Sectors appended so far (atomic)
+static FS_File_t Stream_File;
+static uint32_t Owner[DIRECTORY_SIZE];        // Churn thread holding each number, + 1
+static uint32_t Writers_Left;                 // Churn, append and stream threads running
+static uint32_t Failures;
+static uint32_t Resetting;                    // Format phase running
+
+static void fail(const char *what, uint32_t a, uint32_t b){
+  __atomic_fetch_add(&Failures, 1U, __ATOMIC_SEQ_CST);
+  printf("FAIL %s (%u, %u)\n", what, (unsigned)a, (unsigned)b);
+}
+
+static void fill(uint8_t buf[SECTOR_SIZE], uint32_t tag, uint32_t seq){
+  uint32_t i;
+
+  for(i = 0; i < SECTOR_SIZE; i++){
+    buf[i] = (uint8_t)(tag*71U + seq*13U + i*7U + (i >> 8));
+  }
+}
+
+static uint8_t stream_byte(uint32_t n){
+  return (uint8_t)(n*31U + (n >> 9));
+}
+
+static void *churn_thread(void *arg){
+  uint32_t id = (uint32_t)(uintptr_t)arg;
+  uint8_t buf[SECTOR_SIZE];
+  uint8_t back[SECTOR_SIZE];
+  uint32_t round;
+  uint32_t expected;
+  FS_File_t f;
+
+  for(round = 0; round < CHURN_ROUNDS; round++){
+    f = OS_File_New();
+    if(f == FILE_INVALID){
+      OS_File_Reclaim();
+      round--;
+      continue;
+    }
+    expected = 0;
+    if(!__atomic_compare_exchange_n(&Owner[f], &expected, id + 1U, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)){
+      fail("file number handed out twice", f, expected - 1U);
+      continue;
+    }
+
+    fill(buf, 100U + id, round);
+    if(OS_File_Append(f, buf) != FS_SUCCESS){
+      fail("churn append", id, round);
+    } else if((OS_File_Read(f, 0, back) != FS_SUCCESS) || (memcmp(buf, back, SECTOR_SIZE) != 0)){
+      fail("churn read back", id, round);
+    }
+
+    // Released before the delete: the number stays reserved until then
+    __atomic_store_n(&Owner[f], 0U, __ATOMIC_SEQ_CST);
+    if(OS_File_Delete(f) != FS_SUCCESS){
+      fail("churn delete", id, round);
+    }
+  }
+  __atomic_fetch_sub(&Writers_Left, 1U, __ATOMIC_SEQ_CST);
+  return NULL;
+}
+
+static void *append_thread(void *arg){
+  uint32_t id = (uint32_t)(uintptr_t)arg;
+  uint8_t buf[SECTOR_SIZE];
+  uint32_t n;
+
+  for(n = 0; n < APPEND_SECTORS; n++){
+    fill(buf, id, n);
+    if(OS_File_Append(Append_File[id], buf) != FS_SUCCESS){
+      fail("append", id, n);
+      break;
+    }
+    __atomic_store_n(&Published[id], n + 1U, __ATOMIC_SEQ_CST);
+    if((n%8U) == 7U){
+      OS_File_Flush();
+    }
+  }
+  __atomic_fetch_sub(&Writers_Left, 1U, __ATOMIC_SEQ_CST);
+  return NULL;
+}
+
+static void *read_thread(void *arg){
+  uint32_t seed = 12345U + (uint32_t)(uintptr_t)arg;
+  uint8_t buf[SECTOR_SIZE];
+  uint8_t expect[SECTOR_SIZE];
+  uint32_t k;
+  uint32_t count;
+  uint32_t s;
+
+  while(__atomic_load_n(&Writers_Left, __ATOMIC_SEQ_CST) != 0){
+    seed = seed*1103515245U + 12345U;
+    k = (seed >> 16)%APPEND_THREADS;
+    count = __atomic_load_n(&Published[k], __ATOMIC_SEQ_CST);
+    if(count == 0){
+      sched_yield();
+      continue;
+    }
+    s = (seed >> 8)%count;
+    fill(expect, k, s);
+    if(OS_File_Size(Append_File[k]) < count){
+      fail("size behind appends", k, count);
+    }
+    if((OS_File_Read(Append_File[k], (FS_Sector_t)s, buf) != FS_SUCCESS) ||
+       (memcmp(buf, expect, SECTOR_SIZE) != 0)){
+      fail("torn or wrong sector", k, s);
+    }
+  }
+  return NULL;
+}
+
+static void *stream_thread(void *arg){
+  uint8_t piece[STREAM_PIECE];
+  uint32_t n = 0;
+  uint32_t i;
+  uint32_t len;
+  uint32_t pieces = 0;
+  FS_Handle_t h = OS_File_Open(Stream_File);
+
+  (void)arg;
+  if(h == HANDLE_INVALID){
+    fail("stream open", 0, 0);
+  }
+  while((h != HANDLE_INVALID) && (n < STREAM_BYTES)){
+    len = (STREAM_BYTES - n < STREAM_PIECE) ? STREAM_BYTES - n : STREAM_PIECE;
+    for(i = 0; i < len; i++){
+      piece[i] = stream_byte(n + i);
+    }
+    if(OS_File_Write(h, piece, (uint16_t)len) != len){
+      fail("stream write", n, len);
+      break;
+    }
+    n += len;
+    pieces++;
+    if((pieces%16U) == 0U){
+      OS_File_Sync(Stream_File);
+      OS_File_Flush();
+    } else if((pieces%5U) == 0U){
+      OS_File_Background();
+    }
+  }
+  if((h != HANDLE_INVALID) && ((OS_File_Close(h) != FS_SUCCESS) || (OS_File_Flush() != FS_SUCCESS))){
+    fail("stream close", n, 0);
+  }
+  __atomic_fetch_sub(&Writers_Left, 1U, __ATOMIC_SEQ_CST);
+  return NULL;
+}
+
+static void *reclaim_thread(void *arg){
+  (void)arg;
+  while(__atomic_load_n(&Writers_Left, __ATOMIC_SEQ_CST) != 0){
+    if(OS_File_Reclaim() != FS_SUCCESS){
+      sched_yield();
+    }
+  }
+  return NULL;
+}
+
+// Append to the thread's own file until the format phase is over
+static void *reset_append_thread(void *arg){
+  uint32_t id = (uint32_t)(uintptr_t)arg;
+  uint8_t buf[SECTOR_SIZE];
+  uint32_t n = 0;
+
+  while(__atomic_load_n(&Resetting, __ATOMIC_SEQ_CST)){
+    fill(buf, id, n++);
+    if(OS_File_Append(Append_File[id], buf) != FS_SUCCESS){
+      OS_File_Reclaim();
+    }
+  }
+  return NULL;
+}
+
+// Append one sector to a new file each round, held mid-program; odd
+// rounds write it through a handle, written back when the handle closes
+static void *victim_thread(void *arg){
+  uint8_t buf[SECTOR_SIZE];
+  uint32_t round;
+  FS_Handle_t h;
+
+  (void)arg;
+  for(round = 0; round < DELETE_ROUNDS; round++){
+    Victim_File = OS_File_New();
+    __atomic_store_n(&Victim_Programming, 0U, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&Deleter_Done, 0U, __ATOMIC_SEQ_CST);
+    pthread_barrier_wait(&Round_Barrier);
+
+    fill(buf, 200U, round);
+    if(round%2U){
+      h = OS_File_Open(Victim_File);
+      OS_File_Write(h, buf, SECTOR_SIZE);
+      Victim_Thread = 1;
+      OS_File_Close(h);
+    } else{
+      Victim_Thread = 1;
+      OS_File_Append(Victim_File, buf);
+    }
+    Victim_Thread = 0;
+    __atomic_store_n(&Victim_Programming, 1U, __ATOMIC_SEQ_CST);   // Even if it never programmed
+    pthread_barrier_wait(&Round_Barrier);
+    pthread_barrier_wait(&Round_Barrier);                          // Round checked
+  }
+  return NULL;
+}
+
+// Delete the victim's file mid-append, then take a number and append
+static void *deleter_thread(void *arg){
+  uint8_t buf[SECTOR_SIZE];
+  uint8_t back[SECTOR_SIZE];
+  uint32_t round;
+  FS_File_t deleted;
+  FS_File_t f;
+
+  (void)arg;
+  for(round = 0; round < DELETE_ROUNDS; round++){
+    pthread_barrier_wait(&Round_Barrier);
+    while(!__atomic_load_n(&Victim_Programming, __ATOMIC_SEQ_CST)){
+      sched_yield();
+    }
+    deleted = Victim_File;
+    if((round%2U) && __atomic_load_n(&Victim_Held, __ATOMIC_SEQ_CST)){
+      // The write-back programs with the lock released: readers go on
+      OS_File_Exists(deleted);
+      if(!__atomic_load_n(&Victim_Held, __ATOMIC_SEQ_CST)){
+        fail("read waited for a cache write-back", round, deleted);
+      }
+    }
+    OS_File_Delete(deleted);
+    f = OS_File_New();
+    fill(buf, 300U, round);
+    if((f == FILE_INVALID) || (OS_File_Append(f, buf) != FS_SUCCESS)){
+      fail("append after a delete", round, f);
+    }
+    __atomic_store_n(&Deleter_Done, 1U, __ATOMIC_SEQ_CST);
+    pthread_barrier_wait(&Round_Barrier);
+
+    // Both done: the new file is only its own, the deleted one is gone
+    if((f != FILE_INVALID) && ((OS_File_Size(f) != 1U) || (OS_File_Read(f, 0, back) != FS_SUCCESS) ||
+                               (memcmp(buf, back, SECTOR_SIZE) != 0))){
+      fail("deleted file's sector in a new file", round, f);
+    }
+    if((f != deleted) && OS_File_Exists(deleted)){
+      fail("deleted file came back", round, deleted);
+    }
+    OS_File_Delete(deleted);
+    OS_File_Delete(f);
+    while(OS_File_Reclaim() == FS_SUCCESS){
+    }
+    pthread_barrier_wait(&Round_Barrier);
+  }
+  return NULL;
+}
+
+// Every sector of an appender's file is one of its own, in order
+static void check_reset_file(uint32_t k){
+  uint8_t buf[SECTOR_SIZE];
+  uint8_t expect[SECTOR_SIZE];
+  FS_Sector_t size = OS_File_Size(Append_File[k]);
+  FS_Sector_t s;
+  uint32_t seq = 0;
+
+  for(s = 0; s < size; s++){
+    if(OS_File_Read(Append_File[k], s, buf) != FS_SUCCESS){
+      fail("read after format", k, s);
+      return;
+    }
+    do{
+      fill(expect, k, seq++);
+    } while((memcmp(buf, expect, SECTOR_SIZE) != 0) && (seq < 100000U));
+    if(seq >= 100000U){
+      fail("foreign sector after format", k, s);
+      return;
+    }
+  }
+}
+
+int main(void){
+  pthread_t threads[CHURN_THREADS + APPEND_THREADS + READ_THREADS + 2U];
+  uint8_t buf[SECTOR_SIZE];
+  uint8_t expect[SECTOR_SIZE];
+  uint32_t t = 0;
+  uint32_t i;
+  uint32_t k;
+  uint32_t n;
+  uint16_t got;
+  FS_Handle_t h;
+
+  Flash_Sim_Init();
+  OS_FS_Init();
+  if(OS_File_Format() != FS_SUCCESS){
+    printf("format failed\n");
+    return 1;
+  }
+
+  // Numbers taken before the threads start must stay distinct too
+  for(k = 0; k < APPEND_THREADS; k++){
+    Append_File[k] = OS_File_New();
+  }
+  Stream_File = OS_File_New();
+  for(k = 0; k < APPEND_THREADS; k++){
+    if((Append_File[k] == FILE_INVALID) || (Append_File[k] == Stream_File) ||
+       ((k > 0) && (Append_File[k] == Append_File[k - 1U]))){
+      printf("OS_File_New gave %u twice before any append\n", (unsigned)Append_File[k]);
+      return 1;
+    }
+  }
+
+  Writers_Left = CHURN_THREADS + APPEND_THREADS + 1U;
+  for(i = 0; i < CHURN_THREADS; i++){
+    pthread_create(&threads[t++], NULL, churn_thread, (void *)(uintptr_t)i);
+  }
+  for(i = 0; i < APPEND_THREADS; i++){
+    pthread_create(&threads[t++], NULL, append_thread, (void *)(uintptr_t)i);
+  }
+  for(i = 0; i < READ_THREADS; i++){
+    pthread_create(&threads[t++], NULL, read_thread, (void *)(uintptr_t)i);
+  }
+  pthread_create(&threads[t++], NULL, stream_thread, NULL);
+  pthread_create(&threads[t++], NULL, reclaim_thread, NULL);
+  for(i = 0; i < t; i++){
+    pthread_join(threads[i], NULL);
+  }
+
+  // Everything survives a remount
+  if(OS_File_Flush() != FS_SUCCESS){
+    fail("final flush", 0, 0);
+  }
+  if(OS_File_Mount() != FS_SUCCESS){
+    fail("remount", 0, 0);
+  }
+  for(k = 0; k < APPEND_THREADS; k++){
+    if(OS_File_Size(Append_File[k]) != APPEND_SECTORS){
+      fail("file size after remount", k, OS_File_Size(Append_File[k]));
+      continue;
+    }
+    for(n = 0; n < APPEND_SECTORS; n++){
+      fill(expect, k, n);
+      if((OS_File_Read(Append_File[k], (FS_Sector_t)n, buf) != FS_SUCCESS) ||
+         (memcmp(buf, expect, SECTOR_SIZE) != 0)){
+        fail("sector after remount", k, n);
+      }
+    }
+  }
+  h = OS_File_Open(Stream_File);
+  n = 0;
+  while((got = OS_File_ReadBytes(h, buf, STREAM_PIECE)) != 0){
+    for(i = 0; i < got; i++){
+      if(buf[i] != stream_byte(n + i)){
+        break;
+      }
+    }
+    if(i != got){
+      break;
+    }
+    n += got;
+  }
+  OS_File_Close(h);
+  if(n != STREAM_BYTES){
+    fail("stream after remount", n, STREAM_BYTES);
+  }
+  for(i = 0; i <= MAX_FILE_NUMBER; i++){
+    if(OS_File_Exists((FS_File_t)i) && (i != Stream_File) &&
+       (i != Append_File[0]) && (i != Append_File[APPEND_THREADS - 1U])){
+      fail("churn file left behind", i, 0);
+    }
+  }
+
+  // Format and mount with appends in flight
+  Resetting = 1;
+  t = 0;
+  for(i = 0; i < APPEND_THREADS; i++){
+    pthread_create(&threads[t++], NULL, reset_append_thread, (void *)(uintptr_t)i);
+  }
+  for(n = 0; n < RESET_ROUNDS; n++){
+    if(((n%2U) ? OS_File_Mount() : OS_File_Format()) != FS_SUCCESS){
+      fail("format or mount under appends", n, 0);
+    }
+    sched_yield();
+  }
+  __atomic_store_n(&Resetting, 0U, __ATOMIC_SEQ_CST);
+  for(i = 0; i < t; i++){
+    pthread_join(threads[i], NULL);
+  }
+  OS_File_Flush();
+  for(k = 0; k < APPEND_THREADS; k++){
+    check_reset_file(k);
+  }
+  OS_File_Mount();
+  for(k = 0; k < APPEND_THREADS; k++){
+    check_reset_file(k);
+  }
+
+  // Delete with an append to the file in flight
+  OS_File_Format();
+  pthread_barrier_init(&Round_Barrier, NULL, 2U);
+  pthread_create(&threads[0], NULL, victim_thread, NULL);
+  pthread_create(&threads[1], NULL, deleter_thread, NULL);
+  pthread_join(threads[0], NULL);
+  pthread_join(threads[1], NULL);
+  pthread_barrier_destroy(&Round_Barrier);
+
+  printf("%u churn files, %u appended sectors, %u stream bytes, %u deletes mid-append: %s\n",
+         (unsigned)(CHURN_THREADS*CHURN_ROUNDS), (unsigned)(APPEND_THREADS*APPEND_SECTORS),
+         (unsigned)STREAM_BYTES, (unsigned)DELETE_ROUNDS, Failures ? "FAILED" : "ok");
+  return Failures ? 1 : 0;
+}
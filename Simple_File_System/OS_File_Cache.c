@@ -0,0 +1,432 @@
+// *****************************************************************************
+// OS_File_Cache.c - Write-Back Sector Cache Implementation
+// Runs on LM4F120/TM4C123
+// OS_File_Write() only copies bytes into a RAM line. A line is programmed
+// when it fills (or later, from OS_File_Background()), and on
+// OS_File_Sync()/OS_File_Flush(). A partly filled line that is synced keeps
+// its sector: the next write-back programs the rest of it, re-programming
+// the last partial word over its 0xFF padding (flash programming only
+// clears bits, so the bytes already there are unchanged). The same holds
+// after a mount, when the first write to a file reopens its partial tail.
+//
+// All cache functions run under the file system's write lock
+// (OS_File_Lock.c). A full line going to a sector of its own is programmed
+// with the lock released, as OS_File_Append() does: its sector is BUSY,
+// writers skip a full line, and it counts as an append in flight, so a
+// delete, format or mount waits for it. Lines of a file join its chain in
+// the order they were claimed, so no line of a file is written back while
+// another of that file is in flight. Topping up a placed (synced) line
+// stays under the lock: its sector is already in the chain, where garbage
+// collection may move it.
+//
+// *****************************************************************************
+
+#include "OS_File_Cache.h"
+#include "OS_File_Log.h"
+#include "OS_File_Wear.h"
+#include "OS_File_System.h"
+#include "OS_File_Lock.h"
+#include "OS_File_Crc.h"
+#include "OS_File_Handle.h"
+#include <stdint.h>
+
+// =============================================================================
+// CACHE STATE
+// =============================================================================
+static FS_CacheLine_t Cache[FS_CACHE_LINES];
+static uint32_t NextOrder;                      // Order stamp for the next claim
+
+// =============================================================================
+// HELPER FUNCTIONS
+// =============================================================================
+
+static void line_release(FS_CacheLine_t *line) {
+    uint16_t i;
+
+    for (i = 0; i < SECTOR_SIZE; i++) {
+        line->data[i] = 0xFF;
+    }
+
+    line->fill = 0;
+    line->written = 0;
+    line->placed = 0;
+    line->file = FILE_INVALID;
+}
+
+// Line still accepting bytes for this file
+static FS_CacheLine_t *line_open(FS_File_t num) {
+    uint8_t i;
+
+    for (i = 0; i < FS_CACHE_LINES; i++) {
+        if ((Cache[i].file == num) && (Cache[i].fill < SECTOR_SIZE)) {
+            return &Cache[i];
+        }
+    }
+
+    return 0;
+}
+
+// Oldest line (of one file, or of any file when num is FILE_INVALID),
+// optionally only among full ones
+static FS_CacheLine_t *line_oldest(FS_File_t num, uint8_t fullOnly) {
+    FS_CacheLine_t *oldest = 0;
+    uint8_t i;
+
+    for (i = 0; i < FS_CACHE_LINES; i++) {
+        if ((Cache[i].file == FILE_INVALID) ||
+            ((num != FILE_INVALID) && (Cache[i].file != num)) ||
+            (fullOnly && (Cache[i].fill < SECTOR_SIZE))) {
+            continue;
+        }
+
+        if ((oldest == 0) || ((int32_t)(Cache[i].order - oldest->order) < 0)) {
+            oldest = &Cache[i];
+        }
+    }
+
+    return oldest;
+}
+
+// Oldest line as line_oldest(), once no write-back of its file is in
+// flight; the lock is released while waiting, so the choice is made again
+static FS_CacheLine_t *line_ready(FS_File_t num, uint8_t fullOnly) {
+    FS_CacheLine_t *line;
+
+    while (1) {
+        line = line_oldest(num, fullOnly);
+        if ((line == 0) || !file_appending(line->file)) {
+            return line;
+        }
+        FS_Lock_WaitAppend();
+    }
+}
+
+// Take a free line; with nothing else cached for the file, a partly
+// written tail sector on flash is reopened so appends continue in it
+static FS_CacheLine_t *line_claim(FS_File_t num) {
+    FS_CacheLine_t *line = 0;
+    uint8_t *flashPtr;
+    uint16_t i;
+
+    for (i = 0; i < FS_CACHE_LINES; i++) {
+        if (Cache[i].file == FILE_INVALID) {
+            line = &Cache[i];
+            break;
+        }
+    }
+
+    if (line == 0) {
+        return 0;
+    }
+
+    if (!FS_Cache_Holds(num) && (tail_sector(num) != SECTOR_FREE) &&
+        (tail_length(num) < SECTOR_SIZE)) {
+        flashPtr = (uint8_t *)(uintptr_t)(DISK_START_ADDRESS + ((uint32_t)tail_sector(num) * SECTOR_SIZE));
+
+        // Power lost before a TAIL record was committed can leave bytes past
+        // the recorded length; such a sector is not reopened
+        for (i = tail_length(num); (i < SECTOR_SIZE) && (flashPtr[i] == 0xFF); i++) {
+        }
+
+        if (i == SECTOR_SIZE) {
+            for (i = 0; i < tail_length(num); i++) {
+                line->data[i] = flashPtr[i];
+            }
+
+            line->fill = tail_length(num);
+            line->written = line->fill;
+            line->placed = 1;
+        }
+    }
+
+    line->order = NextOrder++;
+    line->file = num;
+
+    return line;
+}
+
+// Program the words holding the bytes from written up to fill
+static uint8_t line_program(FS_CacheLine_t *line, FS_Sector_t sector) {
+    uint32_t addr = DISK_START_ADDRESS + ((uint32_t)sector * SECTOR_SIZE);
+    uint16_t start = line->written & ~3U;
+    uint16_t end = (uint16_t)((line->fill + 3U) & ~3U);
+
+    // Bytes past fill are 0xFF, so the last word leaves them erased
+    if (program_bytes(addr + start, &line->data[start], (uint16_t)(end - start)) != FS_SUCCESS) {
+        return FS_ERROR;
+    }
+
+    line->written = line->fill;
+
+    return FS_SUCCESS;
+}
+
+// Push a line's new bytes to flash and record them in the metadata log;
+// a full line is released afterwards. No other write-back of the line's
+// file may be in flight (line_ready()).
+static uint8_t line_write_back(FS_CacheLine_t *line) {
+    FS_File_t num = line->file;
+    FS_Sector_t sector;
+    uint8_t result;
+
+    if (line->written == line->fill) {
+        if (line->fill == SECTOR_SIZE) {
+            line_release(line);
+        }
+        return FS_SUCCESS;
+    }
+
+    if (!line->placed) {
+        // The file's old tail is about to be padded out
+        if (seal_tail(line->file) != FS_SUCCESS) {
+            return FS_ERROR;
+        }
+
+        sector = find_free_sector();
+        if (sector == SECTOR_FREE) {
+            return FS_DISK_FULL;
+        }
+
+        if (line->fill == SECTOR_SIZE) {
+            // Nothing writes to a full line, and the sector is BUSY
+            append_begin(num);
+            FS_Unlock_Write();
+            result = line_program(line, sector);
+            FS_Lock_Write();
+            append_done(num);
+        } else {
+            result = line_program(line, sector);
+        }
+
+        // Linked only once the log knows it
+        if (result == FS_SUCCESS) {
+            result = FS_Log_Record(LOG_REC_APPEND, num, sector);
+        }
+
+        if (result != FS_SUCCESS) {
+            FS_Wear_MarkDirty(sector);      // Programmed, or partly - reclaim later
+            line->written = 0;
+            return FS_ERROR;
+        }
+
+        append_fat(num, sector);
+        line->placed = 1;
+    } else {
+        // Placed lines are always the file's tail, wherever GC moved it
+        if (line_program(line, tail_sector(line->file)) != FS_SUCCESS) {
+            return FS_ERROR;
+        }
+    }
+
+    // The line is the whole sector image, 0xFF past fill
+    sector = tail_sector(line->file);
+    FS_Crc_Set(sector, FS_Crc32(line->data, SECTOR_SIZE),
+               FS_VERIFY_WRITES ? CRC_STATE_CHECKED : CRC_STATE_UNCHECKED);
+
+    if (FS_Log_Record(LOG_REC_CRC, sector, FS_Crc_Get(sector)) != FS_SUCCESS) {
+        return FS_ERROR;
+    }
+
+    // append_fat() assumes a full sector; record anything shorter
+    if (tail_length(line->file) != line->fill) {
+        set_tail_length(line->file, line->fill);
+
+        if (FS_Log_Record(LOG_REC_TAIL, line->file, line->fill) != FS_SUCCESS) {
+            return FS_ERROR;
+        }
+    }
+
+    if (line->fill == SECTOR_SIZE) {
+        line_release(line);
+    }
+
+    return FS_SUCCESS;
+}
+
+// Write back a file's full lines in order
+static uint8_t cache_write_full(FS_File_t num) {
+    FS_CacheLine_t *line;
+
+    while ((line = line_ready(num, 1)) != 0) {
+        if (line_write_back(line) != FS_SUCCESS) {
+            return FS_ERROR;
+        }
+    }
+
+    return FS_SUCCESS;
+}
+
+// Free a line for a new claim: the oldest full line if there is one, else
+// the oldest partial line (written back, then reopened from flash on demand)
+static uint8_t line_evict(void) {
+    FS_CacheLine_t *line = line_ready(FILE_INVALID, 1);
+
+    if (line == 0) {
+        line = line_ready(FILE_INVALID, 0);
+    }
+
+    if (line == 0) {
+        return FS_SUCCESS;          // All freed while waiting
+    }
+
+    if (line_write_back(line) != FS_SUCCESS) {
+        return FS_ERROR;
+    }
+
+    if (line->file != FILE_INVALID) {
+        line_release(line);
+    }
+
+    return FS_SUCCESS;
+}
+
+// =============================================================================
+// CACHE FUNCTIONS
+// =============================================================================
+
+void FS_Cache_Init(void) {
+    uint8_t i;
+
+    for (i = 0; i < FS_CACHE_LINES; i++) {
+        line_release(&Cache[i]);
+    }
+
+    NextOrder = 0;
+}
+
+uint8_t FS_Cache_Holds(FS_File_t num) {
+    uint8_t i;
+
+    for (i = 0; i < FS_CACHE_LINES; i++) {
+        if (Cache[i].file == num) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+uint8_t FS_Cache_Close(FS_File_t num) {
+    FS_CacheLine_t *line;
+
+    if (FS_Cache_Sync(num) != FS_SUCCESS) {
+        return FS_ERROR;
+    }
+
+    // Anything left is a synced partial line - stop appending to it
+    line = line_open(num);
+    if (line != 0) {
+        line_release(line);
+    }
+
+    return FS_SUCCESS;
+}
+
+void FS_Cache_Discard(FS_File_t num) {
+    uint8_t i;
+
+    for (i = 0; i < FS_CACHE_LINES; i++) {
+        if (Cache[i].file == num) {
+            line_release(&Cache[i]);
+        }
+    }
+}
+
+uint16_t FS_Cache_Write(FS_File_t num, const uint8_t *data, uint16_t len) {
+    FS_CacheLine_t *line;
+    uint16_t done = 0;
+    uint16_t room;
+
+    // Validate file number
+    if ((num > MAX_FILE_NUMBER) || (data == 0)) {
+        return 0;
+    }
+
+    while (done < len) {
+        line = line_open(num);
+
+        if (line == 0) {
+            line = line_claim(num);
+
+            // No free line: the producer outran the background writer, or
+            // more files are being written than there are lines
+            if (line == 0) {
+                if (line_evict() != FS_SUCCESS) {
+                    break;
+                }
+                continue;
+            }
+        }
+
+        room = SECTOR_SIZE - line->fill;
+        if (room > len - done) {
+            room = len - done;
+        }
+
+        while (room > 0) {
+            line->data[line->fill] = data[done];
+            line->fill++;
+            done++;
+            room--;
+        }
+
+#if FS_CACHE_BACKGROUND == 0
+        if ((line->fill == SECTOR_SIZE) && (cache_write_full(num) != FS_SUCCESS)) {
+            break;
+        }
+#endif
+    }
+
+    return done;
+}
+
+uint8_t FS_Cache_Sync(FS_File_t num) {
+    FS_CacheLine_t *line;
+
+    // Full lines in order, then the partial one (which stays cached); the
+    // lock has been held since the last wait, so none is in flight
+    if (cache_write_full(num) != FS_SUCCESS) {
+        return FS_ERROR;
+    }
+
+    line = line_open(num);
+    if ((line != 0) && (line_write_back(line) != FS_SUCCESS)) {
+        return FS_ERROR;
+    }
+
+    return FS_SUCCESS;
+}
+
+// =============================================================================
+// BUFFERED WRITE FUNCTIONS
+// =============================================================================
+
+uint8_t OS_File_Sync(FS_File_t num) {
+    uint8_t result;
+
+    // Runs held back by compressed-file writers first
+    FS_Lock_Write();
+    result = FS_Handle_Drain(num);
+    if (result == FS_SUCCESS) {
+        result = FS_Cache_Sync(num);
+    }
+    FS_Unlock_Write();
+
+    return result;
+}
+
+uint8_t OS_File_Background(void) {
+    FS_CacheLine_t *line;
+    uint8_t result = FS_NO_DATA;    // Nothing waiting
+
+    FS_Lock_Write();
+
+    line = line_ready(FILE_INVALID, 1);
+    if (line != 0) {
+        result = line_write_back(line);
+    }
+
+    FS_Unlock_Write();
+
+    return result;
+}
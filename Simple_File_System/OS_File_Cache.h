@@ -0,0 +1,60 @@
+// *****************************************************************************
+// OS_File_Cache.h - Write-Back Sector Cache Header
+// Runs on LM4F120/TM4C123
+// Small RAM cache that collects byte-granular OS_File_Write() data into
+// whole sectors so producers never program flash themselves
+//
+// *****************************************************************************
+
+#ifndef __OS_FILE_CACHE_H__
+#define __OS_FILE_CACHE_H__
+
+#include <stdint.h>
+#include "OS_File_System.h"
+
+// =============================================================================
+// CONFIGURATION CONSTANTS
+// =============================================================================
+
+// Number of sector-sized RAM buffers shared by all files
+#ifndef FS_CACHE_LINES
+#define FS_CACHE_LINES          2U
+#endif
+
+// 0: a line is written back by OS_File_Write() as soon as it fills
+// 1: full lines wait for OS_File_Background(); OS_File_Write() only writes
+//    one back itself when every line is full
+#ifndef FS_CACHE_BACKGROUND
+#define FS_CACHE_BACKGROUND     1
+#endif
+
+// =============================================================================
+// TYPE DEFINITIONS
+// =============================================================================
+
+typedef struct {
+    FS_File_t file;             // Owning file, FILE_INVALID when the line is free
+    uint8_t placed;             // Nonzero once the line has a sector (the file's tail)
+    uint16_t fill;              // Bytes buffered
+    uint16_t written;           // Bytes already programmed to flash
+    uint32_t order;             // Claim order, so lines are written back in sequence
+    uint8_t data[SECTOR_SIZE];  // Sector image, 0xFF past fill
+} FS_CacheLine_t;
+
+// =============================================================================
+// CACHE FUNCTIONS
+// =============================================================================
+
+void FS_Cache_Init(void);
+
+uint8_t FS_Cache_Holds(FS_File_t num);
+
+uint16_t FS_Cache_Write(FS_File_t num, const uint8_t *data, uint16_t len);
+
+uint8_t FS_Cache_Sync(FS_File_t num);
+
+uint8_t FS_Cache_Close(FS_File_t num);
+
+void FS_Cache_Discard(FS_File_t num);
+
+#endif // __OS_FILE_CACHE_H__
@@ -0,0 +1,60 @@
+// *****************************************************************************
+// OS_File_Crc.h - Sector Integrity Header
+// Runs on LM4F120/TM4C123
+// CRC32 of every data sector, kept in RAM and in the metadata log and
+// checked the first time the sector is read, plus optional read-back of
+// everything programmed
+//
+// *****************************************************************************
+
+#ifndef __OS_FILE_CRC_H__
+#define __OS_FILE_CRC_H__
+
+#include <stdint.h>
+#include "OS_File_System.h"
+
+// =============================================================================
+// CONFIGURATION CONSTANTS
+// =============================================================================
+
+// 1: read back every programmed word and fail the write if flash does not
+//    hold what was asked for (a word programmed twice keeps old AND new);
+//    costs a second pass over every sector written
+// 0: trust the flash controller; a bad sector is still caught by its CRC
+//    on the first read, and a bad log record by its group checksum
+#ifndef FS_VERIFY_WRITES
+#define FS_VERIFY_WRITES        0
+#endif
+
+// Per-sector CRC states
+#define CRC_STATE_NONE          0U              // No CRC known (free, or logged without one)
+#define CRC_STATE_UNCHECKED     1U              // Known, flash not yet compared against it
+#define CRC_STATE_CHECKED       2U              // Flash matched it since it was set
+
+#define CRC_INITIAL             0xFFFFFFFFU     // FS_Crc_Update() starting state
+
+// =============================================================================
+// CRC FUNCTIONS
+// =============================================================================
+
+void FS_Crc_Init(void);
+
+uint32_t FS_Crc_Update(uint32_t state, const uint8_t *data, uint32_t len);
+
+uint32_t FS_Crc32(const uint8_t *data, uint32_t len);
+
+void FS_Crc_Set(FS_Sector_t sector, uint32_t crc, uint8_t state);
+
+uint32_t FS_Crc_Get(FS_Sector_t sector);
+
+uint8_t FS_Crc_State(FS_Sector_t sector);
+
+void FS_Crc_Move(FS_Sector_t old, FS_Sector_t n);
+
+void FS_Crc_Forget(FS_Sector_t sector);
+
+uint8_t FS_Crc_Check(FS_Sector_t sector, uint16_t valid);
+
+uint8_t FS_Crc_Verify(uint32_t addr, const uint8_t *data, uint16_t len);
+
+#endif // __OS_FILE_CRC_H__
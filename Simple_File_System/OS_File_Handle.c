@@ -0,0 +1,372 @@
+// *****************************************************************************
+// OS_File_Handle.c - Streaming File Handle Implementation
+// Runs on LM4F120/TM4C123
+// A handle is a file plus a read position. Writes always go to the end of
+// the file (the disk is write-once) through the write-back cache, whose
+// lines are the handles' sector buffers. Reads copy straight from the
+// memory-mapped flash sector, so no buffer is needed for them; bytes still
+// in the cache become readable once written back (OS_File_Sync(),
+// OS_File_Background() or OS_File_Close()).
+//
+// A handle belongs to the thread that opened it. Reads take the file
+// system's read lock, so threads reading through their own handles do not
+// wait for each other.
+//
+// Each handle remembers the sector its position is in, so sequential reads
+// follow one FAT link per sector instead of walking the chain from the
+// start. Garbage collection can move sectors, so the remembered sector is
+// only trusted while fat_generation() is unchanged.
+//
+// Each sector is checked against its CRC the first time any read reaches
+// it (OS_File_Crc.c); a read stops short at a sector that fails.
+//
+// On a compressed file (OS_File_SetMode) a handle writes and reads whole
+// int32_t samples; its coder (OS_File_Pack.c) sits between the caller and
+// the stored bytes. A run of unchanged samples is held in the handle until
+// a changed sample, OS_File_Sync(), OS_File_Flush() or OS_File_Close().
+// Seeking counts decoded bytes and decodes from the start of the file;
+// OS_File_Length() and OS_File_Read() see the stored, compressed bytes.
+//
+// *****************************************************************************
+
+#include "OS_File_Handle.h"
+#include "OS_File_Cache.h"
+#include "OS_File_System.h"
+#include "OS_File_Lock.h"
+#include "OS_File_Crc.h"
+#include <stdint.h>
+
+// =============================================================================
+// HANDLE STATE
+// =============================================================================
+static FS_OpenFile_t Handle[FS_HANDLES];
+
+// =============================================================================
+// HELPER FUNCTIONS
+// =============================================================================
+
+static FS_OpenFile_t *handle_get(FS_Handle_t h) {
+    if ((h >= FS_HANDLES) || (Handle[h].file == FILE_INVALID)) {
+        return 0;
+    }
+
+    return &Handle[h];
+}
+
+// Find the sector holding the handle's position; 0 past the last sector
+static uint8_t handle_locate(FS_OpenFile_t *open) {
+    FS_Sector_t target = (FS_Sector_t)(open->position / SECTOR_SIZE);
+    FS_Sector_t sector;
+    FS_Sector_t i;
+
+    if ((open->sector != SECTOR_FREE) && (open->generation == fat_generation())) {
+        if (open->index == target) {
+            return 1;
+        }
+
+        // Next sector of a sequential read
+        if ((open->index + 1U == target) && (RAM_FAT[open->sector] != SECTOR_FREE)) {
+            open->sector = RAM_FAT[open->sector];
+            open->index = target;
+            return 1;
+        }
+    }
+
+    sector = RAM_Directory[open->file];
+
+    for (i = 0; (i < target) && (sector != SECTOR_FREE); i++) {
+        sector = RAM_FAT[sector];
+    }
+
+    if (sector == SECTOR_FREE) {
+        return 0;
+    }
+
+    open->sector = sector;
+    open->index = target;
+    open->generation = fat_generation();
+
+    return 1;
+}
+
+// Copy stored bytes from the handle's position; caller holds the read lock
+static uint16_t handle_read_raw(FS_OpenFile_t *open, uint8_t *data, uint16_t len) {
+    uint8_t *flashPtr;
+    uint16_t done = 0;
+    uint16_t offset;
+    uint16_t avail;
+
+    while ((done < len) && handle_locate(open)) {
+        // Every sector but the last is whole
+        offset = (uint16_t)(open->position % SECTOR_SIZE);
+        avail = (RAM_FAT[open->sector] == SECTOR_FREE) ? tail_length(open->file) : SECTOR_SIZE;
+
+        // A sector failing its CRC ends the read like end of file
+        if (FS_Crc_Check(open->sector, avail) != FS_SUCCESS) {
+            break;
+        }
+
+        if (offset >= avail) {
+            break;  // End of file
+        }
+
+        avail -= offset;
+        if (avail > len - done) {
+            avail = len - done;
+        }
+
+        flashPtr = (uint8_t *)(uintptr_t)(DISK_START_ADDRESS + ((uint32_t)open->sector * SECTOR_SIZE) + offset);
+        open->position += avail;
+
+        while (avail > 0) {
+            data[done++] = *flashPtr++;
+            avail--;
+        }
+    }
+
+    return done;
+}
+
+// Decode samples into data; caller holds the read lock
+static uint16_t handle_read_packed(FS_OpenFile_t *open, uint8_t *data, uint16_t len) {
+    FS_Pack_t *pack = &open->reader;
+    uint16_t done = 0;
+    uint8_t byte;
+
+    while (done < len) {
+        if (pack->used < PACK_SAMPLE_BYTES) {
+            data[done++] = pack->sample[pack->used++];
+            open->decoded++;
+        } else if (!FS_Pack_Next(pack)) {
+            // The pending run is used up: the next token comes from flash
+            if (handle_read_raw(open, &byte, 1) == 0) {
+                break;
+            }
+            FS_Pack_Feed(pack, byte);
+        }
+    }
+
+    return done;
+}
+
+// Encode whole samples into the cache; caller holds the write lock
+static uint16_t handle_write_packed(FS_OpenFile_t *open, const uint8_t *data, uint16_t len) {
+    uint8_t out[2U * PACK_TOKEN_BYTES + 1U];
+    uint16_t done = 0;
+    uint8_t n;
+
+    while (done + PACK_SAMPLE_BYTES <= len) {
+        n = FS_Pack_Encode(&open->writer, &data[done], out);
+
+        if ((n != 0) && (FS_Cache_Write(open->file, out, n) != n)) {
+            break;
+        }
+
+        done += PACK_SAMPLE_BYTES;
+    }
+
+    return done;
+}
+
+// Decoded length is not stored: decode up to the position, from the start
+// of the file when it lies behind
+static uint8_t handle_seek_packed(FS_OpenFile_t *open, uint32_t position) {
+    uint8_t scratch[16];
+    uint16_t n;
+
+    FS_Lock_Read();
+
+    if (position < open->decoded) {
+        open->position = 0;
+        open->decoded = 0;
+        FS_Pack_Reset(&open->reader, open->mode);
+    }
+
+    while (open->decoded < position) {
+        n = (position - open->decoded < sizeof(scratch)) ?
+            (uint16_t)(position - open->decoded) : (uint16_t)sizeof(scratch);
+
+        if (handle_read_packed(open, scratch, n) != n) {
+            break;
+        }
+    }
+
+    FS_Unlock_Read();
+
+    return (open->decoded == position) ? FS_SUCCESS : FS_ERROR;
+}
+
+// Write out a compressed-file handle's held-back run
+static uint8_t handle_drain(FS_OpenFile_t *open) {
+    uint8_t out[PACK_TOKEN_BYTES];
+    uint8_t n;
+
+    if (open->mode == FS_MODE_RAW) {
+        return FS_SUCCESS;
+    }
+
+    n = FS_Pack_Drain(&open->writer, out);
+
+    return ((n == 0) || (FS_Cache_Write(open->file, out, n) == n)) ? FS_SUCCESS : FS_ERROR;
+}
+
+// =============================================================================
+// HANDLE FUNCTIONS
+// =============================================================================
+
+void FS_Handle_Init(void) {
+    uint8_t i;
+
+    for (i = 0; i < FS_HANDLES; i++) {
+        Handle[i].file = FILE_INVALID;
+        Handle[i].sector = SECTOR_FREE;
+    }
+}
+
+uint8_t FS_Handle_Holds(FS_File_t num) {
+    uint8_t i;
+
+    for (i = 0; i < FS_HANDLES; i++) {
+        if (Handle[i].file == num) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+uint8_t FS_Handle_Drain(FS_File_t num) {
+    uint8_t i;
+
+    // Every handle on the file, or on any file for FILE_INVALID
+    for (i = 0; i < FS_HANDLES; i++) {
+        if ((Handle[i].file != FILE_INVALID) &&
+            ((num == FILE_INVALID) || (Handle[i].file == num)) &&
+            (handle_drain(&Handle[i]) != FS_SUCCESS)) {
+            return FS_ERROR;
+        }
+    }
+
+    return FS_SUCCESS;
+}
+
+// =============================================================================
+// STREAMING FUNCTIONS
+// =============================================================================
+
+FS_Handle_t OS_File_Open(FS_File_t num) {
+    uint8_t i;
+    FS_Handle_t h = HANDLE_INVALID;     // Every handle is in use
+
+    // Validate file number (an empty file may be opened to write it)
+    if (num > MAX_FILE_NUMBER) {
+        return HANDLE_INVALID;
+    }
+
+    FS_Lock_Write();
+
+    for (i = 0; i < FS_HANDLES; i++) {
+        if (Handle[i].file == FILE_INVALID) {
+            Handle[i].file = num;
+            Handle[i].mode = file_mode(num);
+            Handle[i].position = 0;
+            Handle[i].sector = SECTOR_FREE;
+            Handle[i].decoded = 0;
+            FS_Pack_Reset(&Handle[i].writer, Handle[i].mode);
+            FS_Pack_Reset(&Handle[i].reader, Handle[i].mode);
+            h = i;
+            break;
+        }
+    }
+
+    FS_Unlock_Write();
+
+    return h;
+}
+
+uint16_t OS_File_Write(FS_Handle_t h, const uint8_t *data, uint16_t len) {
+    FS_OpenFile_t *open = handle_get(h);
+    uint16_t done;
+
+    if (open == 0) {
+        return 0;
+    }
+
+    FS_Lock_Write();
+
+    if (open->mode == FS_MODE_RAW) {
+        done = FS_Cache_Write(open->file, data, len);
+    } else {
+        done = handle_write_packed(open, data, len);    // Whole samples only
+    }
+
+    FS_Unlock_Write();
+
+    return done;
+}
+
+uint16_t OS_File_ReadBytes(FS_Handle_t h, uint8_t *data, uint16_t len) {
+    FS_OpenFile_t *open = handle_get(h);
+    uint16_t done;
+
+    if ((open == 0) || (data == 0)) {
+        return 0;
+    }
+
+    FS_Lock_Read();
+
+    if (open->mode == FS_MODE_RAW) {
+        done = handle_read_raw(open, data, len);
+    } else {
+        done = handle_read_packed(open, data, len);
+    }
+
+    FS_Unlock_Read();
+
+    return done;
+}
+
+uint8_t OS_File_Seek(FS_Handle_t h, uint32_t position) {
+    FS_OpenFile_t *open = handle_get(h);
+    uint32_t length;
+
+    if (open == 0) {
+        return FS_ERROR;
+    }
+
+    if (open->mode != FS_MODE_RAW) {
+        return handle_seek_packed(open, position);
+    }
+
+    FS_Lock_Read();
+    length = file_length(open->file);
+    FS_Unlock_Read();
+
+    if (position > length) {
+        return FS_ERROR;
+    }
+
+    open->position = position;
+
+    return FS_SUCCESS;
+}
+
+uint8_t OS_File_Close(FS_Handle_t h) {
+    FS_OpenFile_t *open = handle_get(h);
+    uint8_t result;
+
+    if (open == 0) {
+        return FS_ERROR;
+    }
+
+    // Buffered bytes reach flash; the partial line stays for later writes
+    FS_Lock_Write();
+    result = handle_drain(open);
+    if (result == FS_SUCCESS) {
+        result = FS_Cache_Sync(open->file);
+    }
+    open->file = FILE_INVALID;
+    FS_Unlock_Write();
+
+    return result;
+}
@@ -0,0 +1,51 @@
+// *****************************************************************************
+// OS_File_Handle.h - Streaming File Handle Header
+// Runs on LM4F120/TM4C123
+// Byte-stream access to files through a small table of open handles, so
+// callers never need a sector-sized buffer of their own
+//
+// *****************************************************************************
+
+#ifndef __OS_FILE_HANDLE_H__
+#define __OS_FILE_HANDLE_H__
+
+#include <stdint.h>
+#include "OS_File_System.h"
+#include "OS_File_Pack.h"
+
+// =============================================================================
+// CONFIGURATION CONSTANTS
+// =============================================================================
+
+// Handles that may be open at once
+#ifndef FS_HANDLES
+#define FS_HANDLES              4U
+#endif
+
+// =============================================================================
+// TYPE DEFINITIONS
+// =============================================================================
+
+typedef struct {
+    FS_File_t file;             // Open file, FILE_INVALID when the slot is free
+    uint8_t mode;               // The file's storage mode when it was opened
+    uint32_t position;          // Next stored byte to read
+    FS_Sector_t sector;         // Sector holding that byte, SECTOR_FREE if not looked up
+    FS_Sector_t index;          // Its place in the chain
+    uint32_t generation;        // fat_generation() when sector was looked up
+    uint32_t decoded;           // Compressed files: next decoded byte OS_File_ReadBytes() returns
+    FS_Pack_t writer;           // Compressed files: encoder of this handle's writes
+    FS_Pack_t reader;           // Compressed files: decoder of its reads
+} FS_OpenFile_t;
+
+// =============================================================================
+// HANDLE FUNCTIONS
+// =============================================================================
+
+void FS_Handle_Init(void);
+
+uint8_t FS_Handle_Holds(FS_File_t num);
+
+uint8_t FS_Handle_Drain(FS_File_t num);
+
+#endif // __OS_FILE_HANDLE_H__
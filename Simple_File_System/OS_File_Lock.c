@@ -0,0 +1,267 @@
+// *****************************************************************************
+// OS_File_Lock.c - File System Locking Implementation
+// Runs on LM4F120/TM4C123
+// Any number of readers (OS_File_Read, OS_File_ReadBytes, sizes, status)
+// share the lock; a writer (anything that changes the directory, FAT,
+// cache or log, or erases) holds it alone. The first reader in takes the
+// writer semaphore for the group and the last one out gives it back, so a
+// steady stream of readers can hold off a writer.
+//
+// Only the public OS_File_ and OS_FS_ functions take the lock; everything
+// they call internally assumes it is held. Programming an appended sector
+// happens with the lock released (see OS_File_Append), as does a cache
+// write-back that gives a full line a sector of its own (OS_File_Cache.c);
+// format, mount and a delete of that file wait for it to be linked in. They sleep on a
+// semaphore the appender signals once it is, not in a yield loop: with
+// strict priorities a yielding thread above the appender would be picked
+// again at once and the appender would never get to finish.
+//
+// Everything else that touches flash runs with the write lock held, so
+// readers wait for it too: topping up a synced partial line, which is
+// already the file's tail, and garbage collection (OS_File_Reclaim, or
+// the allocator when no erased sector is left), which copies live sectors
+// out of a block and erases it, some 10ms per block plus a program per
+// moved sector. Those steps change the FAT and the wear tables as they
+// go, which is why they are not done unlocked.
+// Threads that must not wait that long read before or after them, or
+// call OS_File_Reclaim ahead of need from a low-priority thread.
+//
+// Block erases and multi-word programs are queued on the flash driver and
+// the calling thread sleeps on a semaphore of its own, which the flash
+// controller interrupt signals when the request is done; SysTick keeps
+// switching threads meanwhile. Without the kernel the blocking driver
+// calls are used, which also leave interrupts enabled while they wait.
+//
+// The CPU stalls on every flash fetch while an erase runs, interrupts
+// included, so code that must not stall that long (a fast control loop
+// running from flash) holds erases off with FS_Flash_Hold(). An erase
+// asked for meanwhile sleeps its thread, lock and all, until the hold is
+// released; the thread holding must not call the file system until then.
+//
+// *****************************************************************************
+
+#include "OS_File_Lock.h"
+#include "OS_File_System.h"
+#include "FlashProgram.h"
+#include <stdint.h>
+
+#if FS_THREAD_SAFE
+
+// Blocking semaphores and thread switch (os_v2.c)
+void OS_InitSemaphore(int32_t *s, int32_t value);
+void OS_Wait(int32_t *s);
+void OS_Signal(int32_t *s);
+void OS_Suspend(void);
+void OS_Sleep(uint32_t SleepCtr);
+
+// =============================================================================
+// LOCK STATE
+// =============================================================================
+static int32_t WriteSema;                       // Held by one writer or by the readers
+static int32_t ReaderSema;                      // Guards ReaderCount
+static int32_t ReaderCount;                     // Readers inside
+static int32_t EraseSema = 1;                   // Taken by an erase, or by a hold
+static uint8_t EraseHeld;                       // FS_Flash_Hold() has EraseSema
+static int32_t AppendSema;                      // Signaled when appends in flight finish
+static int32_t AppendWaiters;                   // Threads waiting on it (write lock guards)
+
+// =============================================================================
+// HELPER FUNCTIONS
+// =============================================================================
+
+// Flash controller interrupt task: wake the thread waiting on this request
+static void lock_flash_done(void *tag) {
+    OS_Signal((int32_t *)tag);
+}
+
+// =============================================================================
+// LOCK FUNCTIONS
+// =============================================================================
+
+void FS_Lock_Init(void) {
+    OS_InitSemaphore(&WriteSema, 1);
+    OS_InitSemaphore(&ReaderSema, 1);
+    OS_InitSemaphore(&AppendSema, 0);
+    ReaderCount = 0;
+    AppendWaiters = 0;
+    Flash_EnableInterrupt(&lock_flash_done, FS_FLASH_PRIORITY);
+}
+
+void FS_Lock_Read(void) {
+    OS_Wait(&ReaderSema);
+
+    ReaderCount++;
+    if (ReaderCount == 1) {
+        OS_Wait(&WriteSema);    // First reader locks writers out
+    }
+
+    OS_Signal(&ReaderSema);
+}
+
+void FS_Unlock_Read(void) {
+    OS_Wait(&ReaderSema);
+
+    ReaderCount--;
+    if (ReaderCount == 0) {
+        OS_Signal(&WriteSema);  // Last reader lets writers in
+    }
+
+    OS_Signal(&ReaderSema);
+}
+
+void FS_Lock_Write(void) {
+    OS_Wait(&WriteSema);
+}
+
+void FS_Unlock_Write(void) {
+    OS_Signal(&WriteSema);
+}
+
+// Let other threads run while waiting under the write lock for work done
+// outside it; the lock is held again on return. Sleeping rather than
+// suspending lets threads of lower priority run too.
+void FS_Lock_Yield(void) {
+    OS_Signal(&WriteSema);
+    OS_Sleep(1);
+    OS_Wait(&WriteSema);
+}
+
+// Sleep, with the write lock released, until an append in flight finishes
+// (FS_Lock_AppendDone); the lock is held again on return. The waiter is
+// counted under the lock, so a finish between the release and the wait
+// leaves AppendSema signaled and is not missed.
+void FS_Lock_WaitAppend(void) {
+    AppendWaiters++;
+    OS_Signal(&WriteSema);
+    OS_Wait(&AppendSema);
+    OS_Wait(&WriteSema);
+}
+
+// Wake every thread in FS_Lock_WaitAppend (write lock held); each checks
+// again whether what it waits for is done
+void FS_Lock_AppendDone(void) {
+    while (AppendWaiters > 0) {
+        AppendWaiters--;
+        OS_Signal(&AppendSema);
+    }
+}
+
+// =============================================================================
+// FLASH FUNCTIONS
+// =============================================================================
+
+uint8_t FS_Flash_Erase(uint32_t addr) {
+    int32_t done;
+
+    OS_Wait(&EraseSema);    // Not while erases are held off
+
+    // The queue is shared with other users of the driver; wait for room
+    OS_InitSemaphore(&done, 0);
+    while (Flash_EraseStart(addr, &done) != NOERROR) {
+        if (!Flash_Busy()) {
+            OS_Signal(&EraseSema);
+            return FS_ERROR;
+        }
+        OS_Suspend();
+    }
+
+    OS_Wait(&done);         // Other threads run until the interrupt
+    OS_Signal(&EraseSema);
+
+    return FS_SUCCESS;
+}
+
+// EraseSema is set up statically, not by FS_Lock_Init(), so a hold taken
+// before the file system is started survives it
+void FS_Flash_Hold(uint8_t hold) {
+    if (hold && !EraseHeld) {
+        OS_Wait(&EraseSema);
+        EraseHeld = 1;
+    } else if (!hold && EraseHeld) {
+        EraseHeld = 0;
+        OS_Signal(&EraseSema);
+    }
+}
+
+uint8_t FS_Flash_Program(uint32_t addr, const uint32_t *words, uint16_t count) {
+    int32_t done;
+
+    OS_InitSemaphore(&done, 0);
+    while (Flash_WriteStart(words, addr, count, &done) != NOERROR) {
+        if (!Flash_Busy()) {
+            return FS_ERROR;
+        }
+        OS_Suspend();
+    }
+
+    OS_Wait(&done);
+
+    return FS_SUCCESS;
+}
+
+#else
+
+void FS_Lock_Init(void) {
+}
+
+void FS_Lock_Read(void) {
+}
+
+void FS_Unlock_Read(void) {
+}
+
+void FS_Lock_Write(void) {
+}
+
+void FS_Unlock_Write(void) {
+}
+
+void FS_Lock_Yield(void) {
+}
+
+void FS_Lock_WaitAppend(void) {
+}
+
+void FS_Lock_AppendDone(void) {
+}
+
+// =============================================================================
+// FLASH FUNCTIONS
+// =============================================================================
+
+uint8_t FS_Flash_Erase(uint32_t addr) {
+    return (Flash_Erase(addr) == NOERROR) ? FS_SUCCESS : FS_ERROR;
+}
+
+// Without threads there is nobody to wait for a hold: callers that must not
+// stall simply do not erase
+void FS_Flash_Hold(uint8_t hold) {
+    (void)hold;
+}
+
+uint8_t FS_Flash_Program(uint32_t addr, const uint32_t *words, uint16_t count) {
+    uint16_t done = 0;
+    uint16_t left;
+    uint16_t n;
+
+    // Whole 128-byte windows through the write buffer, the rest a word at a time
+    while (done < count) {
+        left = (uint16_t)(count - done);
+        if ((((addr + 4U * done) & 0x7FU) == 0) && (left >= 32U)) {
+            n = (uint16_t)Flash_FastWrite((uint32_t *)&words[done], addr + 4U * done, 32);
+            if (n != 32U) {
+                return FS_ERROR;
+            }
+        } else {
+            if (Flash_Write(addr + 4U * done, words[done]) != NOERROR) {
+                return FS_ERROR;
+            }
+            n = 1;
+        }
+        done += n;
+    }
+
+    return FS_SUCCESS;
+}
+
+#endif // FS_THREAD_SAFE
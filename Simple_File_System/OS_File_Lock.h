@@ -0,0 +1,63 @@
+// *****************************************************************************
+// OS_File_Lock.h - File System Locking Header
+// Runs on LM4F120/TM4C123
+// Readers-writer lock over the directory, FAT, wear, log, cache and handle
+// state, built on the RTOS kernel's blocking semaphores, and flash erases
+// and programs that sleep the calling thread instead of spinning
+//
+// *****************************************************************************
+
+#ifndef __OS_FILE_LOCK_H__
+#define __OS_FILE_LOCK_H__
+
+#include <stdint.h>
+
+// =============================================================================
+// CONFIGURATION CONSTANTS
+// =============================================================================
+
+// 1: file system calls from several RTOS threads are serialized with the
+//    kernel's OS_Wait()/OS_Signal() (the kernel must be linked in)
+// 0: single-threaded use, the lock functions do nothing
+#ifndef FS_THREAD_SAFE
+#define FS_THREAD_SAFE          0
+#endif
+
+// NVIC priority of the flash controller interrupt that ends an erase or program
+#ifndef FS_FLASH_PRIORITY
+#define FS_FLASH_PRIORITY       6U
+#endif
+
+// =============================================================================
+// LOCK FUNCTIONS
+// =============================================================================
+
+void FS_Lock_Init(void);
+
+void FS_Lock_Read(void);
+
+void FS_Unlock_Read(void);
+
+void FS_Lock_Write(void);
+
+void FS_Unlock_Write(void);
+
+void FS_Lock_Yield(void);
+
+void FS_Lock_WaitAppend(void);
+
+void FS_Lock_AppendDone(void);
+
+// =============================================================================
+// FLASH FUNCTIONS
+// =============================================================================
+
+uint8_t FS_Flash_Erase(uint32_t addr);
+
+// Hold off block erases (1) or let them go on (0); holding waits for an
+// erase under way. Only with FS_THREAD_SAFE; one thread holds at a time.
+void FS_Flash_Hold(uint8_t hold);
+
+uint8_t FS_Flash_Program(uint32_t addr, const uint32_t *words, uint16_t count);
+
+#endif // __OS_FILE_LOCK_H__
@@ -0,0 +1,971 @@
+// *****************************************************************************
+// OS_File_Log.c - Append-Only Metadata Log Implementation
+// Runs on LM4F120/TM4C123
+// Directory/FAT changes are queued in RAM and committed as two-word records
+// to the active log area. When the area fills, the current state is
+// compacted into the other (freshly erased) area and the header is written
+// last, so the old area stays valid until the new one is complete.
+//
+// Record layout:  word 0 = [31:24] type  [23:8] a  [7:0] check
+//                 word 1 = b
+// (operands a/b per record type are listed in OS_File_Log.h)
+// Area word 0 holds the header (magic + sequence), word 1 its complement;
+// records start at word 2.
+//
+// Every commit is two-phase: the queued records first, then a COMMIT
+// record carrying their count and a checksum of their words. Replay only
+// applies groups whose COMMIT is intact, so power lost mid-flush leaves
+// the state of the previous flush. The compacted snapshot at the start of
+// an area is closed the same way (count 0) before the header goes on.
+//
+// Snapshot layout: a SNAPSHOT record giving the table word count, then
+// the packed tables in this order, each padded to a whole word:
+//   erase count of every data block              (one word each)
+//   first sector of every directory entry        (FS_Sector_t each)
+//   next sector of every data sector (the FAT)   (FS_Sector_t each)
+//   which data sectors have a CRC                (one bit each)
+//   CRC of every data sector                     (one word each)
+//   bytes used in every file's last sector       (uint16_t each)
+//   storage mode of every file                   (uint8_t each)
+// padded to an even word count so the records after it stay aligned.
+// Entries are packed little end first within a word. Erased words are
+// left unprogrammed, so free sectors and empty files cost no flash writes.
+//
+// Once a compaction has moved the log, the old area is dead weight;
+// FS_Log_Prepare() erases it a block at a time in the background, and
+// compaction skips blocks that are already blank.
+//
+// With FS_LOG_EEPROM, commits are written to a journal in the on-chip
+// EEPROM instead, in the same record and group format (word 0-1 header,
+// groups from word 2). Its words are rewritten in place, so a flush costs
+// a few EEPROM writes and nothing on flash. When the journal is full its
+// groups are merged into the flash log as one group, dropping TAIL
+// records a later record makes obsolete, and the journal starts over
+// under the next sequence number. Each merge (and each snapshot) carries
+// a JOURNAL record naming the journal it absorbed, so a journal whose
+// merge completed before a power loss is not applied a second time.
+// Group checksums are seeded with the journal's sequence number, so
+// groups left from an earlier journal never pass as current ones.
+//
+// *****************************************************************************
+
+#include "OS_File_Log.h"
+#include "OS_File_System.h"
+#include "OS_File_Wear.h"
+#include "OS_File_Lock.h"
+#include "OS_File_Crc.h"
+#include "FlashProgram.h"
+#if FS_LOG_EEPROM
+#include "EepromProgram.h"
+#endif
+#include <stdint.h>
+
+#define LOG_NO_AREA             0xFFU           // No valid area on flash yet
+
+#define LOG_TABLE_WORDS_USED    LOG_SNAPSHOT_TABLE_WORDS(METADATA_SECTOR, NUM_DATA_BLOCKS)
+
+// The snapshot log_compact() writes, and a full pending group after it,
+// must fit an area; a table added to the snapshot goes into
+// LOG_SNAPSHOT_TABLE_WORDS (OS_File_System.h) as well
+#if (LOG_SNAPSHOT_BYTES(METADATA_SECTOR, NUM_DATA_BLOCKS) + \
+     (LOG_PENDING_MAX + 1U) * LOG_RECORD_BYTES) > LOG_AREA_BYTES
+#error "OS_File_Log: the snapshot tables do not fit LOG_AREA_BYTES"
+#endif
+
+// =============================================================================
+// LOG STATE
+// =============================================================================
+static uint32_t Pending[2 * LOG_PENDING_MAX];   // Deltas not yet on flash
+static uint8_t PendingCount;
+static uint8_t ActiveArea = LOG_NO_AREA;        // Area holding the newest log
+static uint16_t ActiveSeq;                      // Sequence number of that area
+static uint32_t WriteIndex;                     // Next free word in that area
+static uint32_t GroupSum;                       // Checksum of the group being written
+static uint32_t PackWord;                       // Table bytes not yet programmed
+static uint8_t PackBytes;                       // How many
+#if FS_LOG_EEPROM
+static uint32_t JournalWords;                   // EEPROM words in use, 0 if it failed to start
+static uint32_t JournalIndex;                   // Next free journal word, 0 if not started
+static uint16_t JournalSeq;                     // Sequence number of the journal
+static uint16_t MergedSeq;                      // Newest journal the flash log has absorbed
+static uint8_t MergedValid;                     // MergedSeq was found by the replay
+
+static void journal_start(uint16_t seq);
+#endif
+
+// =============================================================================
+// HELPER FUNCTIONS
+// =============================================================================
+
+static uint32_t log_area_address(uint8_t area) {
+    return DISK_START_ADDRESS +
+           ((uint32_t)(METADATA_SECTOR + area * LOG_AREA_SECTORS) * SECTOR_SIZE);
+}
+
+static uint8_t log_check(uint8_t type, uint16_t a, uint32_t b) {
+    return (uint8_t)(type ^ a ^ (a >> 8) ^ b ^ (b >> 8) ^ (b >> 16) ^ (b >> 24) ^ 0x5AU);
+}
+
+static uint32_t log_encode(uint8_t type, uint16_t a, uint32_t b) {
+    return ((uint32_t)type << 24) | ((uint32_t)a << 8) | log_check(type, a, b);
+}
+
+static uint8_t log_valid(uint32_t word0, uint32_t word1) {
+    uint8_t type = (uint8_t)(word0 >> 24);
+    uint16_t a = (uint16_t)(word0 >> 8);
+
+    return ((uint8_t)word0 == log_check(type, a, word1)) ? 1 : 0;
+}
+
+// Checksum of a commit group, one word at a time
+static uint32_t log_sum(uint32_t sum, uint32_t word) {
+    return ((sum << 1) | (sum >> 31)) ^ word;
+}
+
+static uint8_t log_block_blank(uint32_t addr) {
+    const uint32_t *blockPtr = (const uint32_t *)(uintptr_t)addr;
+    uint32_t i;
+
+    for (i = 0; i < ERASE_BLOCK_SIZE / 4U; i++) {
+        if (blockPtr[i] != LOG_ERASED_WORD) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static uint8_t log_header_valid(uint32_t word0, uint32_t word1) {
+    return ((word0 & LOG_HEADER_MASK) == LOG_HEADER_MAGIC) && (word1 == ~word0);
+}
+
+// Program one encoded record at *index; advances even on failure so a
+// torn record is never reused
+static uint8_t log_program(uint32_t addr, uint32_t *index, uint32_t word0, uint32_t word1) {
+    uint32_t at = *index;
+
+    if (at + 2U > LOG_AREA_WORDS) {
+        return FS_ERROR;  // Area overflow
+    }
+
+    *index = at + 2U;
+    GroupSum = log_sum(log_sum(GroupSum, word0), word1);
+
+    if ((Flash_Write(addr + 4U * at, word0) != NOERROR) ||
+        (Flash_Write(addr + 4U * (at + 1U), word1) != NOERROR)) {
+        return FS_ERROR;
+    }
+
+#if FS_VERIFY_WRITES
+    // A record landing on programmed words would read back as their AND
+    if ((((volatile uint32_t *)(uintptr_t)addr)[at] != word0) ||
+        (((volatile uint32_t *)(uintptr_t)addr)[at + 1U] != word1)) {
+        return FS_ERROR;
+    }
+#endif
+
+    return FS_SUCCESS;
+}
+
+static uint8_t log_write(uint32_t addr, uint32_t *index, uint8_t type, uint16_t a, uint32_t b) {
+    return log_program(addr, index, log_encode(type, a, b), b);
+}
+
+// Close the group written since GroupSum was reset
+static uint8_t log_close(uint32_t addr, uint32_t *index, uint16_t count) {
+    uint32_t sum = GroupSum;
+
+    return log_write(addr, index, LOG_REC_COMMIT, count, sum);
+}
+
+// Program one table word; erased words are already in place
+static uint8_t log_program_word(uint32_t addr, uint32_t *index, uint32_t word) {
+    uint32_t at = *index;
+
+    if (at >= LOG_AREA_WORDS) {
+        return FS_ERROR;  // Area overflow
+    }
+
+    *index = at + 1U;
+    GroupSum = log_sum(GroupSum, word);
+
+    if ((word != LOG_ERASED_WORD) && (Flash_Write(addr + 4U * at, word) != NOERROR)) {
+        return FS_ERROR;
+    }
+
+#if FS_VERIFY_WRITES
+    if (((volatile uint32_t *)(uintptr_t)addr)[at] != word) {
+        return FS_ERROR;
+    }
+#endif
+
+    return FS_SUCCESS;
+}
+
+// Add the low 'bytes' bytes of value to a packed table, programming each
+// word as it fills; bytes 0 pads the table out to a whole word
+static uint8_t log_pack(uint32_t addr, uint32_t *index, uint32_t value, uint8_t bytes) {
+    uint32_t word;
+
+    if (bytes == 0) {
+        if (PackBytes == 0) {
+            return FS_SUCCESS;
+        }
+        bytes = (uint8_t)(4U - PackBytes);
+        value = LOG_ERASED_WORD;
+    }
+
+    if (bytes < 4U) {
+        value &= (1UL << (8U * bytes)) - 1U;
+    }
+    PackWord |= value << (8U * PackBytes);
+    PackBytes = (uint8_t)(PackBytes + bytes);
+
+    if (PackBytes < 4U) {
+        return FS_SUCCESS;
+    }
+
+    word = PackWord;
+    PackWord = 0;
+    PackBytes = 0;
+
+    return log_program_word(addr, index, word);
+}
+
+// Entry i of a packed table of 'bytes'-byte entries
+static uint32_t log_unpack(const uint32_t *table, uint32_t i, uint8_t bytes) {
+    uint32_t offset = i * bytes;
+    uint32_t word = table[offset / 4U] >> (8U * (offset % 4U));
+
+    return (bytes < 4U) ? (word & ((1UL << (8U * bytes)) - 1U)) : word;
+}
+
+// Check the group ending in the COMMIT record at index; returns the index
+// the group starts at, or 0 if it is torn or overlaps an earlier group
+static uint32_t log_group_start(const uint32_t *areaPtr, uint32_t index, uint32_t floor) {
+    uint16_t count = (uint16_t)(areaPtr[index] >> 8);
+    uint32_t start;
+    uint32_t sum = LOG_SUM_SEED;
+    uint32_t i;
+
+    if (count == 0) {
+        start = LOG_FIRST_RECORD;           // Snapshot: must be the first group
+        if (floor != LOG_FIRST_RECORD) {
+            return 0;
+        }
+    } else {
+        if (2U * (uint32_t)count > index - floor) {
+            return 0;
+        }
+        start = index - 2U * (uint32_t)count;
+    }
+
+    for (i = start; i < index; i++) {
+        sum = log_sum(sum, areaPtr[i]);
+    }
+
+    return (sum == areaPtr[index + 1U]) ? start : 0;
+}
+
+// Index just past an area's snapshot, or 0 if the area holds no intact one
+static uint32_t log_snapshot_end(const uint32_t *areaPtr) {
+    uint32_t i;
+
+    // The tables must be the ones this geometry writes
+    if (!log_valid(areaPtr[LOG_FIRST_RECORD], areaPtr[LOG_FIRST_RECORD + 1U]) ||
+        ((uint8_t)(areaPtr[LOG_FIRST_RECORD] >> 24) != LOG_REC_SNAPSHOT) ||
+        (areaPtr[LOG_FIRST_RECORD + 1U] != LOG_TABLE_WORDS_USED)) {
+        return 0;
+    }
+
+    for (i = LOG_FIRST_RECORD + 2U + LOG_TABLE_WORDS_USED; i + 1U < LOG_AREA_WORDS; i += 2U) {
+        if (areaPtr[i] == LOG_ERASED_WORD) {
+            break;
+        }
+
+        if (log_valid(areaPtr[i], areaPtr[i + 1U]) &&
+            ((uint8_t)(areaPtr[i] >> 24) == LOG_REC_COMMIT)) {
+            return (log_group_start(areaPtr, i, LOG_FIRST_RECORD) == LOG_FIRST_RECORD) ? i + 2U : 0;
+        }
+    }
+
+    return 0;
+}
+
+// Apply one record to the RAM directory/FAT and wear state
+static void log_apply(uint32_t word0, uint32_t b) {
+    uint8_t type = (uint8_t)(word0 >> 24);
+    uint16_t a = (uint16_t)(word0 >> 8);
+
+    switch (type) {
+        case LOG_REC_APPEND:
+            if ((a <= MAX_FILE_NUMBER) && (b < METADATA_SECTOR)) {
+                append_fat(a, b);
+            }
+            break;
+
+        case LOG_REC_DELETE:
+            if (a <= MAX_FILE_NUMBER) {
+                free_chain(a);
+            }
+            break;
+
+        case LOG_REC_MOVE:
+            if ((a < METADATA_SECTOR) && (b < METADATA_SECTOR)) {
+                move_fat(a, b);
+            }
+            break;
+
+        case LOG_REC_ERASE:
+            if (a < NUM_DATA_BLOCKS) {
+                FS_Wear_CountErase(a);
+                FS_Wear_Forget(a);
+            }
+            break;
+
+        case LOG_REC_CRC:
+            if (a < METADATA_SECTOR) {
+                FS_Crc_Set(a, b, CRC_STATE_UNCHECKED);
+            }
+            break;
+
+        case LOG_REC_MODE:
+            if (a <= MAX_FILE_NUMBER) {
+                set_file_mode(a, (uint8_t)b);
+            }
+            break;
+
+        case LOG_REC_TAIL:
+            if ((a <= MAX_FILE_NUMBER) && (b <= SECTOR_SIZE)) {
+                set_tail_length(a, (uint16_t)b);
+            }
+            break;
+
+#if FS_LOG_EEPROM
+        case LOG_REC_JOURNAL:
+            MergedSeq = a;
+            MergedValid = 1;
+            break;
+#endif
+
+        default:
+            break;  // Unknown record type
+    }
+}
+
+// Rebuild the RAM state from a snapshot's tables, through the same calls
+// the delta records make; returns the entries applied
+static uint32_t log_snapshot_load(const uint32_t *areaPtr) {
+    const uint32_t *wear = &areaPtr[LOG_FIRST_RECORD + 2U];
+    const uint32_t *directory = wear + NUM_DATA_BLOCKS;
+    const uint32_t *fat = directory + LOG_TABLE_WORDS(DIRECTORY_SIZE * LOG_INDEX_BYTES);
+    const uint32_t *hasCrc = fat + LOG_TABLE_WORDS(METADATA_SECTOR * LOG_INDEX_BYTES);
+    const uint32_t *crc = hasCrc + (METADATA_SECTOR + 31U) / 32U;
+    const uint32_t *tails = crc + METADATA_SECTOR;
+    const uint32_t *modes = tails + LOG_TABLE_WORDS(DIRECTORY_SIZE * 2U);
+    uint32_t applied = 0;
+    uint32_t block;
+    uint32_t file;
+    uint32_t sector;
+    uint32_t count;
+    uint32_t value;
+
+    for (block = 0; block < NUM_DATA_BLOCKS; block++) {
+        if (wear[block] != 0) {
+            FS_Wear_SetEraseCount((FS_Sector_t)block, wear[block]);
+            applied++;
+        }
+    }
+
+    for (file = 0; file <= MAX_FILE_NUMBER; file++) {
+        value = log_unpack(modes, file, 1U);
+        if (value != FS_MODE_RAW) {
+            set_file_mode((FS_File_t)file, (uint8_t)value);
+            applied++;
+        }
+
+        // Each chain in order, as APPEND records would have built it; a
+        // repeated sector is left for the mount sweep to cut
+        sector = log_unpack(directory, file, LOG_INDEX_BYTES);
+        count = 0;
+        while ((sector < METADATA_SECTOR) && (count++ < METADATA_SECTOR)) {
+            append_fat((FS_File_t)file, (FS_Sector_t)sector);
+            if (hasCrc[sector / 32U] & (1UL << (sector % 32U))) {
+                FS_Crc_Set((FS_Sector_t)sector, crc[sector], CRC_STATE_UNCHECKED);
+            }
+            applied++;
+            sector = log_unpack(fat, sector, LOG_INDEX_BYTES);
+        }
+
+        value = log_unpack(tails, file, 2U);
+        if ((count != 0) && (value <= SECTOR_SIZE)) {
+            set_tail_length((FS_File_t)file, (uint16_t)value);
+        }
+    }
+
+    return applied;
+}
+
+// Erase the inactive area and rewrite the full RAM state into it
+// (every table written here is counted in LOG_SNAPSHOT_TABLE_WORDS)
+static uint8_t log_compact(void) {
+    uint8_t target;
+    uint16_t seq;
+    uint32_t index;
+    uint32_t file;
+    uint32_t count;
+    uint32_t block;
+    uint32_t sector;
+    uint32_t bits;
+    uint32_t crc;
+    uint32_t addr;
+    uint32_t offset;
+
+    target = (ActiveArea == LOG_NO_AREA) ? 0 : (uint8_t)(ActiveArea ^ 1U);
+    seq = (uint16_t)(ActiveSeq + 1U);
+    addr = log_area_address(target);
+
+    // Erase every 1 KB block of the target area not already pre-erased
+    for (offset = 0; offset < LOG_AREA_BYTES; offset += ERASE_BLOCK_SIZE) {
+        if (!log_block_blank(addr + offset) && (FS_Flash_Erase(addr + offset) != FS_SUCCESS)) {
+            return FS_ERROR;
+        }
+    }
+
+    index = LOG_FIRST_RECORD;
+    GroupSum = LOG_SUM_SEED;
+    PackWord = 0;
+    PackBytes = 0;
+
+    if (log_write(addr, &index, LOG_REC_SNAPSHOT, 0, LOG_TABLE_WORDS_USED) != FS_SUCCESS) {
+        return FS_ERROR;
+    }
+
+    // Erase counters
+    for (block = 0; block < NUM_DATA_BLOCKS; block++) {
+        if (log_program_word(addr, &index, FS_Wear_EraseCount((FS_Sector_t)block)) != FS_SUCCESS) {
+            return FS_ERROR;
+        }
+    }
+
+    // Directory, then FAT
+    for (file = 0; file < DIRECTORY_SIZE; file++) {
+        if (log_pack(addr, &index, RAM_Directory[file], LOG_INDEX_BYTES) != FS_SUCCESS) {
+            return FS_ERROR;
+        }
+    }
+    if (log_pack(addr, &index, 0, 0) != FS_SUCCESS) {
+        return FS_ERROR;
+    }
+    for (sector = 0; sector < METADATA_SECTOR; sector++) {
+        if (log_pack(addr, &index, RAM_FAT[sector], LOG_INDEX_BYTES) != FS_SUCCESS) {
+            return FS_ERROR;
+        }
+    }
+    if (log_pack(addr, &index, 0, 0) != FS_SUCCESS) {
+        return FS_ERROR;
+    }
+
+    // Which sectors have a CRC, then the CRCs
+    for (sector = 0; sector < METADATA_SECTOR; sector += 32U) {
+        bits = 0;
+        for (count = 0; (count < 32U) && (sector + count < METADATA_SECTOR); count++) {
+            if (FS_Crc_State((FS_Sector_t)(sector + count)) != CRC_STATE_NONE) {
+                bits |= 1UL << count;
+            }
+        }
+        if (log_program_word(addr, &index, bits) != FS_SUCCESS) {
+            return FS_ERROR;
+        }
+    }
+    for (sector = 0; sector < METADATA_SECTOR; sector++) {
+        crc = (FS_Crc_State((FS_Sector_t)sector) != CRC_STATE_NONE) ?
+              FS_Crc_Get((FS_Sector_t)sector) : LOG_ERASED_WORD;
+        if (log_program_word(addr, &index, crc) != FS_SUCCESS) {
+            return FS_ERROR;
+        }
+    }
+
+    // Last sector lengths (OS_File_Write), then storage modes
+    for (file = 0; file < DIRECTORY_SIZE; file++) {
+        count = (RAM_Directory[file] == FILE_EMPTY) ? 0xFFFFU : tail_length((FS_File_t)file);
+        if (log_pack(addr, &index, count, 2U) != FS_SUCCESS) {
+            return FS_ERROR;
+        }
+    }
+    if (log_pack(addr, &index, 0, 0) != FS_SUCCESS) {
+        return FS_ERROR;
+    }
+    for (file = 0; file < DIRECTORY_SIZE; file++) {
+        if (log_pack(addr, &index, file_mode((FS_File_t)file), 1U) != FS_SUCCESS) {
+            return FS_ERROR;
+        }
+    }
+    if (log_pack(addr, &index, 0, 0) != FS_SUCCESS) {
+        return FS_ERROR;
+    }
+
+    // Keep the records after the tables two-word aligned
+    if (((index - LOG_FIRST_RECORD) & 1U) &&
+        (log_program_word(addr, &index, LOG_ERASED_WORD) != FS_SUCCESS)) {
+        return FS_ERROR;
+    }
+
+#if FS_LOG_EEPROM
+    // The snapshot holds everything the EEPROM journal does
+    if ((JournalWords != 0) &&
+        (log_write(addr, &index, LOG_REC_JOURNAL, JournalSeq, 0) != FS_SUCCESS)) {
+        return FS_ERROR;
+    }
+#endif
+
+    // Then the snapshot's COMMIT, the header check word and the header
+    // itself: until that is programmed the old area remains the newest
+    if ((log_close(addr, &index, 0) != FS_SUCCESS) ||
+        (Flash_Write(addr + 4U, ~(LOG_HEADER_MAGIC | seq)) != NOERROR) ||
+        (Flash_Write(addr, LOG_HEADER_MAGIC | seq) != NOERROR)) {
+        return FS_ERROR;
+    }
+
+    ActiveArea = target;
+    ActiveSeq = seq;
+    WriteIndex = index;
+    PendingCount = 0;   // Snapshot already includes every pending delta
+
+#if FS_LOG_EEPROM
+    if (JournalWords != 0) {
+        journal_start((uint16_t)(JournalSeq + 1U));
+    }
+#endif
+
+    return FS_SUCCESS;
+}
+
+#if FS_LOG_EEPROM
+
+// =============================================================================
+// EEPROM JOURNAL FUNCTIONS
+// =============================================================================
+
+static uint32_t journal_seed(void) {
+    return LOG_SUM_SEED ^ JournalSeq;
+}
+
+// Index just past the last intact group of the journal
+static uint32_t journal_end(void) {
+    uint32_t i = LOG_FIRST_RECORD;
+    uint32_t start = LOG_FIRST_RECORD;
+    uint32_t sum = journal_seed();
+    uint32_t word0;
+    uint32_t word1;
+
+    while (i + 1U < JournalWords) {
+        word0 = Eeprom_Read(i);
+        word1 = Eeprom_Read(i + 1U);
+
+        if ((word0 == LOG_ERASED_WORD) || !log_valid(word0, word1)) {
+            break;
+        }
+
+        if ((uint8_t)(word0 >> 24) == LOG_REC_COMMIT) {
+            if ((((word0 >> 8) & 0xFFFFU) != (i - start) / 2U) || (word1 != sum)) {
+                break;      // Torn group: the journal ends before it
+            }
+            start = i + 2U;
+            sum = journal_seed();
+        } else {
+            sum = log_sum(log_sum(sum, word0), word1);
+        }
+
+        i += 2U;
+    }
+
+    return start;
+}
+
+// Begin an empty journal; until its header is written the old one (now
+// merged) reads as already absorbed
+static void journal_start(uint16_t seq) {
+    uint32_t header = JOURNAL_HEADER_MAGIC | seq;
+
+    JournalSeq = seq;
+    JournalIndex = 0;
+
+    if ((Eeprom_Write(LOG_FIRST_RECORD, LOG_ERASED_WORD) == NOERROR) &&
+        (Eeprom_Write(1, ~header) == NOERROR) &&
+        (Eeprom_Write(0, header) == NOERROR)) {
+        JournalIndex = LOG_FIRST_RECORD;
+    }
+}
+
+// Write the pending records and their COMMIT after the last group
+static uint8_t journal_commit(void) {
+    uint32_t index = JournalIndex;
+    uint32_t sum = journal_seed();
+    uint8_t i;
+
+    for (i = 0; i < PendingCount; i++) {
+        sum = log_sum(log_sum(sum, Pending[2U * i]), Pending[2U * i + 1U]);
+    }
+
+    // A failed write leaves the journal full, so the next commit merges it
+    JournalIndex = JournalWords;
+
+    for (i = 0; i < PendingCount; i++) {
+        if ((Eeprom_Write(index, Pending[2U * i]) != NOERROR) ||
+            (Eeprom_Write(index + 1U, Pending[2U * i + 1U]) != NOERROR)) {
+            return FS_ERROR;
+        }
+        index += 2U;
+    }
+
+    if ((Eeprom_Write(index, log_encode(LOG_REC_COMMIT, PendingCount, sum)) != NOERROR) ||
+        (Eeprom_Write(index + 1U, sum) != NOERROR)) {
+        return FS_ERROR;
+    }
+    index += 2U;
+
+    // Mark the end, so the next mount need not rely on the checksum alone
+    if ((index < JournalWords) && (Eeprom_Write(index, LOG_ERASED_WORD) != NOERROR)) {
+        return FS_ERROR;
+    }
+
+    JournalIndex = index;
+    PendingCount = 0;
+
+    return FS_SUCCESS;
+}
+
+// A TAIL record is obsolete once a later one, or an APPEND or DELETE of
+// the same file, follows it in the journal or the pending queue
+static uint8_t journal_superseded(uint32_t index, uint32_t end, uint16_t file) {
+    uint32_t word;
+    uint8_t type;
+    uint8_t i;
+
+    for (index += 2U; index < end; index += 2U) {
+        word = Eeprom_Read(index);
+        type = (uint8_t)(word >> 24);
+
+        if (((type == LOG_REC_TAIL) || (type == LOG_REC_APPEND) || (type == LOG_REC_DELETE)) &&
+            ((uint16_t)(word >> 8) == file)) {
+            return 1;
+        }
+    }
+
+    for (i = 0; i < PendingCount; i++) {
+        type = (uint8_t)(Pending[2U * i] >> 24);
+
+        if (((type == LOG_REC_TAIL) || (type == LOG_REC_APPEND) || (type == LOG_REC_DELETE)) &&
+            ((uint16_t)(Pending[2U * i] >> 8) == file)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Journal record worth merging (not a COMMIT, not an obsolete TAIL)
+static uint8_t journal_keep(uint32_t index, uint32_t end) {
+    uint32_t word = Eeprom_Read(index);
+    uint8_t type = (uint8_t)(word >> 24);
+
+    if (type == LOG_REC_COMMIT) {
+        return 0;
+    }
+
+    return (type != LOG_REC_TAIL) || !journal_superseded(index, end, (uint16_t)(word >> 8));
+}
+
+// Move the journal and the pending records into the flash log as one
+// group, then start the next journal
+static uint8_t journal_merge(void) {
+    uint32_t end = journal_end();
+    uint32_t addr;
+    uint32_t index;
+    uint16_t count = 0;
+    uint8_t i;
+
+    for (index = LOG_FIRST_RECORD; index < end; index += 2U) {
+        count += journal_keep(index, end);
+    }
+    count += PendingCount + 1U;     // And the JOURNAL record
+
+    // No room in the flash area: a snapshot absorbs the journal as well
+    if (WriteIndex + 2U * ((uint32_t)count + 1U) > LOG_AREA_WORDS) {
+        return log_compact();
+    }
+
+    addr = log_area_address(ActiveArea);
+    GroupSum = LOG_SUM_SEED;
+
+    for (index = LOG_FIRST_RECORD; index < end; index += 2U) {
+        if (journal_keep(index, end) &&
+            (log_program(addr, &WriteIndex, Eeprom_Read(index), Eeprom_Read(index + 1U)) != FS_SUCCESS)) {
+            return FS_ERROR;
+        }
+    }
+
+    for (i = 0; i < PendingCount; i++) {
+        if (log_program(addr, &WriteIndex, Pending[2U * i], Pending[2U * i + 1U]) != FS_SUCCESS) {
+            return FS_ERROR;
+        }
+    }
+
+    if ((log_write(addr, &WriteIndex, LOG_REC_JOURNAL, JournalSeq, 0) != FS_SUCCESS) ||
+        (log_close(addr, &WriteIndex, count) != FS_SUCCESS)) {
+        return FS_ERROR;
+    }
+
+    PendingCount = 0;
+    journal_start((uint16_t)(JournalSeq + 1U));
+
+    return FS_SUCCESS;
+}
+
+// After the flash log: apply the journal unless a merge already absorbed it
+static void journal_replay(uint8_t flashLog, FS_MountReport_t *report) {
+    uint32_t header = Eeprom_Read(0);
+    uint32_t end;
+    uint32_t i;
+
+    if ((header & LOG_HEADER_MASK) != JOURNAL_HEADER_MAGIC) {
+        header = 0;
+    } else if (Eeprom_Read(1) != ~header) {
+        header = 0;
+    }
+
+    if (header == 0) {
+        // No journal: the next one follows whatever the flash log absorbed
+        JournalSeq = MergedValid ? MergedSeq : 0U;
+        if (flashLog) {
+            journal_start((uint16_t)(JournalSeq + 1U));
+        }
+        return;
+    }
+
+    JournalSeq = (uint16_t)header;
+
+    // A blank disk has no state for the journal to apply to; the format
+    // that follows starts a new one
+    if (!flashLog) {
+        return;
+    }
+
+    if (MergedValid && (MergedSeq == JournalSeq)) {
+        journal_start((uint16_t)(JournalSeq + 1U));
+        return;
+    }
+
+    end = journal_end();
+
+    for (i = LOG_FIRST_RECORD; i < end; i += 2U) {
+        if ((uint8_t)(Eeprom_Read(i) >> 24) != LOG_REC_COMMIT) {
+            log_apply(Eeprom_Read(i), Eeprom_Read(i + 1U));
+            report->records++;
+        }
+    }
+
+    JournalIndex = end;
+}
+
+#endif // FS_LOG_EEPROM
+
+// =============================================================================
+// LOG FUNCTIONS
+// =============================================================================
+
+void FS_Log_Init(void) {
+    PendingCount = 0;
+    ActiveArea = LOG_NO_AREA;
+    ActiveSeq = 0;
+    WriteIndex = 0;
+
+#if FS_LOG_EEPROM
+    // Without a working EEPROM every commit goes to flash
+    if ((JournalWords == 0) && (Eeprom_Init() == NOERROR)) {
+        JournalWords = (Eeprom_Words() < FS_JOURNAL_WORDS) ? Eeprom_Words() : FS_JOURNAL_WORDS;
+    }
+    JournalIndex = 0;
+    MergedValid = 0;
+#endif
+}
+
+uint8_t FS_Log_Record(uint8_t type, uint16_t a, uint32_t b) {
+    // Queue full - push it to flash before accepting more
+    if (PendingCount >= LOG_PENDING_MAX) {
+        if (FS_Log_Commit() != FS_SUCCESS) {
+            return FS_ERROR;
+        }
+    }
+
+    Pending[2U * PendingCount] = log_encode(type, a, b);
+    Pending[2U * PendingCount + 1U] = b;
+    PendingCount++;
+
+    return FS_SUCCESS;
+}
+
+uint8_t FS_Log_Commit(void) {
+    uint32_t addr;
+    uint8_t i;
+
+    // Nothing new since the last commit
+    if ((PendingCount == 0) && (ActiveArea != LOG_NO_AREA)) {
+        return FS_SUCCESS;
+    }
+
+    // No log on flash yet
+    if (ActiveArea == LOG_NO_AREA) {
+        return log_compact();
+    }
+
+#if FS_LOG_EEPROM
+    // Into the EEPROM journal while it has room, else the journal goes to flash
+    if (JournalIndex != 0) {
+        if (JournalIndex + 2U * (PendingCount + 1U) <= JournalWords) {
+            return journal_commit();
+        }
+        return journal_merge();
+    }
+#endif
+
+    // No room for the records and their COMMIT
+    if (WriteIndex + 2U * (PendingCount + 1U) > LOG_AREA_WORDS) {
+        return log_compact();
+    }
+
+    addr = log_area_address(ActiveArea);
+    GroupSum = LOG_SUM_SEED;
+
+    // Phase 1: the records; phase 2: the COMMIT that makes them count
+    for (i = 0; i < PendingCount; i++) {
+        if (log_program(addr, &WriteIndex, Pending[2U * i], Pending[2U * i + 1U]) != FS_SUCCESS) {
+            return FS_ERROR;
+        }
+    }
+
+    if (log_close(addr, &WriteIndex, PendingCount) != FS_SUCCESS) {
+        return FS_ERROR;
+    }
+
+    PendingCount = 0;
+
+    return FS_SUCCESS;
+}
+
+uint8_t FS_Log_Checkpoint(void) {
+    // Snapshot the RAM state into the other area, pending deltas included
+    return log_compact();
+}
+
+uint8_t FS_Log_Replay(FS_MountReport_t *report) {
+    uint8_t area;
+    uint8_t best = LOG_NO_AREA;
+    uint16_t bestSeq = 0;
+    uint16_t seq;
+    uint32_t i;
+    uint32_t j;
+    uint32_t start;
+    uint32_t floor;
+    uint32_t word;
+    uint32_t *areaPtr;
+
+    FS_Log_Init();
+
+    // Pick the newest area with an intact header and snapshot
+    for (area = 0; area < LOG_AREA_COUNT; area++) {
+        areaPtr = (uint32_t *)(uintptr_t)log_area_address(area);
+        word = areaPtr[0];
+
+        if (!log_header_valid(word, areaPtr[1]) || (log_snapshot_end(areaPtr) == 0)) {
+            continue;
+        }
+
+        seq = (uint16_t)word;
+        if ((best == LOG_NO_AREA) || ((int16_t)(seq - bestSeq) > 0)) {
+            best = area;
+            bestSeq = seq;
+        }
+    }
+
+    // Blank or freshly formatted disk: nothing to replay
+    if (best == LOG_NO_AREA) {
+#if FS_LOG_EEPROM
+        if (JournalWords != 0) {
+            journal_replay(0, report);
+        }
+#endif
+        return FS_SUCCESS;
+    }
+
+    areaPtr = (uint32_t *)(uintptr_t)log_area_address(best);
+    floor = log_snapshot_end(areaPtr);
+
+    // The snapshot: its tables, then the records between them and its COMMIT
+    report->records += log_snapshot_load(areaPtr);
+    for (j = LOG_FIRST_RECORD + 2U + LOG_TABLE_WORDS_USED; j + 2U < floor; j += 2U) {
+        log_apply(areaPtr[j], areaPtr[j + 1U]);
+        report->records++;
+    }
+
+    // Apply each intact group when its COMMIT is reached; records of a
+    // torn group are passed over, and scanning stops at the first erased word
+    for (i = floor; i + 1U < LOG_AREA_WORDS; i += 2U) {
+        word = areaPtr[i];
+
+        if (word == LOG_ERASED_WORD) {
+            break;
+        }
+
+        if (!log_valid(word, areaPtr[i + 1U]) || ((uint8_t)(word >> 24) != LOG_REC_COMMIT)) {
+            continue;
+        }
+
+        start = log_group_start(areaPtr, i, floor);
+        if (start == 0) {
+            report->tornGroups++;
+            continue;
+        }
+
+        for (j = start; j < i; j += 2U) {
+            log_apply(areaPtr[j], areaPtr[j + 1U]);
+            report->records++;
+        }
+
+        floor = i + 2U;
+    }
+
+    ActiveArea = best;
+    ActiveSeq = bestSeq;
+    WriteIndex = i;
+
+#if FS_LOG_EEPROM
+    // Commits newer than the flash log
+    if (JournalWords != 0) {
+        journal_replay(1, report);
+    }
+#endif
+
+    return FS_SUCCESS;
+}
+
+uint8_t FS_Log_Prepare(void) {
+    uint32_t addr;
+    uint32_t offset;
+
+    // With no log on flash yet, either area may be the next target
+    if (ActiveArea == LOG_NO_AREA) {
+        return FS_NO_DATA;
+    }
+
+    addr = log_area_address((uint8_t)(ActiveArea ^ 1U));
+
+    for (offset = 0; offset < LOG_AREA_BYTES; offset += ERASE_BLOCK_SIZE) {
+        if (!log_block_blank(addr + offset)) {
+            return FS_Flash_Erase(addr + offset);
+        }
+    }
+
+    return FS_NO_DATA;
+}
@@ -0,0 +1,75 @@
+// *****************************************************************************
+// OS_File_Log.h - Append-Only Metadata Log Header
+// Runs on LM4F120/TM4C123
+// Records directory/FAT changes as small delta entries in a reserved flash
+// region so OS_File_Flush() never has to rewrite a programmed sector,
+// optionally staged in the on-chip EEPROM first
+//
+// *****************************************************************************
+
+#ifndef __OS_FILE_LOG_H__
+#define __OS_FILE_LOG_H__
+
+#include <stdint.h>
+#include "OS_File_System.h"
+
+// =============================================================================
+// CONFIGURATION CONSTANTS
+// =============================================================================
+
+// Log geometry (area count and size are set in OS_File_System.h)
+#define LOG_AREA_WORDS          (LOG_AREA_BYTES / 4U)
+#define LOG_FIRST_RECORD        2U              // Words 0-1: area header
+
+// Deltas queued in RAM between flushes (a full queue forces a commit)
+#define LOG_PENDING_MAX         32U
+
+// 1: commits go to a journal in the on-chip EEPROM (EepromProgram.c) and
+//    reach the flash log only when the journal is full
+// 0: every commit is programmed into the flash log
+#ifndef FS_LOG_EEPROM
+#define FS_LOG_EEPROM           0
+#endif
+
+// EEPROM words the journal may use, from word 0 (the whole 2 KB by default)
+#ifndef FS_JOURNAL_WORDS
+#define FS_JOURNAL_WORDS        512U
+#endif
+
+// Area header: upper half is the magic, lower half the area sequence number
+#define LOG_HEADER_MAGIC        0x4C470000U     // "LG"
+#define JOURNAL_HEADER_MAGIC    0x4A4E0000U     // "JN" (EEPROM journal)
+#define LOG_HEADER_MASK         0xFFFF0000U
+#define LOG_ERASED_WORD         0xFFFFFFFFU
+#define LOG_SUM_SEED            0xFFFFFFFFU     // Commit checksum starting value
+
+// Record types (bits 31-24 of a record's first word) and their operands:
+// a is 16 bits, b is the full second word
+#define LOG_REC_APPEND          0xA1U           // file, sector appended to it
+#define LOG_REC_DELETE          0xA2U           // file, unused
+#define LOG_REC_MOVE            0xA3U           // old sector, new sector
+#define LOG_REC_ERASE           0xA4U           // erase block, unused
+#define LOG_REC_TAIL            0xA6U           // file, bytes used in its last sector
+#define LOG_REC_COMMIT          0xA7U           // records in the group (0: snapshot), checksum
+#define LOG_REC_CRC             0xA8U           // sector, CRC32 of its contents
+#define LOG_REC_MODE            0xA9U           // file, storage mode (OS_File_SetMode)
+#define LOG_REC_JOURNAL         0xAAU           // EEPROM journal sequence merged into flash, unused
+#define LOG_REC_SNAPSHOT        0xABU           // unused, words of packed tables that follow
+
+// =============================================================================
+// LOG FUNCTIONS
+// =============================================================================
+
+void FS_Log_Init(void);
+
+uint8_t FS_Log_Record(uint8_t type, uint16_t a, uint32_t b);
+
+uint8_t FS_Log_Commit(void);
+
+uint8_t FS_Log_Checkpoint(void);
+
+uint8_t FS_Log_Replay(FS_MountReport_t *report);
+
+uint8_t FS_Log_Prepare(void);
+
+#endif // __OS_FILE_LOG_H__
@@ -0,0 +1,189 @@
+// *****************************************************************************
+// OS_File_Pack.c - Compressed Telemetry Stream Implementation
+// Runs on LM4F120/TM4C123
+// A compressed file holds records of 1 to FS_PACK_CHANNELS interleaved
+// int32_t samples (RPM, error, duty, ...). Each sample is stored as the
+// difference from the previous sample of its channel, zigzag-mapped so
+// small changes either way give small numbers, in a varint token:
+//
+//   first byte   [7] more bytes follow  [6:1] payload bits 5..0  [0] kind
+//   next bytes   [7] more bytes follow  [6:0] next 7 payload bits
+//
+//   kind 0: one sample, payload = zigzag(difference)
+//   kind 1: payload n > 0: n samples unchanged from their channel's last
+//           payload 0: reset - every channel restarts from 0 at channel 0
+//
+// A slowly moving signal costs one byte per sample instead of four, and a
+// steady one a byte or two per run. Every writer starts with a reset token,
+// so a file written across several opens (or mounts) needs no state from
+// the earlier writers, and a record cut short by a power loss ends there.
+//
+// The coder only turns samples into bytes and back; OS_File_Handle.c moves
+// the bytes through the write-back cache and reads them from flash. Its
+// state is a few dozen bytes per handle and no window or dictionary.
+//
+// *****************************************************************************
+
+#include "OS_File_Pack.h"
+#include <stdint.h>
+
+#define PACK_KIND_SAMPLE        0U
+#define PACK_KIND_RUN           1U
+#define PACK_RESET              0x01U           // Run token of length 0
+
+// =============================================================================
+// HELPER FUNCTIONS
+// =============================================================================
+
+static uint8_t pack_token(uint8_t *out, uint32_t payload, uint8_t kind) {
+    uint8_t n = 0;
+
+    out[0] = (uint8_t)(((payload & 0x3FU) << 1) | kind);
+    payload >>= 6;
+
+    while (payload != 0) {
+        out[n++] |= 0x80U;
+        out[n] = (uint8_t)(payload & 0x7FU);
+        payload >>= 7;
+    }
+
+    return (uint8_t)(n + 1U);
+}
+
+static void pack_restart(FS_Pack_t *pack) {
+    uint8_t i;
+
+    for (i = 0; i < FS_PACK_CHANNELS; i++) {
+        pack->last[i] = 0;
+    }
+
+    pack->channel = 0;
+    pack->run = 0;
+}
+
+// Store a sample for the decoder to return and move to the next channel
+static void pack_emit(FS_Pack_t *pack, int32_t value) {
+    pack->last[pack->channel] = value;
+    pack->sample[0] = (uint8_t)value;
+    pack->sample[1] = (uint8_t)((uint32_t)value >> 8);
+    pack->sample[2] = (uint8_t)((uint32_t)value >> 16);
+    pack->sample[3] = (uint8_t)((uint32_t)value >> 24);
+    pack->used = 0;
+
+    pack->channel++;
+    if (pack->channel >= pack->channels) {
+        pack->channel = 0;
+    }
+}
+
+// =============================================================================
+// PACK FUNCTIONS
+// =============================================================================
+
+void FS_Pack_Reset(FS_Pack_t *pack, uint8_t channels) {
+    pack_restart(pack);
+
+    pack->channels = ((channels == 0) || (channels > FS_PACK_CHANNELS)) ? 1U : channels;
+    pack->token = 0;
+    pack->shift = 0;
+    pack->kind = PACK_KIND_SAMPLE;
+    pack->started = 0;
+    pack->used = PACK_SAMPLE_BYTES;     // Nothing decoded yet
+}
+
+uint8_t FS_Pack_Encode(FS_Pack_t *pack, const uint8_t sample[PACK_SAMPLE_BYTES],
+                       uint8_t out[2U * PACK_TOKEN_BYTES + 1U]) {
+    uint8_t n = 0;
+    uint32_t value;
+    uint32_t delta;
+
+    if (!pack->started) {
+        out[n++] = PACK_RESET;
+        pack->started = 1;
+    }
+
+    value = (uint32_t)sample[0] | ((uint32_t)sample[1] << 8) |
+            ((uint32_t)sample[2] << 16) | ((uint32_t)sample[3] << 24);
+    delta = value - (uint32_t)pack->last[pack->channel];
+
+    pack->last[pack->channel] = (int32_t)value;
+    pack->channel++;
+    if (pack->channel >= pack->channels) {
+        pack->channel = 0;
+    }
+
+    // Unchanged samples only add to the pending run
+    if (delta == 0) {
+        pack->run++;
+        if (pack->run == PACK_RUN_MAX) {
+            n += pack_token(&out[n], pack->run, PACK_KIND_RUN);
+            pack->run = 0;
+        }
+        return n;
+    }
+
+    if (pack->run != 0) {
+        n += pack_token(&out[n], pack->run, PACK_KIND_RUN);
+        pack->run = 0;
+    }
+
+    return (uint8_t)(n + pack_token(&out[n], (delta << 1) ^ (uint32_t)((int32_t)delta >> 31),
+                                    PACK_KIND_SAMPLE));
+}
+
+uint8_t FS_Pack_Drain(FS_Pack_t *pack, uint8_t out[PACK_TOKEN_BYTES]) {
+    uint8_t n = 0;
+
+    if (pack->run != 0) {
+        n = pack_token(out, pack->run, PACK_KIND_RUN);
+        pack->run = 0;
+    }
+
+    return n;
+}
+
+uint8_t FS_Pack_Feed(FS_Pack_t *pack, uint8_t byte) {
+    uint32_t delta;
+
+    if (pack->shift == 0) {
+        pack->kind = byte & 1U;
+        pack->token = (uint32_t)(byte >> 1) & 0x3FU;
+        pack->shift = 6;
+    } else {
+        if (pack->shift < 32U) {
+            pack->token |= (uint32_t)(byte & 0x7FU) << pack->shift;
+        }
+        pack->shift += 7;   // Overlong tokens (damaged data) keep their low bits
+    }
+
+    if (byte & 0x80U) {
+        return 0;           // Token continues
+    }
+
+    pack->shift = 0;
+
+    if (pack->kind == PACK_KIND_RUN) {
+        if (pack->token == 0) {
+            pack_restart(pack);
+        } else {
+            pack->run = pack->token;
+        }
+        return 0;
+    }
+
+    delta = (pack->token >> 1) ^ (0U - (pack->token & 1U));
+    pack_emit(pack, (int32_t)((uint32_t)pack->last[pack->channel] + delta));
+
+    return 1;
+}
+
+uint8_t FS_Pack_Next(FS_Pack_t *pack) {
+    if (pack->run == 0) {
+        return 0;           // Needs another token
+    }
+
+    pack->run--;
+    pack_emit(pack, pack->last[pack->channel]);
+
+    return 1;
+}
@@ -0,0 +1,61 @@
+// *****************************************************************************
+// OS_File_Pack.h - Compressed Telemetry Stream Header
+// Runs on LM4F120/TM4C123
+// Delta + varint coding of interleaved 32-bit samples, used by handles on
+// files stored in a compressed mode (OS_File_SetMode)
+//
+// *****************************************************************************
+
+#ifndef __OS_FILE_PACK_H__
+#define __OS_FILE_PACK_H__
+
+#include <stdint.h>
+#include "OS_File_System.h"
+
+// =============================================================================
+// CONFIGURATION CONSTANTS
+// =============================================================================
+
+// Most channels (interleaved values per record) a compressed file may have
+#ifndef FS_PACK_CHANNELS
+#define FS_PACK_CHANNELS        4U
+#endif
+
+#define PACK_SAMPLE_BYTES       4U              // One little-endian int32_t per sample
+#define PACK_TOKEN_BYTES        5U              // Longest token (33 bits of payload)
+#define PACK_RUN_MAX            0x7FFFFFFFU     // Longest run one token holds
+
+// =============================================================================
+// TYPE DEFINITIONS
+// =============================================================================
+
+typedef struct {
+    int32_t last[FS_PACK_CHANNELS];     // Previous sample of each channel
+    uint32_t run;                       // Unchanged samples not yet emitted (encoder)
+                                        // or still to return (decoder)
+    uint32_t token;                     // Token payload gathered so far (decoder)
+    uint8_t shift;                      // Payload bits gathered so far (decoder)
+    uint8_t kind;                       // Kind bit of that token (decoder)
+    uint8_t channels;                   // Samples per record (the file's mode)
+    uint8_t channel;                    // Channel of the next sample
+    uint8_t started;                    // Encoder: reset token emitted
+    uint8_t sample[PACK_SAMPLE_BYTES];  // Decoded sample being returned
+    uint8_t used;                       // Bytes of it already returned
+} FS_Pack_t;
+
+// =============================================================================
+// PACK FUNCTIONS
+// =============================================================================
+
+void FS_Pack_Reset(FS_Pack_t *pack, uint8_t channels);
+
+uint8_t FS_Pack_Encode(FS_Pack_t *pack, const uint8_t sample[PACK_SAMPLE_BYTES],
+                       uint8_t out[2U * PACK_TOKEN_BYTES + 1U]);
+
+uint8_t FS_Pack_Drain(FS_Pack_t *pack, uint8_t out[PACK_TOKEN_BYTES]);
+
+uint8_t FS_Pack_Feed(FS_Pack_t *pack, uint8_t byte);
+
+uint8_t FS_Pack_Next(FS_Pack_t *pack);
+
+#endif // __OS_FILE_PACK_H__
@@ -2,71 +2,248 @@
 // OS_File_System.c - Write-Once File System Implementation
 // Runs on LM4F120/TM4C123
 // Simple file system stored in flash memory with FAT-like structure
+//
+// Mount replays the metadata log, then makes one sweep over the directory
+// and FAT: every chain is followed once, cut at the first out-of-range or
+// already-reached sector, and the tails, back links, counters and the set
+// of sectors no file reaches are rebuilt from it. Mount time is linear in
+// the log and the FAT; sector contents are not read (free sectors are
+// blank-checked on first allocation, see OS_File_Wear.c).
+//
+// Each public function takes the file system lock (OS_File_Lock.c) and
+// runs a static body that assumes it; the helpers further down are only
+// called with the lock held.
 // 
 // *****************************************************************************
 
 #include "OS_File_System.h"
+#include "OS_File_Log.h"
+#include "OS_File_Wear.h"
+#include "OS_File_Cache.h"
+#include "OS_File_Handle.h"
+#include "OS_File_Lock.h"
+#include "OS_File_Crc.h"
+#include "OS_File_Pack.h"
 #include "FlashProgram.h"
 #include <stdint.h>
 
+#define PROGRAM_CHUNK_WORDS     8U              // Stack buffer for an unaligned program
+
 // =============================================================================
 // GLOBAL VARIABLES
 // =============================================================================
-uint8_t RAM_Directory[DIRECTORY_SIZE];     // Directory loaded in RAM
-uint8_t RAM_FAT[FAT_SIZE];                 // FAT loaded in RAM
+FS_Sector_t RAM_Directory[DIRECTORY_SIZE];     // Directory loaded in RAM
+FS_Sector_t RAM_FAT[FAT_SIZE];                 // FAT loaded in RAM
+static FS_Sector_t File_Tail[DIRECTORY_SIZE];  // Last sector of each file
+static uint16_t File_TailBytes[DIRECTORY_SIZE]; // Bytes used in that sector
+static uint8_t File_Mode[DIRECTORY_SIZE];       // Storage mode (OS_File_SetMode)
+static uint16_t File_Count;                     // Directory entries with a sector
+static FS_Sector_t Used_Count;                  // Sectors linked into a file
+static FS_Sector_t FAT_Back[FAT_SIZE];          // Sector linking to each sector (file number for a first sector)
+static uint32_t Mount_Reached[(FAT_SIZE + 31U) / 32U]; // Mount sweep: sectors on a chain
+static FS_MountReport_t Mount_Report;           // Findings of the last mount
+static uint32_t FAT_Generation;                 // Bumped when sectors leave a chain or move
+static uint32_t File_Reserved[(DIRECTORY_SIZE + 31U) / 32U]; // Numbers handed out by OS_File_New
+static uint16_t Appends_InFlight;               // Appends programming with the lock released
+static uint8_t File_Appends[DIRECTORY_SIZE];    // Of those, the ones to each file
 
 // =============================================================================
 // INITIALIZATION
 // =============================================================================
 
-void OS_FS_Init(void) {
-    uint16_t i;
+static void clear_tables(void) {
+    uint32_t i;
     
     // Mark all directory entries as free
     for (i = 0; i < DIRECTORY_SIZE; i++) {
         RAM_Directory[i] = FILE_EMPTY;
+        File_Tail[i] = SECTOR_FREE;
+        File_TailBytes[i] = 0;
+        File_Mode[i] = FS_MODE_RAW;
     }
+    for (i = 0; i < (DIRECTORY_SIZE + 31U) / 32U; i++) {
+        File_Reserved[i] = 0;
+    }
+    
+    File_Count = 0;
+    Used_Count = 0;
+    FAT_Generation++;
     
     // Mark all FAT entries as free
     for (i = 0; i < FAT_SIZE; i++) {
         RAM_FAT[i] = SECTOR_FREE;
+        FAT_Back[i] = SECTOR_FREE;
     }
+    
+    FS_Crc_Init();
 }
 
-// =============================================================================
-// FILE OPERATIONS
-// =============================================================================
+// Whether FAT_Back[sector] names the file this sector starts
+static uint8_t back_is_file(FS_Sector_t sector) {
+    FS_Sector_t back = FAT_Back[sector];
+    
+    return ((back <= MAX_FILE_NUMBER) && (RAM_Directory[back] == sector)) ? 1 : 0;
+}
 
-uint8_t OS_File_New(void) {
-    uint16_t i;
+// A chain may continue into this sector: in range and not yet reached
+static uint8_t sweep_take(FS_Sector_t sector) {
+    uint32_t bit = 1UL << (sector % 32U);
     
-    // Check if disk has at least one free sector
-    if (find_free_sector() == FS_DISK_FULL) {
-        return FS_ERROR;
+    if ((sector >= METADATA_SECTOR) || (Mount_Reached[sector / 32U] & bit)) {
+        return 0;
     }
     
-    // Find first available file slot in directory
+    Mount_Reached[sector / 32U] |= bit;
+    return 1;
+}
+
+// Validate every chain once and rebuild what depends on them
+static void mount_sweep(void) {
+    uint32_t i;
+    FS_Sector_t sector;
+    FS_Sector_t next;
+    FS_Sector_t tail;
+    
+    for (i = 0; i < (FAT_SIZE + 31U) / 32U; i++) {
+        Mount_Reached[i] = 0;
+    }
+    
+    File_Count = 0;
+    Used_Count = 0;
+    
     for (i = 0; i <= MAX_FILE_NUMBER; i++) {
-        if (RAM_Directory[i] == FILE_EMPTY) {
-            // Mark as empty file (no sectors allocated yet)
+        sector = RAM_Directory[i];
+        tail = SECTOR_FREE;
+        
+        if ((sector != FILE_EMPTY) && !sweep_take(sector)) {
             RAM_Directory[i] = FILE_EMPTY;
-            return (uint8_t)i;
+            Mount_Report.brokenChains++;
+        } else if (sector != FILE_EMPTY) {
+            FAT_Back[sector] = (FS_Sector_t)i;
+            File_Count++;
+            
+            // A sector is taken at most once, so this is linear overall
+            while (1) {
+                Used_Count++;
+                next = RAM_FAT[sector];
+                
+                if (next == SECTOR_FREE) {
+                    break;
+                }
+                
+                if (!sweep_take(next)) {
+                    RAM_FAT[sector] = SECTOR_FREE;
+                    Mount_Report.brokenChains++;
+                    break;
+                }
+                
+                FAT_Back[next] = sector;
+                sector = next;
+            }
+            
+            tail = sector;
+        }
+        
+        // A cut chain ends in a sector whose length is unknown: keep it whole
+        if (File_Tail[i] != tail) {
+            File_Tail[i] = tail;
+            File_TailBytes[i] = (tail == SECTOR_FREE) ? 0 : SECTOR_SIZE;
         }
     }
     
-    // All file slots are in use
-    return FS_ERROR;
+    // Sectors no chain reached hold no links; any still marked live are
+    // handed to garbage collection
+    for (i = 0; i < METADATA_SECTOR; i++) {
+        if (Mount_Reached[i / 32U] & (1UL << (i % 32U))) {
+            continue;
+        }
+        
+        RAM_FAT[i] = SECTOR_FREE;
+        FAT_Back[i] = SECTOR_FREE;
+        
+        if (FS_Wear_State((FS_Sector_t)i) == SECTOR_STATE_USED) {
+            FS_Wear_MarkDirty((FS_Sector_t)i);
+            Mount_Report.lostSectors++;
+        }
+    }
 }
 
-uint8_t OS_File_Size(uint8_t num) {
-    uint8_t count = 0;
-    uint8_t sector;
+// With the write lock held, wait until no append is programming outside
+// it and the flash driver has nothing queued, so a reset cannot forget a
+// BUSY sector that is still being written or relinked afterwards
+static void fs_quiesce(void) {
+    while ((Appends_InFlight != 0) || Flash_Busy()) {
+        if (Appends_InFlight != 0) {
+            FS_Lock_WaitAppend();   // Woken by append_done()
+        } else {
+            FS_Lock_Yield();        // Another user's request, ended by the interrupt
+        }
+    }
+}
+
+static void fs_reset(void) {
+    clear_tables();
     
-    // Validate file number
-    if (num > MAX_FILE_NUMBER) {
+    // Forget any uncommitted log deltas, cached writes and open handles
+    FS_Log_Init();
+    FS_Cache_Init();
+    FS_Handle_Init();
+    
+    // Sector states unknown until mount/allocation, counters zeroed
+    FS_Wear_Init();
+    FS_Wear_ClearCounts();
+}
+
+void OS_FS_Init(void) {
+    FS_Lock_Init();
+    fs_reset();
+}
+
+// Every sector not linked into a file can be reused after GC, except the
+// few garbage collection keeps for moving live sectors
+static FS_Sector_t free_sectors(void) {
+    if (Used_Count >= METADATA_SECTOR - WEAR_RESERVE_SECTORS) {
         return 0;
     }
     
+    return METADATA_SECTOR - WEAR_RESERVE_SECTORS - Used_Count;
+}
+
+// =============================================================================
+// FILE OPERATIONS
+// =============================================================================
+
+FS_File_t OS_File_New(void) {
+    uint32_t i;
+    uint32_t bit;
+    FS_File_t num = FILE_INVALID;   // All file slots are in use
+    
+    // Search and reservation under one write lock: two threads asking at
+    // once get different numbers even before either has appended
+    FS_Lock_Write();
+    
+    // Check if disk has at least one free (or reclaimable) sector, then
+    // find first available file slot in directory
+    for (i = 0; (free_sectors() != 0) && (i <= MAX_FILE_NUMBER); i++) {
+        bit = 1UL << (i % 32U);
+        if ((RAM_Directory[i] == FILE_EMPTY) && (File_Mode[i] == FS_MODE_RAW) &&
+            !(File_Reserved[i / 32U] & bit) &&
+            !FS_Cache_Holds((FS_File_t)i) && !FS_Handle_Holds((FS_File_t)i)) {
+            File_Reserved[i / 32U] |= bit;  // Taken until deleted or remounted
+            num = (FS_File_t)i;     // Empty file, no sectors allocated yet
+            break;
+        }
+    }
+    
+    FS_Unlock_Write();
+    
+    return num;
+}
+
+static FS_Sector_t file_size(FS_File_t num) {
+    FS_Sector_t count = 0;
+    FS_Sector_t sector;
+    
     sector = RAM_Directory[num];
     
     // File is empty or doesn't exist
@@ -80,7 +257,7 @@ uint8_t OS_File_Size(uint8_t num) {
         sector = RAM_FAT[sector];
         
         // Sanity check to prevent infinite loop
-        if (count > NUM_SECTORS) {
+        if (count > METADATA_SECTOR) {
             return 0;  // Corrupted FAT
         }
     }
@@ -88,42 +265,90 @@ uint8_t OS_File_Size(uint8_t num) {
     return count;
 }
 
-uint8_t OS_File_Append(uint8_t num, uint8_t buf[512]) {
-    uint8_t freeSector;
+FS_Sector_t OS_File_Size(FS_File_t num) {
+    FS_Sector_t count;
+    
+    // Validate file number
+    if (num > MAX_FILE_NUMBER) {
+        return 0;
+    }
+    
+    FS_Lock_Read();
+    count = file_size(num);
+    FS_Unlock_Read();
+    
+    return count;
+}
+
+uint8_t OS_File_Append(FS_File_t num, uint8_t buf[SECTOR_SIZE]) {
+    FS_Sector_t freeSector = SECTOR_FREE;
+    uint8_t result;
     
     // Validate file number
     if (num > MAX_FILE_NUMBER) {
         return FS_ERROR;
     }
     
-    // Find a free sector
-    freeSector = find_free_sector();
-    if (freeSector == FS_DISK_FULL) {
+    FS_Lock_Write();
+    
+    // Write back buffered bytes first (their last sector is padded out),
+    // then find a free sector
+    result = FS_Cache_Close(num);
+    if (result == FS_SUCCESS) {
+        freeSector = find_free_sector();
+    }
+    if (freeSector != SECTOR_FREE) {
+        append_begin(num);
+    }
+    
+    FS_Unlock_Write();
+    
+    if (result != FS_SUCCESS) {
+        return FS_ERROR;            // Write-back failed, not a full disk
+    }
+    if (freeSector == SECTOR_FREE) {
         return FS_DISK_FULL;
     }
     
-    // Write data to flash sector
-    if (eDisk_WriteSector(buf, freeSector) != FS_SUCCESS) {
-        return FS_ERROR;  // Write failure
+    // Write data to flash sector without holding the lock: the sector is
+    // BUSY, so neither allocation nor garbage collection will touch it
+    result = eDisk_WriteSector(buf, freeSector);
+    
+    FS_Lock_Write();
+    
+    if (result != FS_SUCCESS) {
+        FS_Wear_MarkDirty(freeSector);  // Partly programmed - reclaim later
+        result = FS_ERROR;              // Write failure
+    } else {
+        // Queue the delta for the next flush, then update directory/FAT to
+        // link this sector; a sector the log does not know is never linked
+        result = seal_tail(num);
+        
+        if (result == FS_SUCCESS) {
+            result = FS_Log_Record(LOG_REC_APPEND, num, freeSector);
+        }
+        
+        if (result == FS_SUCCESS) {
+            append_fat(num, freeSector);
+            result = FS_Log_Record(LOG_REC_CRC, freeSector, FS_Crc_Get(freeSector));
+        } else {
+            FS_Crc_Forget(freeSector);
+            FS_Wear_MarkDirty(freeSector);  // Programmed but unlinked - reclaim later
+        }
     }
+    append_done(num);
     
-    // Update directory/FAT to link this sector
-    append_fat(num, freeSector);
+    FS_Unlock_Write();
     
-    return FS_SUCCESS;
+    return result;
 }
 
-uint8_t OS_File_Read(uint8_t num, uint8_t location, uint8_t buf[512]) {
-    uint16_t i;
-    uint8_t sector;
+static uint8_t file_read(FS_File_t num, FS_Sector_t location, uint8_t buf[SECTOR_SIZE]) {
+    uint32_t i;
+    FS_Sector_t sector;
     uint32_t addr;
     uint8_t *flashPtr;
     
-    // Validate file number
-    if (num > MAX_FILE_NUMBER) {
-        return FS_NO_DATA;
-    }
-    
     sector = RAM_Directory[num];
     
     // File is empty or doesn't exist
@@ -143,37 +368,84 @@ uint8_t OS_File_Read(uint8_t num, uint8_t location, uint8_t buf[512]) {
     
     // Compute physical address of this sector
     addr = DISK_START_ADDRESS + ((uint32_t)sector * SECTOR_SIZE);
-    flashPtr = (uint8_t *)addr;
+    flashPtr = (uint8_t *)(uintptr_t)addr;
     
     // Copy data from flash to RAM buffer
     for (i = 0; i < SECTOR_SIZE; i++) {
         buf[i] = flashPtr[i];
     }
     
-    return FS_SUCCESS;
+    // First read since mount or since it was written: compare with its CRC
+    return FS_Crc_Check(sector, (RAM_FAT[sector] == SECTOR_FREE) ? tail_length(num) : SECTOR_SIZE);
+}
+
+uint8_t OS_File_Read(FS_File_t num, FS_Sector_t location, uint8_t buf[SECTOR_SIZE]) {
+    uint8_t result;
+    
+    // Validate file number
+    if (num > MAX_FILE_NUMBER) {
+        return FS_NO_DATA;
+    }
+    
+    // Readers share the lock; the copy runs while no writer can move or
+    // erase the sector
+    FS_Lock_Read();
+    result = file_read(num, location, buf);
+    FS_Unlock_Read();
+    
+    return result;
 }
 
 // =============================================================================
 // PERSISTENCE OPERATIONS
 // =============================================================================
 
-uint8_t OS_File_Flush(void) {
-    uint8_t buffer[SECTOR_SIZE];
-    uint16_t i;
+static uint8_t fs_flush(void) {
+    uint32_t i;
     
-    // Pack directory and FAT into one 512-byte buffer
-    // First 256 bytes: directory
-    for (i = 0; i < DIRECTORY_SIZE; i++) {
-        buffer[i] = RAM_Directory[i];
+    // Runs held back by compressed-file writers go to the cache first
+    if (FS_Handle_Drain(FILE_INVALID) != FS_SUCCESS) {
+        return FS_ERROR;
     }
     
-    // Second 256 bytes: FAT
-    for (i = 0; i < FAT_SIZE; i++) {
-        buffer[i + DIRECTORY_SIZE] = RAM_FAT[i];
+    // Write back every cached line so the commit covers all written bytes
+    for (i = 0; i <= MAX_FILE_NUMBER; i++) {
+        if (FS_Cache_Holds((FS_File_t)i) && (FS_Cache_Sync((FS_File_t)i) != FS_SUCCESS)) {
+            return FS_ERROR;
+        }
     }
     
-    // Write to metadata sector (sector 255)
-    if (eDisk_WriteSector(buffer, METADATA_SECTOR) != FS_SUCCESS) {
+    // Append the queued deltas to the metadata log (a few words, no erase)
+    return FS_Log_Commit();
+}
+
+uint8_t OS_File_Flush(void) {
+    uint8_t result;
+    
+    FS_Lock_Write();
+    result = fs_flush();
+    FS_Unlock_Write();
+    
+    return result;
+}
+
+static uint8_t fs_mount(void) {
+    // Start from an empty directory/FAT and replay the log on top of it
+    fs_reset();
+    
+    Mount_Report.records = 0;
+    Mount_Report.tornGroups = 0;
+    Mount_Report.brokenChains = 0;
+    Mount_Report.lostSectors = 0;
+    
+    if (FS_Log_Replay(&Mount_Report) != FS_SUCCESS) {
+        return FS_ERROR;
+    }
+    
+    mount_sweep();
+    
+    // Repaired metadata is mounted, but the caller is told about it
+    if ((Mount_Report.brokenChains != 0) || (Mount_Report.lostSectors != 0)) {
         return FS_ERROR;
     }
     
@@ -181,100 +453,209 @@ uint8_t OS_File_Flush(void) {
 }
 
 uint8_t OS_File_Mount(void) {
-    uint8_t buffer[SECTOR_SIZE];
-    uint16_t i;
-    uint32_t addr;
-    uint8_t *flashPtr;
+    uint8_t result;
     
-    // Read metadata sector from flash
-    addr = DISK_START_ADDRESS + ((uint32_t)METADATA_SECTOR * SECTOR_SIZE);
-    flashPtr = (uint8_t *)addr;
+    FS_Lock_Write();
+    fs_quiesce();
+    result = fs_mount();
+    FS_Unlock_Write();
     
-    // Copy from flash to temporary buffer
-    for (i = 0; i < SECTOR_SIZE; i++) {
-        buffer[i] = flashPtr[i];
+    return result;
+}
+
+static uint8_t file_delete(FS_File_t num) {
+    uint32_t bit = 1UL << (num % 32U);
+    uint8_t reserved;
+    
+    // An append to this file programming with the lock released would
+    // relink its sector after the delete, bringing the file back (or
+    // handing its data to whoever OS_File_New gives the number next):
+    // let it finish first, then delete what it appended too
+    while (File_Appends[num] != 0) {
+        FS_Lock_WaitAppend();
     }
+    reserved = (File_Reserved[num / 32U] & bit) ? 1U : 0U;
     
-    // Unpack directory (first 256 bytes)
-    for (i = 0; i < DIRECTORY_SIZE; i++) {
-        RAM_Directory[i] = buffer[i];
+    // The number goes back to OS_File_New
+    File_Reserved[num / 32U] &= ~bit;
+    
+    // Unwritten bytes go with the file
+    if (FS_Cache_Holds(num)) {
+        FS_Cache_Discard(num);
     }
     
-    // Unpack FAT (second 256 bytes)
-    for (i = 0; i < FAT_SIZE; i++) {
-        RAM_FAT[i] = buffer[i + DIRECTORY_SIZE];
+    // An empty file given a storage mode still has something to delete;
+    // one only handed out by OS_File_New has nothing on flash
+    if ((RAM_Directory[num] == FILE_EMPTY) && (File_Mode[num] == FS_MODE_RAW)) {
+        return reserved ? FS_SUCCESS : FS_FILE_NOT_FOUND;
     }
     
-    return FS_SUCCESS;
+    // Sectors become dirty (and the mode goes back to raw); garbage
+    // collection erases them later
+    free_chain(num);
+    
+    return FS_Log_Record(LOG_REC_DELETE, num, 0);
 }
 
-uint8_t OS_File_Format(void) {
-    uint32_t address;
-    int result;
+uint8_t OS_File_Delete(FS_File_t num) {
+    uint8_t result;
     
-    // Erase from start to end of disk in 1KB blocks
-    address = DISK_START_ADDRESS;
+    // Validate file number
+    if (num > MAX_FILE_NUMBER) {
+        return FS_ERROR;
+    }
     
-    while (address < DISK_END_ADDRESS) {
-        result = Flash_Erase(address);
-        
-        if (result != NOERROR) {  // NOERROR defined in FlashProgram.h as 0
-            return FS_ERROR;  // Erase failure
-        }
-        
-        address += 1024;  // Move to next 1KB block
+    FS_Lock_Write();
+    result = file_delete(num);
+    FS_Unlock_Write();
+    
+    return result;
+}
+
+static uint8_t file_set_mode(FS_File_t num, uint8_t mode) {
+    // Only an empty file with nothing buffered or open can change mode
+    if ((RAM_Directory[num] != FILE_EMPTY) || FS_Cache_Holds(num) || FS_Handle_Holds(num)) {
+        return FS_ERROR;
     }
     
-    // Reinitialize RAM structures after format
-    OS_FS_Init();
+    if (File_Mode[num] == mode) {
+        return FS_SUCCESS;
+    }
     
-    return FS_SUCCESS;
+    File_Mode[num] = mode;
+    
+    return FS_Log_Record(LOG_REC_MODE, num, mode);
+}
+
+uint8_t OS_File_SetMode(FS_File_t num, uint8_t mode) {
+    uint8_t result;
+    
+    // Validate file number and mode
+    if ((num > MAX_FILE_NUMBER) || (mode > FS_MODE_DELTA(FS_PACK_CHANNELS))) {
+        return FS_ERROR;
+    }
+    
+    FS_Lock_Write();
+    result = file_set_mode(num, mode);
+    FS_Unlock_Write();
+    
+    return result;
+}
+
+uint8_t OS_File_Mode(FS_File_t num) {
+    uint8_t mode;
+    
+    if (num > MAX_FILE_NUMBER) {
+        return FS_MODE_RAW;  // Invalid file number
+    }
+    
+    FS_Lock_Read();
+    mode = File_Mode[num];
+    FS_Unlock_Read();
+    
+    return mode;
+}
+
+static uint8_t fs_format(void) {
+    // Recover the erase counters (and the log's sequence number)
+    fs_mount();
+    
+    // Empty the RAM structures and make that the newest snapshot; losing
+    // power part way through leaves an empty disk, never stale files
+    clear_tables();
+    FS_Cache_Init();
+    FS_Wear_Init();
+    
+    // The data blocks are not erased here: no file links their sectors
+    // any more, so they are blank-checked on first allocation and the
+    // programmed ones are reclaimed like any deleted sector, by
+    // OS_File_Reclaim() or by the allocator
+    return FS_Log_Checkpoint();
+}
+
+uint8_t OS_File_Format(void) {
+    uint8_t result;
+    
+    // Appends programming outside the lock are let finish first (their
+    // sectors are then dropped along with everything else), as are
+    // erases and programs still queued on the flash driver
+    FS_Lock_Write();
+    fs_quiesce();
+    result = fs_format();
+    FS_Unlock_Write();
+    
+    return result;
 }
 
 // =============================================================================
 // HELPER FUNCTIONS
 // =============================================================================
 
-uint8_t find_free_sector(void) {
-    int16_t firstFreeSector = -1;
-    int16_t lastUsedSector = -1;
-    uint8_t lastSectorInFile;
+// Program len bytes (a multiple of 4) at addr. The bytes of a word are
+// stored little-endian, which is also how the Cortex-M lays out a
+// uint32_t, so a word-aligned buffer goes to the driver as it is;
+// otherwise a few words at a time are packed on the stack. With
+// FS_VERIFY_WRITES the flash is read back afterwards.
+uint8_t program_bytes(uint32_t addr, const uint8_t *data, uint16_t len) {
+    uint32_t words[PROGRAM_CHUNK_WORDS];
+    uint16_t total = len;
+    uint16_t done;
+    uint16_t n;
     uint16_t i;
     
-    // Scan all files to find the highest used sector
-    for (i = 0; i < DIRECTORY_SIZE; i++) {
-        if (RAM_Directory[i] != FILE_EMPTY) {
-            lastSectorInFile = last_sector(RAM_Directory[i]);
-            
-            if (lastSectorInFile != SECTOR_FREE) {
-                if ((int16_t)lastSectorInFile > lastUsedSector) {
-                    lastUsedSector = (int16_t)lastSectorInFile;
-                }
-            }
+    if (((uintptr_t)data & 3U) == 0) {
+        if (FS_Flash_Program(addr, (const uint32_t *)data, len / 4U) != FS_SUCCESS) {
+            return FS_ERROR;
         }
+        len = 0;  // Nothing left for the packing loop
     }
     
-    // First free sector is one after the last used sector
-    firstFreeSector = lastUsedSector + 1;
-    
-    // Check if we have space (can't use sector 255 - reserved for metadata)
-    if (firstFreeSector >= METADATA_SECTOR) {
-        return FS_DISK_FULL;
+    for (done = 0; done < len; done += n) {
+        n = (uint16_t)(len - done);     // uint16_t, not promoted to int
+        if (n > 4U * PROGRAM_CHUNK_WORDS) {
+            n = 4U * PROGRAM_CHUNK_WORDS;
+        }
+        
+        for (i = 0; i < n; i += 4) {
+            words[i / 4U] = (uint32_t)data[done + i] |
+                            ((uint32_t)data[done + i + 1] << 8) |
+                            ((uint32_t)data[done + i + 2] << 16) |
+                            ((uint32_t)data[done + i + 3] << 24);
+        }
+        
+        if (FS_Flash_Program(addr + done, words, n / 4U) != FS_SUCCESS) {
+            return FS_ERROR;
+        }
     }
     
-    return (uint8_t)firstFreeSector;
+#if FS_VERIFY_WRITES
+    return FS_Crc_Verify(addr, data, total);
+#else
+    (void)total;
+    return FS_SUCCESS;
+#endif
 }
 
-uint8_t last_sector(uint8_t start) {
-    uint8_t current;
-    uint8_t next;
-    uint8_t count = 0;
+FS_Sector_t find_free_sector(void) {
+    // Least-worn erased sector (SECTOR_FREE if full); may run GC first
+    return FS_Wear_Allocate();
+}
+
+FS_Sector_t last_sector(FS_Sector_t start) {
+    FS_Sector_t current;
+    FS_Sector_t next;
+    uint32_t count = 0;
     
     // File is empty
     if (start == FILE_EMPTY) {
         return SECTOR_FREE;
     }
     
+    // First sector of a file: its tail is cached
+    if (back_is_file(start)) {
+        return File_Tail[FAT_Back[start]];
+    }
+    
     current = start;
     
     // Follow the FAT chain to the end
@@ -296,74 +677,208 @@ uint8_t last_sector(uint8_t start) {
     }
 }
 
-void append_fat(uint8_t num, uint8_t n) {
-    uint8_t current;
-    uint8_t next;
-    
+void append_fat(FS_File_t num, FS_Sector_t n) {
     // Mark new sector as end of chain
     RAM_FAT[n] = SECTOR_FREE;
+    FS_Wear_MarkUsed(n);
+    
+    Used_Count++;
     
     // If file is empty, this is the first sector
     if (RAM_Directory[num] == FILE_EMPTY) {
         RAM_Directory[num] = n;
-        return;
+        FAT_Back[n] = num;
+        File_Count++;
+    } else {
+        // Link after the cached tail instead of walking the chain
+        RAM_FAT[File_Tail[num]] = n;
+        FAT_Back[n] = File_Tail[num];
     }
     
-    // File already has sectors - find the last one
+    File_Tail[num] = n;
+    File_TailBytes[num] = SECTOR_SIZE;  // OS_File_Write() lowers this for a partial sector
+}
+
+void free_chain(FS_File_t num) {
+    FS_Sector_t current;
+    FS_Sector_t next;
+    uint32_t count = 0;
+    
     current = RAM_Directory[num];
+    if (current != FILE_EMPTY) {
+        File_Count--;
+    }
+    RAM_Directory[num] = FILE_EMPTY;
+    File_Tail[num] = SECTOR_FREE;
+    File_TailBytes[num] = 0;
+    File_Mode[num] = FS_MODE_RAW;
+    FAT_Generation++;
     
-    while (1) {
+    // Unlink every sector and mark it for garbage collection
+    while ((current != SECTOR_FREE) && (count++ <= NUM_SECTORS)) {
         next = RAM_FAT[current];
-        
-        // Found the last sector in chain
-        if (next == SECTOR_FREE) {
-            RAM_FAT[current] = n;  // Link new sector
-            return;
-        }
-        
+        RAM_FAT[current] = SECTOR_FREE;
+        FAT_Back[current] = SECTOR_FREE;
+        FS_Crc_Forget(current);
+        FS_Wear_MarkDirty(current);
+        Used_Count--;
         current = next;
     }
 }
 
+void move_fat(FS_Sector_t old, FS_Sector_t n) {
+    uint32_t i;
+    FS_Sector_t back = FAT_Back[old];
+    
+    // Point whichever entry referenced the old sector at the new one
+    if (back_is_file(old)) {
+        RAM_Directory[back] = n;
+    } else if ((back < METADATA_SECTOR) && (RAM_FAT[back] == old)) {
+        RAM_FAT[back] = n;
+    }
+    
+    // Keep the tail cache pointing at the live copy
+    if (RAM_FAT[old] == SECTOR_FREE) {
+        for (i = 0; i <= MAX_FILE_NUMBER; i++) {
+            if (File_Tail[i] == old) {
+                File_Tail[i] = n;
+                break;
+            }
+        }
+    } else {
+        FAT_Back[RAM_FAT[old]] = n;
+    }
+    
+    // New sector takes over the old one's links
+    RAM_FAT[n] = RAM_FAT[old];
+    RAM_FAT[old] = SECTOR_FREE;
+    FAT_Back[n] = back;
+    FAT_Back[old] = SECTOR_FREE;
+    FAT_Generation++;
+    FS_Crc_Move(old, n);
+    
+    FS_Wear_MarkUsed(n);
+    FS_Wear_MarkDirty(old);
+}
+
+FS_Sector_t tail_sector(FS_File_t num) {
+    return File_Tail[num];
+}
+
+uint16_t tail_length(FS_File_t num) {
+    return File_TailBytes[num];
+}
+
+void set_tail_length(FS_File_t num, uint16_t bytes) {
+    // Only meaningful once the file has a sector
+    if (File_Tail[num] != SECTOR_FREE) {
+        File_TailBytes[num] = bytes;
+    }
+}
+
+uint8_t file_mode(FS_File_t num) {
+    return File_Mode[num];
+}
+
+void set_file_mode(FS_File_t num, uint8_t mode) {
+    File_Mode[num] = mode;
+}
+
+uint8_t seal_tail(FS_File_t num) {
+    FS_Sector_t sector = File_Tail[num];
+    uint8_t *flashPtr;
+    uint16_t i;
+    
+    if ((sector == SECTOR_FREE) || (FS_Crc_State(sector) == CRC_STATE_NONE)) {
+        return FS_SUCCESS;
+    }
+    
+    // Bytes programmed past the tail before a power loss are normally left
+    // out of its CRC; once the sector is padded out they are file data
+    flashPtr = (uint8_t *)(uintptr_t)(DISK_START_ADDRESS + ((uint32_t)sector * SECTOR_SIZE));
+    for (i = File_TailBytes[num]; (i < SECTOR_SIZE) && (flashPtr[i] == 0xFF); i++) {
+    }
+    
+    if ((i == SECTOR_SIZE) || (FS_Crc_Check(sector, File_TailBytes[num]) != FS_SUCCESS)) {
+        return FS_SUCCESS;  // Nothing to add, or already corrupt
+    }
+    
+    FS_Crc_Set(sector, FS_Crc32(flashPtr, SECTOR_SIZE), CRC_STATE_CHECKED);
+    
+    return FS_Log_Record(LOG_REC_CRC, sector, FS_Crc_Get(sector));
+}
+
+uint32_t file_length(FS_File_t num) {
+    FS_Sector_t sectors = file_size(num);
+    
+    // Bytes on flash: whole sectors plus the used part of the last one
+    if (sectors == 0) {
+        return 0;
+    }
+    
+    return ((uint32_t)(sectors - 1U) * SECTOR_SIZE) + File_TailBytes[num];
+}
+
+// An append (or a cache write-back) is about to program a BUSY sector
+// of this file with the write lock released
+void append_begin(FS_File_t num) {
+    Appends_InFlight++;             // Format and mount wait for the relink,
+    File_Appends[num]++;            // and so does a delete of this file
+}
+
+// That append has finished (write lock held again): wake format, mount,
+// a delete or a write-back of the same file waiting for it
+void append_done(FS_File_t num) {
+    Appends_InFlight--;
+    File_Appends[num]--;
+    
+    if ((Appends_InFlight == 0) || (File_Appends[num] == 0)) {
+        FS_Lock_AppendDone();
+    }
+}
+
+uint8_t file_appending(FS_File_t num) {
+    return (File_Appends[num] != 0) ? 1 : 0;
+}
+
+uint32_t fat_generation(void) {
+    // Open handles re-walk a chain when this changes
+    return FAT_Generation;
+}
+
 // =============================================================================
 // LOW-LEVEL DISK FUNCTIONS
 // =============================================================================
 
-uint8_t eDisk_WriteSector(uint8_t buf[512], uint8_t n) {
+uint8_t eDisk_WriteSector(uint8_t buf[SECTOR_SIZE], FS_Sector_t n) {
     uint32_t addr;
-    uint32_t dataWord;
-    uint16_t i;
-    int result;
+    uint32_t crc;
     
     // Calculate physical address
     addr = DISK_START_ADDRESS + ((uint32_t)n * SECTOR_SIZE);
     
-    // Write data 4 bytes at a time (flash is word-addressable)
-    for (i = 0; i < SECTOR_SIZE; i += 4) {
-        // Pack 4 bytes into 32-bit word (little-endian)
-        dataWord = (uint32_t)buf[i] | 
-                   ((uint32_t)buf[i + 1] << 8) | 
-                   ((uint32_t)buf[i + 2] << 16) | 
-                   ((uint32_t)buf[i + 3] << 24);
-        
-        result = Flash_Write(addr + i, dataWord);
-        
-        if (result != NOERROR) {  // NOERROR defined in FlashProgram.h as 0
-            return 1;  // Write failure
-        }
+    // CRC of what is about to be programmed; the caller logs it
+    crc = FS_Crc32(buf, SECTOR_SIZE);
+    
+    // One request to the flash driver; the caller sleeps until it is done
+    if (program_bytes(addr, buf, SECTOR_SIZE) != FS_SUCCESS) {
+        return 1;  // Write failure
     }
     
+    // Read back already, or still to be compared on first read
+    FS_Crc_Set(n, crc, FS_VERIFY_WRITES ? CRC_STATE_CHECKED : CRC_STATE_UNCHECKED);
+    
     return 0;  // Success
 }
 
-uint8_t eDisk_ReadSector(uint8_t buf[512], uint8_t n) {
+uint8_t eDisk_ReadSector(uint8_t buf[SECTOR_SIZE], FS_Sector_t n) {
     uint32_t addr;
     uint8_t *flashPtr;
     uint16_t i;
     
     // Calculate physical address
     addr = DISK_START_ADDRESS + ((uint32_t)n * SECTOR_SIZE);
-    flashPtr = (uint8_t *)addr;
+    flashPtr = (uint8_t *)(uintptr_t)addr;
     
     // Copy from flash to RAM
     for (i = 0; i < SECTOR_SIZE; i++) {
@@ -378,59 +893,62 @@ uint8_t eDisk_ReadSector(uint8_t buf[512], uint8_t n) {
 // =============================================================================
 
 void OS_FS_GetStatus(FS_Status_t *status) {
-    uint16_t i;
-    uint8_t totalFiles = 0;
-    uint8_t usedSectors = 0;
-    
     if (status == 0) {
         return;  // Null pointer
     }
     
-    // Count files
-    for (i = 0; i <= MAX_FILE_NUMBER; i++) {
-        if (RAM_Directory[i] != FILE_EMPTY) {
-            totalFiles++;
-        }
+    // Counters kept by append_fat()/free_chain(), rebuilt by mount replay
+    FS_Lock_Read();
+    status->totalFiles = File_Count;
+    status->usedSectors = Used_Count;
+    status->freeSectors = free_sectors();
+    FS_Unlock_Read();
+}
+
+void OS_FS_GetMountReport(FS_MountReport_t *report) {
+    if (report == 0) {
+        return;  // Null pointer
     }
     
-    // Count used sectors by scanning FAT
-    for (i = 0; i < METADATA_SECTOR; i++) {
-        // Check if sector is referenced in directory
-        for (uint8_t j = 0; j <= MAX_FILE_NUMBER; j++) {
-            if (RAM_Directory[j] == i) {
-                usedSectors++;
-                break;
-            }
-        }
-        
-        // Check if sector is referenced in FAT
-        for (uint8_t j = 0; j < METADATA_SECTOR; j++) {
-            if (RAM_FAT[j] == i) {
-                usedSectors++;
-                break;
-            }
-        }
+    FS_Lock_Read();
+    *report = Mount_Report;
+    FS_Unlock_Read();
+}
+
+uint8_t OS_File_Exists(FS_File_t num) {
+    uint8_t exists;
+    
+    if (num > MAX_FILE_NUMBER) {
+        return 0;  // Invalid file number
     }
     
-    status->totalFiles = totalFiles;
-    status->usedSectors = usedSectors;
-    status->freeSectors = METADATA_SECTOR - usedSectors;  // Sector 255 reserved
+    FS_Lock_Read();
+    exists = (RAM_Directory[num] != FILE_EMPTY) ? 1 : 0;
+    FS_Unlock_Read();
+    
+    return exists;
 }
 
-uint8_t OS_File_Exists(uint8_t num) {
+uint32_t OS_File_Length(FS_File_t num) {
+    uint32_t length;
+    
     if (num > MAX_FILE_NUMBER) {
         return 0;  // Invalid file number
     }
     
-    return (RAM_Directory[num] != FILE_EMPTY) ? 1 : 0;
+    FS_Lock_Read();
+    length = file_length(num);
+    FS_Unlock_Read();
+    
+    return length;
 }
 
-uint8_t OS_FS_FreeSectors(void) {
-    uint8_t freeSector = find_free_sector();
+FS_Sector_t OS_FS_FreeSectors(void) {
+    FS_Sector_t sectors;
     
-    if (freeSector == FS_DISK_FULL) {
-        return 0;
-    }
+    FS_Lock_Read();
+    sectors = free_sectors();
+    FS_Unlock_Read();
     
-    return (METADATA_SECTOR - freeSector);
+    return sectors;
 }
\ No newline at end of file
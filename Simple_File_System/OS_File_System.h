@@ -15,18 +15,85 @@
 // =============================================================================
 
 // Disk geometry
+// Any of these may be defined before this header is included (e.g. on the
+// compiler command line) to resize the disk. The disk must be whole 1 KB
+// erase blocks; SECTOR_SIZE must divide ERASE_BLOCK_SIZE. Lowering
+// DISK_START_ADDRESS to just past the program image lets the disk span
+// the rest of the 256 KB flash.
+#ifndef DISK_START_ADDRESS
 #define DISK_START_ADDRESS      0x00020000U     // First address in flash (128 KB mark)
+#endif
+#ifndef DISK_END_ADDRESS
 #define DISK_END_ADDRESS        0x00040000U     // Last address (256 KB mark)
+#endif
+#ifndef SECTOR_SIZE
 #define SECTOR_SIZE             512U            // Bytes per sector
-#define NUM_SECTORS             256U            // Total sectors (0-255)
+#endif
+#define ERASE_BLOCK_SIZE        1024U           // Smallest erasable unit
+#define SECTORS_PER_BLOCK       (ERASE_BLOCK_SIZE / SECTOR_SIZE)
+#define NUM_SECTORS             ((DISK_END_ADDRESS - DISK_START_ADDRESS) / SECTOR_SIZE)
+#ifndef DIRECTORY_SIZE
 #define DIRECTORY_SIZE          256U            // Directory entries
-#define FAT_SIZE                256U            // FAT entries
+#endif
+#define FAT_SIZE                NUM_SECTORS     // FAT entries (one per sector)
+
+// Sector and file indices are 8-bit unless the geometry needs more
+// (or FS_WIDE_INDEX is defined as 1)
+#ifndef FS_WIDE_INDEX
+#if (NUM_SECTORS > 256U) || (DIRECTORY_SIZE > 256U)
+#define FS_WIDE_INDEX           1
+#else
+#define FS_WIDE_INDEX           0
+#endif
+#endif
+
+#if (NUM_SECTORS > 0xFFFFU) || (DIRECTORY_SIZE > 0xFFFFU)
+#error "OS_File_System: at most 65535 sectors and directory entries"
+#endif
+
+// Metadata log: two ping-pong areas at the top of the disk. A compaction
+// writes the whole state to one area as a snapshot of packed tables (an
+// erase count per block; the directory, FAT, CRC and tail length of every
+// sector and file; each file's storage mode), framed by a header record
+// and the COMMIT; later changes follow as two-word (8-byte) delta
+// records. The tables depend on the data sector count, which depends on
+// the area size, so the area is sized for the tables of the whole disk,
+// with a quarter more on top so the deltas after a snapshot fill several
+// flushes before the next compaction: 4 KB per area at the default
+// geometry. OS_File_Log.c checks the real tables fit.
+#define LOG_AREA_COUNT          2U
+#define LOG_RECORD_BYTES        8U
+#define LOG_INDEX_BYTES         (FS_WIDE_INDEX ? 2U : 1U)   // sizeof(FS_Sector_t)
+#define LOG_TABLE_WORDS(bytes)  (((bytes) + 3U) / 4U)
+#define LOG_SNAPSHOT_TABLE_WORDS(sectors, blocks) \
+                                ((((blocks) + \
+                                   LOG_TABLE_WORDS(DIRECTORY_SIZE * LOG_INDEX_BYTES) + \
+                                   LOG_TABLE_WORDS((sectors) * LOG_INDEX_BYTES) + \
+                                   ((sectors) + 31U) / 32U + (sectors) + \
+                                   LOG_TABLE_WORDS(DIRECTORY_SIZE * 2U) + \
+                                   LOG_TABLE_WORDS(DIRECTORY_SIZE)) + 1U) & ~1U)
+#define LOG_SNAPSHOT_BYTES(sectors, blocks) \
+                                ((LOG_SNAPSHOT_TABLE_WORDS(sectors, blocks) * 4U) + \
+                                 (4U * LOG_RECORD_BYTES))   // Area header, SNAPSHOT, JOURNAL, COMMIT
+#define LOG_AREA_BYTES          ((((LOG_SNAPSHOT_BYTES(NUM_SECTORS, NUM_SECTORS / SECTORS_PER_BLOCK) * 5U / 4U) + \
+                                   ERASE_BLOCK_SIZE - 1U) / ERASE_BLOCK_SIZE) * ERASE_BLOCK_SIZE)
+#define LOG_AREA_SECTORS        (LOG_AREA_BYTES / SECTOR_SIZE)
 
 // Special values
+#if FS_WIDE_INDEX
+#define SECTOR_FREE             0xFFFFU         // Indicates free/unused sector
+#define FILE_EMPTY              0xFFFFU         // Indicates empty file
+#define FILE_INVALID            0xFFFFU         // No file number (OS_File_New failure)
+#define MAX_FILE_NUMBER         (DIRECTORY_SIZE - 1U)
+#else
 #define SECTOR_FREE             0xFFU           // Indicates free/unused sector
 #define FILE_EMPTY              0xFFU           // Indicates empty file
-#define MAX_FILE_NUMBER         254U            // Maximum file number (0-254)
-#define METADATA_SECTOR         255U            // Sector 255 stores directory + FAT
+#define FILE_INVALID            0xFFU           // No file number (OS_File_New failure)
+#define MAX_FILE_NUMBER         (DIRECTORY_SIZE - 2U)   // 0-254: 255 is FILE_INVALID
+#endif
+#define HANDLE_INVALID          0xFFU           // No handle (OS_File_Open failure)
+#define METADATA_SECTOR         (NUM_SECTORS - LOG_AREA_COUNT * LOG_AREA_SECTORS)
+#define NUM_DATA_BLOCKS         (METADATA_SECTOR / SECTORS_PER_BLOCK)
 
 // Error codes
 #define FS_SUCCESS              0x00U           // Operation successful
@@ -34,30 +101,53 @@
 #define FS_DISK_FULL            0xFFU           // No free sectors available
 #define FS_NO_DATA              0xFFU           // No data to read
 #define FS_FILE_NOT_FOUND       0xFFU           // File does not exist
+#define FS_CORRUPT              0xFEU           // Sector does not match its CRC
+
+// File storage modes (OS_File_SetMode)
+#define FS_MODE_RAW             0U              // Bytes stored as written
+#define FS_MODE_DELTA(channels) ((uint8_t)(channels)) // Records of 1..FS_PACK_CHANNELS
+                                                // int32_t samples, delta coded
 
 // =============================================================================
 // TYPE DEFINITIONS
 // =============================================================================
 
+#if FS_WIDE_INDEX
+typedef uint16_t FS_Sector_t;   // Sector (and erase block) index or count
+typedef uint16_t FS_File_t;     // Directory index
+#else
+typedef uint8_t FS_Sector_t;
+typedef uint8_t FS_File_t;
+#endif
+
+typedef uint8_t FS_Handle_t;    // Open-file table index (OS_File_Open)
+
 typedef struct {
-    uint8_t totalFiles;         // Number of files in directory
-    uint8_t freeSectors;        // Number of free sectors
-    uint8_t usedSectors;        // Number of used sectors
+    uint16_t totalFiles;        // Number of files in directory
+    uint16_t freeSectors;       // Number of free sectors
+    uint16_t usedSectors;       // Number of used sectors
 } FS_Status_t;
 
+typedef struct {
+    uint32_t records;           // Log records applied
+    uint16_t tornGroups;        // Committed groups that failed their checksum
+    uint16_t brokenChains;      // Chains cut at an out-of-range or repeated sector
+    uint16_t lostSectors;       // Live sectors no file reaches (left for GC)
+} FS_MountReport_t;
+
 // =============================================================================
 // CORE FILE SYSTEM FUNCTIONS
 // =============================================================================
 
 void OS_FS_Init(void);
 
-uint8_t OS_File_New(void);
+FS_File_t OS_File_New(void);
 
-uint8_t OS_File_Size(uint8_t num);
+FS_Sector_t OS_File_Size(FS_File_t num);
 
-uint8_t OS_File_Append(uint8_t num, uint8_t buf[512]);
+uint8_t OS_File_Append(FS_File_t num, uint8_t buf[SECTOR_SIZE]);
 
-uint8_t OS_File_Read(uint8_t num, uint8_t location, uint8_t buf[512]);
+uint8_t OS_File_Read(FS_File_t num, FS_Sector_t location, uint8_t buf[SECTOR_SIZE]);
 
 uint8_t OS_File_Flush(void);
 
@@ -65,23 +155,88 @@ uint8_t OS_File_Format(void);
 
 uint8_t OS_File_Mount(void);
 
+uint8_t OS_File_Delete(FS_File_t num);
+
+uint8_t OS_File_SetMode(FS_File_t num, uint8_t mode);
+
+uint8_t OS_File_Mode(FS_File_t num);
+
+// =============================================================================
+// STREAMING FUNCTIONS (OS_File_Handle.c)
+// =============================================================================
+
+FS_Handle_t OS_File_Open(FS_File_t num);
+
+uint16_t OS_File_Write(FS_Handle_t h, const uint8_t *data, uint16_t len);
+
+uint16_t OS_File_ReadBytes(FS_Handle_t h, uint8_t *data, uint16_t len);
+
+uint8_t OS_File_Seek(FS_Handle_t h, uint32_t position);
+
+uint8_t OS_File_Close(FS_Handle_t h);
+
+// =============================================================================
+// BUFFERED WRITE FUNCTIONS (OS_File_Cache.c)
+// =============================================================================
+
+uint8_t OS_File_Sync(FS_File_t num);
+
+uint8_t OS_File_Background(void);
+
+uint32_t OS_File_Length(FS_File_t num);
+
+// =============================================================================
+// BACKGROUND ERASE FUNCTIONS (OS_File_Wear.c)
+// =============================================================================
+
+uint8_t OS_File_Reclaim(void);
+
 // =============================================================================
 // HELPER FUNCTIONS
 // =============================================================================
+// Callers hold the file system lock (OS_File_Lock.h)
+
+FS_Sector_t find_free_sector(void);
+
+FS_Sector_t last_sector(FS_Sector_t start);
+
+void append_fat(FS_File_t num, FS_Sector_t n);
+
+void free_chain(FS_File_t num);
+
+void move_fat(FS_Sector_t old, FS_Sector_t n);
 
-uint8_t find_free_sector(void);
+FS_Sector_t tail_sector(FS_File_t num);
 
-uint8_t last_sector(uint8_t start);
+uint16_t tail_length(FS_File_t num);
 
-void append_fat(uint8_t num, uint8_t n);
+void set_tail_length(FS_File_t num, uint16_t bytes);
+
+uint8_t file_mode(FS_File_t num);
+
+void set_file_mode(FS_File_t num, uint8_t mode);
+
+uint8_t seal_tail(FS_File_t num);
+
+uint32_t file_length(FS_File_t num);
+
+uint32_t fat_generation(void);
+
+void append_begin(FS_File_t num);
+
+void append_done(FS_File_t num);
+
+uint8_t file_appending(FS_File_t num);
+
+uint8_t program_bytes(uint32_t addr, const uint8_t *data, uint16_t len);
 
 // =============================================================================
 // LOW-LEVEL DISK FUNCTIONS
 // =============================================================================
 
-uint8_t eDisk_WriteSector(uint8_t buf[512], uint8_t n);
+uint8_t eDisk_WriteSector(uint8_t buf[SECTOR_SIZE], FS_Sector_t n);
 
-uint8_t eDisk_ReadSector(uint8_t buf[512], uint8_t n);
+uint8_t eDisk_ReadSector(uint8_t buf[SECTOR_SIZE], FS_Sector_t n);
 
 // =============================================================================
 // FLASH PROGRAMMING FUNCTIONS (from FlashProgram.h)
@@ -99,14 +254,16 @@ void Flash_Init(uint8_t systemClockFreqMHz);
 
 void OS_FS_GetStatus(FS_Status_t *status);
 
-uint8_t OS_File_Exists(uint8_t num);
+void OS_FS_GetMountReport(FS_MountReport_t *report);
+
+uint8_t OS_File_Exists(FS_File_t num);
 
-uint8_t OS_FS_FreeSectors(void);
+FS_Sector_t OS_FS_FreeSectors(void);
 
 // =============================================================================
 // GLOBAL VARIABLES
 // =============================================================================
-extern uint8_t RAM_Directory[DIRECTORY_SIZE];   // Directory in RAM
-extern uint8_t RAM_FAT[FAT_SIZE];               // FAT in RAM
+extern FS_Sector_t RAM_Directory[DIRECTORY_SIZE];   // Directory in RAM
+extern FS_Sector_t RAM_FAT[FAT_SIZE];               // FAT in RAM
 
 #endif // __OS_FILE_SYSTEM_H__
\ No newline at end of file
@@ -0,0 +1,524 @@
+// *****************************************************************************
+// OS_File_Wear.c - Wear-Leveling and Garbage Collection Implementation
+// Runs on LM4F120/TM4C123
+// Flash can only be erased in 1 KB blocks, so a deleted sector becomes
+// usable again only once its whole block is erased.
+//
+// Blocks with erased sectors wait in a FIFO ring; appends fill one open
+// block at a time, so allocation is O(1). A block goes to the back of the
+// ring when it is erased, which rotates writes through every block
+// (least recently erased first). When erased sectors run low, the least
+// worn fully dead block is reclaimed as it is; only when there is none
+// are the blocks scanned for the one with the most dead sectors (moving
+// its live sectors out first). Every WEAR_STATIC_INTERVAL erases
+// the coldest fully-live block is migrated if the erase-count spread has
+// grown past WEAR_STATIC_THRESHOLD.
+//
+// OS_File_Reclaim(), called from a low-priority thread, erases dead
+// blocks ahead of the allocator (and partly dead ones while erased space
+// is below WEAR_PREERASE_SECTORS), so appends normally find erased
+// sectors waiting and the allocator's own collection is only a fallback.
+//
+// An allocated sector stays BUSY until it is linked (USED) or given up
+// (DIRTY). Its block is never picked for garbage collection meanwhile, so
+// OS_File_Append() can program it without holding the file system lock.
+//
+// Sectors that are not linked into a file after mount start out UNKNOWN
+// and are blank-checked on the first allocation, so mount never has to
+// trust that a sector is still erased.
+//
+// *****************************************************************************
+
+#include "OS_File_Wear.h"
+#include "OS_File_Log.h"
+#include "OS_File_System.h"
+#include "OS_File_Lock.h"
+#include <stdint.h>
+
+#define WEAR_NO_BLOCK           SECTOR_FREE     // No open block / no candidate
+
+// =============================================================================
+// WEAR STATE
+// =============================================================================
+static uint8_t SectorState[METADATA_SECTOR];        // One SECTOR_STATE_ per data sector
+static uint32_t EraseCount[NUM_DATA_BLOCKS];        // Erases per 1 KB block
+static uint8_t BlockErased[NUM_DATA_BLOCKS];        // Erased sectors per block
+static uint8_t BlockDirty[NUM_DATA_BLOCKS];         // Dead sectors per block
+static uint8_t BlockUsed[NUM_DATA_BLOCKS];          // Live sectors per block
+static uint8_t BlockBusy[NUM_DATA_BLOCKS];          // Allocated, not yet linked
+static FS_Sector_t FreeRing[NUM_DATA_BLOCKS];       // Blocks holding erased sectors
+static FS_Sector_t FreeHead;
+static FS_Sector_t FreeCount;
+static FS_Sector_t DeadStack[NUM_DATA_BLOCKS];      // Blocks with every sector dead
+static FS_Sector_t DeadCount;
+static FS_Sector_t OpenBlock;                       // Block appends are filling
+static FS_Sector_t ErasedSectors;                   // Sectors in SECTOR_STATE_ERASED
+static uint16_t ErasesSinceStatic;                  // Erases since last static check
+static uint8_t Resolved;                            // Nonzero once UNKNOWN sectors checked
+
+// =============================================================================
+// HELPER FUNCTIONS
+// =============================================================================
+
+static uint32_t *sector_pointer(FS_Sector_t sector) {
+    return (uint32_t *)(uintptr_t)(DISK_START_ADDRESS + ((uint32_t)sector * SECTOR_SIZE));
+}
+
+static uint8_t sector_blank(FS_Sector_t sector) {
+    uint32_t *flashPtr = sector_pointer(sector);
+    uint16_t i;
+
+    for (i = 0; i < SECTOR_SIZE / 4U; i++) {
+        if (flashPtr[i] != 0xFFFFFFFFU) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static void ring_push(FS_Sector_t block) {
+    FreeRing[(FreeHead + FreeCount) % NUM_DATA_BLOCKS] = block;
+    FreeCount++;
+}
+
+static FS_Sector_t ring_pop(void) {
+    FS_Sector_t block = FreeRing[FreeHead];
+
+    FreeHead = (FS_Sector_t)((FreeHead + 1U) % NUM_DATA_BLOCKS);
+    FreeCount--;
+
+    return block;
+}
+
+// Move a sector between states, keeping the per-block counters in step
+static void set_state(FS_Sector_t sector, uint8_t state) {
+    FS_Sector_t block = sector / SECTORS_PER_BLOCK;
+    uint8_t old = SectorState[sector];
+
+    if (old == SECTOR_STATE_ERASED) {
+        BlockErased[block]--;
+        ErasedSectors--;
+    } else if (old == SECTOR_STATE_DIRTY) {
+        BlockDirty[block]--;
+    } else if (old == SECTOR_STATE_USED) {
+        BlockUsed[block]--;
+    } else if (old == SECTOR_STATE_BUSY) {
+        BlockBusy[block]--;
+    }
+
+    SectorState[sector] = state;
+
+    if (state == SECTOR_STATE_ERASED) {
+        BlockErased[block]++;
+        ErasedSectors++;
+    } else if (state == SECTOR_STATE_DIRTY) {
+        BlockDirty[block]++;
+        // A block that just became entirely dead can be erased as is
+        if ((BlockDirty[block] == SECTORS_PER_BLOCK) && Resolved &&
+            (DeadCount < NUM_DATA_BLOCKS)) {
+            DeadStack[DeadCount++] = block;
+        }
+    } else if (state == SECTOR_STATE_USED) {
+        BlockUsed[block]++;
+    } else if (state == SECTOR_STATE_BUSY) {
+        BlockBusy[block]++;
+    }
+}
+
+// Blank-check every sector whose state was not known at mount, then queue
+// blocks with erased sectors least-worn first
+static void wear_resolve(void) {
+    FS_Sector_t sector;
+    FS_Sector_t block;
+    FS_Sector_t i;
+    FS_Sector_t j;
+
+    for (sector = 0; sector < METADATA_SECTOR; sector++) {
+        if (SectorState[sector] == SECTOR_STATE_UNKNOWN) {
+            set_state(sector, sector_blank(sector) ? SECTOR_STATE_ERASED : SECTOR_STATE_DIRTY);
+        }
+    }
+
+    FreeHead = 0;
+    FreeCount = 0;
+    DeadCount = 0;
+
+    for (block = 0; block < NUM_DATA_BLOCKS; block++) {
+        if (BlockErased[block] != 0) {
+            // Insertion by erase count; runs once per mount
+            i = FreeCount;
+            while ((i > 0) && (EraseCount[FreeRing[i - 1U]] > EraseCount[block])) {
+                FreeRing[i] = FreeRing[i - 1U];
+                i--;
+            }
+            FreeRing[i] = block;
+            FreeCount++;
+        } else if (BlockDirty[block] == SECTORS_PER_BLOCK) {
+            DeadStack[DeadCount++] = block;
+        }
+    }
+
+    // Partly programmed blocks first, so they are finished before fresh ones
+    for (i = 0, j = 0; i < FreeCount; i++) {
+        if (BlockErased[FreeRing[i]] != SECTORS_PER_BLOCK) {
+            block = FreeRing[i];
+            FreeRing[i] = FreeRing[j];
+            FreeRing[j] = block;
+            j++;
+        }
+    }
+
+    OpenBlock = WEAR_NO_BLOCK;
+    Resolved = 1;
+}
+
+// Next erased sector: from the open block, else the next block in the ring
+static FS_Sector_t wear_next(void) {
+    FS_Sector_t first;
+    FS_Sector_t i;
+
+    while ((OpenBlock == WEAR_NO_BLOCK) || (BlockErased[OpenBlock] == 0)) {
+        if (FreeCount == 0) {
+            OpenBlock = WEAR_NO_BLOCK;
+            return SECTOR_FREE;
+        }
+        OpenBlock = ring_pop();
+    }
+
+    first = OpenBlock * SECTORS_PER_BLOCK;
+    for (i = 0; i < SECTORS_PER_BLOCK; i++) {
+        if (SectorState[first + i] == SECTOR_STATE_ERASED) {
+            return first + i;
+        }
+    }
+
+    return SECTOR_FREE;  // Not reached: BlockErased says one exists
+}
+
+// Copy every live sector of a block elsewhere so the block can be erased
+static uint8_t wear_evacuate(FS_Sector_t block) {
+    FS_Sector_t first = block * SECTORS_PER_BLOCK;
+    FS_Sector_t sector;
+    FS_Sector_t dest;
+    FS_Sector_t i;
+
+    for (i = 0; i < SECTORS_PER_BLOCK; i++) {
+        sector = first + i;
+
+        if (SectorState[sector] != SECTOR_STATE_USED) {
+            continue;
+        }
+
+        dest = wear_next();
+        if (dest == SECTOR_FREE) {
+            return FS_DISK_FULL;
+        }
+
+        // Program straight from the old flash location
+        if (eDisk_WriteSector((uint8_t *)sector_pointer(sector), dest) != FS_SUCCESS) {
+            FS_Wear_MarkDirty(dest);
+            return FS_ERROR;
+        }
+
+        move_fat(sector, dest);
+
+        if (FS_Log_Record(LOG_REC_MOVE, sector, dest) != FS_SUCCESS) {
+            return FS_ERROR;
+        }
+    }
+
+    return FS_SUCCESS;
+}
+
+// Fallback victim when no block is entirely dead: most dead sectors whose
+// live sectors fit in the erased space, least-worn on a tie
+static FS_Sector_t wear_scan_victim(void) {
+    FS_Sector_t block;
+    FS_Sector_t victim = WEAR_NO_BLOCK;
+    uint8_t victimDirty = 0;
+
+    for (block = 0; block < NUM_DATA_BLOCKS; block++) {
+        // Blocks with erased or busy sectors are still being filled
+        if ((BlockDirty[block] == 0) || (BlockErased[block] != 0) ||
+            (BlockBusy[block] != 0) || (BlockUsed[block] > ErasedSectors)) {
+            continue;
+        }
+
+        if ((BlockDirty[block] > victimDirty) ||
+            ((BlockDirty[block] == victimDirty) && (EraseCount[block] < EraseCount[victim]))) {
+            victim = block;
+            victimDirty = BlockDirty[block];
+        }
+    }
+
+    return victim;
+}
+
+// Entirely dead blocks cost nothing to reclaim; the least worn goes
+// first, so a file deleted and rewritten over and over does not keep
+// landing on the few blocks that died last
+static FS_Sector_t wear_pop_dead(void) {
+    FS_Sector_t victim = WEAR_NO_BLOCK;
+    FS_Sector_t at = 0;
+    FS_Sector_t block;
+    FS_Sector_t i = 0;
+
+    while (i < DeadCount) {
+        block = DeadStack[i];
+        if (BlockDirty[block] != SECTORS_PER_BLOCK) {
+            DeadStack[i] = DeadStack[--DeadCount];     // Stale entry
+            continue;
+        }
+        if ((victim == WEAR_NO_BLOCK) || (EraseCount[block] < EraseCount[victim])) {
+            victim = block;
+            at = i;
+        }
+        i++;
+    }
+
+    if (victim != WEAR_NO_BLOCK) {
+        DeadStack[at] = DeadStack[--DeadCount];
+    }
+
+    return victim;
+}
+
+// Move the live sectors out of a block, then erase it
+static uint8_t wear_reclaim(FS_Sector_t block) {
+    if (wear_evacuate(block) != FS_SUCCESS) {
+        return FS_ERROR;
+    }
+
+    return FS_Wear_EraseBlock(block);
+}
+
+// Coldest fully-live block, if the spread to the hottest block is too wide
+static FS_Sector_t wear_scan_cold(void) {
+    FS_Sector_t block;
+    FS_Sector_t cold = WEAR_NO_BLOCK;
+    uint32_t hottest = 0;
+
+    for (block = 0; block < NUM_DATA_BLOCKS; block++) {
+        if (EraseCount[block] > hottest) {
+            hottest = EraseCount[block];
+        }
+
+        if ((BlockUsed[block] == SECTORS_PER_BLOCK) &&
+            ((cold == WEAR_NO_BLOCK) || (EraseCount[block] < EraseCount[cold]))) {
+            cold = block;
+        }
+    }
+
+    if ((cold == WEAR_NO_BLOCK) || (hottest - EraseCount[cold] <= WEAR_STATIC_THRESHOLD)) {
+        return WEAR_NO_BLOCK;
+    }
+
+    return cold;
+}
+
+// =============================================================================
+// WEAR-LEVELING FUNCTIONS
+// =============================================================================
+
+void FS_Wear_Init(void) {
+    uint32_t i;
+
+    for (i = 0; i < METADATA_SECTOR; i++) {
+        SectorState[i] = SECTOR_STATE_UNKNOWN;
+    }
+
+    for (i = 0; i < NUM_DATA_BLOCKS; i++) {
+        BlockErased[i] = 0;
+        BlockDirty[i] = 0;
+        BlockUsed[i] = 0;
+        BlockBusy[i] = 0;
+    }
+
+    FreeHead = 0;
+    FreeCount = 0;
+    DeadCount = 0;
+    OpenBlock = WEAR_NO_BLOCK;
+    ErasedSectors = 0;
+    ErasesSinceStatic = 0;
+    Resolved = 0;
+}
+
+void FS_Wear_ClearCounts(void) {
+    uint32_t i;
+
+    for (i = 0; i < NUM_DATA_BLOCKS; i++) {
+        EraseCount[i] = 0;
+    }
+}
+
+FS_Sector_t FS_Wear_Allocate(void) {
+    FS_Sector_t sector;
+
+    if (!Resolved) {
+        wear_resolve();
+    }
+
+    // Reclaim space while there is still room to move live sectors
+    if (ErasedSectors <= WEAR_GC_THRESHOLD) {
+        FS_Wear_Collect();
+    }
+
+    // Keep the reserve for evacuation
+    if (ErasedSectors <= WEAR_RESERVE_SECTORS) {
+        return SECTOR_FREE;
+    }
+
+    // The caller links it (MarkUsed) or gives it up (MarkDirty)
+    sector = wear_next();
+    if (sector != SECTOR_FREE) {
+        set_state(sector, SECTOR_STATE_BUSY);
+    }
+
+    return sector;
+}
+
+void FS_Wear_MarkUsed(FS_Sector_t sector) {
+    set_state(sector, SECTOR_STATE_USED);
+}
+
+void FS_Wear_MarkDirty(FS_Sector_t sector) {
+    set_state(sector, SECTOR_STATE_DIRTY);
+}
+
+uint8_t FS_Wear_State(FS_Sector_t sector) {
+    return SectorState[sector];
+}
+
+uint8_t FS_Wear_Collect(void) {
+    FS_Sector_t victim;
+
+    if (!Resolved) {
+        wear_resolve();
+    }
+
+    victim = wear_pop_dead();
+    if (victim == WEAR_NO_BLOCK) {
+        victim = wear_scan_victim();
+    }
+
+    if ((victim != WEAR_NO_BLOCK) && (wear_reclaim(victim) != FS_SUCCESS)) {
+        return FS_ERROR;
+    }
+
+    // Static: move cold data onto worn blocks so its block rejoins the pool
+    if ((ErasesSinceStatic >= WEAR_STATIC_INTERVAL) &&
+        (ErasedSectors >= SECTORS_PER_BLOCK)) {
+        ErasesSinceStatic = 0;
+        victim = wear_scan_cold();
+
+        if ((victim != WEAR_NO_BLOCK) && (wear_reclaim(victim) != FS_SUCCESS)) {
+            return FS_ERROR;
+        }
+    }
+
+    return FS_SUCCESS;
+}
+
+uint8_t FS_Wear_Prepare(void) {
+    FS_Sector_t victim;
+
+    if (!Resolved) {
+        wear_resolve();
+    }
+
+    victim = wear_pop_dead();
+    if ((victim == WEAR_NO_BLOCK) && (ErasedSectors < WEAR_PREERASE_SECTORS)) {
+        victim = wear_scan_victim();
+    }
+
+    if (victim == WEAR_NO_BLOCK) {
+        return FS_NO_DATA;
+    }
+
+    return wear_reclaim(victim);
+}
+
+uint8_t FS_Wear_EraseBlock(FS_Sector_t block) {
+    FS_Sector_t first = block * SECTORS_PER_BLOCK;
+    FS_Sector_t i;
+
+    // Never erase live data, or a sector still being programmed
+    if ((BlockUsed[block] != 0) || (BlockBusy[block] != 0)) {
+        return FS_ERROR;
+    }
+
+    // Deletes and moves that freed this block must be durable before
+    // the old copies are destroyed
+    if (FS_Log_Commit() != FS_SUCCESS) {
+        return FS_ERROR;
+    }
+
+    if (FS_Flash_Erase(DISK_START_ADDRESS + (uint32_t)block * ERASE_BLOCK_SIZE) != FS_SUCCESS) {
+        return FS_ERROR;
+    }
+
+    FS_Wear_CountErase(block);
+    ErasesSinceStatic++;
+
+    // An evacuated victim was pushed as dead while its sectors moved out
+    if ((DeadCount > 0) && (DeadStack[DeadCount - 1U] == block)) {
+        DeadCount--;
+    }
+
+    for (i = 0; i < SECTORS_PER_BLOCK; i++) {
+        set_state(first + i, SECTOR_STATE_ERASED);
+    }
+
+    // Back of the queue: every other erased block is used first
+    if (block != OpenBlock) {
+        ring_push(block);
+    }
+
+    return FS_Log_Record(LOG_REC_ERASE, block, 0);
+}
+
+void FS_Wear_Forget(FS_Sector_t block) {
+    FS_Sector_t first = block * SECTORS_PER_BLOCK;
+    FS_Sector_t i;
+
+    // Replayed erase: whatever earlier records said about these sectors is
+    // stale, so they are blank-checked again on first allocation
+    for (i = 0; i < SECTORS_PER_BLOCK; i++) {
+        set_state(first + i, SECTOR_STATE_UNKNOWN);
+    }
+}
+
+void FS_Wear_CountErase(FS_Sector_t block) {
+    if (EraseCount[block] < WEAR_COUNT_MAX) {
+        EraseCount[block]++;
+    }
+}
+
+uint32_t FS_Wear_EraseCount(FS_Sector_t block) {
+    return EraseCount[block];
+}
+
+void FS_Wear_SetEraseCount(FS_Sector_t block, uint32_t count) {
+    EraseCount[block] = count;
+}
+
+// =============================================================================
+// BACKGROUND FUNCTIONS
+// =============================================================================
+
+uint8_t OS_File_Reclaim(void) {
+    uint8_t result;
+
+    FS_Lock_Write();
+
+    // Data blocks first; the log's spare area only once they are done
+    result = FS_Wear_Prepare();
+    if (result == FS_NO_DATA) {
+        result = FS_Log_Prepare();
+    }
+
+    FS_Unlock_Write();
+
+    return result;
+}
@@ -0,0 +1,77 @@
+// *****************************************************************************
+// OS_File_Wear.h - Wear-Leveling and Garbage Collection Header
+// Runs on LM4F120/TM4C123
+// Tracks the state of every data sector and the erase count of every
+// 1 KB erase block, picks the least-worn erased sector for each append
+// and reclaims deleted sectors one erase block at a time
+//
+// *****************************************************************************
+
+#ifndef __OS_FILE_WEAR_H__
+#define __OS_FILE_WEAR_H__
+
+#include <stdint.h>
+#include "OS_File_System.h"
+
+// =============================================================================
+// CONFIGURATION CONSTANTS
+// =============================================================================
+
+// Sector states
+#define SECTOR_STATE_UNKNOWN    0U              // Not in a chain, not yet blank-checked
+#define SECTOR_STATE_ERASED     1U              // Blank, ready to program
+#define SECTOR_STATE_USED       2U              // Linked into a file
+#define SECTOR_STATE_DIRTY      3U              // Programmed but no longer linked
+#define SECTOR_STATE_BUSY       4U              // Allocated, being programmed, not yet linked
+
+// Garbage collection runs when this few erased sectors remain. The last
+// WEAR_RESERVE_SECTORS are never handed out for new data, so a partly
+// dead block always has somewhere to move its live sectors.
+#define WEAR_GC_THRESHOLD       SECTORS_PER_BLOCK
+#define WEAR_RESERVE_SECTORS    (SECTORS_PER_BLOCK - 1U)
+
+// OS_File_Reclaim() always erases entirely dead blocks, but only copies
+// live sectors out of partly dead ones while fewer erased sectors than
+// this remain
+#ifndef WEAR_PREERASE_SECTORS
+#define WEAR_PREERASE_SECTORS   (4U * SECTORS_PER_BLOCK)
+#endif
+
+// Static wear leveling: every WEAR_STATIC_INTERVAL erases, move cold data
+// if erase counts have spread further than WEAR_STATIC_THRESHOLD
+#define WEAR_STATIC_INTERVAL    16U
+#define WEAR_STATIC_THRESHOLD   32U
+
+#define WEAR_COUNT_MAX          0xFFFFFFFEU     // Erase counters saturate here
+
+// =============================================================================
+// WEAR-LEVELING FUNCTIONS
+// =============================================================================
+
+void FS_Wear_Init(void);
+
+void FS_Wear_ClearCounts(void);
+
+FS_Sector_t FS_Wear_Allocate(void);
+
+void FS_Wear_MarkUsed(FS_Sector_t sector);
+
+void FS_Wear_MarkDirty(FS_Sector_t sector);
+
+uint8_t FS_Wear_State(FS_Sector_t sector);
+
+uint8_t FS_Wear_Collect(void);
+
+uint8_t FS_Wear_Prepare(void);
+
+uint8_t FS_Wear_EraseBlock(FS_Sector_t block);
+
+void FS_Wear_Forget(FS_Sector_t block);
+
+void FS_Wear_CountErase(FS_Sector_t block);
+
+uint32_t FS_Wear_EraseCount(FS_Sector_t block);
+
+void FS_Wear_SetEraseCount(FS_Sector_t block, uint32_t count);
+
+#endif // __OS_FILE_WEAR_H__
@@ -4,9 +4,14 @@
 #include "tm4c123gh6pm.h"
 #include "tm4c123gh6pm_def.h"
 #include "OS_File_System.h"
-uint8_t File0, File1, File_Size;
-uint8_t Data[512];
+FS_File_t File0, File1;
+FS_Handle_t Handle0;
+FS_Sector_t File_Size;
+uint8_t Data[SECTOR_SIZE];
 uint8_t Process_FB;
+uint32_t File_Length;
+uint8_t Record[12];
+uint16_t Record_Bytes;
 
 
 int main(void){
@@ -51,4 +56,29 @@ int main(void){
   
   OS_File_Flush();
   
+  // A second flush only appends log records - no erase needed
+  Process_FB=OS_File_Append(File1, Data);
+  Process_FB=OS_File_Flush();
+  Process_FB=OS_File_Mount();
+  File_Size=OS_File_Size(File1);
+  
+  // Deleting File1 leaves its sectors for garbage collection
+  Process_FB=OS_File_Delete(File1);
+  Process_FB=OS_File_Flush();
+  while (OS_File_Reclaim() == FS_SUCCESS){}     // Erased now by an idle thread, not by a later append
+  
+  // Small writes collect in the cache and reach flash a sector at a time
+  Handle0=OS_File_Open(File0);
+  for (i=0; i<100; i++){
+    OS_File_Write(Handle0, &i, 1);
+  }
+  while (OS_File_Background() == FS_SUCCESS){}  // What a low-priority thread would do
+  Process_FB=OS_File_Sync(File0);               // Partial sector programmed too
+  File_Length=OS_File_Length(File0);
+  
+  // Read a few of those bytes back, no sector buffer needed
+  Process_FB=OS_File_Seek(Handle0, File_Length-100);
+  Record_Bytes=OS_File_ReadBytes(Handle0, Record, sizeof(Record));
+  Process_FB=OS_File_Close(Handle0);
+  
 }